@@ -512,6 +512,20 @@ static uint32 sieve_core_vc8(sieve_conf_t *conf,
 			pfbptr->next_loc2 = fbptr->root2;
 		}
 
+		/* the vector trial factoring code needs the
+		   roots too, packed next to each other */
+
+		if (conf->tf_simd != NULL) {
+			tf_primes_t *tf_primes = &conf->tf_primes;
+
+			for (j = MIN_FB_OFFSET + 1; 
+					j < conf->tf_med_recip1_cutoff; j++) {
+				fb_t *fbptr = factor_base + j;
+				tf_primes->root1[j] = fbptr->root1;
+				tf_primes->root2[j] = fbptr->root2;
+			}
+		}
+
 		/* Form 'c', equal to (b * b - n) / a (exact
 		   division). Having this quantity available
 		   makes trial factoring a little faster.
@@ -13,6 +13,7 @@ $Id$
 --------------------------------------------------------------------*/
 
 #include <batch_factor.h>
+#include <thread.h>
 
 /*------------------------------------------------------------------*/
 #define BREAKOVER_WORDS 50
@@ -101,40 +102,69 @@ static void relation_to_gmp(relation_batch_t *rb,
 }
 
 /*------------------------------------------------------------------*/
-static void multiply_relations(uint32 first, uint32 last, 
-				relation_batch_t *rb,
-				mpz_t prod) {
-	mpz_t half_prod;
+/* The batch is factored with a product tree and a remainder
+   tree. Level 0 of the product tree has the unfactored part of
+   each relation, and node i of level k is the product of nodes
+   2*i and 2*i+1 of level k-1 (or a copy of node 2*i, if that
+   is the last node). The whole tree is built once and kept
+   until the batch is finished, and each level is built by all
+   the threads together.
+
+   Walking down the remainder tree is also split across threads:
+   one thread walks the top few levels, then the subtrees below
+   are divided among all the threads. With a scaled remainder
+   tree, each node carries the fractional part of
+   prime_product / (node product) instead of the remainder, to
+   a precision of the size of the node product plus a few guard
+   bits. Going down a level then takes only a multiply by the
+   sibling node and a truncation instead of a division, and the
+   remainder is recovered at the bottom with one more multiply */
+
+#define MAX_TREE_LEVELS 33
+
+#define SCALED_GUARD_BITS 64
+
+typedef struct {
+	uint32 num_levels;
+	uint32 num_nodes[MAX_TREE_LEVELS];
+	mpz_t *nodes[MAX_TREE_LEVELS];
+} product_tree_t;
+
+/* one relation that survived; they are printed in the
+   order the relations were added to the batch */
+
+typedef struct {
+	uint32 index;
+	uint32 lp_r[MAX_LARGE_PRIMES];
+	uint32 lp_a[MAX_LARGE_PRIMES];
+} batch_success_t;
 
-	/* recursive routine to multiply together a list of
-	   relations. The current invocation multiplies relations
-	   first to last of the list, inclusive */
+typedef struct {
+	relation_batch_t *rb;
+	product_tree_t *tree;
 
-	/* base case of recursion */
+	/* nodes [node_start,node_end) of this level */
 
-	if (first == last) {
-		relation_to_gmp(rb, first, prod);
-		return;
-	}
+	uint32 level;
+	uint32 node_start;
+	uint32 node_end;
 
-	/* recurse on the left and right halves */
+	/* when walking the remainder tree, the value at each 
+	   node of stop_level is saved in stop_vals[] instead 
+	   of continuing further down. stop_prec[] gives the 
+	   precision of the value for scaled remainder trees, 
+	   or is zero if nothing was saved */
 
-	mpz_init(half_prod);
-	if (last == first + 1) {
-		relation_to_gmp(rb, first, half_prod);
-		relation_to_gmp(rb, last, prod);
-	}
-	else {
-		uint32 mid = (last + first) / 2;
-		multiply_relations(first, mid, rb, prod);
-		multiply_relations(mid + 1, last, rb, half_prod);
-	}
+	uint32 stop_level;
+	mpz_t *stop_vals;
+	uint32 *stop_prec;
 
-	/* multiply the halves */
+	uint32 num_success;
+	uint32 num_success_alloc;
+	batch_success_t *success;
+} tree_task_t;
 
-	mpz_mul(prod, prod, half_prod);
-	mpz_clear(half_prod);
-}
+#define NO_STOP_LEVEL ((uint32)(-1))
 
 /*------------------------------------------------------------------*/
 static mp_t two = {1, {2}};
@@ -145,12 +175,14 @@ static mp_t two = {1, {2}};
    so only this routine needs to change when more advanced factoring
    code becomes available. */
 
-static void check_relation(relation_batch_t *rb,
+static void check_relation(tree_task_t *t,
 			uint32 index,
 			mp_t *prime_product) {
 
 	uint32 i;
+	relation_batch_t *rb = t->rb;
 	cofactor_t *c = rb->relations + index;
+	batch_success_t *s;
 	uint32 *f = rb->factors + c->factor_list_word;
 	uint32 *lp1 = f + c->num_factors_r + c->num_factors_a;
 	uint32 *lp2 = lp1 + c->lp_r_num_words;
@@ -405,63 +437,277 @@ static void check_relation(relation_batch_t *rb,
 		lp_a[num_a++] = large->val[0];
 	}
 
-	/* yay! Another relation found */
+	/* yay! Another relation found. Save it for printing
+	   once all the threads are finished */
+
+	if (t->num_success == t->num_success_alloc) {
+		t->num_success_alloc = MAX(100, 2 * t->num_success_alloc);
+		t->success = (batch_success_t *)xrealloc(t->success,
+						t->num_success_alloc *
+						sizeof(batch_success_t));
+	}
+	s = t->success + t->num_success++;
+	s->index = index;
+	for (i = 0; i < MAX_LARGE_PRIMES; i++) {
+		s->lp_r[i] = lp_r[i];
+		s->lp_a[i] = lp_a[i];
+	}
+}
+
+/*------------------------------------------------------------------*/
+static void run_tree_tasks(relation_batch_t *rb, run_func run,
+			tree_task_t *tasks, uint32 num_tasks) {
 
-	rb->num_success++;
-	rb->print_relation(rb->savefile, c->a, c->b,
-			f, c->num_factors_r, lp_r,
-			f + c->num_factors_r, c->num_factors_a, lp_a);
+	/* the calling thread runs the last task */
+
+	uint32 i;
+
+	for (i = 0; i < num_tasks - 1; i++) {
+		task_control_t t;
+
+		t.init = NULL;
+		t.run = run;
+		t.shutdown = NULL;
+		t.data = tasks + i;
+		threadpool_add_task(rb->threadpool, &t, 1);
+	}
+	run(tasks + num_tasks - 1, rb->num_threads - 1);
+	if (num_tasks > 1)
+		threadpool_drain(rb->threadpool, 1);
+}
+
+/*------------------------------------------------------------------*/
+static void build_level(void *data, int thread_num) {
+
+	tree_task_t *t = (tree_task_t *)data;
+	product_tree_t *tree = t->tree;
+	uint32 level = t->level;
+	uint32 i;
+
+	for (i = t->node_start; i < t->node_end; i++) {
+		mpz_ptr node = tree->nodes[level][i];
+
+		mpz_init(node);
+		if (level == 0) {
+			relation_to_gmp(t->rb, i, node);
+		}
+		else {
+			mpz_t *prev = tree->nodes[level - 1];
+
+			if (2 * i + 1 < tree->num_nodes[level - 1])
+				mpz_mul(node, prev[2 * i], prev[2 * i + 1]);
+			else
+				mpz_set(node, prev[2 * i]);
+		}
+	}
 }
 
 /*------------------------------------------------------------------*/
-static void compute_remainder_tree(uint32 first, uint32 last,
-				relation_batch_t *rb,
-				mpz_t numerator) {
-
-	/* recursively compute numerator % (each relation in 
-	   rb->relations) */
-
-	uint32 mid = (first + last) / 2;
-	mpz_t relation_prod, remainder;
-
-	/* recursion base case: numerator already fits in
-	   an mp_t, so manually compute the remainder and
-	   postprocess each relation */
-
-	if (mpz_size(numerator) * GMP_LIMB_BITS/32 <= MAX_MP_WORDS) {
-		if (mpz_sgn(numerator) > 0) {
-			mp_t num;
-			gmp2mp(numerator, &num);
-			while (first <= last)
-				check_relation(rb, first++, &num);
+static void build_product_tree(relation_batch_t *rb, 
+				product_tree_t *tree,
+				tree_task_t *tasks) {
+	uint32 i;
+	uint32 num_nodes = rb->num_relations;
+	uint32 level = 0;
+
+	while (1) {
+		uint32 num_tasks = MIN(rb->num_threads, num_nodes);
+
+		tree->num_nodes[level] = num_nodes;
+		tree->nodes[level] = (mpz_t *)xmalloc(num_nodes * 
+							sizeof(mpz_t));
+
+		for (i = 0; i < num_tasks; i++) {
+			tree_task_t *t = tasks + i;
+
+			t->level = level;
+			t->node_start = (uint64)num_nodes * i / num_tasks;
+			t->node_end = (uint64)num_nodes * (i + 1) / num_tasks;
 		}
+		run_tree_tasks(rb, build_level, tasks, num_tasks);
+
+		if (num_nodes == 1)
+			break;
+		num_nodes = (num_nodes + 1) / 2;
+		level++;
+	}
+	tree->num_levels = level + 1;
+}
+
+/*------------------------------------------------------------------*/
+static void free_product_tree(product_tree_t *tree) {
+
+	uint32 i, j;
+
+	for (i = 0; i < tree->num_levels; i++) {
+		for (j = 0; j < tree->num_nodes[i]; j++)
+			mpz_clear(tree->nodes[i][j]);
+		free(tree->nodes[i]);
+	}
+}
+
+/*------------------------------------------------------------------*/
+static void check_relations(tree_task_t *t, uint32 level, 
+			uint32 node, mpz_t numerator) {
+
+	/* recursion base case: numerator fits in an mp_t, 
+	   so manually compute the remainder and postprocess 
+	   each relation below this node */
+
+	uint32 i = node << level;
+	uint32 end = MIN((node + 1) << level, t->rb->num_relations);
+
+	if (mpz_sgn(numerator) > 0) {
+		mp_t num;
+		gmp2mp(numerator, &num);
+		for (; i < end; i++)
+			check_relation(t, i, &num);
+	}
+}
+
+#define FITS_MP(x) (mpz_size(x) * GMP_LIMB_BITS/32 <= MAX_MP_WORDS)
+
+/*------------------------------------------------------------------*/
+static void compute_remainder_tree(tree_task_t *t, uint32 level, 
+				uint32 node, mpz_t numerator) {
+
+	/* recursively compute numerator % (each relation 
+	   below this node of the product tree) */
+
+	product_tree_t *tree = t->tree;
+	mpz_ptr relation_prod = tree->nodes[level][node];
+	mpz_t remainder;
+
+	if (level == t->stop_level) {
+		mpz_set(t->stop_vals[node], numerator);
+		t->stop_prec[node] = 1;
 		return;
 	}
 
-	/* multiply together the unfactored parts of all the
-	   relations from first to last */
+	if (FITS_MP(numerator)) {
+		check_relations(t, level, node, numerator);
+		return;
+	}
 
-	mpz_init(relation_prod);
 	mpz_init(remainder);
-	multiply_relations(first, last, rb, relation_prod);
+	if (mpz_cmp(numerator, relation_prod) >= 0)
+		mpz_tdiv_r(remainder, numerator, relation_prod);
+	else
+		mpz_set(remainder, numerator);
 
 	/* use the remainder to deal with the left and right
 	   halves of the relation list */
 
-	if (mpz_cmp(numerator, relation_prod) < 0) {
-		mpz_clear(relation_prod);
-		compute_remainder_tree(first, mid, rb, numerator);
-		compute_remainder_tree(mid + 1, last, rb, numerator);
+	if (level == 0 || FITS_MP(remainder)) {
+		check_relations(t, level, node, remainder);
 	}
 	else {
-		mpz_tdiv_r(remainder, numerator, relation_prod);
-		mpz_clear(relation_prod);
-		compute_remainder_tree(first, mid, rb, remainder);
-		compute_remainder_tree(mid + 1, last, rb, remainder);
+		compute_remainder_tree(t, level - 1, 2 * node, remainder);
+		if (2 * node + 1 < tree->num_nodes[level - 1]) {
+			compute_remainder_tree(t, level - 1, 
+						2 * node + 1, remainder);
+		}
 	}
 	mpz_clear(remainder);
 }
 
+/*------------------------------------------------------------------*/
+static void compute_scaled_tree(tree_task_t *t, uint32 level, 
+				uint32 node, mpz_t frac, uint32 prec) {
+
+	/* as above, except that frac / 2^prec is the fractional
+	   part of prime_product / (product of the relations
+	   below this node) */
+
+	product_tree_t *tree = t->tree;
+	mpz_ptr relation_prod = tree->nodes[level][node];
+	mpz_t *children;
+	mpz_t tmp;
+
+	if (level == t->stop_level) {
+		mpz_set(t->stop_vals[node], frac);
+		t->stop_prec[node] = prec;
+		return;
+	}
+
+	mpz_init(tmp);
+
+	if (level == 0 || FITS_MP(relation_prod)) {
+
+		/* round to the nearest integer to get the
+		   remainder back */
+
+		mpz_mul(tmp, frac, relation_prod);
+		mpz_fdiv_q_2exp(tmp, tmp, prec - 1);
+		mpz_add_ui(tmp, tmp, 1);
+		mpz_fdiv_q_2exp(tmp, tmp, 1);
+		if (mpz_cmp(tmp, relation_prod) >= 0)
+			mpz_sub(tmp, tmp, relation_prod);
+
+		check_relations(t, level, node, tmp);
+		mpz_clear(tmp);
+		return;
+	}
+
+	children = tree->nodes[level - 1] + 2 * node;
+
+	if (2 * node + 1 >= tree->num_nodes[level - 1]) {
+
+		/* only child, with the same product */
+
+		compute_scaled_tree(t, level - 1, 2 * node, frac, prec);
+	}
+	else {
+		uint32 prec0 = mpz_sizeinbase(children[0], 2) + 
+					SCALED_GUARD_BITS;
+		uint32 prec1 = mpz_sizeinbase(children[1], 2) + 
+					SCALED_GUARD_BITS;
+
+		mpz_mul(tmp, frac, children[1]);
+		mpz_tdiv_r_2exp(tmp, tmp, prec);
+		mpz_tdiv_q_2exp(tmp, tmp, prec - prec0);
+		compute_scaled_tree(t, level - 1, 2 * node, tmp, prec0);
+
+		mpz_mul(tmp, frac, children[0]);
+		mpz_tdiv_r_2exp(tmp, tmp, prec);
+		mpz_tdiv_q_2exp(tmp, tmp, prec - prec1);
+		compute_scaled_tree(t, level - 1, 2 * node + 1, tmp, prec1);
+	}
+	mpz_clear(tmp);
+}
+
+/*------------------------------------------------------------------*/
+static void descend_subtrees(void *data, int thread_num) {
+
+	tree_task_t *t = (tree_task_t *)data;
+	uint32 i;
+
+	for (i = t->node_start; i < t->node_end; i++) {
+		if (t->stop_prec[i] == 0)
+			continue;
+
+		if (t->rb->scaled_tree) {
+			compute_scaled_tree(t, t->level, i, 
+					t->stop_vals[i], t->stop_prec[i]);
+		}
+		else {
+			compute_remainder_tree(t, t->level, i, 
+					t->stop_vals[i]);
+		}
+	}
+}
+
+/*------------------------------------------------------------------*/
+static int compare_success(const void *x, const void *y) {
+
+	batch_success_t *xx = (batch_success_t *)x;
+	batch_success_t *yy = (batch_success_t *)y;
+
+	if (xx->index < yy->index)
+		return -1;
+	return (xx->index > yy->index);
+}
+
 /*------------------------------------------------------------------*/
 void relation_batch_init(msieve_obj *obj, relation_batch_t *rb,
 			uint32 min_prime, uint32 max_prime,
@@ -499,6 +745,24 @@ void relation_batch_init(msieve_obj *obj, relation_batch_t *rb,
 	rb->savefile = savefile;
 	rb->print_relation = print_relation;
 
+	/* the batch is factored with as many threads as the
+	   sieving was told to use */
+
+	rb->num_threads = MAX(obj->num_threads, 1);
+	rb->threadpool = NULL;
+	if (rb->num_threads > 1) {
+		thread_control_t control;
+
+		memset(&control, 0, sizeof(control));
+		rb->threadpool = threadpool_init(rb->num_threads - 1,
+						rb->num_threads, &control);
+	}
+
+	rb->scaled_tree = 0;
+	if (obj->nfs_args != NULL && 
+	    strstr(obj->nfs_args, "batch_scaled=1"))
+		rb->scaled_tree = 1;
+
 	/* compute the cutoffs used by the recursion base-case. Large
 	   primes have a maximum size specified as input arguments, 
 	   but numbers that can be passed to the SQUFOF routine are
@@ -540,6 +804,8 @@ void relation_batch_init(msieve_obj *obj, relation_batch_t *rb,
 /*------------------------------------------------------------------*/
 void relation_batch_free(relation_batch_t *rb) {
 
+	if (rb->num_threads > 1)
+		threadpool_free(rb->threadpool);
 	mpz_clear(rb->prime_product);
 	free(rb->relations);
 	free(rb->factors);
@@ -625,11 +891,124 @@ void relation_batch_add(int64 a, uint32 b,
 /*------------------------------------------------------------------*/
 uint32 relation_batch_run(relation_batch_t *rb) {
 
+	uint32 i, j;
+	uint32 num_threads = rb->num_threads;
+	uint32 top, split;
+	uint32 num_success;
+	product_tree_t tree;
+	tree_task_t *tasks;
+	tree_task_t *serial;
+	batch_success_t *success;
+	mpz_t root_frac;
+	uint32 root_prec = 0;
+
 	rb->num_success = 0;
-	if (rb->num_relations > 0) {
-		compute_remainder_tree(0, rb->num_relations - 1,
-					rb, rb->prime_product);
+	if (rb->num_relations == 0)
+		return 0;
+
+	tasks = (tree_task_t *)xcalloc(num_threads, sizeof(tree_task_t));
+	for (i = 0; i < num_threads; i++) {
+		tasks[i].rb = rb;
+		tasks[i].tree = &tree;
+	}
+
+	build_product_tree(rb, &tree, tasks);
+	top = tree.num_levels - 1;
+
+	/* choose the level below which the threads split up
+	   the remainder tree */
+
+	split = NO_STOP_LEVEL;
+	if (num_threads > 1) {
+		for (split = top; split > 0; split--) {
+			if (tree.num_nodes[split] >= 4 * num_threads)
+				break;
+		}
+	}
+
+	/* walk down to that level, or all the way down if 
+	   there is only one thread */
+
+	serial = tasks + num_threads - 1;
+	serial->stop_level = split;
+	if (split != NO_STOP_LEVEL) {
+		serial->stop_vals = (mpz_t *)xmalloc(tree.num_nodes[split] *
+						sizeof(mpz_t));
+		serial->stop_prec = (uint32 *)xcalloc(tree.num_nodes[split],
+						sizeof(uint32));
+		for (i = 0; i < tree.num_nodes[split]; i++)
+			mpz_init(serial->stop_vals[i]);
+	}
+
+	mpz_init(root_frac);
+	if (rb->scaled_tree) {
+		mpz_ptr root = tree.nodes[top][0];
+
+		root_prec = mpz_sizeinbase(root, 2) + SCALED_GUARD_BITS;
+		mpz_tdiv_r(root_frac, rb->prime_product, root);
+		mpz_mul_2exp(root_frac, root_frac, root_prec);
+		mpz_tdiv_q(root_frac, root_frac, root);
+		compute_scaled_tree(serial, top, 0, root_frac, root_prec);
+	}
+	else {
+		compute_remainder_tree(serial, top, 0, rb->prime_product);
+	}
+	mpz_clear(root_frac);
+
+	/* finish the subtrees in parallel */
+
+	if (split != NO_STOP_LEVEL) {
+		uint32 num_nodes = tree.num_nodes[split];
+
+		for (i = 0; i < num_threads; i++) {
+			tree_task_t *t = tasks + i;
+
+			t->level = split;
+			t->node_start = (uint64)num_nodes * i / num_threads;
+			t->node_end = (uint64)num_nodes * (i + 1) / num_threads;
+			t->stop_level = NO_STOP_LEVEL;
+			t->stop_vals = serial->stop_vals;
+			t->stop_prec = serial->stop_prec;
+		}
+		run_tree_tasks(rb, descend_subtrees, tasks, num_threads);
+
+		for (i = 0; i < num_nodes; i++)
+			mpz_clear(serial->stop_vals[i]);
+		free(serial->stop_vals);
+		free(serial->stop_prec);
+	}
+	free_product_tree(&tree);
+
+	/* print the relations that survived, in the order
+	   they were added */
+
+	for (i = num_success = 0; i < num_threads; i++)
+		num_success += tasks[i].num_success;
+
+	success = (batch_success_t *)xmalloc(MAX(num_success, 1) *
+					sizeof(batch_success_t));
+	for (i = j = 0; i < num_threads; i++) {
+		memcpy(success + j, tasks[i].success, tasks[i].num_success *
+					sizeof(batch_success_t));
+		j += tasks[i].num_success;
+		free(tasks[i].success);
+	}
+	qsort(success, (size_t)num_success, sizeof(batch_success_t),
+			compare_success);
+
+	for (i = 0; i < num_success; i++) {
+		batch_success_t *s = success + i;
+		cofactor_t *c = rb->relations + s->index;
+		uint32 *f = rb->factors + c->factor_list_word;
+
+		rb->print_relation(rb->savefile, c->a, c->b,
+				f, c->num_factors_r, s->lp_r,
+				f + c->num_factors_r, c->num_factors_a, 
+				s->lp_a);
 	}
+	rb->num_success = num_success;
+	free(success);
+	free(tasks);
 
 	/* wipe out batched relations */
 
@@ -0,0 +1,236 @@
+/*--------------------------------------------------------------------
+This source distribution is placed in the public domain by its author,
+Jason Papadopoulos. You may use it for any purpose, free of charge,
+without having to notify anyone. I disclaim any responsibility for any
+errors.
+
+Optionally, please be nice and tell me if you find this source to be
+useful. Again optionally, if you add to the functionality present here
+please consider making those additions public too, so that others may
+benefit from your work.
+
+$Id$
+--------------------------------------------------------------------*/
+
+#include <common.h>
+#include <thread.h>
+
+/* Batch factoring of many small inputs. Every worker thread
+   owns one msieve_obj that is reused for all the inputs the
+   thread handles, and the quadratic sieve's prime list is
+   built once for the largest input we expect and shared */
+
+/* inputs up to this size (about 90 digits) use the shared
+   prime list; anything larger builds its own */
+
+#define BATCH_QS_MAX_BITS 300
+
+/* jobs that can be queued per worker before adding
+   another one blocks */
+
+#define BATCH_QUEUE_PER_THREAD 4
+
+typedef struct {
+	msieve_obj *obj;
+	char *savefile_name;
+} batch_worker_t;
+
+struct msieve_batch {
+	uint32 flags;
+	uint32 num_threads;
+	batch_worker_t *workers;
+	struct threadpool *threadpool;
+	prime_list_t qs_primes;
+
+	mutex_t callback_lock;
+	msieve_batch_callback callback;
+	void *user_data;
+
+	volatile uint32 stop;
+};
+
+typedef struct {
+	msieve_batch *batch;
+	uint32 id;
+	char *input;
+} batch_job_t;
+
+/*--------------------------------------------------------------------*/
+static void free_factors(msieve_obj *obj) {
+
+	msieve_factor *curr_factor = obj->factors;
+
+	while (curr_factor != NULL) {
+		msieve_factor *next_factor = curr_factor->next;
+		free(curr_factor->number);
+		free(curr_factor);
+		curr_factor = next_factor;
+	}
+	obj->factors = NULL;
+}
+
+/*--------------------------------------------------------------------*/
+static void batch_job_run(void *data, int thread_num) {
+
+	batch_job_t *job = (batch_job_t *)data;
+	msieve_batch *batch = job->batch;
+	msieve_obj *obj = batch->workers[thread_num].obj;
+
+	/* reset the per-input state of the worker; the
+	   random seeds carry over from the last input */
+
+	obj->input = job->input;
+	obj->flags = batch->flags;
+	if (batch->stop)
+		return;
+
+	msieve_run(obj);
+
+	mutex_lock(&batch->callback_lock);
+	batch->callback(batch->user_data, job->id, job->input,
+			obj->factors, obj->flags);
+	mutex_unlock(&batch->callback_lock);
+
+	free_factors(obj);
+	obj->input = NULL;
+}
+
+/*--------------------------------------------------------------------*/
+static void batch_job_free(void *data, int thread_num) {
+
+	/* called after the job runs, or if it never does */
+
+	batch_job_t *job = (batch_job_t *)data;
+
+	free(job->input);
+	free(job);
+}
+
+/*--------------------------------------------------------------------*/
+msieve_batch * msieve_batch_new(uint32 flags,
+				char *savefile_name,
+				char *logfile_name,
+				uint32 seed1, uint32 seed2,
+				enum cpu_type cpu,
+				uint32 cache_size1, uint32 cache_size2,
+				uint32 num_threads,
+				msieve_batch_callback callback,
+				void *user_data) {
+
+	uint32 i;
+	thread_control_t control;
+	msieve_batch *batch = (msieve_batch *)xcalloc((size_t)1,
+						sizeof(msieve_batch));
+
+	if (savefile_name == NULL)
+		savefile_name = MSIEVE_DEFAULT_SAVEFILE;
+
+	batch->flags = flags & ~(MSIEVE_FLAG_STOP_SIEVING |
+				 MSIEVE_FLAG_FACTORIZATION_DONE |
+				 MSIEVE_FLAG_SIEVING_IN_PROGRESS);
+	batch->num_threads = num_threads = MAX(num_threads, 1);
+	batch->callback = callback;
+	batch->user_data = user_data;
+	mutex_init(&batch->callback_lock);
+	mp_aprcl_lock_init();
+
+	qs_fill_prime_list(&batch->qs_primes, BATCH_QS_MAX_BITS);
+
+	/* each worker factors one input at a time, so it gets
+	   one thread, its own savefile and its own seeds */
+
+	batch->workers = (batch_worker_t *)xmalloc(num_threads *
+						sizeof(batch_worker_t));
+	for (i = 0; i < num_threads; i++) {
+		batch_worker_t *w = batch->workers + i;
+		msieve_obj *obj;
+
+		w->savefile_name = (char *)xmalloc(strlen(savefile_name) + 16);
+		sprintf(w->savefile_name, "%s.%u", savefile_name, i);
+
+		w->obj = obj = msieve_obj_new(NULL, batch->flags,
+					w->savefile_name, logfile_name,
+					NULL,
+					(seed1 + i) * ((uint32)40499 * 65543),
+					(seed2 + i) * ((uint32)40499 * 65543),
+					0, cpu, cache_size1, cache_size2,
+					1, 0, NULL);
+
+		obj->qs_primes = batch->qs_primes.list;
+		obj->num_qs_primes = batch->qs_primes.num_primes;
+	}
+
+	memset(&control, 0, sizeof(control));
+	batch->threadpool = threadpool_init(num_threads,
+				BATCH_QUEUE_PER_THREAD * num_threads,
+				&control);
+	return batch;
+}
+
+/*--------------------------------------------------------------------*/
+void msieve_batch_add(msieve_batch *batch, uint32 id,
+			const char *input) {
+
+	task_control_t t;
+	batch_job_t *job = (batch_job_t *)xmalloc(sizeof(batch_job_t));
+	size_t len = strlen(input) + 1;
+
+	job->batch = batch;
+	job->id = id;
+	job->input = (char *)xmalloc(len);
+	memcpy(job->input, input, len);
+
+	t.init = NULL;
+	t.run = batch_job_run;
+	t.shutdown = batch_job_free;
+	t.data = job;
+
+	threadpool_add_task(batch->threadpool, &t, 1);
+}
+
+/*--------------------------------------------------------------------*/
+void msieve_batch_wait(msieve_batch *batch) {
+
+	threadpool_drain(batch->threadpool, 1);
+}
+
+/*--------------------------------------------------------------------*/
+void msieve_batch_stop(msieve_batch *batch) {
+
+	uint32 i;
+
+	/* no locks here, so that a signal handler can call
+	   this; workers check batch->stop before starting
+	   each input */
+
+	batch->stop = 1;
+	for (i = 0; i < batch->num_threads; i++) {
+		msieve_obj *obj = batch->workers[i].obj;
+
+		if (obj->flags & MSIEVE_FLAG_SIEVING_IN_PROGRESS)
+			obj->flags |= MSIEVE_FLAG_STOP_SIEVING;
+	}
+}
+
+/*--------------------------------------------------------------------*/
+msieve_batch * msieve_batch_free(msieve_batch *batch) {
+
+	uint32 i;
+
+	threadpool_drain(batch->threadpool, 1);
+	threadpool_free(batch->threadpool);
+
+	for (i = 0; i < batch->num_threads; i++) {
+		batch_worker_t *w = batch->workers + i;
+
+		msieve_obj_free(w->obj);
+		remove(w->savefile_name);
+		free(w->savefile_name);
+	}
+	free(batch->workers);
+	free(batch->qs_primes.list);
+	mutex_free(&batch->callback_lock);
+	mp_aprcl_lock_free();
+	free(batch);
+	return NULL;
+}
@@ -119,6 +119,27 @@ $Id$
 	   it is the best algorithm available for continuing to prune
 	   relations */
 
+/* The search for cliques is split across threads. Rather than
+   a breadth-first traversal from each clique ideal, which is
+   inherently serial, we find connected components with a union-
+   find structure over the relations: every thread walks its own
+   block of relations, and for each clique ideal atomically
+   records the first relation that contains it; any later relation
+   containing the same ideal is merged with that first relation.
+   Trees are always linked so that the smaller relation number
+   becomes the parent, which means the root of each component is
+   its smallest relation no matter how the threads interleave.
+
+   Each relation also gets a partial score from its non-clique
+   ideals. Once the components are known, they are numbered in
+   order of their root and the threads compute clique scores
+   (summing relations in increasing order, so that the floating
+   point results do not depend on the number of threads) and each
+   save the heaviest cliques they find. Cliques with the same score
+   are ranked by clique number, so the cliques that get deleted are
+   reproducible from run to run. Finally the deleted relations are
+   squeezed out of the relation array in parallel */
+
 /* representation of one clique */
 
 typedef struct {
@@ -126,11 +147,18 @@ typedef struct {
 	uint16 num_ideals;          /* number of weight-2 ideals in clique */
 	float score;                /* measure of how 'heavy' the clique is
 				       (higher implies heavier) */
-	uint32 *relation_array_word;  /* list of word offsets within the
-					 relation array of relations that
-					 occur in this clique */
+	uint32 index;               /* clique number; the relations in the
+				       clique are in the member list starting
+				       at clique_start[index] */
 } clique_t;
 
+/* cliques with the same score are ranked by number,
+   with the lowest-numbered clique counting as heaviest */
+
+#define CLIQUE_LIGHTER(a, b) ((a).score < (b).score || \
+				((a).score == (b).score && \
+				 (a).index > (b).index))
+
 /*--------------------------------------------------------------------*/
 
 /* boilerplate code for managing a heap of cliques */
@@ -147,16 +175,16 @@ static void heapify(clique_t *h, uint32 index, uint32 size) {
 	for (c = HEAP_LEFT(index); c < (size-1); 
 			index = c, c = HEAP_LEFT(index)) {
 
-		if( h[c].score > h[c+1].score )
+		if (CLIQUE_LIGHTER(h[c+1], h[c]))
 			c++;
 
-		if( h[index].score > h[c].score ) {
+		if (CLIQUE_LIGHTER(h[c], h[index])) {
 			HEAP_SWAP(h[index], h[c]);
 		}
 		else
 			return;
 	}
-	if (c == (size-1) && h[index].score > h[c].score) {
+	if (c == (size-1) && CLIQUE_LIGHTER(h[c], h[index])) {
 		HEAP_SWAP(h[index], h[c]);
 	}
 }
@@ -168,386 +196,439 @@ static void make_heap(clique_t *h, uint32 size) {
 		heapify(h, i-1, size);
 }
 
-/*--------------------------------------------------------------------*/
-static int compare_uint32(const void *x, const void *y) {
-	uint32 *xx = (uint32 *)x;
-	uint32 *yy = (uint32 *)y;
-	if (*xx > *yy)
-		return 1;
-	if (*xx < *yy)
-		return -1;
-	return 0;
-}
-
 /*--------------------------------------------------------------------*/
 static int compare_score_descending(const void *x, const void *y) {
 	clique_t *xx = (clique_t *)x;
 	clique_t *yy = (clique_t *)y;
 
-	if (xx->score > yy->score)
+	if (CLIQUE_LIGHTER(*yy, *xx))
 		return -1;
-	if (xx->score < yy->score)
+	if (CLIQUE_LIGHTER(*xx, *yy))
 		return 1;
 	return 0;
 }
 
 /*--------------------------------------------------------------------*/
-static void delete_relations(filter_t *filter,
-			uint32 *delete_array, uint32 num_delete) {
+/* lock-free union-find on relation numbers. parent[x] <= x
+   always holds, so the root of every tree is its smallest
+   member */
 
-	uint32 i, j;
-	uint32 num_relations = filter->num_relations;
-	relation_ideal_t *relation_array = filter->relation_array;
-	relation_ideal_t *curr_relation;
-	relation_ideal_t *old_relation;
+#define NO_RELATION ((uint32)(-1))
 
-	/* put relation pointers in sorted order */
+static uint32 uf_find(volatile uint32 *parent, uint32 x) {
 
-	qsort(delete_array, (size_t)num_delete, 
-			sizeof(uint32), compare_uint32);
+	uint32 p, gp;
 
-	/* walk through the relation list and delete the
-	   relations that appear in the delete list */
+	/* path halving; a failed update just means
+	   another thread got there first */
 
-	curr_relation = relation_array;
-	old_relation = relation_array;
-	for (i = j = 0; i < num_relations; i++) {
-		uint32 array_word = (uint32)((uint32 *)curr_relation -
-						(uint32 *)relation_array);
-		relation_ideal_t *next_relation = 
-				next_relation_ptr(curr_relation);
+	while ((p = parent[x]) != x) {
+		gp = parent[p];
+		if (gp != p)
+			atomic_cas32(parent + x, p, gp);
+		x = p;
+	}
+	return x;
+}
 
-		if (array_word == delete_array[j]) {
+static void uf_union(volatile uint32 *parent, uint32 a, uint32 b) {
 
-			/* relation is skipped; don't increment
-			   the 'delete pointer' if there are no
-			   more relations to delete */
+	while (1) {
+		a = uf_find(parent, a);
+		b = uf_find(parent, b);
+		if (a == b)
+			return;
 
-			if (j < num_delete - 1)
-				j++;
+		if (a < b) {
+			uint32 tmp = a;
+			a = b;
+			b = tmp;
 		}
-		else {
-			/* relation has survived */
 
-			uint8 curr_num_ideals = curr_relation->ideal_count;
-			uint32 k;
-			old_relation->rel_index = curr_relation->rel_index;
-			old_relation->gf2_factors = curr_relation->gf2_factors;
-			old_relation->ideal_count = curr_num_ideals;
-			for (k = 0; k < curr_num_ideals; k++) {
-				old_relation->ideal_list[k] =
-						curr_relation->ideal_list[k];
-			}
-			old_relation = next_relation_ptr(old_relation);
-		}
-		curr_relation = next_relation;
-	}
-
-	/* trim the relation array */
+		/* link the larger root under the smaller one, 
+		   unless another thread changed it first */
 
-	filter->relation_array = (relation_ideal_t *)xrealloc(relation_array,
-				(size_t)(old_relation + 1 - relation_array) *
-				sizeof(relation_ideal_t));
-	filter->num_relations = num_relations - num_delete;
+		if (atomic_cas32(parent + a, a, b) == a)
+			return;
+	}
 }
 
 /*--------------------------------------------------------------------*/
-static uint32 purge_cliques_core(msieve_obj *obj, 
-				filter_t *filter,
-				uint32 clique_heap_size,
-				uint32 max_clique_relations,
-				uint32 num_excess_relations) {
 
-	uint32 i, j;
-	ideal_map_t *ideal_map;
-	relation_ideal_t *relation_array;
-	relation_ideal_t *curr_relation;
-	uint32 num_relations;
-	uint32 num_ideals;
-	uint32 num_ideals_delete;
-	clique_t *clique_heap;
-	uint32 num_clique;
+/* relations get a one-byte tag that is zero if the
+   relation contains no clique ideals, or else one more
+   than the number of clique ideals the relation was the
+   first to contain. Relations that are to be deleted
+   are tagged with DELETE_MARK */
 
-	uint32 *delete_array;
-	uint32 num_delete;
-	uint32 num_delete_alloc;
+#define DELETE_MARK 0xff
 
-	ideal_relation_t *reverse_array;
-	uint32 num_reverse;
-	uint32 num_reverse_alloc;
+typedef struct {
+	uint32 max_clique_relations;
+	uint32 *ideal_weight;     /* number of relations with each ideal */
+	uint32 *ideal_first;      /* first relation containing each 
+				     clique ideal */
+	uint32 *parent;           /* union-find forest; later, the clique
+				     number of each relation */
+	float *relation_score;    /* score of each relation by itself */
+	uint8 *relation_tag;
+
+	uint32 *clique_start;     /* offset in the member list where 
+				     each clique starts */
+	uint32 *members;          /* relation numbers of clique members */
+	uint32 clique_heap_size;
+} clique_data_t;
 
-	uint32 *clique_relations;
-	uint32 num_clique_relations;
-	uint32 num_clique_relations_alloc;
+typedef struct {
+	clique_data_t *data;
 
-	uint32 *clique_ideals;
-	uint32 num_clique_ideals;
-	uint32 num_clique_ideals_alloc;
+	/* the block of relations handled by this thread */
 
-	relation_array = filter->relation_array;
-	num_relations = filter->num_relations;
-	num_ideals = filter->num_ideals;
+	relation_ideal_t *start;
+	relation_ideal_t *end;
+	uint32 first_relation;
+	uint32 num_relations;
 
-	/* set up the hashtable for ideal counts */
+	/* the range of cliques handled by this thread,
+	   and a heap of the heaviest of them */
 
-	ideal_map = (ideal_map_t *)xcalloc((size_t)num_ideals, 
-					sizeof(ideal_map_t));
+	uint32 first_clique;
+	uint32 num_cliques;
+	clique_t *heap;
+	uint32 num_heap;
+} clique_task_t;
 
-	/* set up structure for linked lists of clique relations */
+/*--------------------------------------------------------------------*/
+static void find_components_core(void *data, int thread_num) {
+
+	clique_task_t *t = (clique_task_t *)data;
+	clique_data_t *d = t->data;
+	relation_ideal_t *r = t->start;
+	uint32 max_clique_relations = d->max_clique_relations;
+	uint32 *ideal_weight = d->ideal_weight;
+	volatile uint32 *ideal_first = d->ideal_first;
+	volatile uint32 *parent = d->parent;
+	uint32 i, j;
 
-	num_reverse = 1;
-	num_reverse_alloc = 10000;
-	reverse_array = (ideal_relation_t *)xmalloc(num_reverse_alloc *
-					sizeof(ideal_relation_t));
+	for (i = 0; i < t->num_relations; i++) {
+		uint32 rel = t->first_relation + i;
+		uint32 num_owned = 0;
+		uint32 in_clique = 0;
+		float score = 0.0;
 
-	/* count the number of times each ideal occurs in relations */
+		for (j = 0; j < r->ideal_count; j++) {
+			uint32 ideal = r->ideal_list[j];
+			uint32 weight = ideal_weight[ideal];
+			uint32 first;
 
-	curr_relation = relation_array;
-	for (i = 0; i < num_relations; i++) {
-		curr_relation->connected = 0;
-		for (j = 0; j < curr_relation->ideal_count; j++) {
-			uint32 ideal = curr_relation->ideal_list[j];
-			ideal_map[ideal].payload++;
+			/* add the contribution of this ideal
+			   to the score of the clique */
+
+			if (weight > max_clique_relations) {
+				score += 1.0 / weight;
+				continue;
+			}
+
+			/* clique ideal; the first relation that claims
+			   it also accounts for it in the clique size, 
+			   and later relations join that relation's
+			   clique */
+
+			in_clique = 1;
+			first = atomic_cas32(ideal_first + ideal,
+						NO_RELATION, rel);
+			if (first == NO_RELATION)
+				num_owned++;
+			else
+				uf_union(parent, rel, first);
 		}
-		curr_relation = next_relation_ptr(curr_relation);
+
+		d->relation_score[rel] = score;
+		d->relation_tag[rel] = in_clique ? 1 + num_owned : 0;
+		r = next_relation_ptr(r);
 	}
+}
 
-	/* mark all the ideals with small enough weight as 
-	   belonging to a clique, and set the head of their 
-	   linked list of relations to empty */
+/*--------------------------------------------------------------------*/
+static void score_cliques_core(void *data, int thread_num) {
+
+	clique_task_t *t = (clique_task_t *)data;
+	clique_data_t *d = t->data;
+	uint32 heap_size = MIN(d->clique_heap_size, t->num_cliques);
+	uint32 i, j;
 
-	for (i = 0; i < num_ideals; i++) {
-		if (ideal_map[i].payload <= max_clique_relations) {
-			ideal_map[i].payload = 0;
-			ideal_map[i].clique = 1;
+	t->num_heap = 0;
+	t->heap = (clique_t *)xmalloc(MAX(heap_size, 1) * sizeof(clique_t));
+
+	for (i = 0; i < t->num_cliques; i++) {
+		uint32 index = t->first_clique + i;
+		uint32 start = d->clique_start[index];
+		uint32 end = d->clique_start[index + 1];
+		uint32 num_ideals = 0;
+		float score = 0.0;
+		clique_t c;
+
+		for (j = start; j < end; j++) {
+			uint32 rel = d->members[j];
+			num_ideals += d->relation_tag[rel] - 1;
+			score += d->relation_score[rel];
 		}
-	}
 
-	/* for each relation */
+		/* throw the clique away if it is too large 
+		   to fit into a packed structure */
 
-	curr_relation = relation_array;
-	for (i = 0; i < num_relations; i++) {
+		if (end - start > 65535 || num_ideals > 65535)
+			continue;
 
-		uint64 relation_array_word = 
-				((uint32 *)curr_relation -
-				 (uint32 *)relation_array);
+		c.num_relations = (uint16)(end - start);
+		c.num_ideals = (uint16)num_ideals;
+		c.score = score;
+		c.index = index;
 
-		if (relation_array_word > (uint32)(-1))
-			break;
+		if (t->num_heap < heap_size) {
+			/* heap not full; append this clique */
+			t->heap[t->num_heap++] = c;
+			if (t->num_heap == heap_size)
+				make_heap(t->heap, heap_size);
+		}
+		else if (CLIQUE_LIGHTER(t->heap[0], c)) {
+			/* this clique replaces the lowest-
+			   scoring clique in the heap */
+			t->heap[0] = c;
+			heapify(t->heap, 0, heap_size);
+		}
+	}
+}
 
-		/* for each ideal in the relation */
+/*--------------------------------------------------------------------*/
+static void delete_relations_core(void *data, int thread_num) {
 
-		for (j = 0; j < curr_relation->ideal_count; j++) {
-			uint32 ideal = curr_relation->ideal_list[j];
+	clique_task_t *t = (clique_task_t *)data;
+	uint8 *relation_tag = t->data->relation_tag;
+	relation_ideal_t *curr_relation = t->start;
+	relation_ideal_t *old_relation = t->start;
+	uint32 i, j;
 
-			if (!ideal_map[ideal].clique)
-				continue;
+	for (i = 0; i < t->num_relations; i++) {
+		relation_ideal_t *next_relation = 
+				next_relation_ptr(curr_relation);
 
-			/* relation belongs in a clique because of this
-			   ideal; add it to the ideal's linked list */
+		if (relation_tag[t->first_relation + i] != DELETE_MARK) {
 
-			if (num_reverse == num_reverse_alloc) {
-				num_reverse_alloc *= 2;
-				reverse_array = (ideal_relation_t *)xrealloc(
-						reverse_array,
-						num_reverse_alloc *
-						sizeof(ideal_relation_t));
+			/* relation has survived */
+
+			uint8 curr_num_ideals = curr_relation->ideal_count;
+			if (old_relation != curr_relation) {
+				old_relation->rel_index = 
+						curr_relation->rel_index;
+				old_relation->gf2_factors = 
+						curr_relation->gf2_factors;
+				old_relation->ideal_count = curr_num_ideals;
+				for (j = 0; j < curr_num_ideals; j++) {
+					old_relation->ideal_list[j] =
+						curr_relation->ideal_list[j];
+				}
 			}
-			reverse_array[num_reverse].relation_array_word =
-						(uint32)relation_array_word;
-			reverse_array[num_reverse].next = 
-						ideal_map[ideal].payload;
-			ideal_map[ideal].payload = num_reverse++;
+			old_relation = next_relation_ptr(old_relation);
 		}
-
-		curr_relation = next_relation_ptr(curr_relation);
+		curr_relation = next_relation;
 	}
 
-	num_clique = 0;
-	clique_heap = (clique_t *)xmalloc(clique_heap_size * sizeof(clique_t));
+	t->end = old_relation;
+}
 
-	num_clique_relations_alloc = 500;
-	clique_relations = (uint32 *)xmalloc(num_clique_relations_alloc *
-					sizeof(uint32));
+/*--------------------------------------------------------------------*/
+static void run_clique_tasks(struct threadpool *threadpool,
+			clique_task_t *tasks, uint32 num_tasks,
+			run_func func) {
 
-	num_clique_ideals_alloc = 500;
-	clique_ideals = (uint32 *)xmalloc(num_clique_ideals_alloc *
-					sizeof(uint32));
+	uint32 i;
+	task_control_t task = {NULL, NULL, NULL, NULL};
 
-	/* find all the cliques and save the heaviest ones.
-	   We perform breadth first search by iterating through
-	   all of the ideals */
+	task.run = func;
+	for (i = 0; i < num_tasks - 1; i++) {
+		task.data = tasks + i;
+		threadpool_add_task(threadpool, &task, 1);
+	}
+	func(tasks + i, i);
 
-	for (i = 0; i < num_ideals; i++) {
-		clique_t *next_clique;
-		uint32 curr_clique_ideal;
-		float clique_score = 0.0;
+	if (i > 0)
+		threadpool_drain(threadpool, 1);
+}
 
-		/* check if the ideal is not part of a clique,
-		   or is part of a clique but the clique has
-		   already been visited */
+/*--------------------------------------------------------------------*/
+static uint32 purge_cliques_core(msieve_obj *obj, 
+				filter_t *filter,
+				uint32 clique_heap_size,
+				uint32 max_clique_relations,
+				uint32 num_excess_relations) {
 
-		if (!ideal_map[i].clique || ideal_map[i].connected)
-			continue;
+	uint32 i, j;
+	clique_data_t data;
+	clique_task_t *tasks;
+	uint32 num_threads;
+	struct threadpool *threadpool = NULL;
+	relation_ideal_t *relation_array;
+	relation_ideal_t *curr_relation;
+	uint32 num_relations;
+	uint32 num_ideals;
+	uint32 num_ideals_delete;
+	uint32 num_delete;
+	uint32 num_members;
+	clique_t *clique_list;
+	uint32 num_clique;
 
-		/* we've found a clique, and have to measure its
-		   weight and find all the relations in it. 
+	relation_array = filter->relation_array;
+	num_relations = filter->num_relations;
+	num_ideals = filter->num_ideals;
 
-		   This is a fairly standard breadth-first search.
-		   We find all the unvisited relations that contain
-		   this ideal, list them, and add any unvisited
-		   clique ideals they contain to a queue. The clique
-		   is complete when the queue of clique ideals is empty */
+	num_threads = MIN(obj->num_threads, MAX_FILTER_THREADS);
+	num_threads = MIN(num_threads, num_relations / 10000);
+	num_threads = MAX(num_threads, 1);
+	tasks = (clique_task_t *)xcalloc((size_t)num_threads,
+					sizeof(clique_task_t));
+	if (num_threads > 1) {
+		thread_control_t control = {NULL, NULL, NULL};
+		threadpool = threadpool_init(num_threads - 1, 
+						200, &control);
+	}
 
-		num_clique_relations = 0;
-		curr_clique_ideal = 0;
-		clique_ideals[0] = i;
-		ideal_map[i].connected = 1;
-		num_clique_ideals = 1;
+	memset(&data, 0, sizeof(data));
+	data.max_clique_relations = max_clique_relations;
+	data.clique_heap_size = clique_heap_size;
+	data.ideal_weight = (uint32 *)xcalloc((size_t)num_ideals + 1, 
+					sizeof(uint32));
+	data.ideal_first = (uint32 *)xmalloc(((size_t)num_ideals + 1) *
+					sizeof(uint32));
+	memset(data.ideal_first, 0xff, num_ideals * sizeof(uint32));
+	data.parent = (uint32 *)xmalloc(((size_t)num_relations + 1) *
+					sizeof(uint32));
+	data.relation_score = (float *)xmalloc(((size_t)num_relations + 1) *
+					sizeof(float));
+	data.relation_tag = (uint8 *)xmalloc((size_t)num_relations + 1);
 
-		/* for each clique ideal in the queue */
+	/* divide the relations into one block per thread, and
+	   count the number of times each ideal occurs in relations */
 
-		while (curr_clique_ideal < num_clique_ideals) {
-			uint32 idx = clique_ideals[curr_clique_ideal];
-			uint32 offset = ideal_map[idx].payload;
+	curr_relation = relation_array;
+	for (i = 0; i < num_threads; i++) {
+		clique_task_t *t = tasks + i;
+		uint32 block_size = num_relations / num_threads;
+
+		t->data = &data;
+		t->start = curr_relation;
+		t->first_relation = i * block_size;
+		if (i == num_threads - 1)
+			block_size = num_relations - t->first_relation;
+		t->num_relations = block_size;
+
+		for (j = 0; j < block_size; j++) {
+			uint32 k;
 
-			/* find the relations containing the ideal */
+			for (k = 0; k < curr_relation->ideal_count; k++) {
+				uint32 ideal = curr_relation->ideal_list[k];
+				data.ideal_weight[ideal]++;
+			}
+			data.parent[t->first_relation + j] = 
+						t->first_relation + j;
+			curr_relation = next_relation_ptr(curr_relation);
+		}
+	}
 
-			while (offset != 0) {
-				ideal_relation_t *rev = reverse_array + offset;
-				relation_ideal_t *r = (relation_ideal_t *)(
-						(uint32 *)relation_array +
-						rev->relation_array_word);
+	/* find the connected components */
 
-				if (r->connected) {
-					offset = rev->next;
-					continue;
-				}
+	run_clique_tasks(threadpool, tasks, num_threads, 
+				find_components_core);
+	free(data.ideal_weight);
+	free(data.ideal_first);
 
-				/* relation seen for the first time;
-				   look for clique ideals it contains */
-
-				for (j = 0; j < r->ideal_count; j++) {
-					uint32 new_ideal = r->ideal_list[j];
-					ideal_map_t *map = ideal_map+new_ideal;
-
-					/* add the contribution of this ideal
-					   to the score of the clique */
-
-					if (!map->clique) {
-						clique_score += 1.0 / 
-							map->payload;
-						continue;
-					}
-
-					if (map->connected)
-						continue;
-
-					/* ideal is a clique ideal and has
-					   not been visited before; add it 
-					   to the queue */
-
-					if (num_clique_ideals ==
-						num_clique_ideals_alloc) {
-						num_clique_ideals_alloc *= 2;
-						clique_ideals = (uint32 *)
-							xrealloc(clique_ideals,
-							num_clique_ideals_alloc
-							* sizeof(uint32));
-					}
-					clique_ideals[num_clique_ideals++] =
-							new_ideal;
-					map->connected = 1;
-				}
+	/* number the cliques in order of their smallest relation,
+	   and replace the union-find parent of each relation with
+	   its clique number. Parents always come before their
+	   children, so one pass is enough */
 
-				/* save the relation and mark as visited */
+	num_clique = 0;
+	num_members = 0;
+	for (i = 0; i < num_relations; i++) {
+		uint32 p = data.parent[i];
 
-				if (num_clique_relations ==
-						num_clique_relations_alloc) {
-					num_clique_relations_alloc *= 2;
-					clique_relations = (uint32 *)xrealloc(
-						clique_relations,
-						num_clique_relations_alloc *
-						sizeof(uint32));
-				}
-				clique_relations[num_clique_relations++] = 
-						rev->relation_array_word;
-				r->connected = 1;
-				offset = rev->next;
-			}
+		if (data.relation_tag[i] == 0)
+			continue;
 
-			/* current clique ideal is finished */
+		num_members++;
+		if (p == i)
+			data.parent[i] = num_clique++;
+		else
+			data.parent[i] = data.parent[p];
+	}
 
-			curr_clique_ideal++;
-		}
+	/* list the relations in each clique, in increasing order */
 
-		/* clique is enumerated; throw it away if it is
-		   too large to fit into a packed structure */
+	data.clique_start = (uint32 *)xcalloc((size_t)num_clique + 1,
+					sizeof(uint32));
+	data.members = (uint32 *)xmalloc(((size_t)num_members + 1) *
+					sizeof(uint32));
+	for (i = 0; i < num_relations; i++) {
+		if (data.relation_tag[i] != 0)
+			data.clique_start[data.parent[i] + 1]++;
+	}
+	for (i = 0; i < num_clique; i++)
+		data.clique_start[i + 1] += data.clique_start[i];
+	for (i = 0; i < num_relations; i++) {
+		if (data.relation_tag[i] != 0)
+			data.members[data.clique_start[data.parent[i]]++] = i;
+	}
+	for (i = num_clique; i; i--)
+		data.clique_start[i] = data.clique_start[i - 1];
+	data.clique_start[0] = 0;
+	free(data.parent);
 
-		if (num_clique_relations > 65535 ||
-		     num_clique_ideals > 65535)
-			continue;
+	/* score the cliques and save the heaviest ones */
 
-		if (num_clique < clique_heap_size) {
-			/* heap not full; append this clique */
-			next_clique = clique_heap + num_clique;
-		}
-		else if (clique_score <= clique_heap[0].score) {
-			/* all cliques in the heap are heavier
-			   than this one; just skip it */
-			continue;
-		}
-		else {
-			/* this clique replaces the lowest-
-			   scoring clique in the heap */
-			next_clique = clique_heap;
-			free(next_clique->relation_array_word);
-		}
-			
-		/* save this clique */
-
-		next_clique->num_relations = (uint16)num_clique_relations;
-		next_clique->num_ideals = (uint16)num_clique_ideals;
-		next_clique->score = clique_score;
-		next_clique->relation_array_word = 
-				(uint32 *)xmalloc(num_clique_relations *
-						sizeof(uint32));
-		memcpy(next_clique->relation_array_word,
-			clique_relations, 
-			num_clique_relations * sizeof(uint32));
-
-		/* manage the heap */
-
-		if (num_clique < clique_heap_size) {
-			if (num_clique == clique_heap_size - 1)
-				make_heap(clique_heap, clique_heap_size);
-			num_clique++;
-		}
-		else {
-			heapify(clique_heap, 0, clique_heap_size);
-		}
+	for (i = 0; i < num_threads; i++) {
+		clique_task_t *t = tasks + i;
+		uint32 block_size = num_clique / num_threads;
+
+		t->first_clique = i * block_size;
+		if (i == num_threads - 1)
+			block_size = num_clique - t->first_clique;
+		t->num_cliques = block_size;
 	}
 
-	free(reverse_array);
-	free(ideal_map);
-	free(clique_relations);
-	free(clique_ideals);
+	run_clique_tasks(threadpool, tasks, num_threads, 
+				score_cliques_core);
+	free(data.relation_score);
+
+	for (i = num_clique = 0; i < num_threads; i++)
+		num_clique += tasks[i].num_heap;
+
+	clique_list = (clique_t *)xmalloc(((size_t)num_clique + 1) *
+					sizeof(clique_t));
+	for (i = num_clique = 0; i < num_threads; i++) {
+		clique_task_t *t = tasks + i;
+
+		memcpy(clique_list + num_clique, t->heap,
+				t->num_heap * sizeof(clique_t));
+		num_clique += t->num_heap;
+		free(t->heap);
+	}
 
 	/* put the heaviest cliques first */
 
-	qsort(clique_heap, (size_t)num_clique, sizeof(clique_t), 
+	qsort(clique_list, (size_t)num_clique, sizeof(clique_t), 
 				compare_score_descending);
+	num_clique = MIN(num_clique, clique_heap_size);
 
-	/* now figure out how many cliques to delete, and list all
+	/* now figure out how many cliques to delete, and mark all
 	   the relations in those cliques */
 
-	num_delete_alloc = 5000;
 	num_delete = 0;
 	num_ideals_delete = 0;
-	delete_array = (uint32 *)xmalloc(num_delete_alloc * sizeof(uint32));
 
 	for (i = 0; i < num_clique; i++) {
-		clique_t *curr_clique = clique_heap + i;
+		clique_t *curr_clique = clique_list + i;
+		uint32 *members = data.members + 
+				data.clique_start[curr_clique->index];
 
 		/* we stop deleting cliques either when all of
 		   them are gone, or when the number of deleted
@@ -567,21 +648,13 @@ static uint32 purge_cliques_core(msieve_obj *obj,
 		num_excess_relations += curr_clique->num_ideals;
 		num_ideals_delete += curr_clique->num_ideals;
 
-		/* append the list of relations in this clique
-		   to the delete list. Since a relation can only
-		   appear in one clique, the list will have no
-		   redundancy */
-
-		for (j = 0; j < curr_clique->num_relations; j++) {
-			if (num_delete == num_delete_alloc) {
-				num_delete_alloc *= 2;
-				delete_array = (uint32 *)xrealloc(delete_array,
-							num_delete_alloc *
-							sizeof(uint32));
-			}
-			delete_array[num_delete++] = 
-				curr_clique->relation_array_word[j];
-		}
+		/* mark the relations in this clique. Since a 
+		   relation can only appear in one clique, no
+		   relation is counted twice */
+
+		for (j = 0; j < curr_clique->num_relations; j++)
+			data.relation_tag[members[j]] = DELETE_MARK;
+		num_delete += curr_clique->num_relations;
 	}
 
 	/* don't bother deleteing cliques if there are too few of
@@ -591,16 +664,43 @@ static uint32 purge_cliques_core(msieve_obj *obj,
 		logprintf(obj, "removing %u relations and %u ideals "
 				"in %u cliques\n", 
 				num_delete, num_ideals_delete, i);
-		delete_relations(filter, delete_array, num_delete);
+
+		run_clique_tasks(threadpool, tasks, num_threads,
+					delete_relations_core);
+
+		/* squeeze out the gaps between blocks, 
+		   then trim the relation array */
+
+		curr_relation = tasks[0].end;
+		for (i = 1; i < num_threads; i++) {
+			clique_task_t *t = tasks + i;
+			size_t block_words = (uint32 *)t->end - 
+						(uint32 *)t->start;
+
+			memmove(curr_relation, t->start, 
+					block_words * sizeof(uint32));
+			curr_relation = (relation_ideal_t *)(
+				(uint32 *)curr_relation + block_words);
+		}
+
+		filter->relation_array = (relation_ideal_t *)xrealloc(
+					relation_array,
+					(size_t)(curr_relation + 1 - 
+						relation_array) *
+					sizeof(relation_ideal_t));
+		filter->num_relations = num_relations - num_delete;
 	}
 	else {
 		num_delete = 0;
 	}
 
-	for (i = 0; i < num_clique; i++)
-		free(clique_heap[i].relation_array_word);
-	free(clique_heap);
-	free(delete_array);
+	if (threadpool != NULL)
+		threadpool_free(threadpool);
+	free(tasks);
+	free(data.relation_tag);
+	free(data.clique_start);
+	free(data.members);
+	free(clique_list);
 	return num_delete;
 }
 
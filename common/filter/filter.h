@@ -71,6 +71,9 @@ typedef struct {
 	uint32 max_ideal_weight;   /* the largest number of relations that
 				        contain the same ideal */
 	uint64 lp_file_size;       /* number of bytes in LP file */
+	uint64 ram_size;           /* memory budget for filtering; LP files
+				      smaller than half of this are kept
+				      resident while being read */
 } filter_t;
 
 /* representation of a 'relation set', i.e. a group
@@ -115,7 +118,8 @@ void filter_read_lp_file(msieve_obj *obj, filter_t *filter,
 
 /* perform approximate singleton removal on relations packed
    into a disk file, then prune the singletons from the file.
-   The relations are not read into memory */
+   The relations are not read into memory; ram_size determines
+   whether the file is kept resident between passes */
 
 void filter_purge_lp_singletons(msieve_obj *obj, filter_t *filter,
 				uint64 ram_size);
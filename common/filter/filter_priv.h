@@ -20,8 +20,14 @@ $Id$
 #ifndef _COMMON_FILTER_FILTER_PRIV_H_
 #define _COMMON_FILTER_FILTER_PRIV_H_
 
+#include <thread.h>
 #include "filter.h"
 
+/* the maximum number of threads that the in-memory
+   filtering phases will use */
+
+#define MAX_FILTER_THREADS 32
+
 #ifdef __cplusplus
 extern "C" {
 #endif
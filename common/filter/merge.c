@@ -328,6 +328,101 @@ static uint32 store_next_relset_group(merge_aux_t *aux,
 	return num_cycles;
 }
 
+/*--------------------------------------------------------------------*/
+/* When multiple threads are available, merging proceeds in
+   batches. Each batch pulls the best ideals off the active heap,
+   skipping any ideal that appears in a relation set of an ideal
+   already chosen for the batch. The relation sets that the batch
+   will merge then form disjoint groups, and the merges themselves
+   (the expensive part) can all run at the same time. Updating the
+   heaps, the cycle count and the matrix weight remains serial, and
+   happens in the order that ideals were chosen. Skipped ideals go
+   back into the active heap to be tried in a later batch.
+
+   With a batch size of 1 this reduces to the ordinary serial
+   merge, one ideal at a time */
+
+#define MERGE_BATCH_PER_THREAD 16
+
+typedef struct {
+	merge_aux_t *aux;       /* first relation set group to merge */
+	uint32 num_aux;         /* number of groups to merge */
+	uint32 stride;          /* distance between groups */
+} merge_task_t;
+
+static void merge_batch_core(void *data, int thread_num) {
+
+	uint32 i;
+	merge_task_t *t = (merge_task_t *)data;
+
+	for (i = 0; i < t->num_aux; i++)
+		do_merges_core(t->aux + i * t->stride);
+}
+
+/*--------------------------------------------------------------------*/
+static uint32 load_next_batch(merge_aux_t *aux_array,
+			uint32 max_batch,
+			heap_t *active_heap, heap_t *inactive_heap,
+			ideal_list_t *ideal_list,
+			relation_set_t *relset_array,
+			uint32 *ideal_mark, uint32 batch_id,
+			uint32 *deferred) {
+
+	uint32 i, j, k;
+	uint32 num_batch = 0;
+	uint32 num_deferred = 0;
+
+	while (num_batch < max_batch && num_deferred < max_batch) {
+
+		ideal_set_t *ideal_set;
+		uint32 ideal = heap_remove_best(active_heap, ideal_list);
+		if (ideal == (uint32)(-1))
+			break;
+
+		/* skip the ideal if merging it would touch
+		   relation sets that the batch already uses */
+
+		if (ideal_mark[ideal] == batch_id) {
+			deferred[num_deferred++] = ideal;
+			continue;
+		}
+
+		/* mark every ideal in the relation sets to be merged;
+		   no other ideal's relation sets can change because
+		   of this merge */
+
+		ideal_set = ideal_list->list + ideal;
+		for (i = 0; i < ideal_set->num_relsets; i++) {
+			relation_set_t *r = relset_array + 
+						ideal_set->relsets[i];
+			uint32 *ideals = r->data + r->num_relations;
+
+			for (j = 0; j < r->num_large_ideals; j++)
+				ideal_mark[ideals[j]] = batch_id;
+		}
+
+		load_next_relset_group(aux_array + num_batch++, 
+					active_heap, inactive_heap,
+					ideal_list, relset_array, ideal, 0);
+	}
+
+	/* return the skipped ideals to the active heap. Loading
+	   relation sets may already have put some of them back, 
+	   and ideals that lost all their relation sets get put 
+	   back when the merged relation sets are stored */
+
+	for (k = 0; k < num_deferred; k++) {
+		ideal_set_t *ideal_set = ideal_list->list + deferred[k];
+
+		if (ideal_set->next == ideal_set && 
+		    ideal_set->num_relsets > 0) {
+			heap_add_ideal(active_heap, ideal_list, deferred[k]);
+		}
+	}
+
+	return num_batch;
+}
+
 /*--------------------------------------------------------------------*/
 #define NUM_CYCLE_BINS 9
 
@@ -428,6 +523,13 @@ int32 filter_merge_full(msieve_obj *obj, merge_t *merge, uint32 min_cycles) {
 	heap_t inactive_heap;
 	ideal_list_t ideal_list;
 	merge_aux_t *aux;
+	uint32 max_batch;
+	uint32 num_threads;
+	uint32 *ideal_mark;
+	uint32 *deferred;
+	uint32 batch_id = 0;
+	merge_task_t tasks[MAX_FILTER_THREADS];
+	struct threadpool *threadpool = NULL;
 	uint64 total_cycle_weight = 0;
 	uint32 cycle_bins[NUM_CYCLE_BINS + 2] = {0};
 	uint32 max_cycles;
@@ -441,7 +543,19 @@ int32 filter_merge_full(msieve_obj *obj, merge_t *merge, uint32 min_cycles) {
 
 	/* initialize; all ideals start off inactive */
 
-	aux = (merge_aux_t *)xmalloc(sizeof(merge_aux_t));
+	num_threads = MIN(obj->num_threads, MAX_FILTER_THREADS);
+	num_threads = MAX(num_threads, 1);
+	max_batch = 1;
+	if (num_threads > 1) {
+		thread_control_t control = {NULL, NULL, NULL};
+
+		max_batch = num_threads * MERGE_BATCH_PER_THREAD;
+		threadpool = threadpool_init(num_threads - 1, 
+						200, &control);
+	}
+	aux = (merge_aux_t *)xmalloc(max_batch * sizeof(merge_aux_t));
+	deferred = (uint32 *)xmalloc(max_batch * sizeof(uint32));
+	ideal_mark = (uint32 *)xcalloc((size_t)num_ideals, sizeof(uint32));
 	heap_init(&active_heap);
 	heap_init(&inactive_heap);
 	ideal_list_init(&ideal_list, num_ideals, 0);
@@ -482,6 +596,7 @@ int32 filter_merge_full(msieve_obj *obj, merge_t *merge, uint32 min_cycles) {
 	while (1) {
 
 		uint32 ideal;
+		uint32 num_batch;
 
 		if (active_heap.num_ideals == 0) {
 
@@ -543,26 +658,50 @@ int32 filter_merge_full(msieve_obj *obj, merge_t *merge, uint32 min_cycles) {
 					merge->num_extra_relations;
 		}
 
-		/* choose the next ideal to merge */
+		/* choose the next ideals to merge */
 
-		ideal = heap_remove_best(&active_heap, &ideal_list);
-		if (ideal == (uint32)(-1))
+		num_batch = load_next_batch(aux, max_batch, 
+					&active_heap, &inactive_heap,
+					&ideal_list, relset_array, 
+					ideal_mark, ++batch_id, deferred);
+		if (num_batch == 0)
 			break;
 
-		/* remove all the relation sets that contain that
-		   ideal from both heaps, merge them, and add them
+		/* remove all the relation sets that contain those
+		   ideals from both heaps, merge them, and add them
 		   back to the heaps, updating the number of cycles
 		   formed and the total weight of all cycles */
 
-		load_next_relset_group(aux, &active_heap, &inactive_heap,
-					&ideal_list, relset_array, ideal, 0);
+		if (num_batch == 1) {
+			do_merges_core(aux);
+		}
+		else {
+			task_control_t task = {NULL, merge_batch_core, 
+						NULL, NULL};
+			uint32 num_tasks = MIN(num_threads, num_batch);
 
-		do_merges_core(aux);
+			for (i = 0; i < num_tasks; i++) {
+				merge_task_t *t = tasks + i;
 
-		num_cycles += store_next_relset_group(aux, 
-					&active_heap, &inactive_heap,
-					&ideal_list, relset_array, 
-					&mat_weight);
+				t->aux = aux + i;
+				t->stride = num_tasks;
+				t->num_aux = (num_batch - i + 
+						num_tasks - 1) / num_tasks;
+			}
+			for (i = 0; i < num_tasks - 1; i++) {
+				task.data = tasks + i;
+				threadpool_add_task(threadpool, &task, 1);
+			}
+			merge_batch_core(tasks + i, i);
+			threadpool_drain(threadpool, 1);
+		}
+
+		for (i = 0; i < num_batch; i++) {
+			num_cycles += store_next_relset_group(aux + i, 
+						&active_heap, &inactive_heap,
+						&ideal_list, relset_array, 
+						&mat_weight);
+		}
 
 		/* swap ideals between the active and inactive
 		   heaps, until all the lightest ideals are in the
@@ -677,5 +816,9 @@ clean_up:
 	heap_free(&inactive_heap);
 	ideal_list_free(&ideal_list);
 	free(aux);
+	free(deferred);
+	free(ideal_mark);
+	if (threadpool != NULL)
+		threadpool_free(threadpool);
 	return status;
 }
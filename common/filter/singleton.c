@@ -14,115 +14,168 @@ $Id$
 
 #include "filter_priv.h"
 
+/* The LP file is read through a memory mapping when possible, 
+   so that the packed relations are used in place instead of being
+   copied into buffers; the routines below make several passes 
+   through the file, and only the final in-memory relation array 
+   is ever allocated. If the file is small enough to stay resident
+   (relative to the filtering memory budget) we ask the OS to 
+   read all of it in, otherwise each pass reads the file 
+   sequentially and the pages behind the current position are
+   released as we go, so that the large arrays the filtering 
+   keeps in memory do not get paged out instead.
+
+   If the file cannot be mapped (e.g. on 32-bit systems) we fall 
+   back to ordinary buffered reads */
+
+#define LP_RELEASE_CHUNK ((uint64)64 << 20)
+
+typedef struct {
+	mapped_file_t map;
+	FILE *fp;
+	uint32 pinned;
+	uint64 offset;
+	uint64 released;
+	relation_ideal_t tmp;
+} lp_scan_t;
+
+static const size_t lp_header_words = (sizeof(relation_ideal_t) - 
+		TEMP_FACTOR_LIST_SIZE * sizeof(uint32)) / sizeof(uint32);
+
 /*--------------------------------------------------------------------*/
-static void filter_read_lp_file_1pass(msieve_obj *obj, 
-				filter_t *filter,
-				uint32 max_ideal_weight) {
+static void lp_scan_open(msieve_obj *obj, lp_scan_t *s, 
+			uint64 mem_budget) {
 
-	uint32 i, j, k;
-	FILE *fp;
 	char buf[256];
-	uint32 num_relations = filter->num_relations;
-	uint32 num_ideals = filter->num_ideals;
-	uint32 *counts;
-	relation_ideal_t *r, *r_old, *r_next;
-
-	logprintf(obj, "reading all ideals from disk\n");
 
+	memset(s, 0, sizeof(lp_scan_t));
 	sprintf(buf, "%s.lp", obj->savefile.name);
-	fp = fopen(buf, "rb");
-	if (fp == NULL) {
+
+	if (map_file(&s->map, buf) == 0) {
+		s->pinned = (s->map.size <= mem_budget / 2);
+		map_file_advise(&s->map, 0, s->map.size, 
+				s->pinned ? MAP_ADVICE_WILLNEED :
+					MAP_ADVICE_SEQUENTIAL);
+		return;
+	}
+
+	s->fp = fopen(buf, "rb");
+	if (s->fp == NULL) {
 		logprintf(obj, "error: can't open LP file\n");
 		exit(-1);
 	}
+}
 
-	filter->relation_array = (relation_ideal_t *)xmalloc(
-					(size_t)filter->lp_file_size);
-	fread(filter->relation_array, (size_t)1, 
-			(size_t)filter->lp_file_size, fp);
+/*--------------------------------------------------------------------*/
+static void lp_scan_close(lp_scan_t *s) {
 
-	fclose(fp);
-	logprintf(obj, "memory use: %.1f MB\n", 
-			(double)filter->lp_file_size / 1048576);
+	if (s->fp != NULL)
+		fclose(s->fp);
+	else
+		unmap_file(&s->map);
+}
 
-	/* build a frequency table for the ideals */
+/*--------------------------------------------------------------------*/
+static void lp_scan_rewind(lp_scan_t *s) {
 
-	counts = (uint32 *)xcalloc((size_t)num_ideals, sizeof(uint32));
-	r = filter->relation_array;
-	for (i = 0; i < num_relations; i++) {
+	if (s->fp != NULL)
+		rewind(s->fp);
+	s->offset = 0;
+	s->released = 0;
+}
 
-		for (j = 0; j < r->ideal_count; j++)
-			counts[r->ideal_list[j]]++;
+/*--------------------------------------------------------------------*/
+static relation_ideal_t * lp_scan_next(lp_scan_t *s) {
 
-		r = next_relation_ptr(r);
-	}
+	/* return the next relation in the file. The 
+	   relation must be treated as read-only */
 
-	/* renumber the ideals to ignore the ones that occur
-	   too often */
+	relation_ideal_t *r;
 
-	for (i = j = 0; i < num_ideals; i++) {
-		if (counts[i] == 0 || counts[i] > max_ideal_weight)
-			counts[i] = (uint32)(-1);
-		else
-			counts[i] = j++;
+	if (s->fp != NULL) {
+		r = &s->tmp;
+		fread(r, sizeof(uint32), lp_header_words, s->fp);
+		fread(r->ideal_list, sizeof(uint32), 
+				(size_t)r->ideal_count, s->fp);
+		return r;
 	}
-	filter->target_excess += i - j;
-	filter->num_ideals = j;
 
-	if (i != j) {
-		logprintf(obj, "keeping %u ideals with weight <= %u, "
-				"target excess is %u\n",
-				j, max_ideal_weight, 
-				filter->target_excess);
+	r = (relation_ideal_t *)(s->map.data + s->offset);
+	s->offset += (lp_header_words + r->ideal_count) * sizeof(uint32);
 
-		r = r_old = filter->relation_array;
-		for (i = 0; i < num_relations; i++) {
+	if (!s->pinned && s->offset - s->released >= LP_RELEASE_CHUNK) {
+		map_file_advise(&s->map, s->released, 
+				LP_RELEASE_CHUNK, MAP_ADVICE_DONTNEED);
+		s->released += LP_RELEASE_CHUNK;
+	}
+	return r;
+}
 
-			uint32 ideal_count = r->ideal_count;
+/*--------------------------------------------------------------------*/
+static size_t read_lp_relations(lp_scan_t *s, filter_t *filter,
+				uint32 *counts) {
 
-			r_next = next_relation_ptr(r);
-			r_old->rel_index = r->rel_index;
-			r_old->gf2_factors = r->gf2_factors;
+	/* given the new numbering of the ideals in counts[]
+	   (with -1 meaning the ideal is skipped), copy the
+	   relations in the LP file into filter->relation_array. 
+	   The size of the array is determined first, so that 
+	   it is allocated only once */
 
-			for (j = k = 0; j < ideal_count; j++) {
+	uint32 i, j, k;
+	uint32 num_relations = filter->num_relations;
+	size_t num_words = 0;
+	relation_ideal_t *r, *r_out;
 
-				uint32 ideal = counts[r->ideal_list[j]];
+	lp_scan_rewind(s);
+	for (i = 0; i < num_relations; i++) {
+		r = lp_scan_next(s);
 
-				if (ideal != (uint32)(-1))
-					r_old->ideal_list[k++] = ideal;
-			}
-			r_old->ideal_count = k;
-			r_old->gf2_factors += ideal_count - k;
-			r_old = next_relation_ptr(r_old);
-			r = r_next;
+		num_words += lp_header_words;
+		for (j = 0; j < r->ideal_count; j++) {
+			if (counts[r->ideal_list[j]] != (uint32)(-1))
+				num_words++;
 		}
+	}
 
-		/* trim the allocated memory */
+	/* leave room for one full relation at the end; the
+	   in-memory singleton removal assumes it is there */
 
-		filter->relation_array = (relation_ideal_t *)xrealloc(
-					filter->relation_array, 
-					(size_t)((uint32 *)r_old - 
-					(uint32 *)filter->relation_array) *
-					sizeof(uint32));
+	filter->relation_array = (relation_ideal_t *)xmalloc(
+				num_words * sizeof(uint32) +
+				sizeof(relation_ideal_t));
+
+	lp_scan_rewind(s);
+	r_out = filter->relation_array;
+	for (i = 0; i < num_relations; i++) {
+		r = lp_scan_next(s);
+
+		r_out->rel_index = r->rel_index;
+		r_out->gf2_factors = r->gf2_factors;
+		r_out->connected = 0;
+
+		for (j = k = 0; j < r->ideal_count; j++) {
+			uint32 ideal = counts[r->ideal_list[j]];
+
+			if (ideal != (uint32)(-1))
+				r_out->ideal_list[k++] = ideal;
+		}
+		r_out->ideal_count = k;
+		r_out->gf2_factors += j - k;
+		r_out = next_relation_ptr(r_out);
 	}
 
-	free(counts);
+	return num_words * sizeof(uint32) + sizeof(relation_ideal_t);
 }
 
 /*--------------------------------------------------------------------*/
 void filter_read_lp_file(msieve_obj *obj, filter_t *filter,
 				uint32 max_ideal_weight) {
-	uint32 i, j, k;
-	FILE *fp;
-	char buf[256];
-	size_t header_words;
-	relation_ideal_t tmp;
-	relation_ideal_t *relation_array;
-	uint32 curr_word;
-	size_t num_relation_alloc;
+	uint32 i, j;
+	lp_scan_t s;
 	uint32 *counts;
 	uint32 num_relations = filter->num_relations;
 	uint32 num_ideals = filter->num_ideals;
+	uint32 read_all = 0;
 	size_t mem_use;
 
 	/* read in the relations from the lp file, as well as the large
@@ -130,111 +183,53 @@ void filter_read_lp_file(msieve_obj *obj, filter_t *filter,
 	   more than max_ideal_weight times in the dataset */
 
 	if (max_ideal_weight == 0) {
-		filter_read_lp_file_1pass(obj, filter, 200);
-		filter_purge_singletons_core(obj, filter);
-		return;
+		logprintf(obj, "reading all ideals from disk\n");
+		max_ideal_weight = 200;
+		read_all = 1;
 	}
-
-	logprintf(obj, "reading large ideals from disk\n");
-
-	sprintf(buf, "%s.lp", obj->savefile.name);
-	fp = fopen(buf, "rb");
-	if (fp == NULL) {
-		logprintf(obj, "error: singleton2 can't open LP file\n");
-		exit(-1);
+	else {
+		logprintf(obj, "reading large ideals from disk\n");
 	}
 
-	header_words = (sizeof(relation_ideal_t) - 
-			sizeof(tmp.ideal_list)) / sizeof(uint32);
+	lp_scan_open(obj, &s, filter->ram_size);
 	counts = (uint32 *)xcalloc((size_t)num_ideals, sizeof(uint32));
 
 	/* first build a frequency table for the large ideals */
 
 	for (i = 0; i < num_relations; i++) {
+		relation_ideal_t *r = lp_scan_next(&s);
 
-		fread(&tmp, sizeof(uint32), header_words, fp);
-
-		for (j = 0; j < tmp.ideal_count; j++) {
-			uint32 curr_ideal;
-
-			fread(&curr_ideal, sizeof(uint32), (size_t)1, fp);
-			counts[curr_ideal]++;
-		}
+		for (j = 0; j < r->ideal_count; j++)
+			counts[r->ideal_list[j]]++;
 	}
 
 	/* renumber the ideals to ignore the ones that occur
 	   too often */
 
 	for (i = j = 0; i < num_ideals; i++) {
-		if (counts[i] <= max_ideal_weight)
-			counts[i] = j++;
-		else
+		if ((read_all && counts[i] == 0) ||
+		    counts[i] > max_ideal_weight)
 			counts[i] = (uint32)(-1);
+		else
+			counts[i] = j++;
 	}
 	filter->target_excess += i - j;
 	filter->num_ideals = j;
-	logprintf(obj, "keeping %u ideals with weight <= %u, "
-			"target excess is %u\n",
-			j, max_ideal_weight, 
-			filter->target_excess);
-
-	/* reread the relation list, saving the sparse ideals */
-
-	rewind(fp);
-	num_relation_alloc = 10000;
-	curr_word = 0;
-	relation_array = (relation_ideal_t *)xmalloc(
-					num_relation_alloc *
-					sizeof(relation_ideal_t));
-	for (i = 0; i < num_relations; i++) {
-
-		relation_ideal_t *r;
-
-		/* make sure the relation array has room for the
-		   new relation. Be careful increasing the array
-		   size, since this is probably the largest array
-		   in the NFS code */
-
-		if (curr_word * sizeof(uint32) >=
-				(num_relation_alloc-1) * 
-				sizeof(relation_ideal_t)) {
-
-			num_relation_alloc = 1.4 * num_relation_alloc;
-			relation_array = (relation_ideal_t *)xrealloc(
-					relation_array, 
-					num_relation_alloc *
-					sizeof(relation_ideal_t));
-		}
-
-		r = (relation_ideal_t *)(
-			(uint32 *)relation_array + curr_word);
-		fread(r, sizeof(uint32), header_words, fp);
-
-		for (j = k = 0; j < r->ideal_count; j++) {
 
-			uint32 curr_ideal;
-
-			fread(&curr_ideal, sizeof(uint32), (size_t)1, fp);
-			curr_ideal = counts[curr_ideal];
-			if (curr_ideal != (uint32)(-1))
-				r->ideal_list[k++] = curr_ideal;
-		}
-		r->gf2_factors += j - k;
-		r->ideal_count = k;
-		curr_word += header_words + k;
+	if (!read_all || i != j) {
+		logprintf(obj, "keeping %u ideals with weight <= %u, "
+				"target excess is %u\n",
+				j, max_ideal_weight, 
+				filter->target_excess);
 	}
 
-	/* finish up: trim the allocated relation array */
+	/* reread the relation list, saving the sparse ideals */
 
-	filter->relation_array = (relation_ideal_t *)xrealloc(
-						relation_array, 
-						curr_word * 
-						sizeof(uint32));
+	mem_use = read_lp_relations(&s, filter, counts);
+	lp_scan_close(&s);
 	free(counts);
-	fclose(fp);
-	mem_use = num_ideals * sizeof(uint32) +
-			num_relation_alloc * 
-			sizeof(relation_ideal_t);
+
+	mem_use += num_ideals * sizeof(uint32);
 	logprintf(obj, "memory use: %.1f MB\n", 
 			(double)mem_use / 1048576);
 
@@ -248,14 +243,13 @@ void filter_purge_lp_singletons(msieve_obj *obj,
 				filter_t *filter,
 				uint64 ram_size) {
 
-	uint32 i, j, k, m;
-	FILE *in_fp;
+	uint32 i, j, k;
+	lp_scan_t s;
 	FILE *out_fp;
 	char buf[256];
 	char buf2[256];
-	size_t header_words;
 	relation_ideal_t tmp;
-	uint32 *relation_num;
+	uint8 *deleted;
 	uint32 *counts;
 	uint32 num_singletons;
 	uint32 num_relations = filter->num_relations;
@@ -268,12 +262,8 @@ void filter_purge_lp_singletons(msieve_obj *obj,
 	logprintf(obj, "start with %u relations and %u ideals\n",
 			num_relations, num_ideals);
 
+	lp_scan_open(obj, &s, ram_size);
 	sprintf(buf, "%s.lp", obj->savefile.name);
-	in_fp = fopen(buf, "rb");
-	if (in_fp == NULL) {
-		logprintf(obj, "error: can't open LP file\n");
-		exit(-1);
-	}
 	sprintf(buf2, "%s.lp0", obj->savefile.name);
 	out_fp = fopen(buf2, "wb");
 	if (out_fp == NULL) {
@@ -281,26 +271,21 @@ void filter_purge_lp_singletons(msieve_obj *obj,
 		exit(-1);
 	}
 
-	header_words = (sizeof(relation_ideal_t) - 
-			sizeof(tmp.ideal_list)) / sizeof(uint32);
-	relation_num = (uint32 *)xmalloc(num_relations * sizeof(uint32));
+	/* deleted relations are tracked in a bitfield, since
+	   the file itself is read-only */
+
+	deleted = (uint8 *)xcalloc(((size_t)start_relations + 7) / 8, 
+					sizeof(uint8));
 	counts = (uint32 *)xcalloc((size_t)num_ideals, sizeof(uint32));
 
 	/* first build a frequency table for the large ideals */
 
-	for (i = 0; i < num_relations; i++) {
-
-		uint32 *ideal_list = tmp.ideal_list;
-
-		relation_num[i] = i;
-		fread(&tmp, sizeof(uint32), header_words, in_fp);
-		fread(ideal_list, sizeof(uint32), 
-			(size_t)tmp.ideal_count, in_fp);
+	for (i = 0; i < start_relations; i++) {
+		relation_ideal_t *r = lp_scan_next(&s);
 
-		for (j = 0; j < tmp.ideal_count; j++)
-			counts[ideal_list[j]]++;
+		for (j = 0; j < r->ideal_count; j++)
+			counts[r->ideal_list[j]]++;
 	}
-	rewind(in_fp);
 
 	/* iteratively ignore relations that contain singleton ideals;
 	   we want to limit the number of passes over the disk file,
@@ -309,42 +294,36 @@ void filter_purge_lp_singletons(msieve_obj *obj,
 
 	do {
 		new_file_size = 0;
-		rewind(in_fp);
-
-		for (i = j = k = 0; i < start_relations; i++) {
-
-			uint32 *ideal_list = tmp.ideal_list;
+		num_singletons = 0;
+		lp_scan_rewind(&s);
 
-			fread(&tmp, sizeof(uint32), header_words, in_fp);
-			fread(ideal_list, sizeof(uint32), 
-					(size_t)tmp.ideal_count, in_fp);
+		for (i = 0; i < start_relations; i++) {
 
-			if (i == relation_num[k]) {
-				for (m = 0; m < tmp.ideal_count; m++) {
-					if (counts[ideal_list[m]] < 2)
-						break;
-				}
+			relation_ideal_t *r = lp_scan_next(&s);
+			uint32 ideal_count = r->ideal_count;
 
-				if (m == tmp.ideal_count) {
-					relation_num[j++] = relation_num[k];
-					new_file_size += (header_words +
-							tmp.ideal_count) *
-							sizeof(uint32);
-				}
-				else {
-					for (m = 0; m < tmp.ideal_count; m++)
-						counts[ideal_list[m]]--;
-				}
+			if (deleted[i / 8] & (1 << (i % 8)))
+				continue;
 
-				if (++k == num_relations)
+			for (j = 0; j < ideal_count; j++) {
+				if (counts[r->ideal_list[j]] < 2)
 					break;
 			}
+
+			if (j == ideal_count) {
+				new_file_size += (lp_header_words +
+						ideal_count) * sizeof(uint32);
+			}
+			else {
+				for (j = 0; j < ideal_count; j++)
+					counts[r->ideal_list[j]]--;
+				deleted[i / 8] |= 1 << (i % 8);
+				num_singletons++;
+			}
 		}
-		num_relations = j;
-		num_singletons = k - j;
+		num_relations -= num_singletons;
 		logprintf(obj, "pass %u: found %u singletons\n",
 				++num_passes, num_singletons);
-		rewind(in_fp);
 
 	} while (num_relations > 2000000 && 
 			num_singletons > 500000 &&
@@ -362,24 +341,23 @@ void filter_purge_lp_singletons(msieve_obj *obj,
 	/* reread the relation list, saving relations that survived
 	   singleton removal and renumbering their ideals */
 
-	for (i = j = 0; i < start_relations; i++) {
+	lp_scan_rewind(&s);
+	for (i = 0; i < start_relations; i++) {
 
-		uint32 *ideal_list = tmp.ideal_list;
+		relation_ideal_t *r = lp_scan_next(&s);
 
-		fread(&tmp, sizeof(uint32), header_words, in_fp);
-		fread(ideal_list, sizeof(uint32), 
-				(size_t)tmp.ideal_count, in_fp);
+		if (deleted[i / 8] & (1 << (i % 8)))
+			continue;
 
-		if (i == relation_num[j]) {
-			for (k = 0; k < tmp.ideal_count; k++)
-				ideal_list[k] = counts[ideal_list[k]];
+		tmp.rel_index = r->rel_index;
+		tmp.ideal_count = r->ideal_count;
+		tmp.gf2_factors = r->gf2_factors;
+		tmp.connected = r->connected;
+		for (k = 0; k < r->ideal_count; k++)
+			tmp.ideal_list[k] = counts[r->ideal_list[k]];
 
-			fwrite(&tmp, sizeof(uint32),
-				header_words + tmp.ideal_count, out_fp);
-
-			if (++j == num_relations)
-				break;
-		}
+		fwrite(&tmp, sizeof(uint32),
+			lp_header_words + tmp.ideal_count, out_fp);
 	}
 
 	logprintf(obj, "pruned dataset has %u relations and "
@@ -389,9 +367,9 @@ void filter_purge_lp_singletons(msieve_obj *obj,
 	filter->num_ideals = num_ideals;
 	filter->relation_array = NULL;
 	free(counts);
-	free(relation_num);
+	free(deleted);
 
-	fclose(in_fp);
+	lp_scan_close(&s);
 	fclose(out_fp);
 	if (remove(buf) != 0) {
 		logprintf(obj, "error: can't delete LP file\n");
@@ -404,6 +382,187 @@ void filter_purge_lp_singletons(msieve_obj *obj,
 	filter->lp_file_size = get_file_size(buf);
 }
 
+/*--------------------------------------------------------------------*/
+/* In-memory singleton removal can use multiple threads. The
+   relation array is split into one contiguous block of relations
+   per thread, and in each pass every thread checks the relations
+   in its block against the ideal counts as they were at the start
+   of the pass. Survivors are compacted toward the start of each
+   block, and the ideals of deleted relations are saved so that 
+   the counts can be updated once all the threads are finished.
+
+   The serial code decrements counts immediately, so that deleting
+   one relation can expose more singletons within the same pass.
+   The threaded version only sees those at the next pass, and so
+   may need more passes, but because removing a singleton can never
+   make another relation stop being a singleton, both versions
+   converge to exactly the same set of relations */
+
+#define MIN_RELATIONS_TO_THREAD 100000
+
+typedef struct {
+	relation_ideal_t *start;
+	relation_ideal_t *end;
+	uint32 num_relations;
+	uint32 num_deleted;
+	uint32 *freqtable;
+
+	uint32 *deleted_ideals;
+	uint32 num_deleted_ideals;
+	uint32 num_deleted_ideals_alloc;
+} singleton_task_t;
+
+/*--------------------------------------------------------------------*/
+static void singleton_pass_core(void *data, int thread_num) {
+
+	singleton_task_t *t = (singleton_task_t *)data;
+	uint32 *freqtable = t->freqtable;
+	relation_ideal_t *curr_relation = t->start;
+	relation_ideal_t *old_relation = t->start;
+	uint32 i, j;
+	uint32 num_relations = t->num_relations;
+
+	t->num_deleted = 0;
+	t->num_deleted_ideals = 0;
+
+	for (i = 0; i < num_relations; i++) {
+		uint32 curr_num_ideals = curr_relation->ideal_count;
+		relation_ideal_t *next_relation = 
+				next_relation_ptr(curr_relation);
+
+		for (j = 0; j < curr_num_ideals; j++) {
+			if (freqtable[curr_relation->ideal_list[j]] <= 1)
+				break;
+		}
+
+		if (j < curr_num_ideals) {
+
+			/* relation is a singleton; remember its ideals */
+
+			if (t->num_deleted_ideals + curr_num_ideals >=
+					t->num_deleted_ideals_alloc) {
+				t->num_deleted_ideals_alloc = 2 *
+					t->num_deleted_ideals_alloc +
+					TEMP_FACTOR_LIST_SIZE;
+				t->deleted_ideals = (uint32 *)xrealloc(
+					t->deleted_ideals,
+					t->num_deleted_ideals_alloc *
+					sizeof(uint32));
+			}
+			for (j = 0; j < curr_num_ideals; j++) {
+				t->deleted_ideals[t->num_deleted_ideals++] = 
+					curr_relation->ideal_list[j];
+			}
+			t->num_deleted++;
+		}
+		else {
+			/* relation survived this pass */
+
+			if (old_relation != curr_relation) {
+				old_relation->rel_index = 
+						curr_relation->rel_index;
+				old_relation->gf2_factors = 
+						curr_relation->gf2_factors;
+				old_relation->ideal_count = curr_num_ideals;
+				for (j = 0; j < curr_num_ideals; j++) {
+					old_relation->ideal_list[j] =
+						curr_relation->ideal_list[j];
+				}
+			}
+			old_relation = next_relation_ptr(old_relation);
+		}
+
+		curr_relation = next_relation;
+	}
+
+	t->end = old_relation;
+	t->num_relations -= t->num_deleted;
+}
+
+/*--------------------------------------------------------------------*/
+static relation_ideal_t * purge_singletons_threaded(
+				relation_ideal_t *relation_array,
+				uint32 num_relations,
+				uint32 *freqtable,
+				uint32 num_threads,
+				uint32 *num_relations_out,
+				uint32 *num_passes_out) {
+
+	/* returns a pointer to the end of the surviving relations */
+
+	uint32 i, j;
+	uint32 num_deleted;
+	uint32 num_passes = 0;
+	singleton_task_t *tasks;
+	thread_control_t control = {NULL, NULL, NULL};
+	task_control_t task = {NULL, singleton_pass_core, NULL, NULL};
+	struct threadpool *threadpool;
+	relation_ideal_t *r = relation_array;
+
+	/* divide up the relations */
+
+	tasks = (singleton_task_t *)xcalloc((size_t)num_threads,
+					sizeof(singleton_task_t));
+	for (i = 0; i < num_threads; i++) {
+		singleton_task_t *t = tasks + i;
+		uint32 block_size = num_relations / num_threads;
+
+		if (i == num_threads - 1)
+			block_size = num_relations - 
+				(num_threads - 1) * block_size;
+
+		t->start = r;
+		t->num_relations = block_size;
+		t->freqtable = freqtable;
+		for (j = 0; j < block_size; j++)
+			r = next_relation_ptr(r);
+	}
+
+	threadpool = threadpool_init(num_threads - 1, 200, &control);
+
+	do {
+		for (i = 0; i < num_threads - 1; i++) {
+			task.data = tasks + i;
+			threadpool_add_task(threadpool, &task, 1);
+		}
+		singleton_pass_core(tasks + i, i);
+		threadpool_drain(threadpool, 1);
+
+		/* apply the changes to the ideal counts */
+
+		for (i = num_deleted = 0; i < num_threads; i++) {
+			singleton_task_t *t = tasks + i;
+
+			for (j = 0; j < t->num_deleted_ideals; j++)
+				freqtable[t->deleted_ideals[j]]--;
+			num_deleted += t->num_deleted;
+		}
+		num_relations -= num_deleted;
+		num_passes++;
+	} while (num_deleted > 0);
+
+	threadpool_free(threadpool);
+
+	/* squeeze out the gaps between blocks */
+
+	r = tasks[0].end;
+	for (i = 1; i < num_threads; i++) {
+		singleton_task_t *t = tasks + i;
+		size_t block_words = (uint32 *)t->end - (uint32 *)t->start;
+
+		memmove(r, t->start, block_words * sizeof(uint32));
+		r = (relation_ideal_t *)((uint32 *)r + block_words);
+	}
+
+	for (i = 0; i < num_threads; i++)
+		free(tasks[i].deleted_ideals);
+	free(tasks);
+
+	*num_relations_out = num_relations;
+	*num_passes_out = num_passes;
+	return r;
+}
+
 /*--------------------------------------------------------------------*/
 void filter_purge_singletons_core(msieve_obj *obj, 
 				filter_t *filter) {
@@ -421,6 +580,7 @@ void filter_purge_singletons_core(msieve_obj *obj,
 	uint32 num_relations;
 	uint32 num_ideals;
 	uint32 new_num_relations;
+	uint32 num_threads;
 
 	logprintf(obj, "commencing in-memory singleton removal\n");
 
@@ -448,66 +608,75 @@ void filter_purge_singletons_core(msieve_obj *obj,
 
 	/* while singletons were found */
 
-	num_passes = 0;
-	new_num_relations = num_relations;
-	do {
-		num_relations = new_num_relations;
-		new_num_relations = 0;
-		curr_relation = relation_array;
-		old_relation = relation_array;
-
-		for (i = 0; i < num_relations; i++) {
-			uint32 curr_num_ideals = curr_relation->ideal_count;
-			uint32 ideal;
-			relation_ideal_t *next_relation;
-
-			/* the ideal count in curr_relation may get
-			   overwritten when writing old_relation, so
-			   cache the count and point to the next
-			   relation now */
-
-			next_relation = next_relation_ptr(curr_relation);
+	num_threads = MIN(obj->num_threads, MAX_FILTER_THREADS);
+	if (num_threads > 1 && num_relations >= MIN_RELATIONS_TO_THREAD) {
+		curr_relation = purge_singletons_threaded(relation_array,
+						num_relations, freqtable,
+						num_threads, &num_relations,
+						&num_passes);
+	}
+	else {
+		num_passes = 0;
+		new_num_relations = num_relations;
+		do {
+			num_relations = new_num_relations;
+			new_num_relations = 0;
+			curr_relation = relation_array;
+			old_relation = relation_array;
 
-			/* check the count of each ideal */
+			for (i = 0; i < num_relations; i++) {
+				uint32 curr_num_ideals = curr_relation->ideal_count;
+				uint32 ideal;
+				relation_ideal_t *next_relation;
 
-			for (j = 0; j < curr_num_ideals; j++) {
-				ideal = curr_relation->ideal_list[j];
-				if (freqtable[ideal] <= 1)
-					break;
-			}
+				/* the ideal count in curr_relation may get
+				   overwritten when writing old_relation, so
+				   cache the count and point to the next
+				   relation now */
 
-			if (j < curr_num_ideals) {
+				next_relation = next_relation_ptr(curr_relation);
 
-				/* relation is a singleton; decrement the
-				   count of each of its ideals and skip it */
+				/* check the count of each ideal */
 
 				for (j = 0; j < curr_num_ideals; j++) {
 					ideal = curr_relation->ideal_list[j];
-					freqtable[ideal]--;
+					if (freqtable[ideal] <= 1)
+						break;
 				}
-			}
-			else {
-				/* relation survived this pass; append it to
-				   the list of survivors */
 
-				old_relation->rel_index = 
-						curr_relation->rel_index;
-				old_relation->gf2_factors = 
-						curr_relation->gf2_factors;
-				old_relation->ideal_count = curr_num_ideals;
-				for (j = 0; j < curr_num_ideals; j++) {
-					old_relation->ideal_list[j] =
-						curr_relation->ideal_list[j];
+				if (j < curr_num_ideals) {
+
+					/* relation is a singleton; decrement the
+					   count of each of its ideals and skip it */
+
+					for (j = 0; j < curr_num_ideals; j++) {
+						ideal = curr_relation->ideal_list[j];
+						freqtable[ideal]--;
+					}
+				}
+				else {
+					/* relation survived this pass; append it to
+					   the list of survivors */
+
+					old_relation->rel_index = 
+							curr_relation->rel_index;
+					old_relation->gf2_factors = 
+							curr_relation->gf2_factors;
+					old_relation->ideal_count = curr_num_ideals;
+					for (j = 0; j < curr_num_ideals; j++) {
+						old_relation->ideal_list[j] =
+							curr_relation->ideal_list[j];
+					}
+					new_num_relations++;
+					old_relation = next_relation_ptr(old_relation);
 				}
-				new_num_relations++;
-				old_relation = next_relation_ptr(old_relation);
-			}
 
-			curr_relation = next_relation;
-		}
+				curr_relation = next_relation;
+			}
 
-		num_passes++;
-	} while (new_num_relations != num_relations);
+			num_passes++;
+		} while (new_num_relations != num_relations);
+	}
 
 	/* find the ideal that occurs in the most
 	   relations, and renumber the ideals to ignore
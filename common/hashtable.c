@@ -14,6 +14,85 @@ $Id$
 
 #include <common.h>
 
+#define MAX_LOAD 0.7
+#define MIGRATE_ENTRIES 4
+
+/* tables with up to 2^LOG2_NARROW_MAX slots use 32-bit slots,
+   where the entry index takes the bottom log2_size bits. Larger
+   tables use 64-bit slots and HASHTABLE_INDEX_BITS-bit indices */
+
+#define LOG2_NARROW_MAX 28
+
+/*--------------------------------------------------------------------*/
+static INLINE uint64 hash64(uint32 *key, uint32 num_words) {
+
+	/* unlike hash_function(), all the words of the key
+	   matter, and there are enough hash bits to index
+	   tables with more than 2^32 slots and still have
+	   bits left over for the fingerprint */
+
+	uint32 i;
+	uint64 h = 0;
+
+	for (i = 0; i < num_words; i++) {
+		h = (h ^ key[i]) * 0x9e3779b97f4a7c15ULL;
+		h ^= h >> 29;
+	}
+	h *= 0xbf58476d1ce4e5b9ULL;
+	h ^= h >> 32;
+	return h;
+}
+
+/*--------------------------------------------------------------------*/
+static INLINE uint32 index_bits(uint32 log2_size) {
+	if (log2_size > LOG2_NARROW_MAX)
+		return HASHTABLE_INDEX_BITS;
+	return log2_size;
+}
+
+static INLINE uint64 make_tag(uint64 hashval, uint32 log2_size) {
+
+	/* the fingerprint is the low bits of the hash value,
+	   which are independent of the top bits that choose
+	   the starting slot */
+
+	uint64 tag = hashval << index_bits(log2_size);
+
+	if (log2_size > LOG2_NARROW_MAX)
+		return tag;
+	return tag & 0xffffffff;
+}
+
+static INLINE uint64 read_slot(void *table, uint64 pos, uint32 log2_size) {
+	if (log2_size > LOG2_NARROW_MAX)
+		return ((uint64 *)table)[pos];
+	return ((uint32 *)table)[pos];
+}
+
+static INLINE void write_slot(void *table, uint64 pos, 
+				uint32 log2_size, uint64 slot) {
+	if (log2_size > LOG2_NARROW_MAX)
+		((uint64 *)table)[pos] = slot;
+	else
+		((uint32 *)table)[pos] = (uint32)slot;
+}
+
+static INLINE size_t table_bytes(uint32 log2_size) {
+	if (log2_size > LOG2_NARROW_MAX)
+		return sizeof(uint64) << log2_size;
+	return sizeof(uint32) << log2_size;
+}
+
+/*--------------------------------------------------------------------*/
+static void * alloc_table(hashtable_t *h, uint32 log2_size) {
+
+	h->log2_hashtable_size = log2_size;
+	h->num_used = 0;
+	h->congestion_target = (uint64)(MAX_LOAD * 
+					((uint64)1 << log2_size));
+	return xcalloc(table_bytes(log2_size), (size_t)1);
+}
+
 /*--------------------------------------------------------------------*/
 void hashtable_init(hashtable_t *h, uint32 blob_words, uint32 hash_words) {
 
@@ -25,150 +104,253 @@ void hashtable_init(hashtable_t *h, uint32 blob_words, uint32 hash_words) {
 	if (hash_words == 0)
 		h->hash_words = blob_words;
 
-	h->log2_hashtable_size = log2_hashtable_size;
-	h->hashtable = (uint32 *)xcalloc((size_t)1 << log2_hashtable_size,
-					sizeof(uint32));
-	h->num_used = 0;
-	h->congestion_target = 0.8 * (1 << log2_hashtable_size);
+	h->hashtable = alloc_table(h, log2_hashtable_size);
+	h->old_hashtable = NULL;
+	h->log2_old_hashtable_size = 0;
+	h->old_migrate_pos = 0;
+	h->old_migrate_end = 0;
 
 	h->match_array_size = 1;
 	h->match_array_alloc = init_match_size;
 	h->match_array = (uint32 *)xmalloc(init_match_size * 
-					(blob_words + 1) * sizeof(uint32));
+					blob_words * sizeof(uint32));
 }
 
 /*--------------------------------------------------------------------*/
 void hashtable_free(hashtable_t *h) {
 	free(h->hashtable);
+	free(h->old_hashtable);
 	free(h->match_array);
 	h->hashtable = NULL;
+	h->old_hashtable = NULL;
 	h->match_array = NULL;
 }
 
+/*--------------------------------------------------------------------*/
+void hashtable_reset(hashtable_t *h) {
+	free(h->old_hashtable);
+	h->old_hashtable = NULL;
+
+	h->match_array_size = 1;
+	h->num_used = 0;
+	memset(h->hashtable, 0, table_bytes(h->log2_hashtable_size));
+}
+
 /*--------------------------------------------------------------------*/
 size_t hashtable_sizeof(hashtable_t *h) {
-	return (sizeof(uint32) << h->log2_hashtable_size) +
-		((h->blob_words + 1) * sizeof(uint32) * 
-		 	h->match_array_alloc);
+	size_t size = (h->blob_words * sizeof(uint32) * 
+		 	(size_t)h->match_array_alloc);
+
+	if (h->hashtable != NULL)
+		size += table_bytes(h->log2_hashtable_size);
+	if (h->old_hashtable != NULL)
+		size += table_bytes(h->log2_old_hashtable_size);
+	return size;
 }
 
 /*--------------------------------------------------------------------*/
 void hashtable_close(hashtable_t *h) {
 	free(h->hashtable);
+	free(h->old_hashtable);
 	h->hashtable = NULL;
+	h->old_hashtable = NULL;
 
 	h->match_array = (uint32 *)xrealloc(h->match_array,
-					h->match_array_size *
-					(h->blob_words + 1) *
+					(size_t)h->match_array_size *
+					h->blob_words *
 					sizeof(uint32));
 	h->match_array_alloc = h->match_array_size;
 }
 
 /*--------------------------------------------------------------------*/
-void *hashtable_find(hashtable_t *h, void *blob, 
-		     uint32 *ordinal_id, uint32 *present) {
+static void migrate_entries(hashtable_t *h, uint64 num_entries) {
+
+	/* move some entries from the old table to the current
+	   one. The entries are visited in order of their position
+	   in match_array, which is much cheaper than visiting the
+	   slots of the old table, but the old table is left alone
+	   so that lookups into it keep working until the migration
+	   finishes. Every entry being moved is absent from the 
+	   current table, so no comparisons are needed to insert it */
+
+	void *table = h->hashtable;
+	uint32 log2 = h->log2_hashtable_size;
+	uint64 mask = ((uint64)1 << log2) - 1;
+	uint64 end = MIN(h->old_migrate_end, 
+			h->old_migrate_pos + num_entries);
+	uint64 i;
+
+	for (i = h->old_migrate_pos; i < end; i++) {
+		uint64 hashval = hash64(h->match_array + (size_t)i *
+					h->blob_words, h->hash_words);
+		uint64 pos = hashval >> (64 - log2);
+
+		while (read_slot(table, pos, log2) != 0)
+			pos = (pos + 1) & mask;
+		write_slot(table, pos, log2, make_tag(hashval, log2) | i);
+		h->num_used++;
+	}
+
+	h->old_migrate_pos = end;
+	if (end == h->old_migrate_end) {
+		free(h->old_hashtable);
+		h->old_hashtable = NULL;
+	}
+}
+
+/*--------------------------------------------------------------------*/
+static void grow_table(hashtable_t *h) {
+
+	/* if the previous resize has not finished yet, 
+	   finish it now */
+
+	if (h->old_hashtable != NULL)
+		migrate_entries(h, h->old_migrate_end);
+
+	h->old_hashtable = h->hashtable;
+	h->log2_old_hashtable_size = h->log2_hashtable_size;
+	h->old_migrate_pos = 1;
+	h->old_migrate_end = h->match_array_size;
+	h->hashtable = alloc_table(h, h->log2_hashtable_size + 1);
+}
+
+/*--------------------------------------------------------------------*/
+static INLINE uint64 search_table(hashtable_t *h, void *table,
+				uint32 log2_size, uint64 hashval, 
+				uint32 *key, uint64 *pos_out) {
+
+	/* return the index of the entry matching key, or zero
+	   if not found; in the latter case *pos_out is the
+	   empty slot that ended the search */
+
+	uint32 i;
+	uint64 mask = ((uint64)1 << log2_size) - 1;
+	uint64 index_mask = ((uint64)1 << index_bits(log2_size)) - 1;
+	uint64 tag = make_tag(hashval, log2_size);
+	uint64 pos = hashval >> (64 - log2_size);
+	uint64 slot;
+
+	while ((slot = read_slot(table, pos, log2_size)) != 0) {
+		if ((slot & ~index_mask) == tag) {
+			uint32 *entry = h->match_array + 
+					(size_t)(slot & index_mask) * 
+					h->blob_words;
+
+			for (i = 0; i < h->hash_words; i++) {
+				if (entry[i] != key[i])
+					break;
+			}
+			if (i == h->hash_words)
+				return slot & index_mask;
+		}
+		pos = (pos + 1) & mask;
+	}
+
+	*pos_out = pos;
+	return 0;
+}
+
+/*--------------------------------------------------------------------*/
+void *hashtable_find64(hashtable_t *h, void *blob, 
+		     uint64 *ordinal_id, uint32 *present) {
 
 	uint32 i;
-	uint32 offset, hashval;
 	uint32 *key = (uint32 *)blob;
-	uint32 *entry = NULL;
-	uint32 *hashtable = h->hashtable;
-	uint32 *match_array = h->match_array;
-	uint32 log2_hashtable_size = h->log2_hashtable_size;
+	uint32 *entry;
 	uint32 blob_words = h->blob_words;
 	uint32 hash_words = h->hash_words;
+	uint64 hashval = hash64(key, hash_words);
+	uint64 pos = 0;
+	uint64 old_pos;
+	uint64 offset;
 
 	/* pre-emptively increase the size allocated
 	   for hashtable matches */
 	
 	if (h->match_array_size + 1 >= h->match_array_alloc) {
+		if (h->match_array_size + 1 >= 
+				((uint64)1 << HASHTABLE_INDEX_BITS)) {
+			printf("error: hashtable overflow\n");
+			exit(-1);
+		}
 		h->match_array_alloc *= 2;
-		match_array = h->match_array = (uint32 *)xrealloc(
-						h->match_array,
+		h->match_array = (uint32 *)xrealloc(h->match_array,
 						sizeof(uint32) *
-						h->match_array_alloc *
-						(blob_words + 1));
+						(size_t)h->match_array_alloc *
+						blob_words);
 	}
 
-	/* pre-emptively grow the hashtable size if it's
-	   getting congested */
-
-	if (h->num_used + 1 >= h->congestion_target &&
-			log2_hashtable_size < 28) {
-
-		/* reset the hashtable array */
+	/* pre-emptively grow the hashtable if it's getting 
+	   congested; otherwise make some progress on moving
+	   the entries from any previous table */
 
-		log2_hashtable_size++;
-		free(hashtable);
-		hashtable = h->hashtable = (uint32 *)xcalloc((size_t)1 << 
-						log2_hashtable_size,
-						sizeof(uint32));
-		h->log2_hashtable_size = log2_hashtable_size;
-		h->congestion_target = 0.8 * (1 << log2_hashtable_size);
-		h->num_used = 0;
+	if (h->num_used + 1 >= h->congestion_target)
+		grow_table(h);
+	else if (h->old_hashtable != NULL)
+		migrate_entries(h, MIGRATE_ENTRIES);
 
-		/* re-link all the previously found entries */
+	/* look in the current table first, then in the old
+	   table if there is one. The old table is a snapshot
+	   from before the resize, so an entry found there is
+	   valid whether or not it has migrated yet */
 
-		key = h->match_array + blob_words + 1;
+	offset = search_table(h, h->hashtable, h->log2_hashtable_size,
+				hashval, key, &pos);
 
-		for (i = 1; i < h->match_array_size; i++) {
-			hashval = hash_function(key, hash_words);
-			hashval = hashval >> (32 - log2_hashtable_size);
-
-			key[blob_words] = hashtable[hashval];
-			if (key[blob_words] == 0)
-				h->num_used++;
-			hashtable[hashval] = i;
-			key += blob_words + 1;
-		}
+	if (offset == 0 && h->old_hashtable != NULL) {
+		offset = search_table(h, h->old_hashtable, 
+				h->log2_old_hashtable_size,
+				hashval, key, &old_pos);
 	}
 
-	/* compute hash value; only the first one or two words
-	   figure into it */
+	if (offset == 0) {
 
-	key = (uint32 *)blob;
-	hashval = hash_function(key, hash_words);
-	hashval = hashval >> (32 - log2_hashtable_size);
+		/* not found; add it in the empty slot that
+		   ended the search of the current table */
 
-	/* attempt to find it in the table; all hash_words
-	   words must match for lookup to succeed */
+		offset = h->match_array_size++;
+		entry = h->match_array + (size_t)offset * blob_words;
 
-	offset = hashtable[hashval];
-	while (offset != 0) {
-		entry = match_array + (size_t)offset * (blob_words + 1);
 		for (i = 0; i < hash_words; i++) {
-			if (entry[i] != key[i])
-				break;
+			entry[i] = key[i];
 		}
-		if (i == hash_words)
-			break;
-		offset = entry[blob_words];
-	}
+		write_slot(h->hashtable, pos, h->log2_hashtable_size,
+				make_tag(hashval, h->log2_hashtable_size) | 
+				offset);
+		h->num_used++;
 
-	if (ordinal_id) {
-		if (offset == 0)
-			*ordinal_id = h->match_array_size - 1;
-		else
-			*ordinal_id = offset - 1;
+		if (present)
+			*present = 0;
+	}
+	else {
+		entry = h->match_array + (size_t)offset * blob_words;
+		if (present)
+			*present = 1;
 	}
 
-	if (offset == 0) {
+	if (ordinal_id)
+		*ordinal_id = offset - 1;
 
-		/* not found; add it */
+	return entry;
+}
+
+/*--------------------------------------------------------------------*/
+void *hashtable_find(hashtable_t *h, void *blob, 
+		     uint32 *ordinal_id, uint32 *present) {
 
-		entry = match_array + 
-			(size_t)h->match_array_size * (blob_words + 1);
+	uint64 ordinal;
+	void *entry = hashtable_find64(h, blob, &ordinal, present);
 
-		for (i = 0; i < hash_words; i++) {
-			entry[i] = key[i];
-		}
-		entry[blob_words] = hashtable[hashval]; /* add to linked list */
-		if (entry[blob_words] == 0)
-			h->num_used++;
-		hashtable[hashval] = h->match_array_size++;
+	/* callers of this version number the entries with 
+	   32-bit integers, and would silently reuse numbers
+	   once the table gets too big */
+
+	if (ordinal >> 32) {
+		printf("error: hashtable has more than 2^32 entries\n");
+		exit(-1);
 	}
-	if (present)
-		*present = offset;
 
+	if (ordinal_id)
+		*ordinal_id = (uint32)ordinal;
 	return entry;
 }
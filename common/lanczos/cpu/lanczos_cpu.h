@@ -32,16 +32,48 @@ typedef struct {
 	uint16 col_off;
 } entry_idx_t;
 
-/* struct representing one block */
+/* struct representing one block. Most blocks are a list
+   of entry_idx_t. The first block in each column of blocks
+   is instead stored as 'runs', a list of 16-bit words where
+   each run starts with a row number and a count and is 
+   followed by that many column offsets, and the list ends 
+   with a zero count.
+
+   Optionally the other blocks are delta coded, which takes
+   3 bytes per entry instead of 4. The entries stay sorted by
+   column; the 16-bit row offsets of all the entries come 
+   first, then one byte per entry that gives the distance to
+   the column of the previous entry (the first entry counts
+   from column 0). Distances of DELTA_ESCAPE or more are 
+   stored as DELTA_ESCAPE, and the column itself goes into
+   a list of 16-bit words that follows the bytes, starting
+   at the next 16-bit boundary */
 
 typedef struct {
 	uint32 num_entries;       /* number of nonzero matrix entries */
 	union {
 		entry_idx_t *entries;     /* nonzero entries */
-		uint16 *med_entries;	  /* nonzero entries for medium dense rows */
+		uint16 *med_entries;	  /* nonzero entries as runs */
+		uint16 *delta_entries;	  /* nonzero entries, delta coded */
 	} d;
 } packed_block_t;
 
+/* the ways a block can be stored */
+
+enum block_format {
+	BLOCK_PAIRS = 0,
+	BLOCK_RUNS,
+	BLOCK_DELTA
+};
+
+#define DELTA_ESCAPE 0xff
+
+/* the start of the column bytes and of the escaped 
+   columns of a delta coded block with n entries */
+
+#define DELTA_BYTES(e, n) ((uint8 *)((e) + (n)))
+#define DELTA_ESCAPES(e, n) ((e) + (n) + ((n) + 1) / 2)
+
 #define MAX_THREADS 32
 #define MIN_NROWS_TO_THREAD 200000
 
@@ -60,14 +92,98 @@ typedef struct {
 	v_t *y;
 	uint32 vsize;
 
+	/* items for NUMA placement */
+
+	uint32 cpu;		/* logical CPU the thread is bound to */
+	uint32 node;		/* index of the NUMA node of that CPU */
+	uint32 node_rank;	/* position among the threads on the node */
+	uint32 node_threads;	/* number of threads on the node */
+
 } thread_data_t;
 
 typedef struct {
 	struct packed_matrix_t *matrix;
 	uint32 task_num;
 	uint32 block_num;
+
+	/* the block rows (or for transpose multiplies, the
+	   block columns) of the sparse part to work on */
+
+	uint32 range_start;
+	uint32 range_end;
 } la_task_t;
 
+/* the first block in the range that belongs to a task; block
+   i always goes to task i % num_threads, so that a task keeps
+   the same blocks however the range is split */
+
+static INLINE uint32 task_first_block(la_task_t *task, 
+					uint32 num_threads) {
+
+	uint32 r = task->range_start % num_threads;
+
+	return task->range_start + (task->task_num + num_threads - r) %
+						num_threads;
+}
+
+/* when profiling, add the cycles since start to the
+   count for the thread running a task */
+
+static INLINE void task_prof_end(la_task_t *task, 
+				uint32 which, uint64 start) {
+
+	la_prof_t *prof = task->matrix->prof;
+
+	if (prof != NULL) {
+		prof->thread_cycles[which][task->task_num] += 
+						read_clock() - start;
+	}
+}
+
+/* how the matrix multiply uses the NUMA nodes of the machine.
+   With binding, each thread is bound to one CPU and the part
+   of the packed matrix that the thread multiplies is moved 
+   to memory on that CPU's node. Replication also gives each 
+   node its own copy of the input vector of every multiply */
+
+#define MAX_NUMA_NODES 16
+
+enum numa_policy {
+	NUMA_OFF = 0,
+	NUMA_BIND,
+	NUMA_REPLICATE
+};
+
+/* SIMD versions of the innermost loops, used when vectors
+   are wider than 64 bits. The instruction set is chosen 
+   at runtime by lanczos_simd_init(), which fills in the
+   kernels of one matrix; until then, or when no usable
+   set is found, the entries are NULL and the generic C 
+   code runs instead */
+
+#if VWORDS > 1 && (defined(__x86_64__) || defined(_M_X64)) && \
+	(defined(__GNUC__) || defined(_MSC_VER))
+	#define HAS_LANCZOS_SIMD
+#endif
+
+typedef struct {
+	const char *name;
+	void (*mul_pairs)(entry_idx_t *entries, uint32 num_entries,
+				v_t *curr_col, v_t *curr_b);
+	void (*mul_trans_pairs)(entry_idx_t *entries, uint32 num_entries,
+				v_t *curr_row, v_t *curr_b);
+	void (*gather_runs)(uint16 *entries, v_t *src, v_t *dst);
+	void (*scatter_runs)(uint16 *entries, v_t *src, v_t *dst);
+	void (*mul_delta)(uint16 *entries, uint32 num_entries,
+				v_t *curr_col, v_t *curr_b);
+	void (*mul_trans_delta)(uint16 *entries, uint32 num_entries,
+				v_t *curr_row, v_t *curr_b);
+	void (*NxB_BxB_acc)(v_t *v, v_t *c, v_t *y, uint32 n);
+	void (*BxN_NxB)(v_t *x, v_t *c, v_t *y, uint32 n);
+	void (*vxor)(v_t *dest, v_t *src, uint32 n);
+	void (*vmask)(v_t *v, v_t mask, uint32 n);
+} simd_kernels_t;
+
 /* implementation-specific structure */
 
 typedef struct {
@@ -91,14 +207,35 @@ typedef struct {
 				   dense_blocks[i] holds the i_th batch of
 				   64 matrix rows */
 	packed_block_t *blocks; /* sparse part of matrix, in block format */
+	uint32 sparse_format;	/* an enum block_format, for all blocks
+				   except the first in each column */
+
+	simd_kernels_t simd;	/* the innermost loops to use */
 
 	/* threading stuff */
 
 	struct threadpool *threadpool;
 	thread_data_t thread_data[MAX_THREADS];
 	la_task_t *tasks;
+
+	/* NUMA stuff */
+
+	uint32 numa_policy;	/* an enum numa_policy */
+	uint32 num_nodes;
+	uint32 *cpus;		/* the CPUs the process may use */
+	uint32 num_cpus;
+	v_t *x_node[MAX_NUMA_NODES]; /* per-node copies of x */
 } cpudata_t;
 
+/* the copy of the input vector that a task should read */
+
+static INLINE v_t * task_x(cpudata_t *c, la_task_t *task) {
+
+	if (c->numa_policy == NUMA_REPLICATE)
+		return c->x_node[c->thread_data[task->task_num].node];
+	return c->x;
+}
+
 /* for big jobs, we use a multithreaded framework that calls
    these routines for the heavy lifting */
 
@@ -110,12 +247,29 @@ void mul_trans_packed_core(void *data, int thread_num);
 
 void mul_trans_packed_small_core(void *data, int thread_num);
 
+/* multiply by one block stored as runs. The gather form
+   computes dst[line] ^= src[offsets...] for each run, 
+   and the scatter form computes dst[offsets...] ^= src[line] */
+
+void mul_gather_runs(simd_kernels_t *simd, packed_block_t *curr_block,
+			v_t *src, v_t *dst);
+
+void mul_scatter_runs(simd_kernels_t *simd, packed_block_t *curr_block,
+			v_t *src, v_t *dst);
+
+/* select the kernels; returns the name of the instruction
+   set in use. If enable is zero, the generic code is used */
+
+const char * lanczos_simd_init(simd_kernels_t *simd, uint32 enable);
+
 /* internal stuff for vector-vector operations within the
    matrix multiply */
 
-void mul_NxB_BxB_acc(v_t *v, v_t *x, v_t *y, uint32 n);
+void mul_NxB_BxB_acc(simd_kernels_t *simd, 
+			v_t *v, v_t *x, v_t *y, uint32 n);
 
-void mul_BxN_NxB(v_t *x, v_t *y, v_t *xy, uint32 n);
+void mul_BxN_NxB(simd_kernels_t *simd, 
+			v_t *x, v_t *y, v_t *xy, uint32 n);
 
 #ifdef __cplusplus
 }
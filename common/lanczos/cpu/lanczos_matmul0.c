@@ -15,14 +15,91 @@ $Id$
 #include "lanczos_cpu.h"
 
 /*-------------------------------------------------------------------*/
-static void mul_packed(packed_matrix_t *p, v_t *x, v_t *b) 
+static void run_tasks(packed_matrix_t *p, run_func run, uint32 block_num,
+			uint32 range_start, uint32 range_end)
+{
+	/* run one task per thread and wait for all of them. Task
+	   i always goes to thread i and the last task runs in the
+	   calling thread */
+
+	uint32 i;
+	task_control_t task = {NULL, NULL, NULL, NULL};
+	cpudata_t *c = (cpudata_t *)p->extra;
+
+	task.run = run;
+
+	for (i = 0; i < p->num_threads; i++) {
+		c->tasks[i].block_num = block_num;
+		c->tasks[i].range_start = range_start;
+		c->tasks[i].range_end = range_end;
+	}
+
+	for (i = 0; i < p->num_threads - 1; i++) {
+		task.data = c->tasks + i;
+		threadpool_add_task_to(c->threadpool, &task, i, 1);
+	}
+
+	run(c->tasks + i, i);
+	if (i) {
+		threadpool_drain(c->threadpool, 1);
+	}
+}
+
+/*-------------------------------------------------------------------*/
+static void copy_x_core(void *data, int thread_num)
+{
+	la_task_t *task = (la_task_t *)data;
+	packed_matrix_t *p = task->matrix;
+	cpudata_t *c = (cpudata_t *)p->extra;
+	thread_data_t *t = c->thread_data + task->task_num;
+	uint32 n = task->block_num;
+	uint32 start = (uint32)((uint64)n * t->node_rank / t->node_threads);
+	uint32 end = (uint32)((uint64)n * (t->node_rank + 1) / 
+					t->node_threads);
+
+	vv_copy(c->x_node[t->node] + start, c->x + start, end - start);
+}
+
+static void copy_x_to_nodes(packed_matrix_t *p, uint32 n)
+{
+	/* the threads on each node fill in that node's copy
+	   of the first n elements of x */
+
+	cpudata_t *c = (cpudata_t *)p->extra;
+
+	if (c->numa_policy == NUMA_REPLICATE)
+		run_tasks(p, copy_x_core, n, 0, 0);
+}
+
+/*-------------------------------------------------------------------*/
+static void combine_small_vectors(packed_matrix_t *p, v_t *b)
+{
+	/* xor the small vectors from each thread */
+
+	uint32 i;
+	cpudata_t *c = (cpudata_t *)p->extra;
+	uint32 size = MAX(c->first_block_size, VBITS * 
+				((p->num_dense_rows + VBITS - 1) / VBITS));
+
+	vv_copy(b, c->thread_data[0].tmp_b, size);
+
+	for (i = 1; i < p->num_threads; i++)
+		vv_xor(p, b, c->thread_data[i].tmp_b, size);
+}
+
+/*-------------------------------------------------------------------*/
+static void mul_packed(packed_matrix_t *p, v_t *x, v_t *b,
+			uint32 num_pieces, mul_done_func done, 
+			void *done_data) 
 {
 	uint32 i, j;
+	uint32 num_rows;
 	task_control_t task = {NULL, NULL, NULL, NULL};
 	cpudata_t *c = (cpudata_t *)p->extra;
 
 	c->x = x;
 	c->b = b;
+	copy_x_to_nodes(p, p->ncols);
 
 	/* start accumulating the dense matrix multiply results;
 	   each thread has scratch space for these, so we don't have
@@ -32,42 +109,44 @@ static void mul_packed(packed_matrix_t *p, v_t *x, v_t *b)
 
 	for (i = 0; i < p->num_threads - 1; i++) {
 		task.data = c->tasks + i;
-		threadpool_add_task(c->threadpool, &task, 1);
+		threadpool_add_task_to(c->threadpool, &task, i, 1);
 	}
 	mul_packed_small_core(c->tasks + i, i);
 
-	/* switch to the sparse blocks */
+	/* unless the caller wants the first rows as soon 
+	   as they are ready */
+
+	if (done != NULL) {
+		if (i) {
+			threadpool_drain(c->threadpool, 1);
+		}
+		combine_small_vectors(p, b);
+		done(done_data, MIN(p->nrows, c->first_block_size));
+	}
 
-	task.run = mul_packed_core;
+	/* switch to the sparse blocks; each piece is a range of
+	   block rows, which is finished when all the superblock
+	   columns have been through it */
 
-	for (i = 0; i < c->num_superblock_cols; i++) {
+	num_rows = c->num_block_rows - 1;
 
-		la_task_t *t = c->tasks;
-				
-		for (j = 0; j < p->num_threads; j++)
-			t[j].block_num = i;
+	for (i = 0; i < num_pieces; i++) {
+		uint32 start = (uint64)num_rows * i / num_pieces;
+		uint32 end = (uint64)num_rows * (i + 1) / num_pieces;
 
-		for (j = 0; j < p->num_threads - 1; j++) {
-			task.data = t + j;
-			threadpool_add_task(c->threadpool, &task, 1);
+		for (j = 0; j < c->num_superblock_cols && start < end; j++) {
+			run_tasks(p, mul_packed_core, j, start, end);
 		}
 
-		mul_packed_core(t + j, j);
-		if (j) {
-			threadpool_drain(c->threadpool, 1);
+		if (done != NULL) {
+			done(done_data, MIN(p->nrows, 
+					c->first_block_size + 
+					end * c->block_size));
 		}
 	}
 
-	/* xor the small vectors from each thread */
-
-	vv_copy(b, c->thread_data[0].tmp_b, 
-			MAX(c->first_block_size, VBITS * 
-				((p->num_dense_rows + VBITS - 1) / VBITS)));
-
-	for (i = 1; i < p->num_threads; i++)
-		vv_xor(b, c->thread_data[i].tmp_b,
-			MAX(c->first_block_size, VBITS * 
-				((p->num_dense_rows + VBITS - 1) / VBITS)));
+	if (done == NULL)
+		combine_small_vectors(p, b);
 
 #if defined(GCC_ASM32A) && defined(HAS_MMX)
 	ASM_G volatile ("emms");
@@ -77,51 +156,45 @@ static void mul_packed(packed_matrix_t *p, v_t *x, v_t *b)
 }
 
 /*-------------------------------------------------------------------*/
-static void mul_trans_packed(packed_matrix_t *p, v_t *x, v_t *b) 
+static void mul_trans_packed(packed_matrix_t *p, v_t *x, v_t *b,
+			uint32 num_pieces, mul_done_func done, 
+			void *done_data) 
 {
 	uint32 i, j;
-	task_control_t task = {NULL, NULL, NULL, NULL};
+	uint32 num_cols;
 	cpudata_t *c = (cpudata_t *)p->extra;
 
 	c->x = x;
 	c->b = b;
+	copy_x_to_nodes(p, p->nrows);
 
-	task.run = mul_trans_packed_core;
+	/* each piece is a range of block columns, finished 
+	   when all the superblock rows have been through it */
 
-	for (i = 0; i < c->num_superblock_rows; i++) {
+	num_cols = c->num_block_cols;
 
-		la_task_t *t = c->tasks;
-				
-		for (j = 0; j < p->num_threads; j++)
-			t[j].block_num = i;
+	for (i = 0; i < num_pieces; i++) {
+		uint32 start = (uint64)num_cols * i / num_pieces;
+		uint32 end = (uint64)num_cols * (i + 1) / num_pieces;
 
-		for (j = 0; j < p->num_threads - 1; j++) {
-			task.data = t + j;
-			threadpool_add_task(c->threadpool, &task, 1);
-		}
+		if (start == end)
+			continue;
 
-		mul_trans_packed_core(t + j, j);
-		if (j) {
-			threadpool_drain(c->threadpool, 1);
+		for (j = 0; j < c->num_superblock_rows; j++) {
+			run_tasks(p, mul_trans_packed_core, j, start, end);
 		}
-	}
 
-	if (p->num_dense_rows) {
 		/* add in the dense matrix multiply blocks; these don't 
 		   use scratch space, but need all of b to accumulate 
 		   results so we have to wait until all tasks finish */
 
-		task.run = mul_trans_packed_small_core;
-
-		for (i = 0; i < p->num_threads - 1; i++) {
-			task.data = c->tasks + i;
-			threadpool_add_task(c->threadpool, &task, 1);
+		if (p->num_dense_rows) {
+			run_tasks(p, mul_trans_packed_small_core, 0,
+					start, end);
 		}
 
-		mul_trans_packed_small_core(c->tasks + i, i);
-		if (i) {
-			threadpool_drain(c->threadpool, 1);
-		}
+		if (done != NULL)
+			done(done_data, MIN(p->ncols, end * c->block_size));
 	}
 
 #if defined(GCC_ASM32A) && defined(HAS_MMX)
@@ -138,6 +211,12 @@ static void matrix_thread_init(void *data, int thread_num) {
 	cpudata_t *c = (cpudata_t *)p->extra;
 	thread_data_t *t = c->thread_data + thread_num;
 
+	/* bind first, so the memory this thread touches 
+	   from now on is close to it */
+
+	if (c->numa_policy != NUMA_OFF)
+		thread_bind_cpus(&t->cpu, 1);
+
 	/* we use this scratch vector for both matrix multiplies
 	   and vector-vector operations; it has to be large enough
 	   to support both. Note that first_block_size is split across
@@ -156,6 +235,197 @@ static void matrix_thread_free(void *data, int thread_num) {
 	thread_data_t *t = c->thread_data + thread_num;
 
 	vv_free(t->tmp_b);
+
+	if (c->numa_policy != NUMA_OFF)
+		thread_bind_cpus(c->cpus, c->num_cpus);
+}
+
+/*-------------------------------------------------------------------*/
+#define MAX_CPUS 1024
+
+static void numa_init(msieve_obj *obj, packed_matrix_t *p)
+{
+	uint32 i, j, k;
+	uint32 nodes[MAX_CPUS];
+	uint32 node_id[MAX_NUMA_NODES];
+	uint32 order[MAX_CPUS];
+	uint32 num_nodes = 0;
+	uint32 policy;
+	cpudata_t *c = (cpudata_t *)p->extra;
+
+	/* decide how the matrix multiply uses the NUMA nodes
+	   of the machine. This has to happen before any 
+	   threads start, and only matters for multithreaded 
+	   runs on packed matrices */
+
+	if (p->num_threads < 2 || p->max_nrows <= MIN_NROWS_TO_PACK)
+		return;
+
+	c->cpus = (uint32 *)xmalloc(MAX_CPUS * sizeof(uint32));
+	c->num_cpus = get_cpu_topology(c->cpus, nodes, MAX_CPUS);
+	if (c->num_cpus == 0)
+		return;
+
+	/* number the nodes from zero; nodes past the first
+	   MAX_NUMA_NODES share copies of x */
+
+	for (i = 0; i < c->num_cpus; i++) {
+		for (j = 0; j < num_nodes; j++) {
+			if (node_id[j] == nodes[i])
+				break;
+		}
+		if (j == num_nodes && num_nodes < MAX_NUMA_NODES)
+			node_id[num_nodes++] = nodes[i];
+		nodes[i] = j % MAX_NUMA_NODES;
+	}
+	c->num_nodes = num_nodes;
+
+	/* by default, binding is only worth it when there is
+	   more than one node. Binding on a shared machine could
+	   also put two jobs on the same CPUs, so let the user
+	   turn it off */
+
+	policy = (num_nodes > 1) ? NUMA_REPLICATE : NUMA_OFF;
+	if (obj->nfs_args != NULL) {
+		const char *tmp = strstr(obj->nfs_args, "la_numa=");
+		if (tmp != NULL)
+			policy = MIN((uint32)atoi(tmp + 8), NUMA_REPLICATE);
+	}
+	c->numa_policy = policy;
+	if (policy == NUMA_OFF)
+		return;
+
+	/* deal out the CPUs one node at a time, so that 
+	   the threads are spread evenly across the nodes */
+
+	for (i = k = 0; k < c->num_cpus; i++) {
+		for (j = 0; j < num_nodes; j++) {
+			uint32 m, seen = 0;
+
+			for (m = 0; m < c->num_cpus; m++) {
+				if (nodes[m] == j && seen++ == i) {
+					order[k++] = m;
+					break;
+				}
+			}
+		}
+	}
+
+	for (i = 0; i < p->num_threads; i++) {
+		thread_data_t *t = c->thread_data + i;
+		uint32 m = order[i % c->num_cpus];
+
+		t->cpu = c->cpus[m];
+		t->node = nodes[m];
+		t->node_rank = 0;
+		for (j = 0; j < i; j++) {
+			if (c->thread_data[j].node == t->node)
+				t->node_rank++;
+		}
+	}
+	for (i = 0; i < p->num_threads; i++) {
+		thread_data_t *t = c->thread_data + i;
+
+		t->node_threads = 0;
+		for (j = 0; j < p->num_threads; j++) {
+			if (c->thread_data[j].node == t->node)
+				t->node_threads++;
+		}
+		if (policy == NUMA_REPLICATE && c->x_node[t->node] == NULL) {
+			c->x_node[t->node] = (v_t *)vv_alloc(
+					MAX(p->nrows, p->ncols), c);
+		}
+	}
+
+	logprintf(obj, "binding %u threads to CPUs on %u NUMA node%s%s\n",
+			p->num_threads, num_nodes, 
+			num_nodes > 1 ? "s" : "",
+			policy == NUMA_REPLICATE ? 
+				", with a copy of each vector per node" : "");
+}
+
+/*-------------------------------------------------------------------*/
+static size_t delta_block_words(packed_block_t *b)
+{
+	/* the number of 16-bit words in a delta coded block */
+
+	uint32 i;
+	uint32 n = b->num_entries;
+	uint8 *deltas = DELTA_BYTES(b->d.delta_entries, n);
+	size_t words = n + (n + 1) / 2;
+
+	for (i = 0; i < n; i++) {
+		if (deltas[i] == DELTA_ESCAPE)
+			words++;
+	}
+	return words;
+}
+
+static void move_block(packed_block_t *b, uint32 format)
+{
+	size_t size;
+	void *new_data;
+
+	/* copy the data for one block into memory allocated,
+	   and first touched, by the calling thread */
+
+	if (format == BLOCK_RUNS) {
+		uint16 *runs = b->d.med_entries;
+		size_t words = 0;
+
+		while (runs[words + 1] != 0)
+			words += runs[words + 1] + 2;
+
+		/* the run list has 8 words of padding at the end,
+		   and the first 2 of these are the terminator */
+
+		size = (words + 8) * sizeof(uint16);
+	}
+	else if (format == BLOCK_DELTA) {
+		size = delta_block_words(b) * sizeof(uint16);
+	}
+	else {
+		size = b->num_entries * sizeof(entry_idx_t);
+	}
+
+	if (size == 0)
+		return;
+
+	new_data = xmalloc(size);
+	memcpy(new_data, b->d.entries, size);
+	free(b->d.entries);
+	b->d.entries = (entry_idx_t *)new_data;
+}
+
+static void place_matrix_core(void *data, int thread_num)
+{
+	la_task_t *task = (la_task_t *)data;
+	packed_matrix_t *p = task->matrix;
+	cpudata_t *c = (cpudata_t *)p->extra;
+	uint32 i, j;
+	uint32 num_blocks = c->num_block_cols / p->num_threads;
+	uint32 block_off = num_blocks * task->task_num;
+
+	/* move the sparse block rows that this thread multiplies
+	   in mul_packed_core. The transpose multiply splits the
+	   same blocks by column instead, so it only gets some of
+	   them from local memory */
+
+	for (i = task->task_num; i < c->num_block_rows - 1; 
+					i += p->num_threads) {
+		packed_block_t *b = c->blocks + (i + 1) * c->num_block_cols;
+
+		for (j = 0; j < c->num_block_cols; j++, b++)
+			move_block(b, c->sparse_format);
+	}
+
+	/* and the medium-dense blocks of mul_packed_small_core */
+
+	if (task->task_num == p->num_threads - 1)
+		num_blocks = c->num_block_cols - block_off;
+
+	for (i = 0; i < num_blocks; i++)
+		move_block(c->blocks + block_off + i, BLOCK_RUNS);
 }
 
 /*-------------------------------------------------------------------*/
@@ -219,6 +489,53 @@ static void pack_med_block(packed_block_t *b)
 	b->d.med_entries = med_entries;
 }
 
+/*--------------------------------------------------------------------*/
+static void pack_delta_block(packed_block_t *b)
+{
+	uint32 j;
+	uint32 n = b->num_entries;
+	uint32 col, num_escapes;
+	uint16 *rows;
+	uint8 *deltas;
+	uint16 *escapes;
+	entry_idx_t *e = b->d.entries;
+
+	/* convert a block whose entries are sorted by column
+	   to the delta coded format. Most blocks have fewer 
+	   entries than columns, so the distance between the
+	   columns of neighboring entries is usually small */
+
+	for (j = num_escapes = col = 0; j < n; j++) {
+		if (e[j].col_off - col >= DELTA_ESCAPE)
+			num_escapes++;
+		col = e[j].col_off;
+	}
+
+	rows = (uint16 *)xmalloc((n + (n + 1) / 2 + num_escapes) *
+					sizeof(uint16));
+	deltas = DELTA_BYTES(rows, n);
+	escapes = DELTA_ESCAPES(rows, n);
+
+	for (j = col = 0; j < n; j++) {
+		uint32 d = e[j].col_off - col;
+
+		rows[j] = e[j].row_off;
+		if (d >= DELTA_ESCAPE) {
+			deltas[j] = DELTA_ESCAPE;
+			*escapes++ = e[j].col_off;
+		}
+		else {
+			deltas[j] = d;
+		}
+		col = e[j].col_off;
+	}
+	if (n & 1)
+		deltas[n] = 0;
+
+	free(b->d.entries);
+	b->d.delta_entries = rows;
+}
+
 /*--------------------------------------------------------------------*/
 static void pack_matrix_core(packed_matrix_t *p)
 {
@@ -336,11 +653,461 @@ static void pack_matrix_core(packed_matrix_t *p)
 		}
 
 		pack_med_block(curr_stripe);
+
+		if (c->sparse_format == BLOCK_DELTA) {
+			for (j = 1, b = curr_stripe + num_block_cols; 
+					j < num_block_rows; 
+					j++, b += num_block_cols) {
+				pack_delta_block(b);
+			}
+		}
 	}
 
 	p->unpacked_cols = NULL;
 }
 
+/*--------------------------------------------------------------------*/
+static void add_dense_words(packed_matrix_t *p, la_col_t *col, 
+				uint32 col_num, uint32 dense_words)
+{
+	uint32 j, k;
+	cpudata_t *c = (cpudata_t *)p->extra;
+	uint32 *dest = col->data + col->weight;
+
+	for (j = 0; j < dense_words / (2 * VWORDS); j++) {
+		for (k = 0; k < VWORDS; k++) {
+			uint64 w = c->dense_blocks[j][col_num].w[k];
+
+			*dest++ = (uint32)w;
+			*dest++ = (uint32)(w >> 32);
+		}
+	}
+}
+
+static void unpack_matrix_core(packed_matrix_t *p, la_col_t *A)
+{
+	/* the reverse of pack_matrix_core, so that the matrix
+	   can be packed again with different block sizes. This
+	   also goes one stripe at a time, to limit memory use */
+
+	uint32 i, j, k;
+	cpudata_t *c = (cpudata_t *)p->extra;
+	uint32 ncols = p->ncols;
+	uint32 block_size = c->block_size;
+	uint32 num_block_cols = c->num_block_cols;
+	uint32 dense_row_blocks = (p->num_dense_rows + VBITS - 1) / VBITS;
+	uint32 dense_words = MAX(2 * VWORDS * dense_row_blocks,
+				(p->num_dense_rows + 31) / 32);
+	uint32 *fill = (uint32 *)xmalloc(block_size * sizeof(uint32));
+
+	for (i = 0; i < num_block_cols; i++) {
+
+		uint32 col_start = i * block_size;
+		uint32 curr_cols = MIN(block_size, ncols - col_start);
+		la_col_t *cols = A + col_start;
+		packed_block_t *b = c->blocks + i;
+
+		for (j = 0; j < curr_cols; j++) {
+			cols[j].data = (uint32 *)xmalloc((cols[j].weight +
+						dense_words) * sizeof(uint32));
+			add_dense_words(p, cols + j, col_start + j, 
+					dense_words);
+			fill[j] = 0;
+		}
+
+		for (j = 0; j < c->num_block_rows; j++, b += num_block_cols) {
+
+			uint32 row_start = 0;
+
+			if (j > 0) {
+				row_start = c->first_block_size +
+						(j - 1) * block_size;
+			}
+
+			if (j == 0) {
+				uint16 *runs = b->d.med_entries;
+
+				/* the first block is stored by row */
+
+				for (; runs[1] != 0; runs += runs[1] + 2) {
+					uint16 *off = runs + 2;
+
+					for (k = 0; k < runs[1]; k++) {
+						cols[off[k]].data[
+							fill[off[k]]++] =
+							row_start + runs[0];
+					}
+				}
+			}
+			else if (c->sparse_format == BLOCK_DELTA) {
+				uint16 *rows = b->d.delta_entries;
+				uint8 *deltas = DELTA_BYTES(rows, 
+							b->num_entries);
+				uint16 *escapes = DELTA_ESCAPES(rows, 
+							b->num_entries);
+				uint32 col = 0;
+
+				for (k = 0; k < b->num_entries; k++) {
+					if (deltas[k] == DELTA_ESCAPE)
+						col = *escapes++;
+					else
+						col += deltas[k];
+
+					cols[col].data[fill[col]++] =
+						row_start + rows[k];
+				}
+			}
+			else {
+				entry_idx_t *e = b->d.entries;
+
+				for (k = 0; k < b->num_entries; k++) {
+					uint32 col = e[k].col_off;
+
+					cols[col].data[fill[col]++] =
+						row_start + e[k].row_off;
+				}
+			}
+
+			free(b->d.entries);
+			b->d.entries = NULL;
+			b->num_entries = 0;
+		}
+	}
+
+	for (i = 0; i < dense_row_blocks; i++)
+		vv_free(c->dense_blocks[i]);
+	free(c->dense_blocks);
+	free(c->blocks);
+	c->dense_blocks = NULL;
+	c->blocks = NULL;
+	free(fill);
+
+	p->unpacked_cols = A;
+}
+
+/*--------------------------------------------------------------------*/
+static void pack_matrix(packed_matrix_t *p, uint32 block_size,
+			uint32 superblock_size)
+{
+	/* pack with the given block sizes, then move each 
+	   thread's part of the matrix to memory on its node;
+	   the packing happened in this thread */
+
+	cpudata_t *c = (cpudata_t *)p->extra;
+
+	c->block_size = block_size;
+	c->num_block_cols = (p->ncols + block_size - 1) / block_size;
+	c->num_block_rows = 1 + (p->nrows - c->first_block_size + 
+				block_size - 1) / block_size;
+
+	c->superblock_size = (superblock_size + block_size - 1) / block_size;
+	c->num_superblock_cols = (c->num_block_cols + c->superblock_size - 1) / 
+					c->superblock_size;
+	c->num_superblock_rows = (c->num_block_rows - 1 + 
+				c->superblock_size - 1) / c->superblock_size;
+
+	pack_matrix_core(p);
+
+	if (c->numa_policy != NUMA_OFF)
+		run_tasks(p, place_matrix_core, 0, 0, 0);
+}
+
+/*--------------------------------------------------------------------*/
+/* Autotuning of the block sizes. The matrix is packed with
+   a few candidate sizes and a handful of multiplies are timed
+   for each; first the block size is chosen with the default
+   superblock size, then the superblock size for that block 
+   size. The winner is saved in a file, keyed by the machine
+   and the rough size and density of the matrix, so that later
+   runs on the same machine can skip the search */
+
+#define LA_TUNE_FILE "msieve.tune"
+#define LA_TUNE_REPS 3
+
+static const uint32 tune_block_sizes[] = {2048, 4096, 8192, 16384};
+
+/* multiples of the default superblock size, in 1/4 units */
+
+static const uint32 tune_superblock_mult[] = {2, 8, 16};
+
+static uint32 ilog2(uint64 x)
+{
+	uint32 i = 0;
+
+	while (x >>= 1)
+		i++;
+	return i;
+}
+
+static void tune_get_key(msieve_obj *obj, packed_matrix_t *p,
+			la_col_t *A, char *key)
+{
+	uint32 i;
+	uint64 weight = 0;
+
+	for (i = 0; i < p->ncols; i++)
+		weight += A[i].weight;
+
+	sprintf(key, "%u %u %u %u %u %u %u", 
+			(uint32)obj->cpu, obj->cache_size1, 
+			obj->cache_size2, p->num_threads, VBITS,
+			ilog2(p->ncols), ilog2(weight / p->ncols));
+}
+
+static uint32 tune_read(char *key, uint32 *block_size,
+			uint32 *superblock_size)
+{
+	char buf[LINE_BUF_SIZE];
+	size_t key_len = strlen(key);
+	uint32 found = 0;
+	FILE *fp = fopen(LA_TUNE_FILE, "r");
+
+	if (fp == NULL)
+		return 0;
+
+	/* the last matching line wins */
+
+	while (fgets(buf, sizeof(buf), fp) != NULL) {
+		uint32 b, s;
+
+		if (buf[0] == '#' || strncmp(buf, key, key_len) ||
+		    buf[key_len] != ' ')
+			continue;
+
+		if (sscanf(buf + key_len, "%u %u", &b, &s) == 2 &&
+		    b >= 512 && b <= 65536 && s > 0) {
+			*block_size = b;
+			*superblock_size = s;
+			found = 1;
+		}
+	}
+
+	fclose(fp);
+	return found;
+}
+
+static void tune_write(msieve_obj *obj, char *key, 
+			uint32 block_size, uint32 superblock_size)
+{
+	FILE *fp = fopen(LA_TUNE_FILE, "a");
+
+	if (fp == NULL) {
+		logprintf(obj, "warning: cannot save tuning "
+				"results to " LA_TUNE_FILE "\n");
+		return;
+	}
+
+	if (ftell(fp) == 0) {
+		fprintf(fp, "# cpu L1 L2 threads vbits log2(ncols) "
+				"log2(weight/col) block superblock\n");
+	}
+	fprintf(fp, "%s %u %u\n", key, block_size, superblock_size);
+	fclose(fp);
+}
+
+static uint64 tune_time_one(msieve_obj *obj, packed_matrix_t *p, 
+			la_col_t *A, v_t *x, v_t *b,
+			uint32 block_size, uint32 superblock_size)
+{
+	uint32 i;
+	uint64 best = (uint64)(-1);
+
+	pack_matrix(p, block_size, superblock_size);
+
+	/* the first pair of multiplies warms up the caches */
+
+	for (i = 0; i <= LA_TUNE_REPS; i++) {
+		uint64 start = read_clock();
+
+		mul_core(p, x, b);
+		mul_trans_core(p, b, x);
+		if (i > 0)
+			best = MIN(best, read_clock() - start);
+	}
+
+	logprintf(obj, "block size %u, superblock size %u: "
+			"%.2f Mcycles per multiply\n", block_size,
+			superblock_size, (double)best / 1e6);
+
+	unpack_matrix_core(p, A);
+	return best;
+}
+
+static void tune_block_size(msieve_obj *obj, packed_matrix_t *p,
+			uint32 *block_size_out, 
+			uint32 *superblock_size_out)
+{
+	uint32 i;
+	la_col_t *A = p->unpacked_cols;
+	uint32 block_size = *block_size_out;
+	uint32 superblock_size = *superblock_size_out;
+	uint32 default_superblock = superblock_size;
+	uint32 seed1 = 11, seed2 = 22;
+	uint64 t, best;
+	uint32 n = MAX(p->nrows, p->ncols);
+	char key[LINE_BUF_SIZE];
+	v_t *x, *b;
+
+	tune_get_key(obj, p, A, key);
+	if (tune_read(key, block_size_out, superblock_size_out)) {
+		logprintf(obj, "using tuned block sizes "
+				"from " LA_TUNE_FILE "\n");
+		return;
+	}
+
+	logprintf(obj, "tuning block sizes\n");
+
+	x = (v_t *)vv_alloc(n, p->extra);
+	b = (v_t *)vv_alloc(n, p->extra);
+	for (i = 0; i < n; i++)
+		x[i] = v_random(&seed1, &seed2);
+
+	best = (uint64)(-1);
+	for (i = 0; i < sizeof(tune_block_sizes) / sizeof(uint32); i++) {
+
+		t = tune_time_one(obj, p, A, x, b, tune_block_sizes[i],
+					default_superblock);
+		if (t < best) {
+			best = t;
+			block_size = tune_block_sizes[i];
+		}
+	}
+
+	/* the default superblock size was timed above */
+
+	superblock_size = default_superblock;
+	for (i = 0; i < sizeof(tune_superblock_mult) / sizeof(uint32); i++) {
+
+		uint32 s = default_superblock * tune_superblock_mult[i] / 4;
+
+		/* superblocks bigger than the matrix are all 
+		   the same as the default */
+
+		if (s < block_size || (s > default_superblock &&
+		    default_superblock >= n))
+			continue;
+
+		t = tune_time_one(obj, p, A, x, b, block_size, s);
+		if (t < best) {
+			best = t;
+			superblock_size = s;
+		}
+	}
+
+	vv_free(x);
+	vv_free(b);
+
+	tune_write(obj, key, block_size, superblock_size);
+	*block_size_out = block_size;
+	*superblock_size_out = superblock_size;
+}
+
+/*-------------------------------------------------------------------*/
+static uint64 block_bytes(packed_block_t *b, uint32 format)
+{
+	uint16 *runs = b->d.med_entries;
+	uint64 words = 2;
+
+	if (format == BLOCK_DELTA)
+		return (uint64)delta_block_words(b) * sizeof(uint16);
+	if (format == BLOCK_PAIRS)
+		return (uint64)b->num_entries * sizeof(entry_idx_t);
+
+	while (runs[1] != 0) {
+		words += runs[1] + 2;
+		runs += runs[1] + 2;
+	}
+	return words * sizeof(uint16);
+}
+
+static void prof_count_bytes(packed_matrix_t *p)
+{
+	/* estimate the bytes each thread moves through memory
+	   in one matrix multiply: the part of the matrix it
+	   reads, one pass over the input vector, and reading
+	   and writing its part of the output vector */
+
+	uint32 i, j;
+	uint32 num_threads = p->num_threads;
+	uint32 num_dense = (p->num_dense_rows + VBITS - 1) / VBITS;
+	la_prof_t *prof = p->prof;
+	cpudata_t *c = (cpudata_t *)p->extra;
+	uint64 (*bytes)[LA_PROF_MAX_THREADS] = prof->thread_bytes;
+
+	if (p->unpacked_cols) {
+		la_col_t *A = p->unpacked_cols;
+		uint64 words = 0;
+
+		for (i = 0; i < p->ncols; i++) {
+			words += A[i].weight + 
+				(p->num_dense_rows + 31) / 32;
+		}
+		prof->mul_bytes[0] = prof->mul_bytes[1] =
+				words * sizeof(uint32) + 
+				(uint64)(p->nrows + 2 * p->ncols) * 
+				sizeof(v_t);
+		return;
+	}
+
+	prof->num_threads = num_threads;
+
+	/* the sparse block rows (columns for the transpose)
+	   that each thread multiplies */
+
+	for (i = 0; i < c->num_block_rows - 1; i++) {
+		uint32 t = i % num_threads;
+		uint32 b_off = i * c->block_size + c->first_block_size;
+		packed_block_t *b = c->blocks + (i + 1) * c->num_block_cols;
+
+		for (j = 0; j < c->num_block_cols; j++, b++) {
+			bytes[LA_PROF_TASK_MUL][t] += block_bytes(b, 
+							c->sparse_format);
+		}
+		bytes[LA_PROF_TASK_MUL][t] += 2 * sizeof(v_t) *
+				(uint64)MIN(c->block_size, p->nrows - b_off);
+	}
+
+	for (i = 0; i < c->num_block_cols; i++) {
+		uint32 t = i % num_threads;
+		packed_block_t *b = c->blocks + i;
+
+		for (j = 0; j < c->num_block_rows; j++) {
+			bytes[LA_PROF_TASK_TRANS][t] += block_bytes(b, 
+					j == 0 ? BLOCK_RUNS : c->sparse_format);
+			b += c->num_block_cols;
+		}
+		bytes[LA_PROF_TASK_TRANS][t] += 2 * sizeof(v_t) *
+			(uint64)MIN(c->block_size, p->ncols - i * c->block_size);
+	}
+
+	/* the medium-dense blocks are split evenly by column 
+	   among threads, and the dense rows are too */
+
+	for (i = 0; i < c->num_block_cols; i++) {
+		uint32 t = MIN(i / MAX(c->num_block_cols / num_threads, 1),
+				num_threads - 1);
+		bytes[LA_PROF_TASK_MUL_DENSE][t] += 
+				block_bytes(c->blocks + i, BLOCK_RUNS);
+	}
+
+	for (i = 0; i < num_threads; i++) {
+		uint64 vsize = (uint64)p->ncols / num_threads;
+		uint64 dense = num_dense * vsize * sizeof(v_t);
+
+		bytes[LA_PROF_TASK_MUL][i] += (uint64)p->ncols * sizeof(v_t);
+		bytes[LA_PROF_TASK_TRANS][i] += (uint64)p->nrows * sizeof(v_t);
+		bytes[LA_PROF_TASK_MUL_DENSE][i] += dense + 
+					vsize * sizeof(v_t);
+		bytes[LA_PROF_TASK_TRANS_DENSE][i] += dense +
+					2 * vsize * sizeof(v_t);
+
+		prof->mul_bytes[0] += bytes[LA_PROF_TASK_MUL][i] +
+				bytes[LA_PROF_TASK_MUL_DENSE][i];
+		prof->mul_bytes[1] += bytes[LA_PROF_TASK_TRANS][i] +
+				bytes[LA_PROF_TASK_TRANS_DENSE][i];
+	}
+}
+
 /*-------------------------------------------------------------------*/
 void matrix_extra_init(msieve_obj *obj, packed_matrix_t *p,
 			uint32 first_block_size) {
@@ -349,6 +1116,9 @@ void matrix_extra_init(msieve_obj *obj, packed_matrix_t *p,
 	uint32 num_threads;
 	uint32 block_size;
 	uint32 superblock_size;
+	uint32 use_simd = 1;
+	uint32 use_delta = 0;
+	uint32 autotune = 0;
 	thread_control_t control;
 	cpudata_t *c;
 
@@ -366,6 +1136,7 @@ void matrix_extra_init(msieve_obj *obj, packed_matrix_t *p,
 	   runs need these structures to be allocated */
 
 	c->first_block_size = first_block_size;
+	numa_init(obj, p);
 
 	control.init = matrix_thread_init;
 	control.shutdown = matrix_thread_free;
@@ -386,8 +1157,11 @@ void matrix_extra_init(msieve_obj *obj, packed_matrix_t *p,
 		c->tasks[i].task_num = i;
 	}
 
-	if (p->max_nrows <= MIN_NROWS_TO_PACK)
+	if (p->max_nrows <= MIN_NROWS_TO_PACK) {
+		if (p->prof)
+			prof_count_bytes(p);
 		return;
+	}
 
 	/* determine the block sizes. We assume that the largest
 	   cache in the system is unified and shared across all
@@ -412,34 +1186,68 @@ void matrix_extra_init(msieve_obj *obj, packed_matrix_t *p,
 
 		const char *tmp;
 
-		tmp = strstr(obj->nfs_args, "la_block=");
+		tmp = strstr(obj->nfs_args, "la_autotune=");
 		if (tmp != NULL)
+			autotune = atoi(tmp + 12);
+
+		/* sizes given explicitly are not tuned */
+
+		tmp = strstr(obj->nfs_args, "la_block=");
+		if (tmp != NULL) {
 			block_size = atoi(tmp + 9);
+			autotune = 0;
+		}
 
 		tmp = strstr(obj->nfs_args, "la_superblock=");
-		if (tmp != NULL)
+		if (tmp != NULL) {
 			superblock_size = atoi(tmp + 14);
+			autotune = 0;
+		}
+
+		tmp = strstr(obj->nfs_args, "la_simd=");
+		if (tmp != NULL)
+			use_simd = atoi(tmp + 8);
+
+		tmp = strstr(obj->nfs_args, "la_delta=");
+		if (tmp != NULL)
+			use_delta = atoi(tmp + 9);
+	}
+
+	/* choose the vector instructions for the innermost 
+	   loops; this only matters for vectors wider than 
+	   64 bits */
+
+#if VWORDS > 1
+	logprintf(obj, "using %s kernels for %u-bit vectors\n",
+			lanczos_simd_init(&c->simd, use_simd), VBITS);
+#else
+	lanczos_simd_init(&c->simd, use_simd);
+#endif
+
+	/* the sparse blocks can be delta coded, which cuts
+	   the memory traffic of the matrix by about a quarter
+	   at the cost of a little more work per entry */
+
+	c->sparse_format = BLOCK_PAIRS;
+	if (use_delta) {
+		c->sparse_format = BLOCK_DELTA;
+		logprintf(obj, "using delta coded matrix blocks\n");
 	}
 
+	if (autotune)
+		tune_block_size(obj, p, &block_size, &superblock_size);
+
 	logprintf(obj, "using block size %u and superblock size %u for "
 			"processor cache size %u kB\n", 
 				block_size, superblock_size,
 				obj->cache_size2 / 1024);
 
-	c->block_size = block_size;
-	c->num_block_cols = (p->ncols + block_size - 1) / block_size;
-	c->num_block_rows = 1 + (p->nrows - first_block_size + 
-				block_size - 1) / block_size;
-
-	c->superblock_size = (superblock_size + block_size - 1) / block_size;
-	c->num_superblock_cols = (c->num_block_cols + c->superblock_size - 1) / 
-					c->superblock_size;
-	c->num_superblock_rows = (c->num_block_rows - 1 + 
-				c->superblock_size - 1) / c->superblock_size;
-
 	/* do the core work of packing the matrix */
 
-	pack_matrix_core(p);
+	pack_matrix(p, block_size, superblock_size);
+
+	if (p->prof)
+		prof_count_bytes(p);
 }
 
 /*-------------------------------------------------------------------*/
@@ -472,6 +1280,10 @@ void matrix_extra_free(packed_matrix_t *p) {
 	}
 	matrix_thread_free(p, p->num_threads - 1);
 
+	for (i = 0; i < MAX_NUMA_NODES; i++)
+		vv_free(c->x_node[i]);
+
+	free(c->cpus);
 	free(c->tasks);
 	free(c);
 }
@@ -523,6 +1335,10 @@ size_t packed_matrix_sizeof(packed_matrix_t *p) {
 					    2 * c->first_block_size) * 
 						sizeof(uint16);
 			}
+			else if (c->sparse_format == BLOCK_DELTA) {
+				mem_use += delta_block_words(b) *
+						sizeof(uint16);
+			}
 			else {
 				mem_use += b->num_entries *
 						sizeof(entry_idx_t);
@@ -538,13 +1354,31 @@ void mul_core(packed_matrix_t *A, void *x_in, void *b_in) {
 	/* Multiply the vector x[] by the matrix A and put the 
 	   result in b[]. x must not alias b */
 
+	mul_core_pieces(A, x_in, b_in, 1, NULL, NULL);
+}
+
+/*-------------------------------------------------------------------*/
+void mul_core_pieces(packed_matrix_t *A, void *x_in, void *b_in,
+			uint32 num_pieces, mul_done_func done,
+			void *done_data) {
+    
 	v_t *x = (v_t *)x_in;
 	v_t *b = (v_t *)b_in;
+	uint64 prof_start = la_prof_start(A);
 
-	if (A->unpacked_cols)
+	if (A->unpacked_cols) {
 		mul_unpacked(A, x, b);
-	else
-		mul_packed(A, x, b);
+		if (done != NULL)
+			done(done_data, A->nrows);
+	}
+	else {
+		mul_packed(A, x, b, num_pieces, done, done_data);
+	}
+
+	if (A->prof) {
+		la_prof_end(A, LA_PROF_MUL, prof_start, 
+				A->prof->mul_bytes[0]);
+	}
 }
 
 /*-------------------------------------------------------------------*/
@@ -553,11 +1387,29 @@ void mul_trans_core(packed_matrix_t *A, void *x_in, void *b_in) {
 	/* Multiply the vector x[] by the transpose of matrix A 
 	   and put the result in b[]. x must not alias b */
 
+	mul_trans_core_pieces(A, x_in, b_in, 1, NULL, NULL);
+}
+
+/*-------------------------------------------------------------------*/
+void mul_trans_core_pieces(packed_matrix_t *A, void *x_in, void *b_in,
+			uint32 num_pieces, mul_done_func done,
+			void *done_data) {
+    
 	v_t *x = (v_t *)x_in;
 	v_t *b = (v_t *)b_in;
+	uint64 prof_start = la_prof_start(A);
 
-	if (A->unpacked_cols)
+	if (A->unpacked_cols) {
 		mul_trans_unpacked(A, x, b);
-	else
-		mul_trans_packed(A, x, b);
+		if (done != NULL)
+			done(done_data, A->ncols);
+	}
+	else {
+		mul_trans_packed(A, x, b, num_pieces, done, done_data);
+	}
+
+	if (A->prof) {
+		la_prof_end(A, LA_PROF_MUL_TRANS, prof_start, 
+				A->prof->mul_bytes[1]);
+	}
 }
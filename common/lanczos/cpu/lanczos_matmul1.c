@@ -19,11 +19,20 @@ $Id$
 
 /*-------------------------------------------------------------------*/
 
-static void mul_one_med_block(packed_block_t *curr_block,
+void mul_gather_runs(simd_kernels_t *simd, packed_block_t *curr_block,
 			v_t *curr_col, v_t *curr_b) {
 
 	uint16 *entries = curr_block->d.med_entries;
 
+#ifdef HAS_LANCZOS_SIMD
+	if (simd->gather_runs) {
+		simd->gather_runs(entries, curr_col, curr_b);
+		return;
+	}
+#else
+	(void)simd;
+#endif
+
 	while (1) {
 		v_t accum;
 
@@ -200,13 +209,22 @@ static void mul_one_med_block(packed_block_t *curr_block,
 }
 
 /*-------------------------------------------------------------------*/
-static void mul_one_block(packed_block_t *curr_block,
+static void mul_one_block(simd_kernels_t *simd, packed_block_t *curr_block,
 			v_t *curr_col, v_t *curr_b) {
 
 	uint32 i = 0; 
 	uint32 num_entries = curr_block->num_entries;
 	entry_idx_t *entries = curr_block->d.entries;
 
+#ifdef HAS_LANCZOS_SIMD
+	if (simd->mul_pairs) {
+		simd->mul_pairs(entries, num_entries, curr_col, curr_b);
+		return;
+	}
+#else
+	(void)simd;
+#endif
+
 	/* unroll by 16, i.e. the number of matrix elements
 	   in one cache line (usually). For 32-bit x86, we get
 	   a huge performance boost by using either SSE or MMX
@@ -306,6 +324,43 @@ static void mul_one_block(packed_block_t *curr_block,
 	}
 }
 
+/*-------------------------------------------------------------------*/
+static void mul_one_delta_block(simd_kernels_t *simd, 
+			packed_block_t *curr_block,
+			v_t *curr_col, v_t *curr_b) {
+
+	uint32 i;
+	uint32 col = 0;
+	uint32 num_entries = curr_block->num_entries;
+	uint16 *rows = curr_block->d.delta_entries;
+	uint8 *deltas = DELTA_BYTES(rows, num_entries);
+	uint16 *escapes = DELTA_ESCAPES(rows, num_entries);
+
+#ifdef HAS_LANCZOS_SIMD
+	if (simd->mul_delta) {
+		simd->mul_delta(rows, num_entries, curr_col, curr_b);
+		return;
+	}
+#else
+	(void)simd;
+#endif
+
+	/* the column of each entry depends on the one before
+	   it, but the loads and xors of different entries can
+	   still overlap */
+
+	for (i = 0; i < num_entries; i++) {
+		uint32 d = deltas[i];
+
+		if (d == DELTA_ESCAPE)
+			col = *escapes++;
+		else
+			col += d;
+
+		curr_b[rows[i]] = v_xor(curr_b[rows[i]], curr_col[col]);
+	}
+}
+
 /*-------------------------------------------------------------------*/
 void mul_packed_core(void *data, int thread_num)
 {
@@ -322,11 +377,12 @@ void mul_packed_core(void *data, int thread_num)
 
 	packed_block_t *start_block = c->blocks + start_block_c +
 					c->num_block_cols;
-	v_t *x = c->x + start_block_c * c->block_size;
+	v_t *x = task_x(c, task) + start_block_c * c->block_size;
+	uint64 prof_start = la_prof_start(p);
 	uint32 i, j;
 
-	for (i = task->task_num; i < c->num_block_rows - 1; 
-					i += p->num_threads) {
+	for (i = task_first_block(task, p->num_threads); 
+			i < task->range_end; i += p->num_threads) {
 
 		packed_block_t *curr_block = start_block + 
 					i * c->num_block_cols;
@@ -338,11 +394,20 @@ void mul_packed_core(void *data, int thread_num)
 			vv_clear(b, MIN(c->block_size, p->nrows - b_off));
 
 		for (j = 0; j < num_blocks_c; j++) {
-			mul_one_block(curr_block, curr_x, b);
+			if (c->sparse_format == BLOCK_DELTA) {
+				mul_one_delta_block(&c->simd, curr_block, 
+						curr_x, b);
+			}
+			else {
+				mul_one_block(&c->simd, curr_block, 
+						curr_x, b);
+			}
 			curr_block++;
 			curr_x += c->block_size;
 		}
 	}
+
+	task_prof_end(task, LA_PROF_TASK_MUL, prof_start);
 }
 
 /*-------------------------------------------------------------------*/
@@ -358,9 +423,11 @@ void mul_packed_small_core(void *data, int thread_num)
 	uint32 block_off = num_blocks * task->task_num;
 	uint32 off = c->block_size * block_off;
 	uint32 vsize = num_blocks * c->block_size;
-	v_t *x = c->x + off;
+	v_t *x_base = task_x(c, task);
+	v_t *x = x_base + off;
 	v_t *b = t->tmp_b;
 	packed_block_t *curr_block = c->blocks + block_off;
+	uint64 prof_start = la_prof_start(p);
 	uint32 i;
 
 	vv_clear(b, MAX(c->first_block_size, VBITS * 
@@ -375,7 +442,7 @@ void mul_packed_small_core(void *data, int thread_num)
 	}
 
 	for (i = 0; i < num_blocks; i++) {
-		mul_one_med_block(curr_block, x, b);
+		mul_gather_runs(&c->simd, curr_block, x, b);
 		curr_block++;
 		x += c->block_size;
 	}
@@ -383,6 +450,8 @@ void mul_packed_small_core(void *data, int thread_num)
 	/* multiply the densest few rows by x (in batches of VBITS rows) */
 
 	for (i = 0; i < (p->num_dense_rows + VBITS - 1) / VBITS; i++)
-		mul_BxN_NxB(c->dense_blocks[i] + off, 
-				c->x + off, b + VBITS * i, vsize);
+		mul_BxN_NxB(&c->simd, c->dense_blocks[i] + off, 
+				x_base + off, b + VBITS * i, vsize);
+
+	task_prof_end(task, LA_PROF_TASK_MUL_DENSE, prof_start);
 }
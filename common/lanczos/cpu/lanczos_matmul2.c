@@ -18,11 +18,20 @@ $Id$
 	   when the matrix is in packed format */
 
 /*-------------------------------------------------------------------*/
-static void mul_trans_one_med_block(packed_block_t *curr_block,
+void mul_scatter_runs(simd_kernels_t *simd, packed_block_t *curr_block,
 			v_t *curr_row, v_t *curr_b) {
 
 	uint16 *entries = curr_block->d.med_entries;
 
+#ifdef HAS_LANCZOS_SIMD
+	if (simd->scatter_runs) {
+		simd->scatter_runs(entries, curr_row, curr_b);
+		return;
+	}
+#else
+	(void)simd;
+#endif
+
 	while (1) {
 		v_t t;
 #if defined(GCC_ASM64X)
@@ -229,13 +238,23 @@ static void mul_trans_one_med_block(packed_block_t *curr_block,
 }
 
 /*-------------------------------------------------------------------*/
-static void mul_trans_one_block(packed_block_t *curr_block,
+static void mul_trans_one_block(simd_kernels_t *simd, 
+				packed_block_t *curr_block,
 				v_t *curr_row, v_t *curr_b) {
 
 	uint32 i = 0;
 	uint32 num_entries = curr_block->num_entries;
 	entry_idx_t *entries = curr_block->d.entries;
 
+#ifdef HAS_LANCZOS_SIMD
+	if (simd->mul_trans_pairs) {
+		simd->mul_trans_pairs(entries, num_entries, curr_row, curr_b);
+		return;
+	}
+#else
+	(void)simd;
+#endif
+
 	/* unroll by 16, i.e. the number of matrix elements
 	   in one cache line (usually). For 32-bit x86, we get
 	   a huge performance boost by using either SSE or MMX
@@ -333,6 +352,39 @@ static void mul_trans_one_block(packed_block_t *curr_block,
 	}
 }
 
+/*-------------------------------------------------------------------*/
+static void mul_trans_one_delta_block(simd_kernels_t *simd, 
+				packed_block_t *curr_block,
+				v_t *curr_row, v_t *curr_b) {
+
+	uint32 i;
+	uint32 col = 0;
+	uint32 num_entries = curr_block->num_entries;
+	uint16 *rows = curr_block->d.delta_entries;
+	uint8 *deltas = DELTA_BYTES(rows, num_entries);
+	uint16 *escapes = DELTA_ESCAPES(rows, num_entries);
+
+#ifdef HAS_LANCZOS_SIMD
+	if (simd->mul_trans_delta) {
+		simd->mul_trans_delta(rows, num_entries, curr_row, curr_b);
+		return;
+	}
+#else
+	(void)simd;
+#endif
+
+	for (i = 0; i < num_entries; i++) {
+		uint32 d = deltas[i];
+
+		if (d == DELTA_ESCAPE)
+			col = *escapes++;
+		else
+			col += d;
+
+		curr_b[col] = v_xor(curr_b[col], curr_row[rows[i]]);
+	}
+}
+
 /*-------------------------------------------------------------------*/
 void mul_trans_packed_core(void *data, int thread_num)
 {
@@ -346,12 +398,14 @@ void mul_trans_packed_core(void *data, int thread_num)
 
 	packed_block_t *start_block = c->blocks + 
 				start_block_r * c->num_block_cols;
-	v_t *x = c->x + (start_block_r - 1) * c->block_size +
+	v_t *x_base = task_x(c, task);
+	v_t *x = x_base + (start_block_r - 1) * c->block_size +
 				c->first_block_size;
+	uint64 prof_start = la_prof_start(p);
 	uint32 i, j;
 
-	for (i = task->task_num; i < c->num_block_cols; 
-					i += p->num_threads) {
+	for (i = task_first_block(task, p->num_threads); 
+			i < task->range_end; i += p->num_threads) {
 
 		packed_block_t *curr_block = start_block + i;
 		uint32 b_off = i * c->block_size;
@@ -360,22 +414,32 @@ void mul_trans_packed_core(void *data, int thread_num)
 
 		if (start_block_r == 1) {
 			vv_clear(b, MIN(c->block_size, p->ncols - b_off));
-			mul_trans_one_med_block(curr_block - 
-					c->num_block_cols, c->x, b);
+			mul_scatter_runs(&c->simd, curr_block - 
+					c->num_block_cols, x_base, b);
 		}
 
 		for (j = 0; j < num_blocks_r; j++) {
-			mul_trans_one_block(curr_block, curr_x, b);
+			if (c->sparse_format == BLOCK_DELTA) {
+				mul_trans_one_delta_block(&c->simd, 
+						curr_block, curr_x, b);
+			}
+			else {
+				mul_trans_one_block(&c->simd, curr_block, 
+						curr_x, b);
+			}
 			curr_block += c->num_block_cols;
 			curr_x += c->block_size;
 		}
 	}
+
+	task_prof_end(task, LA_PROF_TASK_TRANS, prof_start);
 }
 
 /*-------------------------------------------------------------------*/
 void mul_trans_packed_small_core(void *data, int thread_num)
 {
-	/* multiply the densest few rows by x (in batches of VBITS rows)
+	/* multiply the densest few rows by x (in batches of VBITS rows),
+	   for the columns in the block columns of the task's range
 	
 	   b doesn't need initializing since this is the last operation
 	   of a transpose multiply */
@@ -383,17 +447,23 @@ void mul_trans_packed_small_core(void *data, int thread_num)
 	la_task_t *task = (la_task_t *)data;
 	packed_matrix_t *p = task->matrix;
 	cpudata_t *c = (cpudata_t *)p->extra;
-	uint32 vsize = p->ncols / p->num_threads;
-	uint32 off = vsize * task->task_num;
-	v_t *x = c->x;
+	uint32 start = MIN(p->ncols, task->range_start * c->block_size);
+	uint32 end = MIN(p->ncols, task->range_end * c->block_size);
+	uint32 vsize = (end - start) / p->num_threads;
+	uint32 off = start + vsize * task->task_num;
+	v_t *x = task_x(c, task);
 	v_t *b = c->b + off;
+	uint64 prof_start = la_prof_start(p);
 	uint32 i;
 
 	if (p->num_threads == 1)
-		vsize = p->ncols;
+		vsize = end - start;
 	else if (task->task_num == p->num_threads - 1)
-		vsize = p->ncols - off;
+		vsize = end - off;
 
 	for (i = 0; i < (p->num_dense_rows + VBITS - 1) / VBITS; i++)
-		mul_NxB_BxB_acc(c->dense_blocks[i] + off, x + VBITS * i, b, vsize);
+		mul_NxB_BxB_acc(&c->simd, c->dense_blocks[i] + off, 
+				x + VBITS * i, b, vsize);
+
+	task_prof_end(task, LA_PROF_TASK_TRANS_DENSE, prof_start);
 }
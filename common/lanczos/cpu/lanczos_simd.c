@@ -0,0 +1,142 @@
+/*--------------------------------------------------------------------
+This source distribution is placed in the public domain by its author,
+Jason Papadopoulos. You may use it for any purpose, free of charge,
+without having to notify anyone. I disclaim any responsibility for any
+errors.
+
+Optionally, please be nice and tell me if you find this source to be
+useful. Again optionally, if you add to the functionality present here
+please consider making those additions public too, so that others may
+benefit from your work.
+
+$Id$
+--------------------------------------------------------------------*/
+
+#include "lanczos_cpu.h"
+
+/* The generic matrix and vector code handles a v_t one
+   64-bit word at a time and leaves any vectorization to
+   the compiler, which is only allowed to use the
+   instruction sets of the build target. For 128- and
+   256-bit vectors, this file builds the innermost loops
+   for each instruction set that can hold a whole v_t in
+   one or two registers, and chooses between them at
+   runtime, so that a binary built for a generic x86_64
+   target still uses the full vector units.
+
+   There is no AVX512 version; a v_t is at most 256 bits,
+   and filling a wider register would mean scattering
+   several v_t's at once, which needs conflict detection
+   because matrix entries in a block often share a row */
+
+#ifdef HAS_LANCZOS_SIMD
+
+#include <immintrin.h>
+
+/*------------------------- SSE2 -----------------------------------*/
+
+/* SSE2 is part of the x86_64 baseline, so no attribute
+   is needed to enable it */
+
+#define SIMD_NAME "SSE2"
+#define SIMD_FUNC(name) name##_sse2
+#define SIMD_TARGET
+
+#if VWORDS == 2
+
+#define VEC_DECL(x) __m128i x
+#define VEC_LOAD(x, p) x = _mm_loadu_si128((const __m128i *)(p))
+#define VEC_STORE(p, x) _mm_storeu_si128((__m128i *)(p), x)
+#define VEC_XOR(x, y) x = _mm_xor_si128(x, y)
+#define VEC_AND(x, y) x = _mm_and_si128(x, y)
+#define VEC_ZERO(x) x = _mm_setzero_si128()
+
+#else
+
+#define VEC_DECL(x) __m128i x##_lo, x##_hi
+#define VEC_LOAD(x, p) do {					\
+		x##_lo = _mm_loadu_si128((const __m128i *)(p));	\
+		x##_hi = _mm_loadu_si128((const __m128i *)(p) + 1);	\
+	} while (0)
+#define VEC_STORE(p, x) do {					\
+		_mm_storeu_si128((__m128i *)(p), x##_lo);	\
+		_mm_storeu_si128((__m128i *)(p) + 1, x##_hi);	\
+	} while (0)
+#define VEC_XOR(x, y) do {					\
+		x##_lo = _mm_xor_si128(x##_lo, y##_lo);		\
+		x##_hi = _mm_xor_si128(x##_hi, y##_hi);		\
+	} while (0)
+#define VEC_AND(x, y) do {					\
+		x##_lo = _mm_and_si128(x##_lo, y##_lo);		\
+		x##_hi = _mm_and_si128(x##_hi, y##_hi);		\
+	} while (0)
+#define VEC_ZERO(x) x##_lo = x##_hi = _mm_setzero_si128()
+
+#endif
+
+#include "lanczos_simd_core.h"
+
+#undef SIMD_NAME
+#undef SIMD_FUNC
+#undef SIMD_TARGET
+#undef VEC_DECL
+#undef VEC_LOAD
+#undef VEC_STORE
+#undef VEC_XOR
+#undef VEC_AND
+#undef VEC_ZERO
+
+/*------------------------- AVX2 -----------------------------------*/
+
+/* one 256-bit register holds a whole v_t */
+
+#if VWORDS == 4
+
+#define SIMD_NAME "AVX2"
+#define SIMD_FUNC(name) name##_avx2
+
+#if defined(_MSC_VER)
+#define SIMD_TARGET
+#else
+#define SIMD_TARGET __attribute__((target("avx2")))
+#endif
+
+#define VEC_DECL(x) __m256i x
+#define VEC_LOAD(x, p) x = _mm256_loadu_si256((const __m256i *)(p))
+#define VEC_STORE(p, x) _mm256_storeu_si256((__m256i *)(p), x)
+#define VEC_XOR(x, y) x = _mm256_xor_si256(x, y)
+#define VEC_AND(x, y) x = _mm256_and_si256(x, y)
+#define VEC_ZERO(x) x = _mm256_setzero_si256()
+
+#include "lanczos_simd_core.h"
+
+#endif
+
+#endif /* HAS_LANCZOS_SIMD */
+
+/*-------------------------------------------------------------------*/
+const char * lanczos_simd_init(simd_kernels_t *simd, uint32 enable) {
+
+	memset(simd, 0, sizeof(simd_kernels_t));
+	if (!enable)
+		return "generic";
+
+#ifdef HAS_LANCZOS_SIMD
+	{
+		uint32 cpu_simd = get_cpu_simd();
+
+#if VWORDS == 4
+		if (cpu_simd & CPU_SIMD_AVX2) {
+			*simd = kernels_avx2;
+			return simd->name;
+		}
+#endif
+		if (cpu_simd & CPU_SIMD_SSE2) {
+			*simd = kernels_sse2;
+			return simd->name;
+		}
+	}
+#endif
+
+	return "generic";
+}
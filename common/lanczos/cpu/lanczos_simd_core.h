@@ -0,0 +1,333 @@
+/*--------------------------------------------------------------------
+This source distribution is placed in the public domain by its author,
+Jason Papadopoulos. You may use it for any purpose, free of charge,
+without having to notify anyone. I disclaim any responsibility for any
+errors.
+
+Optionally, please be nice and tell me if you find this source to be
+useful. Again optionally, if you add to the functionality present here
+please consider making those additions public too, so that others may
+benefit from your work.
+
+$Id$
+--------------------------------------------------------------------*/
+
+/* template for the SIMD versions of the innermost matrix
+   and vector loops. This is included once per instruction
+   set by lanczos_simd.c, which first defines
+
+   SIMD_NAME        the name of the instruction set
+   SIMD_FUNC(name)  the name of each routine for this set
+   SIMD_TARGET      compiler attribute enabling the set
+   VEC_DECL(x)      declare the register(s) holding one v_t
+   VEC_LOAD(x,p)    x = *p
+   VEC_STORE(p,x)   *p = x
+   VEC_XOR(x,y)     x ^= y
+   VEC_AND(x,y)     x &= y
+   VEC_ZERO(x)      x = 0
+
+   Every loop does each load-xor-store of the destination
+   before the next one starts, so repeated destinations
+   within an unrolled group still get the right answer */
+
+/*-------------------------------------------------------------------*/
+static SIMD_TARGET void SIMD_FUNC(mul_pairs)(entry_idx_t *entries,
+				uint32 num_entries,
+				v_t *curr_col, v_t *curr_b) {
+
+	uint32 i;
+	VEC_DECL(t);
+	VEC_DECL(u);
+
+	#define _txor(k) 					\
+		VEC_LOAD(t, curr_b + entries[i+k].row_off);	\
+		VEC_LOAD(u, curr_col + entries[i+k].col_off);	\
+		VEC_XOR(t, u);					\
+		VEC_STORE(curr_b + entries[i+k].row_off, t)
+
+	for (i = 0; i < (num_entries & (uint32)(~7)); i += 8) {
+		_txor(0); _txor(1); _txor(2); _txor(3);
+		_txor(4); _txor(5); _txor(6); _txor(7);
+	}
+	for (; i < num_entries; i++) {
+		_txor(0);
+	}
+	#undef _txor
+}
+
+/*-------------------------------------------------------------------*/
+static SIMD_TARGET void SIMD_FUNC(mul_trans_pairs)(entry_idx_t *entries,
+				uint32 num_entries,
+				v_t *curr_row, v_t *curr_b) {
+
+	uint32 i;
+	VEC_DECL(t);
+	VEC_DECL(u);
+
+	#define _txor(k) 					\
+		VEC_LOAD(t, curr_b + entries[i+k].col_off);	\
+		VEC_LOAD(u, curr_row + entries[i+k].row_off);	\
+		VEC_XOR(t, u);					\
+		VEC_STORE(curr_b + entries[i+k].col_off, t)
+
+	for (i = 0; i < (num_entries & (uint32)(~7)); i += 8) {
+		_txor(0); _txor(1); _txor(2); _txor(3);
+		_txor(4); _txor(5); _txor(6); _txor(7);
+	}
+	for (; i < num_entries; i++) {
+		_txor(0);
+	}
+	#undef _txor
+}
+
+/*-------------------------------------------------------------------*/
+static SIMD_TARGET void SIMD_FUNC(gather_runs)(uint16 *entries,
+				v_t *src, v_t *dst) {
+
+	VEC_DECL(acc0);
+	VEC_DECL(acc1);
+	VEC_DECL(t);
+
+	/* two accumulators, to halve the length of the
+	   dependency chain through the xors */
+
+	while (1) {
+		uint32 i;
+		uint32 line = entries[0];
+		uint32 count = entries[1];
+		uint16 *off = entries + 2;
+
+		if (count == 0)
+			break;
+
+		VEC_ZERO(acc0);
+		VEC_ZERO(acc1);
+		for (i = 0; i < (count & (uint32)(~3)); i += 4) {
+			VEC_LOAD(t, src + off[i+0]); VEC_XOR(acc0, t);
+			VEC_LOAD(t, src + off[i+1]); VEC_XOR(acc1, t);
+			VEC_LOAD(t, src + off[i+2]); VEC_XOR(acc0, t);
+			VEC_LOAD(t, src + off[i+3]); VEC_XOR(acc1, t);
+		}
+		for (; i < count; i++) {
+			VEC_LOAD(t, src + off[i]); VEC_XOR(acc0, t);
+		}
+
+		VEC_LOAD(t, dst + line);
+		VEC_XOR(acc0, acc1);
+		VEC_XOR(t, acc0);
+		VEC_STORE(dst + line, t);
+		entries += count + 2;
+	}
+}
+
+/*-------------------------------------------------------------------*/
+static SIMD_TARGET void SIMD_FUNC(scatter_runs)(uint16 *entries,
+				v_t *src, v_t *dst) {
+
+	VEC_DECL(s);
+	VEC_DECL(t);
+
+	while (1) {
+		uint32 i;
+		uint32 count = entries[1];
+		uint16 *off = entries + 2;
+
+		if (count == 0)
+			break;
+
+		VEC_LOAD(s, src + entries[0]);
+		for (i = 0; i < count; i++) {
+			VEC_LOAD(t, dst + off[i]);
+			VEC_XOR(t, s);
+			VEC_STORE(dst + off[i], t);
+		}
+		entries += count + 2;
+	}
+}
+
+/*-------------------------------------------------------------------*/
+static SIMD_TARGET void SIMD_FUNC(mul_delta)(uint16 *entries,
+				uint32 num_entries,
+				v_t *curr_col, v_t *curr_b) {
+
+	uint32 i;
+	uint32 col = 0;
+	uint8 *deltas = DELTA_BYTES(entries, num_entries);
+	uint16 *escapes = DELTA_ESCAPES(entries, num_entries);
+	VEC_DECL(t);
+	VEC_DECL(u);
+
+	for (i = 0; i < num_entries; i++) {
+		uint32 d = deltas[i];
+
+		if (d == DELTA_ESCAPE)
+			col = *escapes++;
+		else
+			col += d;
+
+		VEC_LOAD(t, curr_b + entries[i]);
+		VEC_LOAD(u, curr_col + col);
+		VEC_XOR(t, u);
+		VEC_STORE(curr_b + entries[i], t);
+	}
+}
+
+/*-------------------------------------------------------------------*/
+static SIMD_TARGET void SIMD_FUNC(mul_trans_delta)(uint16 *entries,
+				uint32 num_entries,
+				v_t *curr_row, v_t *curr_b) {
+
+	uint32 i;
+	uint32 col = 0;
+	uint8 *deltas = DELTA_BYTES(entries, num_entries);
+	uint16 *escapes = DELTA_ESCAPES(entries, num_entries);
+	VEC_DECL(t);
+	VEC_DECL(u);
+
+	for (i = 0; i < num_entries; i++) {
+		uint32 d = deltas[i];
+
+		if (d == DELTA_ESCAPE)
+			col = *escapes++;
+		else
+			col += d;
+
+		VEC_LOAD(t, curr_b + col);
+		VEC_LOAD(u, curr_row + entries[i]);
+		VEC_XOR(t, u);
+		VEC_STORE(curr_b + col, t);
+	}
+}
+
+/*-------------------------------------------------------------------*/
+static SIMD_TARGET void SIMD_FUNC(NxB_BxB_acc)(v_t *v, v_t *c,
+				v_t *y, uint32 n) {
+
+	uint32 i, j, k;
+	VEC_DECL(acc0);
+	VEC_DECL(acc1);
+	VEC_DECL(t);
+
+	/* y[i] ^= the xor of one table entry for each byte
+	   of v[i]; the tables for the 8*VWORDS bytes are laid
+	   out one after the other, 256 entries each */
+
+	for (i = 0; i < n; i++) {
+		v_t vi = v[i];
+		v_t *cj = c;
+
+		VEC_ZERO(acc0);
+		VEC_ZERO(acc1);
+		for (j = 0; j < VWORDS; j++) {
+			uint64 w = vi.w[j];
+
+			for (k = 0; k < 8; k += 2, cj += 2 * 256) {
+				VEC_LOAD(t, cj + (uint8)(w >> (8 * k)));
+				VEC_XOR(acc0, t);
+				VEC_LOAD(t, cj + 256 + (uint8)(w >> (8 * k + 8)));
+				VEC_XOR(acc1, t);
+			}
+		}
+
+		VEC_LOAD(t, y + i);
+		VEC_XOR(acc0, acc1);
+		VEC_XOR(t, acc0);
+		VEC_STORE(y + i, t);
+	}
+}
+
+/*-------------------------------------------------------------------*/
+static SIMD_TARGET void SIMD_FUNC(BxN_NxB)(v_t *x, v_t *c,
+				v_t *y, uint32 n) {
+
+	uint32 i, j, k;
+	VEC_DECL(s);
+	VEC_DECL(t);
+
+	/* the transpose of the above: for each byte of x[i],
+	   xor y[i] into the matching entry of that byte's table */
+
+	for (i = 0; i < n; i++) {
+		v_t xi = x[i];
+		v_t *cj = c;
+
+		VEC_LOAD(s, y + i);
+		for (j = 0; j < VWORDS; j++) {
+			uint64 w = xi.w[j];
+
+			for (k = 0; k < 8; k++, cj += 256) {
+				v_t *e = cj + (uint8)(w >> (8 * k));
+
+				VEC_LOAD(t, e);
+				VEC_XOR(t, s);
+				VEC_STORE(e, t);
+			}
+		}
+	}
+}
+
+/*-------------------------------------------------------------------*/
+static SIMD_TARGET void SIMD_FUNC(vxor)(v_t *dest, v_t *src, uint32 n) {
+
+	uint32 i;
+	VEC_DECL(t0);
+	VEC_DECL(t1);
+	VEC_DECL(u0);
+	VEC_DECL(u1);
+
+	for (i = 0; i < (n & ~1); i += 2) {
+		VEC_LOAD(t0, dest + i);
+		VEC_LOAD(t1, dest + i + 1);
+		VEC_LOAD(u0, src + i);
+		VEC_LOAD(u1, src + i + 1);
+		VEC_XOR(t0, u0);
+		VEC_XOR(t1, u1);
+		VEC_STORE(dest + i, t0);
+		VEC_STORE(dest + i + 1, t1);
+	}
+	if (i < n) {
+		VEC_LOAD(t0, dest + i);
+		VEC_LOAD(u0, src + i);
+		VEC_XOR(t0, u0);
+		VEC_STORE(dest + i, t0);
+	}
+}
+
+/*-------------------------------------------------------------------*/
+static SIMD_TARGET void SIMD_FUNC(vmask)(v_t *v, v_t mask, uint32 n) {
+
+	uint32 i;
+	VEC_DECL(m);
+	VEC_DECL(t0);
+	VEC_DECL(t1);
+
+	VEC_LOAD(m, &mask);
+	for (i = 0; i < (n & ~1); i += 2) {
+		VEC_LOAD(t0, v + i);
+		VEC_LOAD(t1, v + i + 1);
+		VEC_AND(t0, m);
+		VEC_AND(t1, m);
+		VEC_STORE(v + i, t0);
+		VEC_STORE(v + i + 1, t1);
+	}
+	if (i < n) {
+		VEC_LOAD(t0, v + i);
+		VEC_AND(t0, m);
+		VEC_STORE(v + i, t0);
+	}
+}
+
+/*-------------------------------------------------------------------*/
+static const simd_kernels_t SIMD_FUNC(kernels) = {
+	SIMD_NAME,
+	SIMD_FUNC(mul_pairs),
+	SIMD_FUNC(mul_trans_pairs),
+	SIMD_FUNC(gather_runs),
+	SIMD_FUNC(scatter_runs),
+	SIMD_FUNC(mul_delta),
+	SIMD_FUNC(mul_trans_delta),
+	SIMD_FUNC(NxB_BxB_acc),
+	SIMD_FUNC(BxN_NxB),
+	SIMD_FUNC(vxor),
+	SIMD_FUNC(vmask)
+};
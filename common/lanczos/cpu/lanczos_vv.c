@@ -45,12 +45,23 @@ void vv_clear(void *v, uint32 n) {
 	memset(v, 0, n * sizeof(v_t));
 }
 
-void vv_xor(void *dest_in, void *src_in, uint32 n) {
+void vv_xor(packed_matrix_t *A, void *dest_in, void *src_in, uint32 n) {
 
 	v_t *src = (v_t *)src_in;
 	v_t *dest = (v_t *)dest_in;
 	uint32 i;
 
+#ifdef HAS_LANCZOS_SIMD
+	cpudata_t *c = (cpudata_t *)A->extra;
+
+	if (c->simd.vxor) {
+		c->simd.vxor(dest, src, n);
+		return;
+	}
+#else
+	(void)A;
+#endif
+
 	for (i = 0; i < (n & ~7); i += 8) {
 		dest[i + 0] = v_xor(dest[i + 0], src[i + 0]);
 		dest[i + 1] = v_xor(dest[i + 1], src[i + 1]);
@@ -65,11 +76,22 @@ void vv_xor(void *dest_in, void *src_in, uint32 n) {
 		dest[i] = v_xor(dest[i], src[i]);
 }
 
-void vv_mask(void *v_in, v_t mask, uint32 n) {
+void vv_mask(packed_matrix_t *A, void *v_in, v_t mask, uint32 n) {
 
 	v_t *v = (v_t *)v_in;
 	uint32 i;
 
+#ifdef HAS_LANCZOS_SIMD
+	cpudata_t *c = (cpudata_t *)A->extra;
+
+	if (c->simd.vmask) {
+		c->simd.vmask(v, mask, n);
+		return;
+	}
+#else
+	(void)A;
+#endif
+
 	for (i = 0; i < (n & ~7); i += 8) {
 		v[i + 0] = v_and(v[i + 0], mask);
 		v[i + 1] = v_and(v[i + 1], mask);
@@ -85,10 +107,20 @@ void vv_mask(void *v_in, v_t mask, uint32 n) {
 }
 
 /*-------------------------------------------------------------------*/
-static void core_NxB_BxB_acc(v_t *v, v_t *c, v_t *y, uint32 n) {
+static void core_NxB_BxB_acc(simd_kernels_t *simd, 
+				v_t *v, v_t *c, v_t *y, uint32 n) {
 
 	uint32 i;
 
+#ifdef HAS_LANCZOS_SIMD
+	if (simd->NxB_BxB_acc) {
+		simd->NxB_BxB_acc(v, c, y, n);
+		return;
+	}
+#else
+	(void)simd;
+#endif
+
 #if defined(GCC_ASM32A) && defined(HAS_MMX) && defined(NDEBUG) && VWORDS == 1
 	i = 0;
 	ASM_G volatile(
@@ -291,7 +323,8 @@ static void mul_NxB_BxB_precomp(v_t *c, v_t *x) {
 }
 
 /*-------------------------------------------------------------------*/
-void mul_NxB_BxB_acc(v_t *v, v_t *x, v_t *y, uint32 n) {
+void mul_NxB_BxB_acc(simd_kernels_t *simd, 
+			v_t *v, v_t *x, v_t *y, uint32 n) {
 
 	/* let v[][] be a N x B matrix with elements in GF(2), 
 	   represented as an array of n v_t structures. Let c[][]
@@ -303,7 +336,7 @@ void mul_NxB_BxB_acc(v_t *v, v_t *x, v_t *y, uint32 n) {
 
 	mul_NxB_BxB_precomp(c, x);
 
-	core_NxB_BxB_acc(v, c, y, n);
+	core_NxB_BxB_acc(simd, v, c, y, n);
 }
 
 /*-------------------------------------------------------------------*/
@@ -314,7 +347,7 @@ static void outer_thread_run(void *data, int thread_num)
 	cpudata_t *cpudata = (cpudata_t *)p->extra;
 	thread_data_t *t = cpudata->thread_data + task->task_num;
 
-	core_NxB_BxB_acc(t->x, t->b, t->y, t->vsize);
+	core_NxB_BxB_acc(&cpudata->simd, t->x, t->b, t->y, t->vsize);
 }
 
 void vv_mul_NxB_BxB_acc(packed_matrix_t *matrix, 
@@ -329,6 +362,7 @@ void vv_mul_NxB_BxB_acc(packed_matrix_t *matrix,
 	uint32 vsize = n / matrix->num_threads;
 	uint32 off;
 	task_control_t task = {NULL, NULL, NULL, NULL};
+	uint64 prof_start = la_prof_start(matrix);
 
 	mul_NxB_BxB_precomp(c, x);
 
@@ -355,15 +389,30 @@ void vv_mul_NxB_BxB_acc(packed_matrix_t *matrix,
 
 	if (i > 0)
 		threadpool_drain(cpudata->threadpool, 1);
+
+	/* reads v, reads and writes y */
+
+	la_prof_end(matrix, LA_PROF_OUTER, prof_start,
+			3 * (uint64)n * sizeof(v_t));
 }
 
 /*-------------------------------------------------------------------*/
-static void core_BxN_NxB(v_t *x, v_t *c, v_t *y, uint32 n) {
+static void core_BxN_NxB(simd_kernels_t *simd, 
+			v_t *x, v_t *c, v_t *y, uint32 n) {
 
 	uint32 i;
 
 	memset(c, 0, 8 * VWORDS * 256 * sizeof(v_t));
 
+#ifdef HAS_LANCZOS_SIMD
+	if (simd->BxN_NxB) {
+		simd->BxN_NxB(x, c, y, n);
+		return;
+	}
+#else
+	(void)simd;
+#endif
+
 #if defined(GCC_ASM32A) && defined(HAS_MMX) && defined(NDEBUG) && VWORDS == 1
 	i = 0;
 	ASM_G volatile(
@@ -533,14 +582,15 @@ static void mul_BxN_NxB_postproc(v_t *c, v_t *xy) {
 }
 
 /*-------------------------------------------------------------------*/
-void mul_BxN_NxB(v_t *x, v_t *y, v_t *xy, uint32 n) {
+void mul_BxN_NxB(simd_kernels_t *simd, 
+			v_t *x, v_t *y, v_t *xy, uint32 n) {
 
 	/* Let x and y be N x B matrices. This routine computes
 	   the B x B matrix xy[][] given by transpose(x) * y */
 
 	v_t c[8 * VWORDS * 256];
 
-	core_BxN_NxB(x, c, y, n);
+	core_BxN_NxB(simd, x, c, y, n);
 
 	mul_BxN_NxB_postproc(c, xy);
 }
@@ -553,7 +603,7 @@ static void inner_thread_run(void *data, int thread_num)
 	cpudata_t *cpudata = (cpudata_t *)p->extra;
 	thread_data_t *t = cpudata->thread_data + task->task_num;
 
-	mul_BxN_NxB(t->x, t->y, t->tmp_b, t->vsize);
+	mul_BxN_NxB(&cpudata->simd, t->x, t->y, t->tmp_b, t->vsize);
 }
 
 void vv_mul_BxN_NxB(packed_matrix_t *matrix,
@@ -568,6 +618,7 @@ void vv_mul_BxN_NxB(packed_matrix_t *matrix,
 	uint32 vsize = n / matrix->num_threads;
 	uint32 off;
 	task_control_t task = {NULL, NULL, NULL, NULL};
+	uint64 prof_start = la_prof_start(matrix);
 #ifdef HAVE_MPI
 	v_t xytmp[VBITS];
 #endif
@@ -603,21 +654,26 @@ void vv_mul_BxN_NxB(packed_matrix_t *matrix,
 		for (i = 0; i < matrix->num_threads - 1; i++) {
 			thread_data_t *t = cpudata->thread_data + i;
 
-			vv_xor(xy, t->tmp_b, VBITS);
+			vv_xor(matrix, xy, t->tmp_b, VBITS);
 		}
 	}
 
 #ifdef HAVE_MPI
 	/* combine the results across an entire MPI row */
 
-	global_xor(xy, xytmp, VBITS, matrix->mpi_ncols,
+	global_xor(matrix, xy, xytmp, VBITS, matrix->mpi_ncols,
 			matrix->mpi_la_col_rank,
 			matrix->mpi_la_row_grid);
 
 	/* combine the results across an entire MPI column */
     
-	global_xor(xytmp, xy, VBITS, matrix->mpi_nrows,
+	global_xor(matrix, xytmp, xy, VBITS, matrix->mpi_nrows,
 			matrix->mpi_la_row_rank,
 			matrix->mpi_la_col_grid);    
 #endif
+
+	/* reads x and y */
+
+	la_prof_end(matrix, LA_PROF_INNER, prof_start,
+			2 * (uint64)n * sizeof(v_t));
 }
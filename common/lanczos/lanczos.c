@@ -433,7 +433,7 @@ static uint32 combine_cols(uint32 ncols,
 	   back into x[] and represent the nullspace vector output
 	   of the block Lanczos code. */
 
-	uint32 i, j, k, bitpos, col, col_words;
+	uint32 i, j, k, bitpos, col, col_words, num_deps;
 	uint64 mask;
 	uint64 *matrix[2*VBITS], *amatrix[2*VBITS], *tmp;
 
@@ -501,7 +501,25 @@ static uint32 combine_cols(uint32 ncols,
 		i++;
 	}
 
-	/* transpose rows i to VBITS back into x[]. Pack the
+	/* rows of matrix[][] that are all zero are trivial 
+	   dependencies (block Wiedemann produces these when
+	   some of its output vectors are zero); move the rest
+	   of rows i to VBITS in front of them */
+
+	for (j = num_deps = i; j < VBITS; j++) {
+		for (k = 0; k < col_words; k++) {
+			if (matrix[j][k])
+				break;
+		}
+		if (k < col_words) {
+			tmp = matrix[num_deps];
+			matrix[num_deps] = matrix[j];
+			matrix[j] = tmp;
+			num_deps++;
+		}
+	}
+
+	/* transpose those rows back into x[]. Pack the
 	   dependencies into the low-order bits of x[] */
 
 	for (j = 0; j < ncols; j++) {
@@ -510,7 +528,7 @@ static uint32 combine_cols(uint32 ncols,
 		col = j / 64;
 		mask = bitmask[j % 64].w[0];
 
-		for (k = i; k < VBITS; k++) {
+		for (k = i; k < num_deps; k++) {
 			if (matrix[k][col] & mask) {
 				word = v_or(word, bitmask[k - i]);
 			}
@@ -525,7 +543,7 @@ static uint32 combine_cols(uint32 ncols,
 
 	if (i > VBITS)
 		return 0;
-	return VBITS - i;
+	return num_deps - i;
 }
 
 /*-----------------------------------------------------------------------*/
@@ -592,241 +610,131 @@ static v_t * gather_nrows(msieve_obj *obj,
 	return out;
 }
 
-/*-----------------------------------------------------------------------*/
-static void scatter_ncols(msieve_obj *obj,
-			packed_matrix_t *packed_matrix,
-			void *out, void *scratch, 
-			v_t *in) {
-
-	/* push out to the top MPI row */
-
-	if (obj->mpi_la_row_rank == 0)
-		MPI_TRY(MPI_Scatterv(in, packed_matrix->col_counts,
-				packed_matrix->col_offsets, 
-				MPI_LONG_LONG, scratch,
-				VWORDS * packed_matrix->ncols,
-				MPI_LONG_LONG, 0, 
-				obj->mpi_la_row_grid))
-
-	/* push down each column */
-
-	MPI_TRY(MPI_Scatterv(scratch, packed_matrix->subcol_counts,
-	       			packed_matrix->subcol_offsets, 
-	      			MPI_LONG_LONG, out,
-				VWORDS * packed_matrix->ncols,
-	   			MPI_LONG_LONG, 0, 
-       				obj->mpi_la_col_grid))
-}
 #endif
 
 /*-----------------------------------------------------------------------*/
-static void dump_lanczos_state(msieve_obj *obj, 
-			packed_matrix_t *packed_matrix,
-			void *x, v_t **vt_v0, void **v, void *v0,
-			v_t **vt_a_v, v_t **vt_a2_v, v_t **winv,
-			uint32 n, uint32 max_n, uint32 dim_solved, uint32 iter,
-			uint32 s[2][VBITS], uint32 dim1, void *scratch) {
-
-	uint32 vbits = VBITS;
-	char buf[256];
-	char buf_old[256];
-	char buf_bak[256];
-	FILE *fp;
-	uint32 status = 1;
-	v_t *tmp = NULL;
-
-	MPI_NODE_0_START
+static v_t * combine_nullspace(msieve_obj *obj,
+				packed_matrix_t *packed_matrix,
+				v_t *post_lanczos_matrix,
+				void *x, void *v,
+				uint32 *num_deps_found) {
 
-	sprintf(buf, "%s.chk0", obj->savefile.name);
-	sprintf(buf_old, "%s.chk", obj->savefile.name);
-	sprintf(buf_bak, "%s.bak.chk", obj->savefile.name);
-	fp = fopen(buf, "wb");
-	if (fp == NULL) {
-		printf("error: cannot open matrix checkpoint file\n");
-		exit(-1);
-	}
+	/* convert the output of a solver to an actual collection
+	   of nullspace vectors. x and v are blocks of vectors that
+	   are mostly in the nullspace of B'B; block Lanczos produces
+	   both, block Wiedemann only x and sets v to NULL. Both
+	   blocks are freed here. Begin by multiplying them by B */
 
-	status &= (fwrite(&max_n, sizeof(uint32), (size_t)1, fp) == 1);
-	status &= (fwrite(&dim_solved, sizeof(uint32), (size_t)1, fp) == 1);
-	status &= (fwrite(&iter, sizeof(uint32), (size_t)1, fp) == 1);
-	status &= (fwrite(&vbits, sizeof(uint32), (size_t)1, fp) == 1);
-
-	status &= (fwrite(vt_a_v[1], sizeof(v_t), (size_t)VBITS, fp) == VBITS);
-	status &= (fwrite(vt_a2_v[1], sizeof(v_t), (size_t)VBITS, fp) == VBITS);
-	status &= (fwrite(winv[1], sizeof(v_t), (size_t)VBITS, fp) == VBITS);
-	status &= (fwrite(winv[2], sizeof(v_t), (size_t)VBITS, fp) == VBITS);
-	status &= (fwrite(vt_v0[0], sizeof(v_t), (size_t)VBITS, fp) == VBITS);
-	status &= (fwrite(vt_v0[1], sizeof(v_t), (size_t)VBITS, fp) == VBITS);
-	status &= (fwrite(vt_v0[2], sizeof(v_t), (size_t)VBITS, fp) == VBITS);
-	status &= (fwrite(s[1], sizeof(uint32), (size_t)VBITS, fp) == VBITS);
-	status &= (fwrite(&dim1, sizeof(uint32), (size_t)1, fp) == 1);
-	tmp = (v_t *)aligned_malloc(max_n * sizeof(v_t), 64);
-	MPI_NODE_0_END
+	uint32 i;
+	uint32 max_n = packed_matrix->max_ncols;
+	v_t *out0, *out1, *out2, *out3;
 
 #ifdef HAVE_MPI
-	tmp = gather_ncols(obj, packed_matrix, x, scratch, tmp);
-	MPI_NODE_0_START
-	status &= (fwrite(tmp, sizeof(v_t), (size_t)max_n, fp) == max_n);
-	MPI_NODE_0_END
+	/* pull the result vectors into rank 0 */
 
-	tmp = gather_ncols(obj, packed_matrix, v[0], scratch, tmp);
-	MPI_NODE_0_START
-	status &= (fwrite(tmp, sizeof(v_t), (size_t)max_n, fp) == max_n);
-	MPI_NODE_0_END
+	void *scratch = vv_alloc(2 * MAX(packed_matrix->nrows, 
+					packed_matrix->ncols),
+				packed_matrix->extra);
 
-	tmp = gather_ncols(obj, packed_matrix, v[1], scratch, tmp);
-	MPI_NODE_0_START
-	status &= (fwrite(tmp, sizeof(v_t), (size_t)max_n, fp) == max_n);
-	MPI_NODE_0_END
+	mul_MxN_NxB(packed_matrix, x, scratch);
 
-	tmp = gather_ncols(obj, packed_matrix, v[2], scratch, tmp);
-	MPI_NODE_0_START
-	status &= (fwrite(tmp, sizeof(v_t), (size_t)max_n, fp) == max_n);
-	MPI_NODE_0_END
+	out2 = gather_nrows(obj, packed_matrix, scratch, NULL);
+	out0 = gather_ncols(obj, packed_matrix, x, scratch, NULL);
+	vv_free(x);
+    
+	out1 = out3 = NULL;
+	if (v != NULL) {
+		mul_MxN_NxB(packed_matrix, v, scratch);
 
-	tmp = gather_ncols(obj, packed_matrix, v0, scratch, tmp);
-	MPI_NODE_0_START
-	status &= (fwrite(tmp, sizeof(v_t), (size_t)max_n, fp) == max_n);
-	MPI_NODE_0_END
+		out3 = gather_nrows(obj, packed_matrix, scratch, NULL);
+		out1 = gather_ncols(obj, packed_matrix, v, scratch, NULL);
+		vv_free(v);
+	}
+    
+	vv_free(scratch);
 #else
-	vv_copyout(tmp, x, max_n);
-	status &= (fwrite(tmp, sizeof(v_t), (size_t)max_n, fp) == max_n);
+	void *scratch = vv_alloc(max_n, packed_matrix->extra);
 
-	vv_copyout(tmp, v[0], max_n);
-	status &= (fwrite(tmp, sizeof(v_t), (size_t)max_n, fp) == max_n);
+	mul_MxN_NxB(packed_matrix, x, scratch);
 
-	vv_copyout(tmp, v[1], max_n);
-	status &= (fwrite(tmp, sizeof(v_t), (size_t)max_n, fp) == max_n);
+	out0 = (v_t *)aligned_malloc(max_n * sizeof(v_t), 64);
+	vv_copyout(out0, x, max_n);
+	vv_free(x);
 
-	vv_copyout(tmp, v[2], max_n);
-	status &= (fwrite(tmp, sizeof(v_t), (size_t)max_n, fp) == max_n);
+	out2 = (v_t *)aligned_malloc(max_n * sizeof(v_t), 64);
+	vv_copyout(out2, scratch, max_n);
 
-	vv_copyout(tmp, v0, max_n);
-	status &= (fwrite(tmp, sizeof(v_t), (size_t)max_n, fp) == max_n);
-#endif
+	out1 = out3 = NULL;
+	if (v != NULL) {
+		mul_MxN_NxB(packed_matrix, v, scratch);
 
-	MPI_NODE_0_START
-	aligned_free(tmp);
-	fclose(fp);
+		out1 = (v_t *)aligned_malloc(max_n * sizeof(v_t), 64);
+		vv_copyout(out1, v, max_n);
+		vv_free(v);
 
-	/* only delete an old checkpoint file if the current 
-	   checkpoint completed writing. More paranoid: compute a 
-	   cryptographic hash of the file and then verify against 
-	   the disk image */
-
-	if (status == 0) {
-		printf("error: cannot write new checkpoint file\n");
-		printf("error: previous checkpoint file not overwritten\n");
-		exit(-1);
-	}
-	remove(buf_bak);
-	rename(buf_old, buf_bak);
-	if (rename(buf, buf_old)) {
-		printf("error: cannot update checkpoint file\n");
-		exit(-1);
+		out3 = (v_t *)aligned_malloc(max_n * sizeof(v_t), 64);
+		vv_copyout(out3, scratch, max_n);
 	}
+	vv_free(scratch);
+#endif
 
-	MPI_NODE_0_END
-}
+	MPI_NODE_0_START
 
-/*-----------------------------------------------------------------------*/
-static void read_lanczos_state(msieve_obj *obj, 
-			packed_matrix_t *packed_matrix,
-			void *x, v_t **vt_v0, void **v, void *v0,
-			v_t **vt_a_v, v_t **vt_a2_v, v_t **winv,
-			uint32 n, uint32 max_n, uint32 *dim_solved, 
-			uint32 *iter, uint32 s[2][VBITS], uint32 *dim1,
-			void *scratch) {
-
-	uint32 read_n;
-	uint32 status;
-	char buf[256];
-	FILE *fp;
-	v_t *tmp = NULL;
-	uint32 vbits = 0;
-
-	sprintf(buf, "%s.chk", obj->savefile.name);
-	fp = fopen(buf, "rb");
-	if (fp == NULL) {
-		printf("error: cannot open matrix checkpoint file\n");
-		exit(-1);
-	}
+	/* a missing second block is all zero, and contributes
+	   nothing to the dependencies found below */
 
-	status = 1;
-	fread(&read_n, sizeof(uint32), (size_t)1, fp);
-	if (read_n != max_n) {
-		printf("error: unexpected vector size\n");
-		exit(-1);
+	if (out1 == NULL) {
+		out1 = (v_t *)aligned_malloc(max_n * sizeof(v_t), 64);
+		out3 = (v_t *)aligned_malloc(max_n * sizeof(v_t), 64);
+		memset(out1, 0, max_n * sizeof(v_t));
+		memset(out3, 0, max_n * sizeof(v_t));
 	}
-	status &= (fread(dim_solved, sizeof(uint32), (size_t)1, fp) == 1);
-	status &= (fread(iter, sizeof(uint32), (size_t)1, fp) == 1);
-	status &= (fread(&vbits, sizeof(uint32), (size_t)1, fp) == 1);
-	if (vbits != VBITS) {
-		printf("error: vector length mismatch\n");
-		exit(-1);
-	}
-
-	status &= (fread(vt_a_v[1], sizeof(v_t), (size_t)VBITS, fp) == VBITS);
-	status &= (fread(vt_a2_v[1], sizeof(v_t), (size_t)VBITS, fp)== VBITS);
-	status &= (fread(winv[1], sizeof(v_t), (size_t)VBITS, fp) == VBITS);
-	status &= (fread(winv[2], sizeof(v_t), (size_t)VBITS, fp) == VBITS);
-	status &= (fread(vt_v0[0], sizeof(v_t), (size_t)VBITS, fp) == VBITS);
-	status &= (fread(vt_v0[1], sizeof(v_t), (size_t)VBITS, fp) == VBITS);
-	status &= (fread(vt_v0[2], sizeof(v_t), (size_t)VBITS, fp) == VBITS);
-	status &= (fread(s[1], sizeof(uint32), (size_t)VBITS, fp) == VBITS);
-	status &= (fread(dim1, sizeof(uint32), (size_t)1, fp) == 1);
+        
+	/* make sure the last few words of the above matrix products
+	   are zero, since the postprocessing will be using them */
 
-#ifdef HAVE_MPI
-	MPI_NODE_0_START
-	tmp = (v_t *)xmalloc(max_n * sizeof(v_t));
-	status &= (fread(tmp, sizeof(v_t), (size_t)max_n, fp) == max_n);
-	MPI_NODE_0_END
-	scatter_ncols(obj, packed_matrix, x, scratch, tmp);
+	for (i = packed_matrix->max_nrows; 
+			i < packed_matrix->max_ncols; i++) {
+		out2[i] = out3[i] = v_zero;
+	}
 
-	MPI_NODE_0_START
-	status &= (fread(tmp, sizeof(v_t), (size_t)max_n, fp) == max_n);
-	MPI_NODE_0_END
-	scatter_ncols(obj, packed_matrix, v[0], scratch, tmp);
+	/* if necessary, add in the contribution of the
+	   first few rows that were originally in B. We 
+	   expect there to be about VBITS - POST_LANCZOS_ROWS 
+	   bit vectors that are in the nullspace of B and
+	   post_lanczos_matrix simultaneously */
 
-	MPI_NODE_0_START
-	status &= (fread(tmp, sizeof(v_t), (size_t)max_n, fp) == max_n);
-	MPI_NODE_0_END
-	scatter_ncols(obj, packed_matrix, v[1], scratch, tmp);
+	if (post_lanczos_matrix) {
+		for (i = 0; i < POST_LANCZOS_ROWS; i++) {
+			v_t accum0 = v_zero;
+			v_t accum1 = v_zero;
+			uint32 j;
+			for (j = 0; j < max_n; j++) {
+				if (v_bitset(post_lanczos_matrix[j], i)) {
+					accum0 = v_xor(accum0, out0[j]);
+					accum1 = v_xor(accum1, out1[j]);
+				}
+			}
+			out2[i] = v_xor(out2[i], accum0);
+			out3[i] = v_xor(out3[i], accum1);
+		}
+	}
 
-	MPI_NODE_0_START
-	status &= (fread(tmp, sizeof(v_t), (size_t)max_n, fp) == max_n);
-	MPI_NODE_0_END
-	scatter_ncols(obj, packed_matrix, v[2], scratch, tmp);
+	*num_deps_found = combine_cols(max_n, out0, out1, out2, out3);
 
-	MPI_NODE_0_START
-	status &= (fread(tmp, sizeof(v_t), (size_t)max_n, fp) == max_n);
 	MPI_NODE_0_END
-	scatter_ncols(obj, packed_matrix, v0, scratch, tmp);
-#else
-	tmp = (v_t *)xmalloc(max_n * sizeof(v_t));
-
-	status &= (fread(tmp, sizeof(v_t), (size_t)max_n, fp) == max_n);
-	vv_copyin(x, tmp, max_n);
-
-	status &= (fread(tmp, sizeof(v_t), (size_t)max_n, fp) == max_n);
-	vv_copyin(v[0], tmp, max_n);
-
-	status &= (fread(tmp, sizeof(v_t), (size_t)max_n, fp) == max_n);
-	vv_copyin(v[1], tmp, max_n);
-
-	status &= (fread(tmp, sizeof(v_t), (size_t)max_n, fp) == max_n);
-	vv_copyin(v[2], tmp, max_n);
 
-	status &= (fread(tmp, sizeof(v_t), (size_t)max_n, fp) == max_n);
-	vv_copyin(v0, tmp, max_n);
-#endif
-	free(tmp);
+	aligned_free(out1);
+	aligned_free(out2);
+	aligned_free(out3);
 
-	fclose(fp);
-	if (status == 0) {
-		printf("error: checkpoint recovery failed\n");
-		exit(-1);
-	}
+	if (*num_deps_found == 0)
+		logprintf(obj, "lanczos error: only trivial "
+				"dependencies found\n");
+	else
+		logprintf(obj, "recovered %u nontrivial dependencies\n", 
+				*num_deps_found);
+	return out0;
 }
 
 /*-----------------------------------------------------------------------*/
@@ -882,7 +790,8 @@ static v_t * block_lanczos_core(msieve_obj *obj,
 				packed_matrix_t *packed_matrix,
 				uint32 *num_deps_found,
 				v_t *post_lanczos_matrix,
-				uint32 dump_interval) {
+				uint32 dump_interval,
+				uint64 fingerprint) {
 	
 	/* Solve Bx = 0 for some nonzero x; the computed
 	   solution, containing up to 64 of these nullspace
@@ -891,7 +800,6 @@ static v_t * block_lanczos_core(msieve_obj *obj,
 	uint32 n = packed_matrix->ncols;
 	uint32 max_n = packed_matrix->max_ncols;
 	void *vnext, *v[3], *x, *v0, *scratch, *tmp;
-	v_t *out0, *out1, *out2, *out3;
 	v_t *winv[3], *vt_v0_next;
 	v_t *vt_a_v[2], *vt_a2_v[2], *vt_v0[3];
 	uint32 s[2][VBITS];
@@ -909,7 +817,9 @@ static v_t * block_lanczos_core(msieve_obj *obj,
 	uint32 log_eta_once = 0;
 	uint32 next_check = 0;
 	uint32 next_dump = 0;
+	struct lanczos_chk *chk = NULL;
 	time_t first_time;
+	uint64 prof_start;
 
 	if (packed_matrix->num_threads > 1)
 		logprintf(obj, "commencing Lanczos iteration (%u threads)\n",
@@ -964,10 +874,10 @@ static v_t * block_lanczos_core(msieve_obj *obj,
 	dim0 = 0;
 
 	if (obj->flags & MSIEVE_FLAG_NFS_LA_RESTART) {
-		read_lanczos_state(obj, packed_matrix, 
-				x, vt_v0, v, v0, vt_a_v, vt_a2_v,
-				winv, packed_matrix->ncols, max_n, 
-				&dim_solved, &iter, s, &dim1, scratch);
+		lanczos_chk_read(obj, n, max_n, fingerprint,
+				x, vt_v0, v, v0, 
+				vt_a_v, vt_a2_v, winv, 
+				&dim_solved, &iter, s, &dim1);
 		logprintf(obj, "restarting at iteration %u (dim = %u)\n",
 				iter, dim_solved);
 	}
@@ -1001,6 +911,8 @@ static v_t * block_lanczos_core(msieve_obj *obj,
 	}
 
 	if (dump_interval) {
+		chk = lanczos_chk_init(obj, n, max_n, fingerprint);
+
 		/* avoid check (at dump) within the next few iterations */
 		next_dump = ((dim_solved + 6 * VBITS) / dump_interval + 1) * 
 					dump_interval;
@@ -1014,6 +926,7 @@ static v_t * block_lanczos_core(msieve_obj *obj,
 
 	while (1) {
 		iter++;
+		la_prof_iter(obj, packed_matrix, iter);
 
 		/* multiply the current v[0] by the matrix and write
 		   to vnext */
@@ -1081,7 +994,10 @@ static v_t * block_lanczos_core(msieve_obj *obj,
 
 		dim_solved += dim0;
 		if (!v_is_all_ones(mask0)) {
-			vv_mask(vnext, mask0, n);
+			prof_start = la_prof_start(packed_matrix);
+			vv_mask(packed_matrix, vnext, mask0, n);
+			la_prof_end(packed_matrix, LA_PROF_VECTOR, 
+					prof_start, 2 * (uint64)n * sizeof(v_t));
 		}
 
 		/* begin the computation of the next v' * v0. For 
@@ -1113,6 +1029,7 @@ static v_t * block_lanczos_core(msieve_obj *obj,
 #endif
 		    dim_solved >= next_dump)) {
 
+			prof_start = la_prof_start(packed_matrix);
 			vv_mul_BxN_NxB(packed_matrix, v0, vnext, d, n);
 			for (i = 0; i < VBITS; i++) {
 				if (!v_is_all_zeros(d[i])) {
@@ -1134,6 +1051,8 @@ static v_t * block_lanczos_core(msieve_obj *obj,
 			next_check = ((dim_solved + 6 * VBITS) / 
 					check_interval + 1) * check_interval;
 			vv_copy(v0, vnext, n);
+			la_prof_end(packed_matrix, LA_PROF_CHECK, 
+					prof_start, 2 * (uint64)n * sizeof(v_t));
 		}
 
 		/* compute d, fold it into vnext and update v'*v0 */
@@ -1324,11 +1243,12 @@ static v_t * block_lanczos_core(msieve_obj *obj,
 #endif
 			    dim_solved >= next_dump) {
 
-				dump_lanczos_state(obj, packed_matrix, 
-						   x, vt_v0, v, v0, 
+				prof_start = la_prof_start(packed_matrix);
+				lanczos_chk_write(chk, x, vt_v0, v, v0, 
 						   vt_a_v, vt_a2_v, winv, 
-						   n, max_n, dim_solved, 
-						   iter, s, dim1, scratch);
+						   dim_solved, iter, s, dim1);
+				la_prof_end(packed_matrix, LA_PROF_CHECK, 
+					prof_start, 10 * (uint64)n * sizeof(v_t));
 				next_dump = ((dim_solved + 6 * VBITS) / dump_interval + 1) * 
 							dump_interval;
 			}
@@ -1345,6 +1265,14 @@ static v_t * block_lanczos_core(msieve_obj *obj,
 
 	logprintf(obj, "lanczos halted after %u iterations (dim = %u)\n", 
 					iter, dim_solved);
+	la_prof_report(obj, packed_matrix, iter);
+#ifdef HAVE_MPI
+	mul_report_mpi_time(obj, packed_matrix);
+#endif
+
+	/* wait for any checkpoint still being written */
+
+	lanczos_chk_free(chk);
 
 	/* free unneeded storage */
 
@@ -1382,99 +1310,12 @@ static v_t * block_lanczos_core(msieve_obj *obj,
 
 	MPI_NODE_0_END
 
-
-	/* convert the output of the iteration to an actual
-	   collection of nullspace vectors. Begin by multiplying
-	   the output from the iteration by B */
-
-#ifdef HAVE_MPI
-	/* pull the result vectors into rank 0 */
-
 	vv_free(v[1]);
 	vv_free(v[2]);
-
-	mul_MxN_NxB(packed_matrix, x, scratch);
-
-	out2 = gather_nrows(obj, packed_matrix, scratch, NULL);
-	out0 = gather_ncols(obj, packed_matrix, x, scratch, NULL);
-	vv_free(x);
-    
-	mul_MxN_NxB(packed_matrix, v[0], scratch);
-
-	out3 = gather_nrows(obj, packed_matrix, scratch, NULL);
-	out1 = gather_ncols(obj, packed_matrix, v[0], scratch, NULL);
-	vv_free(v[0]);
-    
-	vv_free(scratch);
-#else
-	mul_MxN_NxB(packed_matrix, x, v[1]);
-	mul_MxN_NxB(packed_matrix, v[0], v[2]);
 	vv_free(scratch);
 
-	out0 = (v_t *)aligned_malloc(max_n * sizeof(v_t), 64);
-	vv_copyout(out0, x, max_n);
-	vv_free(x);
-
-	out1 = (v_t *)aligned_malloc(max_n * sizeof(v_t), 64);
-	vv_copyout(out1, v[0], max_n);
-	vv_free(v[0]);
-
-	out2 = (v_t *)aligned_malloc(max_n * sizeof(v_t), 64);
-	vv_copyout(out2, v[1], max_n);
-	vv_free(v[1]);
-
-	out3 = (v_t *)aligned_malloc(max_n * sizeof(v_t), 64);
-	vv_copyout(out3, v[2], max_n);
-	vv_free(v[2]);
-#endif
-
-	MPI_NODE_0_START
-        
-	/* make sure the last few words of the above matrix products
-	   are zero, since the postprocessing will be using them */
-
-	for (i = packed_matrix->max_nrows; 
-			i < packed_matrix->max_ncols; i++) {
-		out2[i] = out3[i] = v_zero;
-	}
-
-	/* if necessary, add in the contribution of the
-	   first few rows that were originally in B. We 
-	   expect there to be about VBITS - POST_LANCZOS_ROWS 
-	   bit vectors that are in the nullspace of B and
-	   post_lanczos_matrix simultaneously */
-
-	if (post_lanczos_matrix) {
-		for (i = 0; i < POST_LANCZOS_ROWS; i++) {
-			v_t accum0 = v_zero;
-			v_t accum1 = v_zero;
-			uint32 j;
-			for (j = 0; j < max_n; j++) {
-				if (v_bitset(post_lanczos_matrix[j], i)) {
-					accum0 = v_xor(accum0, out0[j]);
-					accum1 = v_xor(accum1, out1[j]);
-				}
-			}
-			out2[i] = v_xor(out2[i], accum0);
-			out3[i] = v_xor(out3[i], accum1);
-		}
-	}
-
-	*num_deps_found = combine_cols(max_n, out0, out1, out2, out3);
-
-	MPI_NODE_0_END
-
-	aligned_free(out1);
-	aligned_free(out2);
-	aligned_free(out3);
-
-	if (*num_deps_found == 0)
-		logprintf(obj, "lanczos error: only trivial "
-				"dependencies found\n");
-	else
-		logprintf(obj, "recovered %u nontrivial dependencies\n", 
-				*num_deps_found);
-	return out0;
+	return combine_nullspace(obj, packed_matrix, post_lanczos_matrix,
+				x, v[0], num_deps_found);
 }
 
 /*-----------------------------------------------------------------------*/
@@ -1491,7 +1332,9 @@ uint64 * block_lanczos(msieve_obj *obj,
 	v_t *lanczos_output = NULL;
 	packed_matrix_t packed_matrix;
 	uint32 dump_interval;
+	uint64 fingerprint = 0;
 	uint32 have_post_lanczos;
+	uint32 use_bw = 0;
 #ifdef HAVE_MPI
 	uint32 start_sub;
 #endif
@@ -1616,6 +1459,51 @@ uint64 * block_lanczos(msieve_obj *obj,
 	if (have_post_lanczos)
 		count_matrix_nonzero(obj, nrows, num_dense_rows, ncols, B);
 
+	/* set up for writing checkpoint files. This only applies
+	   to the largest matrices. The initial dump interval is
+	   just to establish timing information */
+
+	if (obj->nfs_args != NULL && 
+	    strstr(obj->nfs_args, "la_solver=bw"))
+		use_bw = 1;
+
+	dump_interval = 0;
+	if (max_nrows > 1000000 && !use_bw)
+		dump_interval = DEFAULT_DUMP_INTERVAL;
+
+	/* checkpoints are tied to the exact matrix they were
+	   made from; this has to be computed before the matrix
+	   is packed, since packing frees the input columns */
+
+	if (dump_interval || use_bw ||
+	    (obj->flags & MSIEVE_FLAG_NFS_LA_RESTART)) {
+		fingerprint = lanczos_chk_fingerprint(obj, B,
+					nrows, max_nrows, start_row,
+					num_dense_rows,
+					ncols, max_ncols, start_col);
+	}
+
+	/* optionally only check that the checkpoint can be used
+	   to restart, and stop */
+
+	if ((obj->flags & MSIEVE_FLAG_NFS_LA_RESTART) && !use_bw &&
+	    obj->nfs_args != NULL &&
+	    strstr(obj->nfs_args, "chk_verify=1")) {
+		uint32 i;
+
+#ifdef HAVE_MPI
+		lanczos_chk_verify(obj, packed_matrix.nsubcols, 
+				max_ncols, fingerprint);
+#else
+		lanczos_chk_verify(obj, ncols, max_ncols, fingerprint);
+#endif
+		for (i = 0; i < ncols; i++)
+			free(B[i].data);
+		free(post_lanczos_matrix);
+		*num_deps_found = 0;
+		return NULL;
+	}
+
 	packed_matrix_init(obj, &packed_matrix, B, 
 			   nrows, max_nrows, start_row,
 			   ncols, max_ncols, start_col, 
@@ -1627,22 +1515,29 @@ uint64 * block_lanczos(msieve_obj *obj,
 #endif
 			   );
 
-	/* set up for writing checkpoint files. This only applies
-	   to the largest matrices. The initial dump interval is
-	   just to establish timing information */
-
-	dump_interval = 0;
-	if (max_nrows > 1000000) {
-		dump_interval = DEFAULT_DUMP_INTERVAL;
+	if (dump_interval)
 		obj->flags |= MSIEVE_FLAG_SIEVING_IN_PROGRESS;
-	}
 
 	/* solve the matrix */
 
-	lanczos_output = block_lanczos_core(obj, &packed_matrix,
+	if (use_bw) {
+		void *x = block_wiedemann(obj, &packed_matrix, fingerprint);
+
+		*num_deps_found = 0;
+		if (x != NULL) {
+			lanczos_output = combine_nullspace(obj, 
+						&packed_matrix,
+						post_lanczos_matrix,
+						x, NULL, num_deps_found);
+		}
+	}
+	else {
+		lanczos_output = block_lanczos_core(obj, &packed_matrix,
 						num_deps_found,
 						post_lanczos_matrix,
-						dump_interval);
+						dump_interval,
+						fingerprint);
+	}
 
 	if (dump_interval)
 		obj->flags &= ~MSIEVE_FLAG_SIEVING_IN_PROGRESS;
@@ -155,6 +155,57 @@ static const v_t v_zero = {{0}};
 
 #define NUM_MEDIUM_ROWS 3000
 
+/* optional profiling of the iteration ('la_profile=X').
+   Each phase accumulates the clock cycles (from read_clock)
+   spent in it, the number of times it ran, and an estimate
+   of the bytes of matrix and vector data it moved through 
+   memory. The matrix multiply tasks also count the cycles 
+   each thread spends working, to show how evenly the work 
+   is split among threads */
+
+enum la_prof_phase {
+	LA_PROF_MUL = 0,	/* mul_core */
+	LA_PROF_MUL_TRANS,	/* mul_trans_core */
+	LA_PROF_COMM,		/* waiting for MPI in the multiply */
+	LA_PROF_INNER,		/* vv_mul_BxN_NxB, with its MPI */
+	LA_PROF_OUTER,		/* vv_mul_NxB_BxB_acc */
+	LA_PROF_VECTOR,		/* other vector operations */
+	LA_PROF_CHECK,		/* integrity checks, checkpoints */
+	LA_PROF_NUM_PHASES
+};
+
+enum la_prof_task {
+	LA_PROF_TASK_MUL = 0,		/* sparse blocks */
+	LA_PROF_TASK_MUL_DENSE,		/* dense rows */
+	LA_PROF_TASK_TRANS,
+	LA_PROF_TASK_TRANS_DENSE,
+	LA_PROF_NUM_TASKS
+};
+
+#define LA_PROF_MAX_THREADS 32
+
+typedef struct {
+	uint64 cycles[LA_PROF_NUM_PHASES];
+	uint64 calls[LA_PROF_NUM_PHASES];
+	uint64 bytes[LA_PROF_NUM_PHASES];
+
+	/* bytes moved by one matrix multiply, filled in 
+	   when the matrix is built */
+	uint64 mul_bytes[2];
+
+	/* cycles each thread spent in the multiply tasks, 
+	   and the bytes each thread moves per multiply */
+	uint32 num_threads;
+	uint64 thread_cycles[LA_PROF_NUM_TASKS][LA_PROF_MAX_THREADS];
+	uint64 thread_bytes[LA_PROF_NUM_TASKS][LA_PROF_MAX_THREADS];
+
+	uint32 interval;	/* iterations between summaries */
+	uint32 first_iter;
+	uint32 next_report;
+	uint64 start_clock;
+	char name[LINE_BUF_SIZE];  /* the machine-readable output */
+} la_prof_t;
+
 /* struct representing a packed matrix */
 
 typedef struct packed_matrix_t {
@@ -173,6 +224,8 @@ typedef struct packed_matrix_t {
 
 	void * extra; /* implementation-specific stuff */
 
+	la_prof_t *prof; /* NULL unless profiling */
+
 #ifdef HAVE_MPI
 	uint32 mpi_size;
 	uint32 mpi_nrows;
@@ -192,10 +245,55 @@ typedef struct packed_matrix_t {
 	int32 row_counts[MAX_MPI_GRID_DIM];
 	int32 row_offsets[MAX_MPI_GRID_DIM];
 
+	/* the number of pieces each half of mul_sym_NxN_NxB 
+	   is computed in, so that communication overlaps the
+	   computation; 1 means no overlap */
+	uint32 mpi_pieces;
+
+	/* wall clock time spent in mul_sym_NxN_NxB, and the 
+	   part of it spent waiting for communication */
+	uint32 mpi_num_mul;
+	double mpi_mul_time;
+	double mpi_comm_time;
 #endif
 
 } packed_matrix_t;
 
+/* the profiling hooks; they cost one branch when
+   profiling is off */
+
+static INLINE uint64 la_prof_start(packed_matrix_t *A) {
+
+	if (A->prof == NULL)
+		return 0;
+	return read_clock();
+}
+
+static INLINE void la_prof_end(packed_matrix_t *A, uint32 phase, 
+				uint64 start, uint64 bytes) {
+
+	la_prof_t *prof = A->prof;
+
+	if (prof == NULL)
+		return;
+	prof->cycles[phase] += read_clock() - start;
+	prof->calls[phase]++;
+	prof->bytes[phase] += bytes;
+}
+
+/* start profiling if the options ask for it */
+
+void la_prof_init(msieve_obj *obj, packed_matrix_t *A);
+
+void la_prof_free(packed_matrix_t *A);
+
+/* called at the start of every iteration; logs a summary
+   every so often. la_prof_report logs one at the end */
+
+void la_prof_iter(msieve_obj *obj, packed_matrix_t *A, uint32 iter);
+
+void la_prof_report(msieve_obj *obj, packed_matrix_t *A, uint32 iter);
+
 void packed_matrix_init(msieve_obj *obj, 
 			packed_matrix_t *packed_matrix,
 			la_col_t *A, 
@@ -232,8 +330,24 @@ void mul_trans_unpacked(packed_matrix_t *matrix, v_t *x, v_t *b);
 void mul_core(packed_matrix_t *A, void *x, void *b);
 void mul_trans_core(packed_matrix_t *A, void *x, void *b);
 
+/* the same, computing b in num_pieces passes. After each
+   pass done(done_data, n) is called, when the first n
+   entries of b are final; the MPI code uses this to start
+   combining the finished part of b with other processes
+   while the rest is computed */
+
+typedef void (*mul_done_func)(void *done_data, uint32 n);
+
+void mul_core_pieces(packed_matrix_t *A, void *x, void *b,
+			uint32 num_pieces, mul_done_func done,
+			void *done_data);
+void mul_trans_core_pieces(packed_matrix_t *A, void *x, void *b,
+			uint32 num_pieces, mul_done_func done,
+			void *done_data);
+
 #ifdef HAVE_MPI
-void global_xor(void *send_buf, void *recv_buf, 
+void global_xor(packed_matrix_t *A, 
+		void *send_buf, void *recv_buf, 
 		uint32 bufsize, uint32 mpi_nodes, 
 		uint32 mpi_rank, MPI_Comm comm);
 
@@ -244,10 +358,16 @@ void global_allgather(void *send_buf, void *recv_buf,
                         uint32 bufsize, uint32 mpi_nodes, 
                         uint32 mpi_rank, MPI_Comm comm);
 
-void global_xor_scatter(void *send_buf, void *recv_buf, 
+void global_xor_scatter(packed_matrix_t *A, 
+			void *send_buf, void *recv_buf, 
 			void *scratch, uint32 bufsize, 
 			uint32 mpi_nodes, uint32 mpi_rank, 
 			MPI_Comm comm);
+
+/* log the time mul_sym_NxN_NxB took so far, averaged 
+   over all the processes in the grid */
+
+void mul_report_mpi_time(msieve_obj *obj, packed_matrix_t *A);
 #endif
 
 /* top-level calls for vector-vector operations */
@@ -258,8 +378,8 @@ void vv_copyin(void *dest, v_t *src, uint32 n);
 void vv_copy(void *dest, void *src, uint32 n);
 void vv_copyout(v_t *dest, void *src, uint32 n);
 void vv_clear(void *v, uint32 n);
-void vv_xor(void *dest, void *src, uint32 n);
-void vv_mask(void *v, v_t mask, uint32 n);
+void vv_xor(packed_matrix_t *A, void *dest, void *src, uint32 n);
+void vv_mask(packed_matrix_t *A, void *v, v_t mask, uint32 n);
 
 void vv_mul_NxB_BxB_acc(packed_matrix_t *A, void *v, v_t *x, 
 			void *y, uint32 n);
@@ -267,6 +387,66 @@ void vv_mul_NxB_BxB_acc(packed_matrix_t *A, void *v, v_t *x,
 void vv_mul_BxN_NxB(packed_matrix_t *A, void *x, void *y, 
 			v_t *xy, uint32 n);
 
+/* checkpointing of the iteration state. Checkpoints
+   are written by a background thread, so that the
+   iteration only pays for copying its state to memory */
+
+struct lanczos_chk;
+
+uint64 lanczos_chk_fingerprint(msieve_obj *obj, la_col_t *cols,
+			uint32 nrows, uint32 max_nrows, uint32 start_row,
+			uint32 num_dense_rows,
+			uint32 ncols, uint32 max_ncols, uint32 start_col);
+
+struct lanczos_chk * lanczos_chk_init(msieve_obj *obj, 
+				uint32 n, uint32 max_n,
+				uint64 fingerprint);
+
+void lanczos_chk_free(struct lanczos_chk *chk);
+
+void lanczos_chk_write(struct lanczos_chk *chk,
+			void *x, v_t **vt_v0, void **v, void *v0,
+			v_t **vt_a_v, v_t **vt_a2_v, v_t **winv,
+			uint32 dim_solved, uint32 iter,
+			uint32 s[2][VBITS], uint32 dim1);
+
+void lanczos_chk_verify(msieve_obj *obj, uint32 n, uint32 max_n,
+			uint64 fingerprint);
+
+void lanczos_chk_read(msieve_obj *obj, uint32 n, uint32 max_n,
+			uint64 fingerprint,
+			void *x, v_t **vt_v0, void **v, void *v0,
+			v_t **vt_a_v, v_t **vt_a2_v, v_t **winv,
+			uint32 *dim_solved, uint32 *iter,
+			uint32 s[2][VBITS], uint32 *dim1);
+
+uint64 lanczos_chk_checksum(uint64 sum, void *data, size_t num_bytes);
+
+/* run num_tasks independent tasks, each task_size bytes 
+   apart in the tasks array, with up to num_threads threads */
+
+void lanczos_run_tasks(void (*run)(void *data, int thread_num),
+			void *tasks, size_t task_size,
+			uint32 num_tasks, uint32 num_threads);
+
+/* block Wiedemann, used instead of block Lanczos when
+   the nullspace computation has to be split up among
+   loosely connected machines. Returns a block of vectors
+   x with A*x = 0, or NULL if there are none or only part
+   of the computation was requested */
+
+void * block_wiedemann(msieve_obj *obj, 
+			packed_matrix_t *packed_matrix,
+			uint64 fingerprint);
+
+/* find a matrix generator for the num_seqs interleaved
+   block sequences in seq. Returns gen_len coefficients,
+   of which the first gen_cols columns are usable */
+
+v_t * bw_lingen(msieve_obj *obj, v_t *seq, uint32 num_seqs,
+		uint32 seq_len, uint32 min_order,
+		uint32 *gen_len, uint32 *gen_cols);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,816 @@
+/*--------------------------------------------------------------------
+This source distribution is placed in the public domain by its author,
+Jason Papadopoulos. You may use it for any purpose, free of charge,
+without having to notify anyone. I disclaim any responsibility for any
+errors.
+
+Optionally, please be nice and tell me if you find this source to be
+useful. Again optionally, if you add to the functionality present here
+please consider making those additions public too, so that others may
+benefit from your work.
+
+$Id$
+--------------------------------------------------------------------*/
+
+#include <thread.h>
+#include "lanczos.h"
+
+/* Checkpointing for the Lanczos iteration.
+
+   For large matrices the five vectors that make up the Lanczos
+   state are hundreds of megabytes, and writing them out used to
+   stall the iteration for as long as the disk took to absorb
+   them (and under MPI, for as long as it took to funnel every
+   vector through the root node). Now the iteration only copies
+   its state into a buffer in memory, and a background thread
+   writes the buffer out, forces it to disk, and only then
+   replaces the previous checkpoint file. There are two buffers,
+   so that a new checkpoint can be captured even if the disk is
+   still busy with the last one; the second buffer is only
+   allocated if that ever actually happens.
+
+   Under MPI, every process writes its own piece of the
+   vectors to its own checkpoint file.
+
+   A checkpoint file starts with a header that identifies the
+   matrix and the MPI grid the checkpoint belongs to, followed
+   by a table of sections (the small VBITS x VBITS matrices, then
+   one section per vector), each with its own checksum; the
+   header has a checksum too. Restarting reads and checks all the
+   sections in parallel before any of the state is used, so that
+   a checkpoint for the wrong matrix or a damaged file is caught
+   right away instead of by the integrity check hundreds of
+   iterations later. Files in the original headerless format
+   can still be read, but cannot be checked as thoroughly */
+
+#define CHK_MAGIC 0x4b48434c	/* "LCHK" */
+#define CHK_VERSION 1
+
+/* the number of length-n vectors that are saved */
+
+#define CHK_NUM_VECTORS 5
+
+enum {
+	CHK_SECTION_SMALL = 0,
+	CHK_SECTION_VECTORS,
+	CHK_NUM_SECTIONS = CHK_SECTION_VECTORS + CHK_NUM_VECTORS
+};
+
+/* the small matrices that are saved; the order of the
+   matrices is the same as in the original file format */
+
+enum {
+	CHK_VT_A_V1 = 0,
+	CHK_VT_A2_V1,
+	CHK_WINV1,
+	CHK_WINV2,
+	CHK_VT_V0_0,
+	CHK_VT_V0_1,
+	CHK_VT_V0_2,
+	CHK_NUM_SMALL
+};
+
+typedef struct {
+	v_t small[CHK_NUM_SMALL][VBITS];
+	uint32 s1[VBITS];
+} chk_small_t;
+
+typedef struct {
+	uint64 offset;		/* from the start of the file */
+	uint64 size;		/* in bytes */
+	uint64 checksum;
+} chk_section_t;
+
+typedef struct {
+	uint32 magic;
+	uint32 version;
+	uint32 vbits;
+	uint32 n;		/* vector entries in this file */
+	uint32 max_n;		/* vector entries in the whole matrix */
+	uint32 mpi_nrows;
+	uint32 mpi_ncols;
+	uint32 mpi_la_row_rank;
+	uint32 mpi_la_col_rank;
+	uint32 dim_solved;
+	uint32 iter;
+	uint32 dim1;
+	uint64 fingerprint;	/* from lanczos_chk_fingerprint */
+	chk_section_t sections[CHK_NUM_SECTIONS];
+	uint64 checksum;	/* of all the above */
+} chk_header_t;
+
+/* errors the background writer can hit */
+
+enum {
+	CHK_OK = 0,
+	CHK_ERR_OPEN,
+	CHK_ERR_WRITE,
+	CHK_ERR_RENAME
+};
+
+struct lanczos_chk;
+
+typedef struct {
+	struct lanczos_chk *chk;
+	uint32 busy;		/* nonzero while queued or being written */
+
+	uint32 dim_solved;
+	uint32 iter;
+	uint32 dim1;
+	chk_small_t small;
+	v_t *vectors;		/* CHK_NUM_VECTORS vectors of n entries */
+} chk_slot_t;
+
+struct lanczos_chk {
+	msieve_obj *obj;
+	uint32 n;
+	uint32 max_n;
+	uint64 fingerprint;
+	char name[256];		/* checkpoint name, without the suffix */
+
+	struct threadpool *writer;
+	mutex_t mutex;		/* protects 'busy' and 'status' */
+	uint32 status;
+	chk_slot_t slots[2];
+};
+
+/*-----------------------------------------------------------------------*/
+uint64 lanczos_chk_checksum(uint64 sum, void *data, size_t num_bytes) {
+
+	/* a fast running hash; all the checkpoint data is a
+	   multiple of 32 bits long. The data can be of any
+	   type, so words are loaded with memcpy to keep the
+	   compiler's aliasing rules happy */
+
+	uint8 *p = (uint8 *)data;
+	size_t i;
+	size_t num_words = num_bytes / sizeof(uint64);
+	uint64 w;
+
+	for (i = 0; i < num_words; i++) {
+		memcpy(&w, p + i * sizeof(uint64), sizeof(uint64));
+		sum = (sum ^ w) * 0x9e3779b97f4a7c15ULL;
+		sum ^= sum >> 29;
+	}
+
+	if (num_bytes % sizeof(uint64)) {
+		uint32 w32;
+
+		memcpy(&w32, p + i * sizeof(uint64), sizeof(uint32));
+		sum = (sum ^ w32) * 0x9e3779b97f4a7c15ULL;
+		sum ^= sum >> 29;
+	}
+
+	return sum;
+}
+
+/*-----------------------------------------------------------------------*/
+void lanczos_run_tasks(run_func run, void *tasks, size_t task_size,
+			uint32 num_tasks, uint32 num_threads) {
+
+	/* run a batch of independent tasks with up to
+	   num_threads threads */
+
+	uint32 i;
+	task_control_t t = {NULL, NULL, NULL, NULL};
+	thread_control_t control = {NULL, NULL, NULL};
+	struct threadpool *pool;
+
+	num_threads = MIN(num_threads, num_tasks);
+	t.run = run;
+
+	if (num_threads <= 1) {
+		for (i = 0; i < num_tasks; i++)
+			run((uint8 *)tasks + i * task_size, 0);
+		return;
+	}
+
+	pool = threadpool_init(num_threads, num_tasks, &control);
+	for (i = 0; i < num_tasks; i++) {
+		t.data = (uint8 *)tasks + i * task_size;
+		threadpool_add_task(pool, &t, 1);
+	}
+	threadpool_drain(pool, 1);
+	threadpool_free(pool);
+}
+
+/*-----------------------------------------------------------------------*/
+typedef struct {
+	char *file_name;	/* if NULL, data is already in memory */
+	uint64 offset;
+	uint64 size;
+	void *data;
+	uint64 checksum;
+	uint32 status;
+} chk_section_task_t;
+
+static void chk_section_core(void *data, int thread_num) {
+
+	/* checksum one section, first reading it from
+	   the file if necessary */
+
+	chk_section_task_t *t = (chk_section_task_t *)data;
+
+	t->status = 1;
+	if (t->file_name != NULL) {
+		FILE *fp = fopen(t->file_name, "rb");
+
+		if (fp == NULL) {
+			t->status = 0;
+			return;
+		}
+		if (fseeko(fp, (int64)t->offset, SEEK_SET) != 0 ||
+		    fread(t->data, (size_t)1, (size_t)t->size, fp) !=
+		    				(size_t)t->size) {
+			t->status = 0;
+		}
+		fclose(fp);
+		if (t->status == 0)
+			return;
+	}
+
+	t->checksum = lanczos_chk_checksum(0, t->data, (size_t)t->size);
+}
+
+/*-----------------------------------------------------------------------*/
+static void chk_fill_sections(chk_header_t *h,
+			chk_section_task_t *tasks,
+			chk_small_t *small, v_t *vectors) {
+
+	/* lay out the sections of a file whose header
+	   has the vector size filled in */
+
+	uint32 i;
+	uint64 offset = sizeof(chk_header_t);
+
+	memset(tasks, 0, CHK_NUM_SECTIONS * sizeof(chk_section_task_t));
+
+	for (i = 0; i < CHK_NUM_SECTIONS; i++) {
+		chk_section_task_t *t = tasks + i;
+
+		if (i == CHK_SECTION_SMALL) {
+			t->size = sizeof(chk_small_t);
+			t->data = small;
+		}
+		else {
+			t->size = (uint64)h->n * sizeof(v_t);
+			t->data = vectors + (size_t)(i - CHK_SECTION_VECTORS) *
+						h->n;
+		}
+		t->offset = offset;
+		offset += t->size;
+	}
+}
+
+/*-----------------------------------------------------------------------*/
+static uint64 chk_header_checksum(chk_header_t *h) {
+
+	return lanczos_chk_checksum(0, h, offsetof(chk_header_t, checksum));
+}
+
+/*-----------------------------------------------------------------------*/
+static uint32 chk_sync(FILE *fp) {
+
+	/* make sure the file is really on disk before
+	   the previous checkpoint is thrown away */
+
+	if (fflush(fp) != 0)
+		return 0;
+
+#if defined(WIN32) || defined(_WIN64)
+	return (_commit(_fileno(fp)) == 0);
+#else
+	return (fsync(fileno(fp)) == 0);
+#endif
+}
+
+/*-----------------------------------------------------------------------*/
+static void chk_init_header(msieve_obj *obj, chk_header_t *h,
+			uint32 n, uint32 max_n, uint64 fingerprint) {
+
+	memset(h, 0, sizeof(chk_header_t));
+	h->magic = CHK_MAGIC;
+	h->version = CHK_VERSION;
+	h->vbits = VBITS;
+	h->n = n;
+	h->max_n = max_n;
+	h->fingerprint = fingerprint;
+#ifdef HAVE_MPI
+	h->mpi_nrows = obj->mpi_nrows;
+	h->mpi_ncols = obj->mpi_ncols;
+	h->mpi_la_row_rank = obj->mpi_la_row_rank;
+	h->mpi_la_col_rank = obj->mpi_la_col_rank;
+#else
+	h->mpi_nrows = 1;
+	h->mpi_ncols = 1;
+#endif
+}
+
+/*-----------------------------------------------------------------------*/
+static void chk_write_core(void *data, int thread_num) {
+
+	chk_slot_t *slot = (chk_slot_t *)data;
+	struct lanczos_chk *chk = slot->chk;
+	chk_header_t h;
+	chk_section_task_t tasks[CHK_NUM_SECTIONS];
+	uint32 status = 1;
+	uint32 error = CHK_OK;
+	char buf[300];
+	char buf_old[300];
+	char buf_bak[300];
+	FILE *fp;
+	uint32 i;
+
+	sprintf(buf, "%s.chk0", chk->name);
+	sprintf(buf_old, "%s.chk", chk->name);
+	sprintf(buf_bak, "%s.bak.chk", chk->name);
+
+	/* fill in the header. The sections are checksummed
+	   in this thread only; the Lanczos threads are still
+	   running, and more threads here would only take
+	   cores away from them */
+
+	chk_init_header(chk->obj, &h, chk->n, chk->max_n, chk->fingerprint);
+	h.dim_solved = slot->dim_solved;
+	h.iter = slot->iter;
+	h.dim1 = slot->dim1;
+
+	chk_fill_sections(&h, tasks, &slot->small, slot->vectors);
+
+	for (i = 0; i < CHK_NUM_SECTIONS; i++) {
+		chk_section_core(tasks + i, 0);
+		h.sections[i].offset = tasks[i].offset;
+		h.sections[i].size = tasks[i].size;
+		h.sections[i].checksum = tasks[i].checksum;
+	}
+	h.checksum = chk_header_checksum(&h);
+
+	fp = fopen(buf, "wb");
+	if (fp == NULL) {
+		error = CHK_ERR_OPEN;
+		goto finished;
+	}
+
+	status &= (fwrite(&h, sizeof(chk_header_t), (size_t)1, fp) == 1);
+	for (i = 0; i < CHK_NUM_SECTIONS; i++) {
+		status &= (fwrite(tasks[i].data, (size_t)1,
+				(size_t)tasks[i].size, fp) ==
+				(size_t)tasks[i].size);
+	}
+	status &= chk_sync(fp);
+	status &= (fclose(fp) == 0);
+
+	/* only delete an old checkpoint file if the current
+	   checkpoint completed writing */
+
+	if (status == 0) {
+		error = CHK_ERR_WRITE;
+		goto finished;
+	}
+
+	remove(buf_bak);
+	rename(buf_old, buf_bak);
+	if (rename(buf, buf_old))
+		error = CHK_ERR_RENAME;
+
+finished:
+	mutex_lock(&chk->mutex);
+	if (chk->status == CHK_OK)
+		chk->status = error;
+	slot->busy = 0;
+	mutex_unlock(&chk->mutex);
+}
+
+/*-----------------------------------------------------------------------*/
+static void chk_check_status(struct lanczos_chk *chk) {
+
+	uint32 status;
+
+	mutex_lock(&chk->mutex);
+	status = chk->status;
+	mutex_unlock(&chk->mutex);
+
+	switch (status) {
+	case CHK_ERR_OPEN:
+		printf("error: cannot open matrix checkpoint file\n");
+		exit(-1);
+	case CHK_ERR_WRITE:
+		printf("error: cannot write new checkpoint file\n");
+		printf("error: previous checkpoint file not overwritten\n");
+		exit(-1);
+	case CHK_ERR_RENAME:
+		printf("error: cannot update checkpoint file\n");
+		exit(-1);
+	}
+}
+
+/*-----------------------------------------------------------------------*/
+static void chk_get_name(msieve_obj *obj, char *name) {
+
+#ifdef HAVE_MPI
+	sprintf(name, "%s.mpi%02u", obj->savefile.name, obj->mpi_rank);
+#else
+	sprintf(name, "%s", obj->savefile.name);
+#endif
+}
+
+/*-----------------------------------------------------------------------*/
+typedef struct {
+	la_col_t *cols;
+	uint32 num_cols;
+	uint32 dense_words;
+	uint64 hash;
+} chk_fingerprint_task_t;
+
+#define CHK_FINGERPRINT_BLOCKS 64
+
+static void chk_fingerprint_core(void *data, int thread_num) {
+
+	chk_fingerprint_task_t *t = (chk_fingerprint_task_t *)data;
+	uint64 hash = 0;
+	uint32 i;
+
+	for (i = 0; i < t->num_cols; i++) {
+		la_col_t *col = t->cols + i;
+
+		hash = lanczos_chk_checksum(hash, &col->weight, sizeof(uint32));
+		hash = lanczos_chk_checksum(hash, col->data,
+				(col->weight + t->dense_words) *
+				sizeof(uint32));
+	}
+	t->hash = hash;
+}
+
+/*-----------------------------------------------------------------------*/
+uint64 lanczos_chk_fingerprint(msieve_obj *obj, la_col_t *cols,
+			uint32 nrows, uint32 max_nrows, uint32 start_row,
+			uint32 num_dense_rows,
+			uint32 ncols, uint32 max_ncols, uint32 start_col) {
+
+	/* hash the (piece of the) matrix a checkpoint belongs
+	   to. The matrix is split into a fixed number of blocks
+	   that are hashed in parallel; the number of blocks must
+	   not depend on the number of threads, or restarting
+	   with a different thread count would look like a
+	   different matrix */
+
+	uint32 i;
+	uint32 block_size = (ncols + CHK_FINGERPRINT_BLOCKS - 1) /
+					CHK_FINGERPRINT_BLOCKS;
+	uint32 dims[7];
+	chk_fingerprint_task_t tasks[CHK_FINGERPRINT_BLOCKS];
+	uint64 hash;
+
+	for (i = 0; i < CHK_FINGERPRINT_BLOCKS; i++) {
+		chk_fingerprint_task_t *t = tasks + i;
+		uint32 start = MIN(i * block_size, ncols);
+
+		t->cols = cols + start;
+		t->num_cols = MIN(block_size, ncols - start);
+		t->dense_words = (num_dense_rows + 31) / 32;
+		t->hash = 0;
+	}
+
+	lanczos_run_tasks(chk_fingerprint_core, tasks,
+			sizeof(chk_fingerprint_task_t),
+			CHK_FINGERPRINT_BLOCKS, obj->num_threads);
+
+	dims[0] = nrows;
+	dims[1] = max_nrows;
+	dims[2] = start_row;
+	dims[3] = num_dense_rows;
+	dims[4] = ncols;
+	dims[5] = max_ncols;
+	dims[6] = start_col;
+
+	hash = lanczos_chk_checksum(0, dims, sizeof(dims));
+	for (i = 0; i < CHK_FINGERPRINT_BLOCKS; i++)
+		hash = lanczos_chk_checksum(hash, &tasks[i].hash, sizeof(uint64));
+
+	return hash;
+}
+
+/*-----------------------------------------------------------------------*/
+struct lanczos_chk * lanczos_chk_init(msieve_obj *obj,
+				uint32 n, uint32 max_n,
+				uint64 fingerprint) {
+
+	struct lanczos_chk *chk = (struct lanczos_chk *)xcalloc(1,
+					sizeof(struct lanczos_chk));
+	thread_control_t control = {NULL, NULL, NULL};
+
+	chk->obj = obj;
+	chk->n = n;
+	chk->max_n = max_n;
+	chk->fingerprint = fingerprint;
+	chk_get_name(obj, chk->name);
+	chk->slots[0].chk = chk;
+	chk->slots[1].chk = chk;
+	mutex_init(&chk->mutex);
+	chk->writer = threadpool_init(1, 4, &control);
+	return chk;
+}
+
+/*-----------------------------------------------------------------------*/
+void lanczos_chk_free(struct lanczos_chk *chk) {
+
+	if (chk == NULL)
+		return;
+
+	/* wait for any checkpoint in progress */
+
+	threadpool_drain(chk->writer, 1);
+	threadpool_free(chk->writer);
+	chk_check_status(chk);
+
+	mutex_free(&chk->mutex);
+	aligned_free(chk->slots[0].vectors);
+	aligned_free(chk->slots[1].vectors);
+	free(chk);
+}
+
+/*-----------------------------------------------------------------------*/
+void lanczos_chk_write(struct lanczos_chk *chk,
+			void *x, v_t **vt_v0, void **v, void *v0,
+			v_t **vt_a_v, v_t **vt_a2_v, v_t **winv,
+			uint32 dim_solved, uint32 iter,
+			uint32 s[2][VBITS], uint32 dim1) {
+
+	uint32 n = chk->n;
+	chk_slot_t *slot = NULL;
+	chk_small_t *small;
+	task_control_t task = {NULL, NULL, NULL, NULL};
+	uint32 i;
+
+	/* report any problem with the previous checkpoint
+	   before starting another one */
+
+	chk_check_status(chk);
+
+	/* find a buffer that is not being written; prefer
+	   one that is already allocated */
+
+	mutex_lock(&chk->mutex);
+	for (i = 0; i < 2; i++) {
+		chk_slot_t *curr_slot = chk->slots + i;
+
+		if (curr_slot->busy)
+			continue;
+		if (slot == NULL ||
+		    (slot->vectors == NULL && curr_slot->vectors != NULL))
+			slot = curr_slot;
+	}
+	mutex_unlock(&chk->mutex);
+
+	if (slot == NULL) {
+		/* both buffers are still in flight; the disk
+		   cannot keep up, so wait for it */
+
+		threadpool_drain(chk->writer, 1);
+		chk_check_status(chk);
+		slot = chk->slots + 0;
+	}
+
+	if (slot->vectors == NULL) {
+		slot->vectors = (v_t *)aligned_malloc((size_t)n *
+					CHK_NUM_VECTORS * sizeof(v_t), 64);
+	}
+
+	/* capture the current state */
+
+	slot->dim_solved = dim_solved;
+	slot->iter = iter;
+	slot->dim1 = dim1;
+
+	small = &slot->small;
+	memcpy(small->s1, s[1], VBITS * sizeof(uint32));
+	memcpy(small->small[CHK_VT_A_V1], vt_a_v[1], VBITS * sizeof(v_t));
+	memcpy(small->small[CHK_VT_A2_V1], vt_a2_v[1], VBITS * sizeof(v_t));
+	memcpy(small->small[CHK_WINV1], winv[1], VBITS * sizeof(v_t));
+	memcpy(small->small[CHK_WINV2], winv[2], VBITS * sizeof(v_t));
+	memcpy(small->small[CHK_VT_V0_0], vt_v0[0], VBITS * sizeof(v_t));
+	memcpy(small->small[CHK_VT_V0_1], vt_v0[1], VBITS * sizeof(v_t));
+	memcpy(small->small[CHK_VT_V0_2], vt_v0[2], VBITS * sizeof(v_t));
+
+	vv_copyout(slot->vectors + (size_t)0 * n, x, n);
+	vv_copyout(slot->vectors + (size_t)1 * n, v[0], n);
+	vv_copyout(slot->vectors + (size_t)2 * n, v[1], n);
+	vv_copyout(slot->vectors + (size_t)3 * n, v[2], n);
+	vv_copyout(slot->vectors + (size_t)4 * n, v0, n);
+
+	/* hand it off to the writer */
+
+	slot->busy = 1;
+	task.run = chk_write_core;
+	task.data = slot;
+	threadpool_add_task(chk->writer, &task, 1);
+}
+
+/*-----------------------------------------------------------------------*/
+static void chk_load_old(FILE *fp, uint32 n, chk_header_t *h,
+			chk_small_t *small, v_t *vectors) {
+
+	/* read a checkpoint in the original format, which is
+	   the header fields followed by the sections. The only
+	   check possible is on the vector size */
+
+	uint32 status = 1;
+	uint32 read_n;
+	uint32 i;
+
+	rewind(fp);
+	status &= (fread(&read_n, sizeof(uint32), (size_t)1, fp) == 1);
+	if (status == 0 || read_n != n) {
+		printf("error: unexpected vector size\n");
+		exit(-1);
+	}
+	status &= (fread(&h->dim_solved, sizeof(uint32), (size_t)1, fp) == 1);
+	status &= (fread(&h->iter, sizeof(uint32), (size_t)1, fp) == 1);
+	status &= (fread(&h->vbits, sizeof(uint32), (size_t)1, fp) == 1);
+	if (h->vbits != VBITS) {
+		printf("error: vector length mismatch\n");
+		exit(-1);
+	}
+	status &= (fread(small->small, sizeof(small->small),
+				(size_t)1, fp) == 1);
+	status &= (fread(small->s1, sizeof(small->s1), (size_t)1, fp) == 1);
+	status &= (fread(&h->dim1, sizeof(uint32), (size_t)1, fp) == 1);
+
+	for (i = 0; i < CHK_NUM_VECTORS; i++) {
+		status &= (fread(vectors + (size_t)i * n, sizeof(v_t),
+				(size_t)n, fp) == n);
+	}
+
+	if (status == 0) {
+		printf("error: checkpoint recovery failed\n");
+		exit(-1);
+	}
+}
+
+/*-----------------------------------------------------------------------*/
+static void chk_load(msieve_obj *obj, uint32 n, uint32 max_n,
+			uint64 fingerprint, chk_header_t *h,
+			chk_small_t *small, v_t *vectors) {
+
+	/* read and check a complete checkpoint file; any
+	   problem is fatal */
+
+	chk_header_t expected;
+	chk_section_task_t tasks[CHK_NUM_SECTIONS];
+	char name[256];
+	char buf[300];
+	FILE *fp;
+	uint32 i;
+
+	chk_get_name(obj, name);
+	sprintf(buf, "%s.chk", name);
+	fp = fopen(buf, "rb");
+	if (fp == NULL) {
+		printf("error: cannot open matrix checkpoint file\n");
+		exit(-1);
+	}
+
+	memset(h, 0, sizeof(chk_header_t));
+	if (fread(h, sizeof(chk_header_t), (size_t)1, fp) != 1 ||
+	    h->magic != CHK_MAGIC) {
+		logprintf(obj, "warning: checkpoint file has no "
+				"header, cannot verify it\n");
+		chk_load_old(fp, n, h, small, vectors);
+		fclose(fp);
+		return;
+	}
+	fclose(fp);
+
+	/* check the header against the current run */
+
+	chk_init_header(obj, &expected, n, max_n, fingerprint);
+
+	if (h->version != CHK_VERSION) {
+		printf("error: unknown checkpoint version %u\n", h->version);
+		exit(-1);
+	}
+	if (h->checksum != chk_header_checksum(h)) {
+		printf("error: checkpoint header is corrupt\n");
+		exit(-1);
+	}
+	if (h->vbits != VBITS) {
+		printf("error: vector length mismatch\n");
+		exit(-1);
+	}
+	if (h->mpi_nrows != expected.mpi_nrows ||
+	    h->mpi_ncols != expected.mpi_ncols ||
+	    h->mpi_la_row_rank != expected.mpi_la_row_rank ||
+	    h->mpi_la_col_rank != expected.mpi_la_col_rank) {
+		printf("error: checkpoint is for position (%u,%u) of a "
+			"%ux%u MPI grid\n",
+			h->mpi_la_row_rank, h->mpi_la_col_rank,
+			h->mpi_nrows, h->mpi_ncols);
+		exit(-1);
+	}
+	if (h->n != n || h->max_n != max_n) {
+		printf("error: unexpected vector size\n");
+		exit(-1);
+	}
+	if (h->fingerprint != fingerprint) {
+		printf("error: checkpoint does not match the matrix\n");
+		exit(-1);
+	}
+
+	/* read and checksum all the sections in parallel */
+
+	chk_fill_sections(h, tasks, small, vectors);
+	for (i = 0; i < CHK_NUM_SECTIONS; i++) {
+		if (tasks[i].offset != h->sections[i].offset ||
+		    tasks[i].size != h->sections[i].size) {
+			printf("error: checkpoint header is corrupt\n");
+			exit(-1);
+		}
+		tasks[i].file_name = buf;
+	}
+
+	lanczos_run_tasks(chk_section_core, tasks, 
+			sizeof(chk_section_task_t), CHK_NUM_SECTIONS, 
+			obj->num_threads);
+
+	for (i = 0; i < CHK_NUM_SECTIONS; i++) {
+		if (tasks[i].status == 0) {
+			printf("error: checkpoint recovery failed\n");
+			exit(-1);
+		}
+		if (tasks[i].checksum != h->sections[i].checksum) {
+			printf("error: checkpoint section %u is corrupt\n", i);
+			exit(-1);
+		}
+	}
+
+#ifdef HAVE_MPI
+	/* every process must have restarted from the same
+	   checkpoint; if one of them was interrupted while
+	   replacing its file this will not be the case */
+	{
+		uint32 min_iter, max_iter;
+
+		MPI_TRY(MPI_Allreduce(&h->iter, &min_iter, 1, MPI_INT,
+				MPI_MIN, obj->mpi_la_grid))
+		MPI_TRY(MPI_Allreduce(&h->iter, &max_iter, 1, MPI_INT,
+				MPI_MAX, obj->mpi_la_grid))
+		if (min_iter != max_iter) {
+			printf("error: MPI checkpoint files are "
+				"from different iterations\n");
+			exit(-1);
+		}
+	}
+#endif
+}
+
+/*-----------------------------------------------------------------------*/
+void lanczos_chk_verify(msieve_obj *obj, uint32 n, uint32 max_n,
+			uint64 fingerprint) {
+
+	chk_header_t h;
+	chk_small_t small;
+	v_t *vectors = (v_t *)aligned_malloc((size_t)n *
+				CHK_NUM_VECTORS * sizeof(v_t), 64);
+
+	chk_load(obj, n, max_n, fingerprint, &h, &small, vectors);
+	logprintf(obj, "checkpoint at iteration %u (dim = %u) "
+			"verified\n", h.iter, h.dim_solved);
+	aligned_free(vectors);
+}
+
+/*-----------------------------------------------------------------------*/
+void lanczos_chk_read(msieve_obj *obj, uint32 n, uint32 max_n,
+			uint64 fingerprint,
+			void *x, v_t **vt_v0, void **v, void *v0,
+			v_t **vt_a_v, v_t **vt_a2_v, v_t **winv,
+			uint32 *dim_solved, uint32 *iter,
+			uint32 s[2][VBITS], uint32 *dim1) {
+
+	chk_header_t h;
+	chk_small_t small;
+	v_t *vectors = (v_t *)aligned_malloc((size_t)n *
+				CHK_NUM_VECTORS * sizeof(v_t), 64);
+
+	chk_load(obj, n, max_n, fingerprint, &h, &small, vectors);
+
+	*dim_solved = h.dim_solved;
+	*iter = h.iter;
+	*dim1 = h.dim1;
+
+	memcpy(s[1], small.s1, VBITS * sizeof(uint32));
+	memcpy(vt_a_v[1], small.small[CHK_VT_A_V1], VBITS * sizeof(v_t));
+	memcpy(vt_a2_v[1], small.small[CHK_VT_A2_V1], VBITS * sizeof(v_t));
+	memcpy(winv[1], small.small[CHK_WINV1], VBITS * sizeof(v_t));
+	memcpy(winv[2], small.small[CHK_WINV2], VBITS * sizeof(v_t));
+	memcpy(vt_v0[0], small.small[CHK_VT_V0_0], VBITS * sizeof(v_t));
+	memcpy(vt_v0[1], small.small[CHK_VT_V0_1], VBITS * sizeof(v_t));
+	memcpy(vt_v0[2], small.small[CHK_VT_V0_2], VBITS * sizeof(v_t));
+
+	vv_copyin(x, vectors + (size_t)0 * n, n);
+	vv_copyin(v[0], vectors + (size_t)1 * n, n);
+	vv_copyin(v[1], vectors + (size_t)2 * n, n);
+	vv_copyin(v[2], vectors + (size_t)3 * n, n);
+	vv_copyin(v0, vectors + (size_t)4 * n, n);
+
+	aligned_free(vectors);
+}
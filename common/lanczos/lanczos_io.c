@@ -15,7 +15,19 @@ $Id$
 #include "lanczos.h"
 
 /*--------------------------------------------------------------------*/
-#ifdef HAVE_MPI
+/* The matrix index file <savefile>.mat.idx lists, for each
+   number of pieces k from 1 to MAT_IDX_DIM, the k+1 columns
+   (and their offsets in the matrix file) that split the
+   matrix into k pieces of about equal weight. Each MPI
+   column reads its slab of the matrix from it, and
+   read_matrix uses the finest split to let several threads
+   read the matrix at once */
+
+#define MAT_IDX_DIM 35
+
+#if defined(HAVE_MPI) && MAX_MPI_GRID_DIM > MAT_IDX_DIM
+#error "matrix index has too few pieces for the MPI grid"
+#endif
 
 typedef struct {
 	uint32 col_start;
@@ -28,16 +40,16 @@ typedef struct {
 	uint64 target_sparse;
 	uint32 curr_mpi;
 	uint32 curr_col;
-	mat_block_t idx_entries[MAX_MPI_GRID_DIM + 1];
+	mat_block_t idx_entries[MAT_IDX_DIM + 1];
 } mat_idx_t;
 
 static mat_idx_t * mat_idx_init(uint64 num_sparse) {
 
 	uint32 i;
-	mat_idx_t *m = (mat_idx_t *)xcalloc(MAX_MPI_GRID_DIM,
+	mat_idx_t *m = (mat_idx_t *)xcalloc(MAT_IDX_DIM,
 					sizeof(mat_idx_t));
 
-	for (i = 1; i <= MAX_MPI_GRID_DIM; i++)
+	for (i = 1; i <= MAT_IDX_DIM; i++)
 		m[i-1].sparse_per_proc = num_sparse / i + 100;
 
 	return m;
@@ -48,7 +60,7 @@ static void mat_idx_update(mat_idx_t *m, FILE *mat_fp,
 
 	uint32 i;
 
-	for (i = 0; i < MAX_MPI_GRID_DIM; i++) {
+	for (i = 0; i < MAT_IDX_DIM; i++) {
 		mat_idx_t *curr_m = m + i;
 
 		if (curr_m->curr_sparse >= curr_m->target_sparse) {
@@ -80,10 +92,10 @@ static void mat_idx_final(msieve_obj *obj, mat_idx_t *m,
 		exit(-1);
 	}
 
-	i = MAX_MPI_GRID_DIM;
+	i = MAT_IDX_DIM;
 	fwrite(&i, sizeof(uint32), (size_t)1, idx_fp);
 
-	for (i = 1; i <= MAX_MPI_GRID_DIM; i++) {
+	for (i = 1; i <= MAT_IDX_DIM; i++) {
 		mat_idx_t *curr_m = m + (i-1);
 
 		curr_m->idx_entries[i].col_start = ncols;
@@ -98,8 +110,58 @@ static void mat_idx_final(msieve_obj *obj, mat_idx_t *m,
 	free(m);
 }
 
+/* read the finest split of the matrix from the index into
+   blocks[]. Pieces too light to get a split of their own
+   leave empty entries, so only the boundaries that move
+   forward are kept. Returns the number of boundaries, or 0 
+   if there is no index or it belongs to another matrix */
+
+static uint32 mat_idx_read(msieve_obj *obj, uint32 ncols,
+			uint64 mat_file_size, mat_block_t *blocks) {
+
+	uint32 i, num_blocks;
+	uint32 max_dim;
+	mat_block_t idx_entries[MAT_IDX_DIM + 1];
+	char buf[256];
+	FILE *idx_fp;
+
+	sprintf(buf, "%s.mat.idx", obj->savefile.name);
+	idx_fp = fopen(buf, "rb");
+	if (idx_fp == NULL)
+		return 0;
+
+	if (fread(&max_dim, sizeof(uint32), (size_t)1, idx_fp) != 1 ||
+	    max_dim != MAT_IDX_DIM ||
+	    fseeko(idx_fp, (int64)((MAT_IDX_DIM * (MAT_IDX_DIM + 1) / 2 - 1) *
+	    			sizeof(mat_block_t)), SEEK_CUR) != 0 ||
+	    fread(idx_entries, sizeof(mat_block_t), 
+	    			(size_t)(MAT_IDX_DIM + 1), 
+				idx_fp) != MAT_IDX_DIM + 1) {
+		fclose(idx_fp);
+		return 0;
+	}
+	fclose(idx_fp);
+
+	if (idx_entries[MAT_IDX_DIM].col_start != ncols ||
+	    idx_entries[MAT_IDX_DIM].mat_file_offset != mat_file_size)
+		return 0;
+
+	blocks[0] = idx_entries[0];
+	for (i = num_blocks = 1; i <= MAT_IDX_DIM; i++) {
+		mat_block_t *prev = blocks + num_blocks - 1;
+
+		if (idx_entries[i].col_start > prev->col_start &&
+		    idx_entries[i].mat_file_offset > prev->mat_file_offset)
+			blocks[num_blocks++] = idx_entries[i];
+	}
+
+	return num_blocks;
+}
+
+#ifdef HAVE_MPI
 static void find_submatrix_bounds(msieve_obj *obj, uint32 *ncols,
-			uint32 *start_col, uint64 *mat_file_offset) {
+			uint32 *start_col, uint64 *mat_file_offset,
+			uint64 *mat_file_end) {
 
 	mat_block_t mat_block;
 	mat_block_t next_mat_block;
@@ -136,8 +198,8 @@ static void find_submatrix_bounds(msieve_obj *obj, uint32 *ncols,
 	*start_col = mat_block.col_start;
 	*ncols = next_mat_block.col_start - mat_block.col_start;
 	*mat_file_offset = mat_block.mat_file_offset;
+	*mat_file_end = next_mat_block.mat_file_offset;
 }
-
 #endif
 
 /*--------------------------------------------------------------------*/
@@ -176,9 +238,7 @@ void dump_matrix(msieve_obj *obj,
 	uint32 dense_row_words;
 	char buf[256];
 	FILE *matrix_fp;
-#ifdef HAVE_MPI
-	mat_idx_t *mpi_idx_data = mat_idx_init(sparse_weight);
-#endif
+	mat_idx_t *idx_data = mat_idx_init(sparse_weight);
 
 	dump_cycles(obj, cols, ncols);
 
@@ -198,16 +258,12 @@ void dump_matrix(msieve_obj *obj,
 		la_col_t *c = cols + i;
 		uint32 num = c->weight + dense_row_words;
 
-#ifdef HAVE_MPI
-		mat_idx_update(mpi_idx_data, matrix_fp, c->weight);
-#endif
+		mat_idx_update(idx_data, matrix_fp, c->weight);
 		fwrite(&c->weight, sizeof(uint32), (size_t)1, matrix_fp);
 		fwrite(c->data, sizeof(uint32), (size_t)num, matrix_fp);
 	}
 
-#ifdef HAVE_MPI
-	mat_idx_final(obj, mpi_idx_data, ncols, ftello(matrix_fp));
-#endif
+	mat_idx_final(obj, idx_data, ncols, ftello(matrix_fp));
 	fclose(matrix_fp);
 }
 
@@ -349,16 +405,21 @@ static int compare_uint32(const void *x, const void *y) {
 }
 
 /*--------------------------------------------------------------------*/
-#define FILE_CACHE_WORDS 20000
+#define FILE_CACHE_WORDS 1000000
 
 typedef struct {
+	FILE *fp;
+	uint64 words_left;
 	uint32 read_ptr;
 	uint32 num_valid;
 	uint32 *cache;
 } file_cache_t;
 
-static void file_cache_init(file_cache_t *f) {
+static void file_cache_init(file_cache_t *f, FILE *fp, 
+			uint64 num_words) {
 
+	f->fp = fp;
+	f->words_left = num_words;
 	f->read_ptr = 0;
 	f->num_valid = 0;
 	f->cache = (uint32 *)xmalloc(FILE_CACHE_WORDS * sizeof(uint32));
@@ -369,10 +430,14 @@ static void file_cache_free(file_cache_t *f) {
 	free(f->cache);
 }
 
-static void file_cache_get_next(msieve_obj *obj, FILE *fp,
-				file_cache_t *f, uint32 dense_row_words, 
-				uint32 *num_out, uint32 *entries,
-				uint32 read_submatrix) {
+/* return the entries of the next column, which stay valid
+   until the next call. The cache only ever reads the
+   words_left words it was told about, so that each thread
+   stops at the end of its own piece of the file */
+
+static uint32 * file_cache_get_next(file_cache_t *f, 
+				uint32 dense_row_words, 
+				uint32 *num_out) {
 
 	uint32 num;
 	uint32 words_left = f->num_valid - f->read_ptr;
@@ -380,46 +445,171 @@ static void file_cache_get_next(msieve_obj *obj, FILE *fp,
 	if (words_left < dense_row_words + 1 ||
 	    f->cache[f->read_ptr] + dense_row_words + 1 > words_left) {
 
+		uint32 num_read = (uint32)MIN(f->words_left,
+					FILE_CACHE_WORDS - words_left);
+
 		memmove(f->cache, f->cache + f->read_ptr, 
 				words_left * sizeof(uint32));
-#ifdef HAVE_MPI
-		/* only the top MPI row reads from disk */
+		f->num_valid = words_left + fread(f->cache + words_left, 
+						sizeof(uint32), num_read,
+						f->fp);
+		f->words_left -= f->num_valid - words_left;
+		f->read_ptr = 0;
 
-		if (obj->mpi_la_row_rank == 0) {
-#endif
-		f->num_valid = words_left +
-			fread(f->cache + words_left, sizeof(uint32),
-				FILE_CACHE_WORDS - words_left, fp);
+		if (f->num_valid < dense_row_words + 1 ||
+		    f->cache[0] + dense_row_words + 1 > f->num_valid) {
+			printf("error: matrix file truncated\n");
+			exit(-1);
+		}
+	}
+
+	num = f->cache[f->read_ptr];
+	if (num + dense_row_words > MAX_COL_IDEALS) {
+		printf("error: column too large; corrupt file?\n");
+		exit(-1);
+	}
+
+	*num_out = num;
+	f->read_ptr += num + dense_row_words + 1;
+	return f->cache + f->read_ptr - num - dense_row_words;
+}
+
+/*--------------------------------------------------------------------*/
+typedef struct {
+	char *file_name;
+	la_col_t *cols;
+	uint32 *rowperm;
+	uint32 *colperm;
+	uint32 dense_row_words;
+	uint32 start_row;
+	uint32 num_static_rows;
+	uint32 mpi_resclass;
+	uint32 mpi_nrows;
+} mat_read_t;
+
+typedef struct {
+	mat_read_t *m;
+	uint32 col_start;
+	uint32 ncols;
+	uint64 mat_file_offset;
+	uint64 mat_file_end;
+} mat_read_task_t;
+
+static void read_column(mat_read_t *m, la_col_t *c, 
+			uint32 *tmp_col, uint32 num) {
+
+	uint32 j, k;
+	uint32 *rowperm = m->rowperm;
 #ifdef HAVE_MPI
+	uint32 start_row = m->start_row;
+	uint32 num_static_rows = m->num_static_rows;
+	uint32 mpi_resclass = m->mpi_resclass;
+	uint32 mpi_nrows = m->mpi_nrows;
+#endif
+
+	k = num + m->dense_row_words;
+	c->data = NULL;
+	c->weight = num;
+
+	/* possibly permute the row numbers */
+
+	if (rowperm != NULL) {
+		for (j = 0; j < num; j++)
+			tmp_col[j] = rowperm[tmp_col[j]];
+	
+		if (num > 1) {
+			qsort(tmp_col, (size_t)num, 
+				sizeof(uint32), compare_uint32);
 		}
+	}
+
+#ifdef HAVE_MPI
+	/* pull out the row numbers that belong in this MPI process */
+
+	for (j = k = 0; j < num; j++) {
+		uint32 curr_row = tmp_col[j];
 
-		if (read_submatrix && obj->mpi_nrows > 1) {
-			/* broadcast the new cache size and new data 
-			   (if any) down the column */
+		if (curr_row < num_static_rows) {
+			if (start_row == 0)
+				tmp_col[k++] = curr_row;
+		}
+		else {
+			uint32 curr_resclass;
 
-			MPI_TRY(MPI_Bcast(&f->num_valid, 1, MPI_INT, 0, 
-						obj->mpi_la_col_grid))
+			curr_row -= num_static_rows;
+			curr_resclass = curr_row % mpi_nrows;
 
-			if (f->num_valid > words_left) {
-				MPI_TRY(MPI_Bcast(f->cache + words_left,
-						f->num_valid - words_left,
-						MPI_INT, 0, obj->mpi_la_col_grid))
+			if (curr_resclass == mpi_resclass) {
+				tmp_col[k] = curr_row / mpi_nrows;
+				if (start_row == 0)
+					tmp_col[k] += num_static_rows;
+				k++;
 			}
 		}
+	}
+	c->weight = k;
+
+	if (start_row == 0) {
+		for (j = 0; j < m->dense_row_words; j++)
+			tmp_col[k + j] = tmp_col[num + j];
+		k += m->dense_row_words;
+	}
 #endif
-		f->read_ptr = 0;
+	if (k > 0) {
+		c->data = (uint32 *)xmalloc(k * sizeof(uint32));
+		memcpy(c->data, tmp_col, k * sizeof(uint32));
 	}
+}
 
-	num = f->cache[f->read_ptr];
-	if (num + dense_row_words > MAX_COL_IDEALS) {
-		printf("error: column too large; corrupt file?\n");
+static void read_columns_core(void *data, int thread_num) {
+
+	mat_read_task_t *task = (mat_read_task_t *)data;
+	mat_read_t *m = task->m;
+	uint32 i;
+	FILE *matrix_fp;
+	file_cache_t file_cache;
+
+	/* every piece of the file gets its own handle, so
+	   the threads do not share a file position */
+
+	matrix_fp = fopen(m->file_name, "rb");
+	if (matrix_fp == NULL) {
+		printf("error: cannot open matrix file\n");
 		exit(-1);
 	}
+	fseeko(matrix_fp, task->mat_file_offset, SEEK_SET);
+	file_cache_init(&file_cache, matrix_fp, 
+			(task->mat_file_end - task->mat_file_offset) /
+				sizeof(uint32));
 
-	*num_out = num;
-	memcpy(entries, f->cache + f->read_ptr + 1,
-			(num + dense_row_words) * sizeof(uint32));
-	f->read_ptr += num + dense_row_words + 1;
+	for (i = 0; i < task->ncols; i++) {
+		uint32 col = task->col_start + i;
+		uint32 tmp_col[MAX_COL_IDEALS];
+		uint32 *entries;
+		uint32 num;
+
+		entries = file_cache_get_next(&file_cache, 
+					m->dense_row_words, &num);
+		memcpy(tmp_col, entries, (num + m->dense_row_words) *
+						sizeof(uint32));
+
+		if (m->colperm != NULL)
+			read_column(m, m->cols + m->colperm[col], 
+					tmp_col, num);
+		else
+			read_column(m, m->cols + col, tmp_col, num);
+	}
+
+	/* the piece must end exactly where the index says */
+
+	if (file_cache.words_left > 0 ||
+	    file_cache.read_ptr != file_cache.num_valid) {
+		printf("error: matrix file does not match its index\n");
+		exit(-1);
+	}
+
+	file_cache_free(&file_cache);
+	fclose(matrix_fp);
 }
 
 /*--------------------------------------------------------------------*/
@@ -431,20 +621,20 @@ void read_matrix(msieve_obj *obj,
 		uint32 *start_col_out, 
 		la_col_t **cols_out, uint32 *rowperm, uint32 *colperm) {
 
-	uint32 i, j, k;
-	uint32 dense_rows, dense_row_words;
+	uint32 i;
+	uint32 dense_rows;
 	uint32 ncols, max_ncols, start_col;
 	uint32 nrows, max_nrows, start_row;
-	uint32 mpi_resclass, mpi_nrows;
+	uint32 num_blocks, num_tasks;
+	uint64 mat_file_offset, mat_file_end;
 	la_col_t *cols;
 	char buf[256];
 	FILE *matrix_fp;
 	uint32 read_submatrix = (start_row_out != NULL &&
 				start_col_out != NULL);
-	file_cache_t file_cache;
-#ifdef HAVE_MPI
-	uint32 num_static_rows = 0;
-#endif
+	mat_read_t m;
+	mat_read_task_t *tasks;
+	mat_block_t blocks[MAT_IDX_DIM + 1];
 
 	if (read_submatrix && colperm != NULL) {
 		logprintf(obj, "error: cannot read submatrix with permute\n");
@@ -461,28 +651,37 @@ void read_matrix(msieve_obj *obj,
 	fread(&max_nrows, sizeof(uint32), (size_t)1, matrix_fp);
 	fread(&dense_rows, sizeof(uint32), (size_t)1, matrix_fp);
 	fread(&max_ncols, sizeof(uint32), (size_t)1, matrix_fp);
+	mat_file_offset = ftello(matrix_fp);
+	fseeko(matrix_fp, (int64)0, SEEK_END);
+	mat_file_end = ftello(matrix_fp);
+	fclose(matrix_fp);
 
 	/* default bounding rectangle on matrix read in */
 
-	dense_row_words = (dense_rows + 31) / 32;
+	memset(&m, 0, sizeof(m));
+	m.file_name = buf;
+	m.rowperm = rowperm;
+	m.colperm = colperm;
+	m.dense_row_words = (dense_rows + 31) / 32;
+	m.mpi_nrows = 1;
+
 	nrows = max_nrows;
 	ncols = max_ncols;
 	start_row = start_col = 0;
-	mpi_resclass = 0;
-	mpi_nrows = 1;
+	num_blocks = mat_idx_read(obj, max_ncols, mat_file_end, blocks);
 
 #ifdef HAVE_MPI
 	if (read_submatrix) {
-		/* read in only a subset of the matrix */
+		/* read in only a subset of the matrix. Every 
+		   process reads its own columns from disk */
 
-		uint64 mat_file_offset;
+		uint32 num_static_rows;
 
 		find_submatrix_bounds(obj, &ncols, &start_col,
-					&mat_file_offset);
-		fseeko(matrix_fp, mat_file_offset, SEEK_SET);
+					&mat_file_offset, &mat_file_end);
 
-		mpi_resclass = obj->mpi_la_row_rank;
-		mpi_nrows = obj->mpi_nrows;
+		m.mpi_resclass = obj->mpi_la_row_rank;
+		m.mpi_nrows = obj->mpi_nrows;
 
 		/* we perform an on-the-fly permutation of the rows,
 		   so that row i winds up in MPI row (i % mpi_nrows). 
@@ -507,93 +706,58 @@ void read_matrix(msieve_obj *obj,
 		/* increase the number of static rows until the
 		   remaining number of rows is a multiple of mpi_nrows */
 
-		num_static_rows += (nrows - num_static_rows) % mpi_nrows;
+		num_static_rows += (nrows - num_static_rows) % m.mpi_nrows;
 
 		/* finally, compute the starting row number for the
 		   current MPI process */
 
-		nrows = (nrows - num_static_rows) / mpi_nrows;
-		if (mpi_resclass == 0)
+		nrows = (nrows - num_static_rows) / m.mpi_nrows;
+		if (m.mpi_resclass == 0)
 			nrows += num_static_rows;
 		else
-			start_row = num_static_rows + mpi_resclass * nrows;
+			start_row = num_static_rows + m.mpi_resclass * nrows;
+
+		m.num_static_rows = num_static_rows;
+		m.start_row = start_row;
 	}
 #endif
 	cols = (la_col_t *)xcalloc((size_t)ncols, sizeof(la_col_t));
-
-	file_cache_init(&file_cache);
-
-	for (i = 0; i < ncols; i++) {
-		la_col_t *c;
-		uint32 tmp_col[MAX_COL_IDEALS];
-		uint32 num;
-		
-		if (colperm != NULL)
-			c = cols + colperm[i];
-		else
-			c = cols + i;
-
-		/* read the whole column */
-
-		file_cache_get_next(obj, matrix_fp, &file_cache,
-				dense_row_words, &num, tmp_col,
-				read_submatrix);
-		k = num + dense_row_words;
-		c->data = NULL;
-		c->weight = num;
-
-		/* possibly permute the row numbers */
-
-		if (rowperm != NULL) {
-			for (j = 0; j < num; j++)
-				tmp_col[j] = rowperm[tmp_col[j]];
-	
-			if (num > 1) {
-				qsort(tmp_col, (size_t)num, 
-					sizeof(uint32), compare_uint32);
-			}
-		}
-
-#ifdef HAVE_MPI
-		/* pull out the row numbers that belong in this MPI process */
-
-		for (j = k = 0; j < num; j++) {
-			uint32 curr_row = tmp_col[j];
-
-			if (curr_row < num_static_rows) {
-				if (start_row == 0)
-					tmp_col[k++] = curr_row;
-			}
-			else {
-				uint32 curr_resclass;
-
-				curr_row -= num_static_rows;
-				curr_resclass = curr_row % mpi_nrows;
-
-				if (curr_resclass == mpi_resclass) {
-					tmp_col[k] = curr_row / mpi_nrows;
-					if (start_row == 0)
-						tmp_col[k] += num_static_rows;
-					k++;
-				}
-			}
-		}
-		c->weight = k;
-
-		if (start_row == 0) {
-			for (j = 0; j < dense_row_words; j++)
-				tmp_col[k + j] = tmp_col[num + j];
-			k += dense_row_words;
-		}
-#endif
-		if (k > 0) {
-			c->data = (uint32 *)xmalloc(k * sizeof(uint32));
-			memcpy(c->data, tmp_col, k * sizeof(uint32));
-		}
+	m.cols = cols;
+
+	/* split the columns to be read at the index boundaries
+	   that fall inside them, and read the pieces in parallel.
+	   Without an index the whole range is one piece */
+
+	tasks = (mat_read_task_t *)xmalloc((MAT_IDX_DIM + 1) *
+					sizeof(mat_read_task_t));
+	tasks[0].m = &m;
+	tasks[0].col_start = 0;
+	tasks[0].mat_file_offset = mat_file_offset;
+	num_tasks = 1;
+
+	for (i = 0; i < num_blocks; i++) {
+		mat_read_task_t *t = tasks + num_tasks - 1;
+
+		if (blocks[i].col_start <= start_col + t->col_start ||
+		    blocks[i].col_start >= start_col + ncols)
+			continue;
+
+		t->ncols = blocks[i].col_start - start_col - t->col_start;
+		t->mat_file_end = blocks[i].mat_file_offset;
+
+		t++;
+		t->m = &m;
+		t->col_start = blocks[i].col_start - start_col;
+		t->mat_file_offset = blocks[i].mat_file_offset;
+		num_tasks++;
 	}
+	tasks[num_tasks - 1].ncols = ncols - tasks[num_tasks - 1].col_start;
+	tasks[num_tasks - 1].mat_file_end = mat_file_end;
+
+	lanczos_run_tasks(read_columns_core, tasks, sizeof(mat_read_task_t),
+			num_tasks, obj->num_threads);
+	free(tasks);
 
-	file_cache_free(&file_cache);
-	fclose(matrix_fp);
 	*cols_out = cols;
 	*ncols_out = ncols;
 	*nrows_out = nrows;
@@ -14,6 +14,37 @@ $Id$
 
 #include "lanczos.h"
 
+#ifdef HAVE_MPI
+
+/* non-blocking collectives first appeared in MPI 3.0; 
+   without them the communication in mul_sym_NxN_NxB
+   happens after all of the computation */
+
+#if MPI_VERSION >= 3
+#define DEFAULT_MPI_PIECES 4
+#endif
+
+/* state for sending off the parts of a matrix-vector
+   product that are finished */
+
+typedef struct {
+	packed_matrix_t *A;
+	v_t *buf;		/* the product */
+	v_t *out;		/* where our own part of it ends up */
+	uint32 size;		/* of the product */
+	uint32 num_chunks;	/* the product is sent in this many */
+	uint32 num_sent;
+	uint32 my_id;
+	uint32 scatter;		/* 0 = everyone gets all of the
+				   product, 1 = chunk i of the
+				   product goes to process i */
+	MPI_Comm comm;
+	MPI_Request req[MAX_MPI_GRID_DIM];
+	double comm_time;
+} overlap_t;
+
+#endif
+
 /*-------------------------------------------------------------------*/
 void mul_unpacked(packed_matrix_t *matrix,
 			  v_t *x, v_t *b) 
@@ -115,8 +146,25 @@ void packed_matrix_init(msieve_obj *obj,
 	p->mpi_la_col_rank = obj->mpi_la_col_rank;
 	p->mpi_la_row_grid = obj->mpi_la_row_grid;
 	p->mpi_la_col_grid = obj->mpi_la_col_grid;
+
+	p->mpi_pieces = 1;
+#if MPI_VERSION >= 3
+	p->mpi_pieces = DEFAULT_MPI_PIECES;
+	if (obj->nfs_args != NULL) {
+		const char *tmp = strstr(obj->nfs_args, "mpi_overlap=");
+
+		if (tmp != NULL)
+			p->mpi_pieces = atoi(tmp + 12);
+	}
+	p->mpi_pieces = MAX(p->mpi_pieces, 1);
+	p->mpi_pieces = MIN(p->mpi_pieces, MAX_MPI_GRID_DIM);
+#endif
+	p->mpi_num_mul = 0;
+	p->mpi_mul_time = 0;
+	p->mpi_comm_time = 0;
 #endif
 
+	la_prof_init(obj, p);
 	matrix_extra_init(obj, p, first_block_size);
 }
 
@@ -124,6 +172,7 @@ void packed_matrix_init(msieve_obj *obj,
 void packed_matrix_free(packed_matrix_t *p) {
 
 	matrix_extra_free(p);
+	la_prof_free(p);
 }
 
 /*-------------------------------------------------------------------*/
@@ -157,12 +206,133 @@ void mul_MxN_NxB(packed_matrix_t *A, void *x,
 	   MPI column, but this routine is called very rarely
 	   so it's not worth removing the redundancy */
 	
-	global_xor(scratch2, scratch, A->nrows, A->mpi_ncols,
+	global_xor(A, scratch2, scratch, A->nrows, A->mpi_ncols,
 			   A->mpi_la_col_rank, A->mpi_la_row_grid);
 
 #endif
 }
 
+#if defined(HAVE_MPI) && MPI_VERSION >= 3
+
+/*-------------------------------------------------------------------*/
+static void overlap_send(void *data, uint32 n) {
+
+	/* start combining every chunk of the product that
+	   lies entirely within its first n entries */
+
+	overlap_t *o = (overlap_t *)data;
+	double start_time = MPI_Wtime();
+	int flag;
+
+	while (o->num_sent < o->num_chunks) {
+		uint32 i = o->num_sent;
+		uint32 chunk_size, chunk_start;
+
+		global_chunk_info(o->size, o->num_chunks, i,
+				&chunk_size, &chunk_start);
+		if (chunk_start + chunk_size > n)
+			break;
+
+		if (o->scatter) {
+			MPI_TRY(MPI_Ireduce(o->buf + chunk_start, 
+					(i == o->my_id) ? o->out : NULL,
+					VWORDS * chunk_size, MPI_LONG_LONG,
+					MPI_BXOR, i, o->comm, o->req + i))
+		}
+		else {
+			MPI_TRY(MPI_Iallreduce(MPI_IN_PLACE, 
+					o->buf + chunk_start,
+					VWORDS * chunk_size, MPI_LONG_LONG,
+					MPI_BXOR, o->comm, o->req + i))
+		}
+		o->num_sent++;
+	}
+
+	/* many MPI implementations only make progress on
+	   non-blocking operations from inside MPI calls */
+
+	if (o->num_sent > 0) {
+		MPI_TRY(MPI_Testall(o->num_sent, o->req, &flag,
+					MPI_STATUSES_IGNORE))
+	}
+	o->comm_time += MPI_Wtime() - start_time;
+}
+
+/*-------------------------------------------------------------------*/
+static void overlap_wait(overlap_t *o) {
+
+	double start_time = MPI_Wtime();
+	uint64 prof_start = la_prof_start(o->A);
+
+	MPI_TRY(MPI_Waitall(o->num_sent, o->req, MPI_STATUSES_IGNORE))
+	la_prof_end(o->A, LA_PROF_COMM, prof_start, 
+			(uint64)o->size * sizeof(v_t));
+	o->comm_time += MPI_Wtime() - start_time;
+}
+
+/*-------------------------------------------------------------------*/
+static void mul_sym_overlap(packed_matrix_t *A, void *x, 
+			void *b, void *scratch) {
+
+	/* the same multiply as below, but with each half split
+	   into pieces; as each piece of the output finishes, it
+	   starts moving through the network with non-blocking
+	   collectives while the next piece is computed. The 
+	   reductions happen in place, so the transpose multiply 
+	   reads from scratch2 and writes to scratch instead of
+	   the other way around */
+
+	v_t *scratch2 = (v_t *)scratch + MAX(A->ncols, A->nrows);
+	overlap_t o;
+	double start_time;
+	uint64 prof_start;
+
+	memset(&o, 0, sizeof(o));
+	o.A = A;
+
+	/* make each MPI column gather its own part of x */
+	 
+	start_time = MPI_Wtime();
+	prof_start = la_prof_start(A);
+	global_allgather(x, scratch, A->ncols, A->mpi_nrows, 
+			A->mpi_la_row_rank, A->mpi_la_col_grid);
+	la_prof_end(A, LA_PROF_COMM, prof_start, 
+			(uint64)A->ncols * sizeof(v_t));
+	o.comm_time = MPI_Wtime() - start_time;
+	
+	/* make each MPI row combine its own part of A*x,
+	   one chunk for each piece */
+
+	o.buf = scratch2;
+	o.size = A->nrows;
+	o.num_chunks = A->mpi_pieces;
+	o.my_id = A->mpi_la_col_rank;
+	o.comm = A->mpi_la_row_grid;
+	mul_core_pieces(A, scratch, scratch2, A->mpi_pieces, 
+			overlap_send, &o);
+	overlap_wait(&o);
+		
+	/* make each MPI row combine and scatter its own part 
+	   of A^T * A*x. Chunk i of the product goes to 
+	   process i, so there are as many chunks as processes */
+
+	o.buf = scratch;
+	o.out = (v_t *)b;
+	o.size = A->ncols;
+	o.num_chunks = A->mpi_nrows;
+	o.num_sent = 0;
+	o.my_id = A->mpi_la_row_rank;
+	o.scatter = 1;
+	o.comm = A->mpi_la_col_grid;
+	mul_trans_core_pieces(A, scratch2, scratch, A->mpi_pieces,
+			overlap_send, &o);
+	overlap_wait(&o);
+
+	A->mpi_comm_time += o.comm_time;
+}
+
+#endif
+
 /*-------------------------------------------------------------------*/
 void mul_sym_NxN_NxB(packed_matrix_t *A, void *x, 
 			void *b, void *scratch) {
@@ -174,6 +344,8 @@ void mul_sym_NxN_NxB(packed_matrix_t *A, void *x,
 
 #ifdef HAVE_MPI
 	v_t *scratch2 = (v_t *)scratch + MAX(A->ncols, A->nrows);
+	double start_time, comm_start;
+	uint64 prof_start;
         
 	if (A->mpi_size <= 1) {
 #endif
@@ -182,24 +354,79 @@ void mul_sym_NxN_NxB(packed_matrix_t *A, void *x,
 #ifdef HAVE_MPI
 		return;
 	}
+
+	start_time = MPI_Wtime();
+	A->mpi_num_mul++;
+
+#if MPI_VERSION >= 3
+	if (A->mpi_pieces > 1) {
+		mul_sym_overlap(A, x, b, scratch);
+		A->mpi_mul_time += MPI_Wtime() - start_time;
+		return;
+	}
+#endif
     
 	/* make each MPI column gather its own part of x */
 	 
+	prof_start = la_prof_start(A);
 	global_allgather(x, scratch, A->ncols, A->mpi_nrows, 
 			A->mpi_la_row_rank, A->mpi_la_col_grid);
+	la_prof_end(A, LA_PROF_COMM, prof_start, 
+			(uint64)A->ncols * sizeof(v_t));
+	A->mpi_comm_time += MPI_Wtime() - start_time;
 	
 	mul_core(A, scratch, scratch2);
 		
 	/* make each MPI row combine its own part of A*x */
 	
-	global_xor(scratch2, scratch, A->nrows, A->mpi_ncols,
+	comm_start = MPI_Wtime();
+	prof_start = la_prof_start(A);
+	global_xor(A, scratch2, scratch, A->nrows, A->mpi_ncols,
 			   A->mpi_la_col_rank, A->mpi_la_row_grid);
+	la_prof_end(A, LA_PROF_COMM, prof_start, 
+			(uint64)A->nrows * sizeof(v_t));
+	A->mpi_comm_time += MPI_Wtime() - comm_start;
 		
 	mul_trans_core(A, scratch, scratch2);
 		
 	/* make each MPI row combine and scatter its own part of A^T * A*x */
 		
-	global_xor_scatter(scratch2, b, scratch,  A->ncols, A->mpi_nrows, 
+	comm_start = MPI_Wtime();
+	prof_start = la_prof_start(A);
+	global_xor_scatter(A, scratch2, b, scratch,  A->ncols, A->mpi_nrows, 
 			A->mpi_la_row_rank, A->mpi_la_col_grid);
+	la_prof_end(A, LA_PROF_COMM, prof_start, 
+			(uint64)A->ncols * sizeof(v_t));
+	A->mpi_comm_time += MPI_Wtime() - comm_start;
+	A->mpi_mul_time += MPI_Wtime() - start_time;
 #endif
 }
+
+#ifdef HAVE_MPI
+/*-------------------------------------------------------------------*/
+void mul_report_mpi_time(msieve_obj *obj, packed_matrix_t *A) {
+
+	/* the communication time is only the time spent waiting
+	   for it; whatever overlaps the computation is free */
+
+	double t[2], sum[2];
+	uint32 num_mul = MAX(A->mpi_num_mul, 1);
+
+	if (A->mpi_size <= 1)
+		return;
+
+	t[0] = A->mpi_mul_time / num_mul;
+	t[1] = A->mpi_comm_time / num_mul;
+	MPI_TRY(MPI_Reduce(t, sum, 2, MPI_DOUBLE, MPI_SUM, 0, 
+				obj->mpi_la_grid))
+
+	if (obj->mpi_la_row_rank + obj->mpi_la_col_rank == 0) {
+		sum[0] = 1000 * sum[0] / A->mpi_size;
+		sum[1] = 1000 * sum[1] / A->mpi_size;
+		logprintf(obj, "matrix multiply: %.2f ms compute, "
+			"%.2f ms communication per iteration "
+			"(%u pieces)\n", sum[0] - sum[1], sum[1],
+			A->mpi_pieces);
+	}
+}
+#endif
@@ -0,0 +1,243 @@
+/*--------------------------------------------------------------------
+This source distribution is placed in the public domain by its author,
+Jason Papadopoulos. You may use it for any purpose, free of charge,
+without having to notify anyone. I disclaim any responsibility for any
+errors.
+
+Optionally, please be nice and tell me if you find this source to be
+useful. Again optionally, if you add to the functionality present here
+please consider making those additions public too, so that others may
+benefit from your work.
+
+$Id$
+--------------------------------------------------------------------*/
+
+#include "lanczos.h"
+
+/* Profiling of the Lanczos iteration. With 'la_profile=X'
+   the log gets a summary of where the time went every X
+   iterations (or only at the end if X is 0), and the same
+   numbers are appended to <savefile>.prof in a form that
+   scripts can read: one line per counter, giving
+
+   	iteration name cycles calls bytes
+
+   For MPI runs each process profiles its own work, and
+   writes <savefile>.mpiNN.prof */
+
+static const char * phase_names[LA_PROF_NUM_PHASES] = {
+	"mul",
+	"mul_trans",
+	"comm",
+	"inner",
+	"outer",
+	"vector",
+	"check",
+};
+
+static const char * phase_desc[LA_PROF_NUM_PHASES] = {
+	"matrix multiply",
+	"transpose multiply",
+	"MPI communication",
+	"inner products",
+	"outer products",
+	"other vector ops",
+	"checks",
+};
+
+static const char * task_names[LA_PROF_NUM_TASKS] = {
+	"mul",
+	"mul_dense",
+	"trans",
+	"trans_dense",
+};
+
+/*-------------------------------------------------------------------*/
+void la_prof_init(msieve_obj *obj, packed_matrix_t *A) {
+
+	const char *tmp;
+	la_prof_t *prof;
+
+	A->prof = NULL;
+	if (obj->nfs_args == NULL)
+		return;
+
+	tmp = strstr(obj->nfs_args, "la_profile=");
+	if (tmp == NULL)
+		return;
+
+	A->prof = prof = (la_prof_t *)xcalloc(1, sizeof(la_prof_t));
+	prof->interval = atoi(tmp + 11);
+
+#ifdef HAVE_MPI
+	sprintf(prof->name, "%s.mpi%02u.prof",
+			obj->savefile.name, obj->mpi_rank);
+#else
+	sprintf(prof->name, "%s.prof", obj->savefile.name);
+#endif
+}
+
+/*-------------------------------------------------------------------*/
+void la_prof_free(packed_matrix_t *A) {
+
+	free(A->prof);
+	A->prof = NULL;
+}
+
+/*-------------------------------------------------------------------*/
+static void prof_write(msieve_obj *obj, la_prof_t *prof,
+			uint32 iter, uint64 total) {
+
+	uint32 i, j;
+	FILE *fp;
+
+	if (prof->name[0] == 0)
+		return;
+
+	fp = fopen(prof->name, "a");
+	if (fp == NULL) {
+		logprintf(obj, "warning: cannot open profile "
+				"file %s\n", prof->name);
+		prof->name[0] = 0;
+		return;
+	}
+
+	fprintf(fp, "%u total %" PRIu64 " %u 0\n", iter, total,
+			iter - prof->first_iter);
+
+	for (i = 0; i < LA_PROF_NUM_PHASES; i++) {
+		fprintf(fp, "%u %s %" PRIu64 " %" PRIu64 " %" PRIu64 "\n",
+				iter, phase_names[i], prof->cycles[i],
+				prof->calls[i], prof->bytes[i]);
+	}
+
+	/* a thread's tasks run once per multiply */
+
+	for (i = 0; i < prof->num_threads; i++) {
+		for (j = 0; j < LA_PROF_NUM_TASKS; j++) {
+			uint64 calls = prof->calls[j < LA_PROF_TASK_TRANS ?
+						LA_PROF_MUL :
+						LA_PROF_MUL_TRANS];
+
+			fprintf(fp, "%u thread%u.%s %" PRIu64 " %" PRIu64
+					" %" PRIu64 "\n",
+					iter, i, task_names[j],
+					prof->thread_cycles[j][i], calls,
+					calls * prof->thread_bytes[j][i]);
+		}
+	}
+
+	fclose(fp);
+}
+
+/*-------------------------------------------------------------------*/
+static void prof_summary(msieve_obj *obj, la_prof_t *prof, uint32 iter) {
+
+	uint32 i;
+	uint64 total = read_clock() - prof->start_clock;
+	uint64 other = total;
+	uint32 num_iter = MAX(iter - prof->first_iter, 1);
+	double scale = 100.0 / MAX(total, 1);
+
+	logprintf(obj, "profile of %u iterations: %.2f Mcycles "
+			"per iteration\n", num_iter,
+			(double)total / num_iter / 1e6);
+
+	for (i = 0; i < LA_PROF_NUM_PHASES; i++) {
+		uint64 cycles = prof->cycles[i];
+
+		if (prof->calls[i] == 0)
+			continue;
+
+		logprintf(obj, "   %-20s %5.1f%%  %8.3f Mcycles/iter  "
+				"%6.2f bytes/cycle\n", phase_desc[i],
+				cycles * scale,
+				(double)cycles / num_iter / 1e6,
+				(double)prof->bytes[i] / MAX(cycles, 1));
+
+		other -= MIN(other, cycles);
+	}
+
+	/* what's left is mostly the VBITSxVBITS matrix
+	   arithmetic between the vector operations */
+
+	logprintf(obj, "   %-20s %5.1f%%  %8.3f Mcycles/iter\n",
+			"dense ops and other", other * scale,
+			(double)other / num_iter / 1e6);
+
+	/* a thread that is busy for much less of the multiply
+	   than the others is waiting on them */
+
+	for (i = 0; i < prof->num_threads &&
+			prof->num_threads > 1; i++) {
+
+		uint64 mul = prof->thread_cycles[LA_PROF_TASK_MUL][i] +
+			     prof->thread_cycles[LA_PROF_TASK_MUL_DENSE][i];
+		uint64 trans = prof->thread_cycles[LA_PROF_TASK_TRANS][i] +
+			     prof->thread_cycles[LA_PROF_TASK_TRANS_DENSE][i];
+
+		logprintf(obj, "   thread %2u busy for %5.1f%% of multiply, "
+				"%5.1f%% of transpose multiply\n", i,
+				100.0 * mul /
+				MAX(prof->cycles[LA_PROF_MUL], 1),
+				100.0 * trans /
+				MAX(prof->cycles[LA_PROF_MUL_TRANS], 1));
+	}
+
+	prof_write(obj, prof, iter, total);
+}
+
+/*-------------------------------------------------------------------*/
+void la_prof_iter(msieve_obj *obj, packed_matrix_t *A, uint32 iter) {
+
+	la_prof_t *prof = A->prof;
+
+	if (prof == NULL)
+		return;
+
+	/* the first iteration starts the clock; anything
+	   counted before it was part of the setup */
+
+	if (prof->start_clock == 0) {
+		FILE *fp;
+
+		memset(prof->cycles, 0, sizeof(prof->cycles));
+		memset(prof->calls, 0, sizeof(prof->calls));
+		memset(prof->bytes, 0, sizeof(prof->bytes));
+		memset(prof->thread_cycles, 0,
+				sizeof(prof->thread_cycles));
+
+		prof->first_iter = iter - 1;
+		prof->next_report = iter - 1 + prof->interval;
+		prof->start_clock = read_clock();
+
+		fp = fopen(prof->name, "w");
+		if (fp == NULL) {
+			logprintf(obj, "warning: cannot open profile "
+					"file %s\n", prof->name);
+			prof->name[0] = 0;
+		}
+		else {
+			fprintf(fp, "# iteration name cycles "
+					"calls bytes\n");
+			fclose(fp);
+		}
+		return;
+	}
+
+	if (prof->interval && iter - 1 >= prof->next_report) {
+		prof_summary(obj, prof, iter - 1);
+		prof->next_report += prof->interval;
+	}
+}
+
+/*-------------------------------------------------------------------*/
+void la_prof_report(msieve_obj *obj, packed_matrix_t *A, uint32 iter) {
+
+	la_prof_t *prof = A->prof;
+
+	if (prof == NULL || prof->start_clock == 0)
+		return;
+
+	prof_summary(obj, prof, iter);
+}
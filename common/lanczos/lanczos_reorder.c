@@ -6,748 +6,1080 @@ errors.
 
 Optionally, please be nice and tell me if you find this source to be
 useful. Again optionally, if you add to the functionality present here
-please consider making those additions public too, so that others may 
-benefit from your work.	
+please consider making those additions public too, so that others may
+benefit from your work.
 
 $Id$
 --------------------------------------------------------------------*/
 
 #include "lanczos.h"
 
-typedef struct {
-	int16 cost;
-	uint32 num_edges : 12;
-	uint32 visited : 1;
-	uint32 boundary : 1;
-	uint32 partition : 1;
-	uint32 is_col : 1;
-	uint32 orig_index;
-	uint32 edge_offset;
-
-	uint32 next;
-	uint32 prev;
-} vertex_t;
+/* Reordering the matrix for faster multiplies.
+
+   The rows and columns of the matrix are the two kinds of
+   vertex in a bipartite graph, with one edge per nonzero.
+   Splitting the graph into two halves with few edges
+   between them, then moving the vertices that touch the
+   other half (the separator) to the end, puts the matrix
+   into the form
+
+		A 0 x
+		0 B x
+		x x x
+
+   and doing the same to A and B recursively concentrates
+   the nonzeros into small diagonal blocks plus thin borders,
+   so that a stripe of the matrix only touches a small piece
+   of the vectors it multiplies.
+
+   Each split is found with the usual multilevel scheme: the
+   graph is coarsened by repeatedly merging pairs of vertices
+   joined by heavy edges, the small graph left at the end is
+   split by growing one half from a random vertex, and the
+   split is carried back through the finer graphs with a
+   few passes of greedy refinement at each level. The pieces
+   at each level of the recursion are independent, so they
+   are split in parallel, and each piece uses its own random
+   numbers so the result does not depend on the number of
+   threads.
+
+   Rows much heavier than average connect everything to
+   everything else; they stay at the top of the matrix,
+   where the densest rows already are, and are not part
+   of the graph */
 
 typedef struct {
-	uint32 num_rows;
-	uint32 num_cols;
-	uint32 num_rows_orig;
-	uint32 num_cols_orig;
-
-	vertex_t *vertex;
+	uint32 num_vertex;
+	uint64 num_edges;
+	uint32 *vertex_wgt;
+	uint64 *offsets;	/* num_vertex + 1 of these */
 	uint32 *edges;
-
-	uint32 stack_alloc;
-	uint32 stack_num;
-	uint32 *stack;
+	uint32 *edge_wgt;
+	uint32 *map;		/* finest graph only: matrix column i
+				   is vertex i, matrix row i is vertex
+				   ncols + i */
 } graph_t;
 
 typedef struct {
-	int32 num_bins;
-	int32 next_bin;
-	int32 bias;
-
-	vertex_t *hashtable;
+	uint32 ncols;
+	uint32 *rowperm;
+	uint32 *colperm;
+	uint32 *rowblock;	/* diagonal block of each row and */
+	uint32 *colblock;	/* column, for the report at the end */
+} reorder_t;
 
-	uint32 partition_max[2];
-	uint32 partition_size[2][2];
-} heap_t;
+typedef struct {
+	reorder_t *r;
+	graph_t graph;
+	uint32 row_pos;
+	uint32 col_pos;
+	uint32 seed1;
+	uint32 seed2;
 
-#define MIN_ROW_IDX 50000
+	uint32 num_children;
+	graph_t child[2];
+	uint32 child_row_pos[2];
+	uint32 child_col_pos[2];
+} split_task_t;
 
 #define INVALID_INDEX ((uint32)(-1))
 
-/*--------------------------------------------------------------------*/
-#define MAX_ROW_ENTRIES 1000
-#define MAX_EDGES 40
+/* rows with more than this many times the average
+   number of nonzeros are left out of the graph */
 
-static void graph_init(msieve_obj *obj, graph_t *graph, heap_t *heap) {
+#define MAX_ROW_WEIGHT_RATIO 4
 
-	uint32 i, j, k;
-	uint32 nrows;
-	uint32 dense_row_words;
-	uint32 ncols;
-	char buf[256];
-	FILE *matrix_fp;
+/* pieces with fewer columns than this are not split,
+   and neither are pieces whose separator would have more
+   than this fraction of their vertices; such a piece has
+   no structure left that is worth splitting it for */
 
-	uint32 num_edges;
-	uint32 num_edges_alloc;
-	uint32 *edges;
-	vertex_t *vertex;
-	uint32 num_vertex;
+#define MIN_BLOCKSIZE 4000
+#define MAX_SEPARATOR_FRAC 0.05
 
-	sprintf(buf, "%s.mat", obj->savefile.name);
-	matrix_fp = fopen(buf, "rb");
-	if (matrix_fp == NULL) {
-		logprintf(obj, "error: can't open matrix file\n");
-		exit(-1);
-	}
+/* coarsening stops at this many vertices, or when
+   a level removes too few of them */
 
-	fread(&nrows, sizeof(uint32), (size_t)1, matrix_fp);
-	fread(&dense_row_words, sizeof(uint32), (size_t)1, matrix_fp);
-	fread(&ncols, sizeof(uint32), (size_t)1, matrix_fp);
-	dense_row_words = (dense_row_words + 31) / 32;
+#define COARSEST_SIZE 2000
+#define MAX_LEVELS 50
 
-	vertex = (vertex_t *)xcalloc((size_t)ncols + nrows - MIN_ROW_IDX, 
-					sizeof(vertex_t));
+/* the larger half of a split can weigh this much more
+   than half the total */
 
-	num_vertex = 0;
-	num_edges = 0;
-	num_edges_alloc = 100000;
-	edges = (uint32 *)xmalloc(num_edges_alloc * sizeof(uint32));
+#define BALANCE_TOL 0.03
 
-	for (i = 0; i < ncols; i++) {
+#define NUM_INIT_TRIES 8
+#define MAX_REFINE_PASSES 8
 
-		uint32 num_row_idx;
-		uint32 row_entries[MAX_ROW_ENTRIES];
-		vertex_t *v;
+/*--------------------------------------------------------------------*/
+static void graph_alloc(graph_t *g, uint32 num_vertex,
+			uint64 num_edges, uint32 with_map) {
+
+	g->num_vertex = num_vertex;
+	g->num_edges = num_edges;
+	g->vertex_wgt = (uint32 *)xmalloc(MAX(num_vertex, 1) *
+					sizeof(uint32));
+	g->offsets = (uint64 *)xmalloc((num_vertex + 1) * sizeof(uint64));
+	g->edges = (uint32 *)xmalloc(MAX(num_edges, 1) * sizeof(uint32));
+	g->edge_wgt = (uint32 *)xmalloc(MAX(num_edges, 1) * sizeof(uint32));
+	g->map = NULL;
+	if (with_map) {
+		g->map = (uint32 *)xmalloc(MAX(num_vertex, 1) *
+						sizeof(uint32));
+	}
+}
 
-		fread(&num_row_idx, sizeof(uint32), 
-				(size_t)1, matrix_fp);
-		fread(row_entries, sizeof(uint32), 
-				(size_t)(num_row_idx + dense_row_words), 
-				matrix_fp);
+static void graph_free(graph_t *g) {
 
-		if (num_edges + num_row_idx >= num_edges_alloc) {
-			num_edges_alloc *= 1.4;
-			edges = (uint32 *)xrealloc(edges, num_edges_alloc *
-						sizeof(uint32));
-		}
+	free(g->vertex_wgt);
+	free(g->offsets);
+	free(g->edges);
+	free(g->edge_wgt);
+	free(g->map);
+	memset(g, 0, sizeof(graph_t));
+}
 
-		for (j = num_row_idx, k = 0; j; j--) {
-			uint32 row = row_entries[j-1];
+/*--------------------------------------------------------------------*/
+static void graph_init(msieve_obj *obj, graph_t *g,
+			la_col_t *cols, uint32 nrows, 
+			uint32 dense_rows, uint32 ncols) {
 
-			if (row < MIN_ROW_IDX)
-				break;
+	/* build the bipartite graph of the sparse part
+	   of the matrix. The rows that the solver handles
+	   specially must not move, so they are left out */
 
-			v = vertex + ncols + row - MIN_ROW_IDX;
-			if (v->num_edges < MAX_EDGES) {
-				v->num_edges++;
-				edges[num_edges + k] = row - MIN_ROW_IDX;
-				k++;
-			}
-		}
-		if (k == 0 || (num_row_idx - k) > MAX_EDGES)
-			continue;
+	uint32 i, j;
+	uint32 num_vertex;
+	uint32 num_rows, num_cols;
+	uint32 max_row_weight;
+	uint32 fixed_rows = MAX(dense_rows, POST_LANCZOS_ROWS);
+	uint32 *row_weight;
+	uint32 *row_vertex;
+	uint64 num_edges = 0;
+	uint64 *row_fill;
+
+	row_weight = (uint32 *)xcalloc((size_t)nrows, sizeof(uint32));
+	for (i = 0; i < ncols; i++) {
+		la_col_t *c = cols + i;
+
+		for (j = 0; j < c->weight; j++)
+			row_weight[c->data[j]]++;
+		num_edges += c->weight;
+	}
 
-		v = vertex + num_vertex++;
-		v->num_edges = k;
-		v->is_col = 1;
-		v->orig_index = i;
-		v->edge_offset = num_edges;
-		num_edges += k;
+	for (i = j = 0; i < nrows; i++) {
+		if (row_weight[i] > 0)
+			j++;
 	}
-	fclose(matrix_fp);
+	max_row_weight = MAX_ROW_WEIGHT_RATIO * num_edges / MAX(j, 1);
+	max_row_weight = MAX(max_row_weight, 2);
 
-	for (i = num_edges = 0; i < num_vertex; i++) {
-		vertex_t *v = vertex + i;
-		uint32 curr_num_edges = v->num_edges;
-		uint32 *row_list = edges + v->edge_offset;
+	for (i = 0; i < MIN(fixed_rows, nrows); i++)
+		row_weight[i] = (uint32)(-1);
 
-		for (j = k = 0; j < curr_num_edges; j++) {
-			uint32 row = row_list[j];
-			vertex_t *row_v = vertex + ncols + row;
+	/* number the columns that have edges left first,
+	   then the rows */
 
-			if (row_v->num_edges < MAX_EDGES) {
-				edges[num_edges + k] = row;
-				k++;
-			}
+	row_vertex = (uint32 *)xmalloc(nrows * sizeof(uint32));
+	num_edges = 0;
+	for (i = 0; i < nrows; i++) {
+		row_vertex[i] = INVALID_INDEX;
+		if (row_weight[i] > 0 && row_weight[i] <= max_row_weight)
+			num_edges += row_weight[i];
+	}
+
+	for (i = num_cols = 0; i < ncols; i++) {
+		la_col_t *c = cols + i;
+
+		for (j = 0; j < c->weight; j++) {
+			uint32 w = row_weight[c->data[j]];
+			if (w <= max_row_weight)
+				break;
 		}
-		v->num_edges = k;
-		v->edge_offset = num_edges;
-		num_edges += k;
+		if (j < c->weight)
+			num_cols++;
 	}
 
-	for (i = 0; i < nrows - MIN_ROW_IDX; i++) {
-		vertex[ncols + i].num_edges = 0;
+	for (i = num_rows = 0; i < nrows; i++) {
+		if (row_weight[i] > 0 && row_weight[i] <= max_row_weight)
+			row_vertex[i] = num_cols + num_rows++;
 	}
+	num_vertex = num_cols + num_rows;
 
-	for (i = j = 0; i < num_vertex; i++) {
-		vertex_t *v = vertex + i;
-		if (v->num_edges > 0) {
-			uint32 curr_num_edges = v->num_edges;
-			uint32 *row_list = edges + v->edge_offset;
+	graph_alloc(g, num_vertex, 2 * num_edges, 1);
 
-			for (k = 0; k < curr_num_edges; k++) {
-				vertex_t *row_v = vertex + ncols + row_list[k];
-				row_v->num_edges++;
-			}
-			vertex[j++] = *v;
+	/* the columns' edges come first, in column order,
+	   followed by room for each row's edges */
+
+	g->offsets[0] = 0;
+	for (i = j = 0; i < ncols; i++) {
+		la_col_t *c = cols + i;
+		uint64 k = g->offsets[j];
+		uint32 m;
+
+		for (m = 0; m < c->weight; m++) {
+			uint32 v = row_vertex[c->data[m]];
+			if (v != INVALID_INDEX)
+				g->edges[k++] = v;
 		}
-	}
-	num_vertex = j;
-
-	for (i = 0, j = num_edges, k = num_vertex; 
-				i < nrows - MIN_ROW_IDX; i++) {
-		vertex_t *v = vertex + ncols + i;
-		if (v->num_edges > 0 && v->num_edges < MAX_EDGES) {
-			v->orig_index = i + MIN_ROW_IDX;
-			v->is_col = 0;
-			v->edge_offset = j;
-			v->next = k++;
-			j += v->num_edges;
+		if (k > g->offsets[j]) {
+			g->map[j] = i;
+			g->offsets[++j] = k;
 		}
 	}
 
-	for (i = 0; i < num_vertex; i++) {
-		vertex_t *v = vertex + i;
-		uint32 curr_num_edges = v->num_edges;
-		uint32 *row_list = edges + v->edge_offset;
+	/* the rows' edges are the transpose of the columns' */
 
-		for (j = 0; j < curr_num_edges; j++) {
-			vertex_t *row_v = vertex + ncols + row_list[j];
-			row_list[j] = row_v->next;
+	row_fill = (uint64 *)xmalloc(MAX(num_rows, 1) * sizeof(uint64));
+	for (i = 0; i < nrows; i++) {
+		uint32 v = row_vertex[i];
+		if (v != INVALID_INDEX) {
+			g->map[v] = ncols + i;
+			g->offsets[v + 1] = g->offsets[v] + row_weight[i];
+			row_fill[v - num_cols] = g->offsets[v];
 		}
 	}
 
-	for (i = j = 0; i < nrows - MIN_ROW_IDX; i++) {
-		vertex_t *v = vertex + ncols + i;
-		if (v->num_edges > 0 && v->num_edges < MAX_EDGES) {
-			vertex[num_vertex + j] = *v;
-			j++;
+	for (i = 0; i < num_cols; i++) {
+		uint64 k;
+
+		for (k = g->offsets[i]; k < g->offsets[i + 1]; k++) {
+			uint32 v = g->edges[k];
+			g->edges[row_fill[v - num_cols]++] = i;
 		}
 	}
+	free(row_fill);
+
+	for (i = 0; i < num_vertex; i++)
+		g->vertex_wgt[i] = 1;
+	for (num_edges = 0; num_edges < g->num_edges; num_edges++)
+		g->edge_wgt[num_edges] = 1;
+
+	logprintf(obj, "reordering sparse core of %u x %u, "
+			"%" PRIu64 " nonzeros\n",
+			num_rows, num_cols, g->num_edges / 2);
+	logprintf(obj, "%u dense or empty rows and rows with "
+			"more than %u nonzeros stay at the top\n",
+			nrows - num_rows, max_row_weight);
+
+	free(row_weight);
+	free(row_vertex);
+}
 
-	graph->num_cols_orig = ncols;
-	graph->num_rows_orig = nrows;
-	logprintf(obj, "matrix is %u x %u\n", nrows, ncols);
-	graph->num_cols = ncols = num_vertex;
-	graph->num_rows = nrows = j;
-	logprintf(obj, "sparse core is %u x %u\n", nrows, ncols);
-	logprintf(obj, "graph has %u edges\n", num_edges);
-	logprintf(obj, "memory use: %.2lf MB\n", 
-			((nrows + ncols) * sizeof(vertex_t) +
-			 2 * num_edges * sizeof(uint32)) / 1048576.0);
+/*--------------------------------------------------------------------*/
+static void graph_extract(graph_t *g, uint8 *part,
+			uint32 side, uint32 *new_index,
+			graph_t *child) {
 
-	edges = (uint32 *)xrealloc(edges, 2 * num_edges * sizeof(uint32));
+	/* build the piece of g with part[] equal to side */
 
-	for (i = 0; i < ncols; i++) {
-		vertex_t *v = vertex + i;
-		uint32 curr_num_edges = v->num_edges;
-		uint32 *row_list = edges + v->edge_offset;
-
-		for (j = 0; j < curr_num_edges; j++) {
-			vertex_t *row_v = vertex + row_list[j];
-			uint32 *row_edges = edges + row_v->edge_offset;
-			row_edges[row_v->prev++] = i;
+	uint32 i, j;
+	uint64 k, num_edges;
+
+	for (i = j = 0, num_edges = 0; i < g->num_vertex; i++) {
+		new_index[i] = INVALID_INDEX;
+		if (part[i] != side)
+			continue;
+
+		new_index[i] = j++;
+		for (k = g->offsets[i]; k < g->offsets[i + 1]; k++) {
+			if (part[g->edges[k]] == side)
+				num_edges++;
 		}
 	}
 
-	for (i = j = 0; i < nrows + ncols; i++) {
-		vertex_t *v = vertex + i;
-		j = MAX(j, v->num_edges);
+	graph_alloc(child, j, num_edges, 1);
+
+	child->offsets[0] = 0;
+	for (i = j = 0, num_edges = 0; i < g->num_vertex; i++) {
+		if (part[i] != side)
+			continue;
+
+		for (k = g->offsets[i]; k < g->offsets[i + 1]; k++) {
+			uint32 v = g->edges[k];
+			if (part[v] == side) {
+				child->edges[num_edges] = new_index[v];
+				child->edge_wgt[num_edges++] = 1;
+			}
+		}
+		child->vertex_wgt[j] = 1;
+		child->map[j] = g->map[i];
+		child->offsets[++j] = num_edges;
 	}
-	logprintf(obj, "max edge weight is %u\n", j);
-	graph->edges = edges;
-	graph->vertex = (vertex_t *)xrealloc(vertex, 
-					(nrows + ncols + 2 * j) *
-					sizeof(vertex_t));
-	heap->num_bins = 2 * j;
-	heap->bias = j;
-	heap->hashtable = graph->vertex + (nrows + ncols);
+}
+
+/*--------------------------------------------------------------------*/
+static void random_perm(uint32 *perm, uint32 n,
+			uint32 *seed1, uint32 *seed2) {
+
+	uint32 i;
+
+	for (i = 0; i < n; i++)
+		perm[i] = i;
 
-	graph->stack_alloc = 100;
-	graph->stack = (uint32 *)xmalloc(graph->stack_alloc * sizeof(uint32));
+	for (i = n; i > 1; i--) {
+		uint32 j = get_rand(seed1, seed2) % i;
+		uint32 tmp = perm[i - 1];
+		perm[i - 1] = perm[j];
+		perm[j] = tmp;
+	}
 }
 
 /*--------------------------------------------------------------------*/
-static void graph_free(graph_t *graph, uint32 **rowperm_out,
-			uint32 **colperm_out) {
+static uint32 graph_coarsen(graph_t *g, graph_t *coarse,
+			uint32 *cmap, uint64 total_wgt,
+			uint32 *seed1, uint32 *seed2) {
+
+	/* merge each vertex with the unmatched neighbor it
+	   shares the heaviest edge with. Returns the number
+	   of vertices in the coarse graph */
 
 	uint32 i, j;
-	uint32 nrows = graph->num_rows;
-	uint32 ncols = graph->num_cols;
-	uint32 nrows_orig = graph->num_rows_orig;
-	uint32 ncols_orig = graph->num_cols_orig;
-	uint32 rowgap = nrows_orig - nrows;
-	uint32 colgap = ncols_orig - ncols;
-	uint32 *rowperm;
-	uint32 *colperm;
+	uint32 nv = g->num_vertex;
+	uint32 num_coarse;
+	uint32 max_wgt = MAX(2, 3 * total_wgt / (2 * COARSEST_SIZE));
+	uint32 *perm = (uint32 *)xmalloc(nv * sizeof(uint32));
+	uint32 *match = (uint32 *)xmalloc(nv * sizeof(uint32));
+	uint64 *marker;
+	uint64 k, num_edges;
+
+	random_perm(perm, nv, seed1, seed2);
+	for (i = 0; i < nv; i++)
+		match[i] = INVALID_INDEX;
+
+	for (i = 0; i < nv; i++) {
+		uint32 v = perm[i];
+		uint32 best = v;
+		uint32 best_wgt = 0;
+
+		if (match[v] != INVALID_INDEX)
+			continue;
+
+		for (k = g->offsets[v]; k < g->offsets[v + 1]; k++) {
+			uint32 u = g->edges[k];
+
+			if (match[u] == INVALID_INDEX && u != v &&
+			    g->edge_wgt[k] > best_wgt &&
+			    g->vertex_wgt[v] + g->vertex_wgt[u] <= max_wgt) {
+				best = u;
+				best_wgt = g->edge_wgt[k];
+			}
+		}
 
-	free(graph->edges);
-	rowperm = (uint32 *)xmalloc(nrows_orig * sizeof(uint32));
-	colperm = (uint32 *)xmalloc(ncols_orig * sizeof(uint32));
+		match[v] = best;
+		match[best] = v;
+	}
 
-	for (i = 0; i < nrows_orig; i++)
-		rowperm[i] = INVALID_INDEX;
+	/* number the coarse vertices in the order of their
+	   first fine vertex, which keeps vertices that were
+	   close together in the fine graph close together in
+	   the coarse graph, and remember that first vertex */
 
-	for (i = 0; i < nrows; i++) {
-		vertex_t *v = graph->vertex + ncols + i;
-		rowperm[v->orig_index] = i + rowgap;
+	for (i = num_coarse = 0; i < nv; i++) {
+		if (match[i] >= i) {
+			cmap[i] = cmap[match[i]] = num_coarse;
+			perm[num_coarse++] = i;
+		}
 	}
 
-	for (i = j = 0; i < nrows_orig; i++) {
-		if (rowperm[i] == INVALID_INDEX)
-			rowperm[i] = j++;
+	if (num_coarse > 0.9 * nv) {
+		free(perm);
+		free(match);
+		return num_coarse;
 	}
 
+	/* merge the edge lists of each pair; edges that
+	   become duplicates have their weights added */
 
-	for (i = 0; i < ncols_orig; i++)
-		colperm[i] = INVALID_INDEX;
+	graph_alloc(coarse, num_coarse, g->num_edges, 0);
+	marker = (uint64 *)xmalloc(num_coarse * sizeof(uint64));
+	for (i = 0; i < num_coarse; i++)
+		marker[i] = (uint64)(-1);
 
-	for (i = 0; i < ncols; i++) {
-		vertex_t *v = graph->vertex + i;
-		colperm[v->orig_index] = i + colgap;
-	}
+	coarse->offsets[0] = num_edges = 0;
+	for (i = 0; i < num_coarse; i++) {
+		uint32 v[2];
+
+		v[0] = perm[i];
+		v[1] = match[v[0]];
+		coarse->vertex_wgt[i] = g->vertex_wgt[v[0]];
+		if (v[1] != v[0])
+			coarse->vertex_wgt[i] += g->vertex_wgt[v[1]];
 
-	for (i = j = 0; i < ncols_orig; i++) {
-		if (colperm[i] == INVALID_INDEX)
-			colperm[i] = j++;
+		for (j = 0; j < 2; j++) {
+			if (j == 1 && v[1] == v[0])
+				break;
+
+			for (k = g->offsets[v[j]];
+					k < g->offsets[v[j] + 1]; k++) {
+				uint32 u = cmap[g->edges[k]];
+
+				if (u == i)
+					continue;
+
+				if (marker[u] != (uint64)(-1) &&
+				    marker[u] >= coarse->offsets[i]) {
+					coarse->edge_wgt[marker[u]] +=
+							g->edge_wgt[k];
+				}
+				else {
+					marker[u] = num_edges;
+					coarse->edges[num_edges] = u;
+					coarse->edge_wgt[num_edges++] =
+							g->edge_wgt[k];
+				}
+			}
+		}
+		coarse->offsets[i + 1] = num_edges;
 	}
+	coarse->num_edges = num_edges;
 
-	free(graph->vertex);
-	free(graph->stack);
-	*rowperm_out = rowperm;
-	*colperm_out = colperm;
+	free(marker);
+	free(perm);
+	free(match);
+	return num_coarse;
 }
 
 /*--------------------------------------------------------------------*/
-static void heap_insert_vertex(graph_t *graph, 
-			heap_t *heap, uint32 v_offset) {
+static uint64 compute_cut(graph_t *g, uint8 *part, uint64 *side_wgt) {
 
-	vertex_t *base = graph->vertex;
-	vertex_t *v = base + v_offset;
-	int32 key = heap->bias + v->cost;
-	vertex_t *head = heap->hashtable + key;
-	uint32 head_offset = head - base;
+	uint32 i;
+	uint64 k;
+	uint64 cut = 0;
 
-	v->prev = head_offset;
-	v->next = head->next;
-	base[head->next].prev = v_offset;
-	head->next = v_offset;
+	side_wgt[0] = side_wgt[1] = 0;
+	for (i = 0; i < g->num_vertex; i++) {
+		side_wgt[part[i]] += g->vertex_wgt[i];
 
-	heap->next_bin = MIN(heap->next_bin, key);
+		for (k = g->offsets[i]; k < g->offsets[i + 1]; k++) {
+			if (part[g->edges[k]] != part[i])
+				cut += g->edge_wgt[k];
+		}
+	}
+	return cut / 2;
 }
 
 /*--------------------------------------------------------------------*/
-static void heap_delete_vertex(graph_t *graph,
-			heap_t *heap, uint32 v_offset) {
-
-	vertex_t *base = graph->vertex;
-	vertex_t *v = base + v_offset;
-	int32 key = heap->bias + v->cost;
-
-	base[v->next].prev = v->prev;
-	base[v->prev].next = v->next;
-	v->next = v_offset;
-	v->prev = v_offset;
-
-	if (key == heap->next_bin) {
-		vertex_t *head = heap->hashtable + key;
-		uint32 head_offset = head - base;
-		while (key < heap->num_bins && head->next == head_offset) {
-			head_offset++;
-			head++;
-			key++;
+static void refine(graph_t *g, uint8 *part, uint64 max_wgt,
+			uint32 *seed1, uint32 *seed2) {
+
+	/* move vertices across the split while that removes
+	   cut edges without unbalancing it. If the split starts
+	   out unbalanced, the first pass also moves boundary
+	   vertices out of the heavy side until it is not */
+
+	uint32 i, pass;
+	uint32 nv = g->num_vertex;
+	uint64 side_wgt[2];
+
+	if (nv == 0)
+		return;
+
+	side_wgt[0] = side_wgt[1] = 0;
+	for (i = 0; i < nv; i++)
+		side_wgt[part[i]] += g->vertex_wgt[i];
+
+	for (pass = 0; pass < MAX_REFINE_PASSES; pass++) {
+		uint32 start = get_rand(seed1, seed2) % nv;
+		uint32 num_moves = 0;
+
+		for (i = 0; i < nv; i++) {
+			uint32 v = (start + i < nv) ? start + i : start + i - nv;
+			uint32 from = part[v];
+			uint32 to = from ^ 1;
+			uint32 vw = g->vertex_wgt[v];
+			int64 gain = 0;
+			uint32 boundary = 0;
+			uint64 k;
+
+			for (k = g->offsets[v]; k < g->offsets[v + 1]; k++) {
+				if (part[g->edges[k]] == from) {
+					gain -= g->edge_wgt[k];
+				}
+				else {
+					gain += g->edge_wgt[k];
+					boundary = 1;
+				}
+			}
+
+			if (side_wgt[from] > max_wgt) {
+				if (!boundary && pass == 0)
+					continue;
+			}
+			else if (side_wgt[to] + vw > max_wgt || gain < 0 ||
+				 !boundary ||
+				 (gain == 0 && side_wgt[from] <=
+				  		side_wgt[to] + vw)) {
+				continue;
+			}
+
+			part[v] = to;
+			side_wgt[from] -= vw;
+			side_wgt[to] += vw;
+			num_moves++;
 		}
-		heap->next_bin = key;
+
+		if (num_moves == 0)
+			break;
 	}
 }
 
 /*--------------------------------------------------------------------*/
-static uint32 heap_delete_min(graph_t *graph, heap_t *heap) {
+typedef struct {
+	uint32 num;
+	uint32 *heap;		/* vertices, largest gain first */
+	uint32 *pos;		/* position of each vertex in heap[] */
+	int64 *gain;
+} gain_heap_t;
+
+static void gain_heap_sift_up(gain_heap_t *h, uint32 i) {
+
+	uint32 v = h->heap[i];
+
+	while (i > 0) {
+		uint32 parent = (i - 1) / 2;
+		uint32 p = h->heap[parent];
 
-	vertex_t *base = graph->vertex;
-	int32 key = heap->next_bin;
+		if (h->gain[p] >= h->gain[v])
+			break;
+		h->heap[i] = p;
+		h->pos[p] = i;
+		i = parent;
+	}
+	h->heap[i] = v;
+	h->pos[v] = i;
+}
 
-	if (key == heap->num_bins)
-		return INVALID_INDEX;
+static uint32 gain_heap_pop(gain_heap_t *h) {
 
-	while (key < heap->num_bins) {
-		vertex_t *head = heap->hashtable + key;
-		uint32 head_offset = head - base;
-		uint32 tmp_offset = head->next;
+	uint32 i = 0;
+	uint32 top = h->heap[0];
+	uint32 v = h->heap[--h->num];
 
-		while (tmp_offset != head_offset) {
-			vertex_t *v = base + tmp_offset;
-			uint32 partition = v->partition;
+	while (2 * i + 1 < h->num) {
+		uint32 child = 2 * i + 1;
 
-			if (heap->partition_size[v->is_col][partition ^ 1] <
-					heap->partition_max[v->is_col]) {
-				heap_delete_vertex(graph, heap, tmp_offset);
-				return tmp_offset;
-			}
+		if (child + 1 < h->num && 
+		    h->gain[h->heap[child + 1]] > h->gain[h->heap[child]])
+			child++;
+		if (h->gain[h->heap[child]] <= h->gain[v])
+			break;
 
-			tmp_offset = v->next;
-		}
-		key++;
+		h->heap[i] = h->heap[child];
+		h->pos[h->heap[i]] = i;
+		i = child;
 	}
-
-	return INVALID_INDEX;
+	h->heap[i] = v;
+	h->pos[v] = i;
+	h->pos[top] = INVALID_INDEX;
+	return top;
 }
 
 /*--------------------------------------------------------------------*/
-static uint32 heap_init(msieve_obj *obj, 
-			graph_t *graph, heap_t *heap, 
-			uint32 row_start, uint32 row_end,
-			uint32 col_start, uint32 col_end) {
-
-	uint32 i, j, k;
-	uint32 edge_cut = 0;
-	
-	heap->next_bin = heap->num_bins;
-	for (i = 0; i < (uint32)heap->num_bins; i++) {
-		vertex_t *head = heap->hashtable + i;
-		head->next = head - graph->vertex;
-		head->prev = head - graph->vertex;
-	}
-
-	heap->partition_max[0] = 1 + 1.01 * ((row_end - row_start + 1) / 2);
-	heap->partition_max[1] = 1 + 1.01 * ((col_end - col_start + 1) / 2);
-	heap->partition_size[0][0] = 0;
-	heap->partition_size[0][1] = 0;
-	heap->partition_size[1][0] = 0;
-	heap->partition_size[1][1] = 0;
+static void initial_split(graph_t *g, uint8 *part, uint64 max_wgt,
+			uint32 *seed1, uint32 *seed2) {
+
+	/* grow one half of the coarsest graph from a random
+	   vertex, each time adding the neighbor that removes
+	   the most cut edges. This is done several times, and
+	   the split with the fewest cut edges is kept */
+
+	uint32 i, try;
+	uint32 nv = g->num_vertex;
+	uint8 *curr_part = (uint8 *)xmalloc(MAX(nv, 1) * sizeof(uint8));
+	int64 *degree = (int64 *)xmalloc(MAX(nv, 1) * sizeof(int64));
+	gain_heap_t h;
+	uint64 total_wgt = 0;
+	uint64 best_cut = (uint64)(-1);
+
+	h.heap = (uint32 *)xmalloc(MAX(nv, 1) * sizeof(uint32));
+	h.pos = (uint32 *)xmalloc(MAX(nv, 1) * sizeof(uint32));
+	h.gain = (int64 *)xmalloc(MAX(nv, 1) * sizeof(int64));
+
+	for (i = 0; i < nv; i++) {
+		uint64 k;
+
+		total_wgt += g->vertex_wgt[i];
+		degree[i] = 0;
+		for (k = g->offsets[i]; k < g->offsets[i + 1]; k++)
+			degree[i] += g->edge_wgt[k];
+	}
 
-	for (i = 0; i < 2; i++) {
-		uint32 vertex_lower = (i == 0) ? row_start : col_start;
-		uint32 vertex_upper = (i == 0) ? row_end : col_end;
-
-		j = get_rand(&obj->seed1, &obj->seed2);
-		for (k = vertex_lower; k <= vertex_upper; k++) {
-			vertex_t *v = graph->vertex + k;
-			uint32 partition = j & 1;
-	
-			v->cost = 0;
-			v->boundary = 0;
-			v->visited = 1;
-			v->partition = partition;
-			heap->partition_size[v->is_col][partition]++;
-
-			j >>= 1;
-			if (k % 32 == 0)
-				j = get_rand(&obj->seed1, &obj->seed2);
+	for (try = 0; try < NUM_INIT_TRIES; try++) {
+		uint32 next_seed = get_rand(seed1, seed2) % MAX(nv, 1);
+		uint64 wgt0 = 0;
+		uint64 side_wgt[2];
+		uint64 cut;
+
+		memset(curr_part, 1, nv * sizeof(uint8));
+		for (i = 0; i < nv; i++) {
+			h.pos[i] = INVALID_INDEX;
+			h.gain[i] = -degree[i];
 		}
-	}
+		h.num = 0;
+
+		while (2 * wgt0 < total_wgt) {
+			uint32 v;
+			uint64 k;
+
+			if (h.num == 0) {
+				/* start over in a part of the
+				   graph not reached yet */
+
+				for (i = 0; i < nv; i++) {
+					v = next_seed++;
+					if (next_seed == nv)
+						next_seed = 0;
+					if (curr_part[v] == 1)
+						break;
+				}
+				if (i == nv)
+					break;
+			}
+			else {
+				v = gain_heap_pop(&h);
+			}
 
-	for (i = 0; i < 2; i++) {
-		uint32 vertex_lower1 = (i == 0) ? row_start : col_start;
-		uint32 vertex_upper1 = (i == 0) ? row_end : col_end;
-		uint32 vertex_lower2 = (i == 0) ? col_start : row_start;
-		uint32 vertex_upper2 = (i == 0) ? col_end : row_end;
-
-		for (j = vertex_lower1; j <= vertex_upper1; j++) {
-			vertex_t *v = graph->vertex + j;
-			uint32 num_edges = v->num_edges;
-			uint32 *edges = graph->edges + v->edge_offset;
-	
-			for (k = 0; k < num_edges; k++) {
-				uint32 v_offset2 = edges[k];
-				vertex_t *v2 = graph->vertex + v_offset2;
-
-				if (v_offset2 < vertex_lower2 ||
-				    v_offset2 > vertex_upper2)
+			curr_part[v] = 0;
+			wgt0 += g->vertex_wgt[v];
+
+			for (k = g->offsets[v]; k < g->offsets[v + 1]; k++) {
+				uint32 u = g->edges[k];
+
+				if (curr_part[u] == 0)
 					continue;
 
-				if (v->partition == v2->partition) {
-					v->cost++;
-				}
-				else {
-					v->cost--;
-					edge_cut++;
+				h.gain[u] += 2 * (int64)g->edge_wgt[k];
+				if (h.pos[u] == INVALID_INDEX) {
+					h.heap[h.num] = u;
+					h.pos[u] = h.num++;
 				}
+				gain_heap_sift_up(&h, h.pos[u]);
 			}
-			v->next = j;
-			v->prev = j;
+		}
+
+		refine(g, curr_part, max_wgt, seed1, seed2);
+		cut = compute_cut(g, curr_part, side_wgt);
+
+		if (side_wgt[0] <= max_wgt && side_wgt[1] <= max_wgt &&
+		    cut < best_cut) {
+			best_cut = cut;
+			memcpy(part, curr_part, nv * sizeof(uint8));
+		}
+		else if (try == 0) {
+			memcpy(part, curr_part, nv * sizeof(uint8));
 		}
 	}
 
-	return edge_cut;
+	free(h.heap);
+	free(h.pos);
+	free(h.gain);
+	free(degree);
+	free(curr_part);
 }
 
 /*--------------------------------------------------------------------*/
-static uint32 repartition_vertex(graph_t *graph, heap_t *heap,
-			uint32 v_offset, uint32 edge_cut, 
-			uint32 row_start, uint32 row_end,
-			uint32 col_start, uint32 col_end) {
+static void bisect(graph_t *g, uint8 *part,
+			uint32 *seed1, uint32 *seed2) {
 
-	uint32 i;
-	vertex_t *v = graph->vertex + v_offset;
-	uint32 num_edges = v->num_edges;
-	uint32 *edges = graph->edges + v->edge_offset;
-	uint32 partition = v->partition;
+	/* split g into two halves of about equal weight */
 
-	v->cost = -(v->cost);
-	v->visited = 1;
-	v->partition = partition ^ 1;
+	uint32 i, num_levels;
+	graph_t *levels[MAX_LEVELS];
+	uint32 *cmaps[MAX_LEVELS];
+	uint8 *parts[MAX_LEVELS];
+	uint64 total_wgt = 0;
+	uint64 max_wgt;
 
-	heap->partition_size[v->is_col][partition]--;
-	heap->partition_size[v->is_col][partition ^ 1]++;
+	for (i = 0; i < g->num_vertex; i++)
+		total_wgt += g->vertex_wgt[i];
+	max_wgt = (uint64)((1 + BALANCE_TOL) * (total_wgt + 1) / 2);
 
-	for (i = 0; i < num_edges; i++) {
-		uint32 v2_offset = edges[i];
-		vertex_t *v2 = graph->vertex + v2_offset;
+	levels[0] = g;
+	parts[0] = part;
+	num_levels = 1;
 
-		if (v2->is_col) {
-			if (v2_offset < col_start || v2_offset > col_end)
-				continue;
-		}
-		else {
-			if (v2_offset < row_start || v2_offset > row_end)
-				continue;
-		}
+	while (num_levels < MAX_LEVELS) {
+		graph_t *fine = levels[num_levels - 1];
+		graph_t *coarse;
+		uint32 *cmap;
 
-		if (!v2->visited)
-			heap_delete_vertex(graph, heap, v2_offset);
+		if (fine->num_vertex <= COARSEST_SIZE)
+			break;
 
-		if (v2->partition == partition) {
-			v2->cost -= 2;
-			edge_cut++;
-		}
-		else {
-			v2->cost += 2;
-			edge_cut--;
+		coarse = (graph_t *)xcalloc(1, sizeof(graph_t));
+		cmap = (uint32 *)xmalloc(fine->num_vertex * sizeof(uint32));
+
+		if (graph_coarsen(fine, coarse, cmap, total_wgt,
+				seed1, seed2) > 0.9 * fine->num_vertex) {
+			free(coarse);
+			free(cmap);
+			break;
 		}
 
-		if (!v2->visited)
-			heap_insert_vertex(graph, heap, v2_offset);
+		cmaps[num_levels - 1] = cmap;
+		parts[num_levels] = (uint8 *)xmalloc(coarse->num_vertex *
+							sizeof(uint8));
+		levels[num_levels++] = coarse;
 	}
 
-	return edge_cut;
+	initial_split(levels[num_levels - 1], parts[num_levels - 1],
+			max_wgt, seed1, seed2);
+
+	/* carry the split back to the original graph */
+
+	for (i = num_levels - 1; i; i--) {
+		graph_t *fine = levels[i - 1];
+		uint8 *fine_part = parts[i - 1];
+		uint32 *cmap = cmaps[i - 1];
+		uint32 j;
+
+		for (j = 0; j < fine->num_vertex; j++)
+			fine_part[j] = parts[i][cmap[j]];
+
+		refine(fine, fine_part, max_wgt, seed1, seed2);
+
+		graph_free(levels[i]);
+		free(levels[i]);
+		free(parts[i]);
+		free(cmap);
+	}
 }
 
 /*--------------------------------------------------------------------*/
-#define MAX_HISTORY 100
+static void find_separator(graph_t *g, uint8 *part) {
 
-static uint32 do_partition_core(graph_t *graph, 
-				heap_t *heap, uint32 edge_cut,
-				uint32 row_start, uint32 row_end,
-				uint32 col_start, uint32 col_end) {
+	/* every cut edge needs one of its ends moved into
+	   the separator (part 2); pick whichever end has more
+	   cut edges, so that few vertices cover all of them */
 
-	uint32 i, j;
-	uint32 min_edge_cut;
-	uint32 num_history;
-	uint32 history[MAX_HISTORY];
+	uint32 i;
+	uint32 *cut_degree = (uint32 *)xcalloc(MAX(g->num_vertex, 1),
+						sizeof(uint32));
 
-	for (i = 0; i < 2; i++) {
-		uint32 vertex_lower = (i == 0) ? row_start : col_start;
-		uint32 vertex_upper = (i == 0) ? row_end : col_end;
-
-		for (j = vertex_lower; j <= vertex_upper; j++) {
-			vertex_t *v = graph->vertex + j;
-			if (v->visited) {
-				v->visited = 0;
-				heap_insert_vertex(graph, heap, j);
-			}
+	for (i = 0; i < g->num_vertex; i++) {
+		uint64 k;
+
+		for (k = g->offsets[i]; k < g->offsets[i + 1]; k++) {
+			if (part[g->edges[k]] != part[i])
+				cut_degree[i]++;
 		}
 	}
 
-	min_edge_cut = edge_cut;
-	num_history = 0;
+	for (i = 0; i < g->num_vertex; i++) {
+		uint64 k;
 
-	while (1) {
-		uint32 v_offset = heap_delete_min(graph, heap);
-		if (v_offset == INVALID_INDEX)
-			break;
+		if (part[i] != 0 || cut_degree[i] == 0)
+			continue;
 
-		edge_cut = repartition_vertex(graph, heap, v_offset, edge_cut,
-						row_start, row_end,
-						col_start, col_end);
+		for (k = g->offsets[i]; k < g->offsets[i + 1]; k++) {
+			uint32 u = g->edges[k];
 
-		if (edge_cut <= min_edge_cut) {
-			num_history = 0;
-			min_edge_cut = edge_cut;
-		}
-		else {
-			history[num_history] = v_offset;
-			if (++num_history == MAX_HISTORY)
+			if (part[u] != 1)
+				continue;
+
+			if (cut_degree[i] >= cut_degree[u]) {
+				part[i] = 2;
 				break;
+			}
+			part[u] = 2;
 		}
 	}
 
-	for (i = num_history - 1; (int32)i >= 0; i--) {
-		edge_cut = repartition_vertex(graph, heap, 
-					history[i], edge_cut,
-					row_start, row_end,
-					col_start, col_end);
-	}
-
-	return min_edge_cut;
+	free(cut_degree);
 }
 
 /*--------------------------------------------------------------------*/
-static void permute_graph_core(graph_t *graph,
-			uint32 v_lower1, uint32 v_upper1,
-			uint32 v_lower2, uint32 v_upper2,
-			uint32 *middle1, uint32 *middle2) {
-
-	int32 i, j, k;
-	vertex_t *vertex_base = graph->vertex;
-	uint32 *edge_base = graph->edges;
-	int32 v_lower, v_upper;
-	vertex_t tmp;
-
-	for (i = v_lower1; i <= v_upper1; i++) {
-		vertex_t *v = vertex_base + i;
-		int32 num_edges = v->num_edges;
-		uint32 *edges = edge_base + v->edge_offset;
-
-		v->prev = i;
-		for (j = k = 0; j < num_edges; j++) {
-			int32 v2_offset = edges[j];
-			if (v2_offset >= v_lower2 && 
-			    v2_offset <= v_upper2) {
-				k++;
-			}
-		}
-		if (v->cost != k)
-			v->boundary = 1;
-	}
+static void place_vertices(split_task_t *t, uint8 *part, uint32 side,
+				uint32 row_pos, uint32 col_pos,
+				uint32 block) {
 
-	v_lower = v_lower1;
-	v_upper = v_upper1;
-	i = v_lower - 1;
-	j = v_upper + 1;
-	while (1) {
-		while (++i <= v_upper) {
-			if (vertex_base[i].boundary == 0)
-				break;
+	/* give the vertices of one side their final place,
+	   keeping them in their original order */
+
+	uint32 i;
+	graph_t *g = &t->graph;
+	reorder_t *r = t->r;
+
+	for (i = 0; i < g->num_vertex; i++) {
+		uint32 v = g->map[i];
+
+		if (part != NULL && part[i] != side)
+			continue;
+
+		if (v < r->ncols) {
+			r->colperm[v] = col_pos++;
+			r->colblock[v] = block;
 		}
-		while (--j >= v_lower) {
-			if (vertex_base[j].boundary == 1)
-				break;
+		else {
+			r->rowperm[v - r->ncols] = row_pos++;
+			r->rowblock[v - r->ncols] = block;
 		}
-		if (j < i)
-			break;
+	}
+}
+
+/*--------------------------------------------------------------------*/
+static void split_core(void *data, int thread_num) {
+
+	split_task_t *t = (split_task_t *)data;
+	graph_t *g = &t->graph;
+	uint32 ncols = t->r->ncols;
+	uint32 i;
+	uint32 num_rows[3] = {0};
+	uint32 num_cols[3] = {0};
+	uint32 *new_index;
+	uint8 *part;
+
+	t->num_children = 0;
 
-		tmp = vertex_base[i];
-		vertex_base[i] = vertex_base[j];
-		vertex_base[j] = tmp;
+	for (i = 0; i < g->num_vertex; i++) {
+		if (g->map[i] < ncols)
+			num_cols[0]++;
 	}
 
-	*middle1 = v_lower = MIN(v_upper, i);
-	i = v_lower - 1;
-	j = v_upper + 1;
-	while (1) {
-		while (++i <= v_upper) {
-			if (vertex_base[i].partition == 1)
-				break;
-		}
-		while (--j >= v_lower) {
-			if (vertex_base[j].partition == 0)
-				break;
-		}
-		if (j < i)
-			break;
+	/* small pieces become diagonal blocks; the block
+	   number only has to be unique, so use the position
+	   of the block's first column */
+
+	if (num_cols[0] < MIN_BLOCKSIZE) {
+		place_vertices(t, NULL, 0, t->row_pos, t->col_pos,
+				t->col_pos);
+		graph_free(g);
+		return;
+	}
 
-		tmp = vertex_base[i];
-		vertex_base[i] = vertex_base[j];
-		vertex_base[j] = tmp;
+	part = (uint8 *)xmalloc(g->num_vertex * sizeof(uint8));
+	bisect(g, part, &t->seed1, &t->seed2);
+	find_separator(g, part);
+
+	num_cols[0] = 0;
+	for (i = 0; i < g->num_vertex; i++) {
+		if (g->map[i] < ncols)
+			num_cols[part[i]]++;
+		else
+			num_rows[part[i]]++;
 	}
-	*middle2 = MIN(v_upper, i);
 
-	for (i = v_lower1; i <= v_upper1; i++) {
-		vertex_t *v0 = vertex_base + i;
-		vertex_t *v1 = vertex_base + v0->prev;
-		v1->next = i;
+	/* a split that leaves one side without any columns
+	   does not make progress */
+
+	if (num_cols[0] == 0 || num_cols[1] == 0 ||
+	    num_rows[2] + num_cols[2] > MAX_SEPARATOR_FRAC * 
+	    				g->num_vertex) {
+		place_vertices(t, NULL, 0, t->row_pos, t->col_pos,
+				t->col_pos);
+		graph_free(g);
+		free(part);
+		return;
 	}
 
-	for (i = v_lower2; i <= v_upper2; i++) {
-		vertex_t *v = vertex_base + i;
-		int32 num_edges = v->num_edges;
-		uint32 *edges = edge_base + v->edge_offset;
+	place_vertices(t, part, 2,
+			t->row_pos + num_rows[0] + num_rows[1],
+			t->col_pos + num_cols[0] + num_cols[1],
+			INVALID_INDEX);
 
-		for (j = 0; j < num_edges; j++) {
-			int32 v1_offset = edges[j];
-			if (v1_offset >= v_lower1 && 
-			    v1_offset <= v_upper1) {
-				vertex_t *v0 = vertex_base + v1_offset;
-				edges[j] = v0->next;
-			}
-		}
+	new_index = (uint32 *)xmalloc(g->num_vertex * sizeof(uint32));
+	for (i = 0; i < 2; i++) {
+		graph_extract(g, part, i, new_index, t->child + i);
+		t->child_row_pos[i] = t->row_pos + (i ? num_rows[0] : 0);
+		t->child_col_pos[i] = t->col_pos + (i ? num_cols[0] : 0);
 	}
+	t->num_children = 2;
+
+	free(new_index);
+	free(part);
+	graph_free(g);
 }
 
 /*--------------------------------------------------------------------*/
-static void permute_graph(graph_t *graph,
-			uint32 row_start, uint32 row_end,
-			uint32 col_start, uint32 col_end,
-			uint32 *row_start1, uint32 *row_start2,
-			uint32 *col_start1, uint32 *col_start2) {
-
-	permute_graph_core(graph, 
-			row_start, row_end,
-			col_start, col_end,
-			row_start1, row_start2);
-
-	permute_graph_core(graph, 
-			col_start, col_end,
-			row_start, row_end,
-			col_start1, col_start2);
+#define REPORT_GRID_MAX 64
+
+static void report_layout(msieve_obj *obj, la_col_t *cols,
+			uint32 nrows, uint32 ncols,
+			uint32 grid_dim, reorder_t *r) {
+
+	/* describe how the nonzeros of the matrix fall into a
+	   grid_dim x grid_dim grid of equal-size blocks, before
+	   and after the permutation */
+
+	uint32 i, j, pass;
+	uint64 *counts = (uint64 *)xmalloc(grid_dim * grid_dim *
+						sizeof(uint64));
+	uint64 in_blocks = 0;
+	uint64 total = 0;
+
+	for (pass = 0; pass < 2; pass++) {
+		uint64 max_count = 0;
+		uint32 num_empty = 0;
+
+		memset(counts, 0, grid_dim * grid_dim * sizeof(uint64));
+
+		for (i = 0; i < ncols; i++) {
+			la_col_t *c = cols + i;
+			uint32 col = pass ? r->colperm[i] : i;
+			uint32 col_block = (uint64)col * grid_dim / ncols;
+
+			for (j = 0; j < c->weight; j++) {
+				uint32 row = c->data[j];
+				uint32 row_block;
+
+				if (pass) {
+					if (r->colblock[i] != INVALID_INDEX &&
+					    r->colblock[i] == r->rowblock[row])
+						in_blocks++;
+					row = r->rowperm[row];
+				}
+				else {
+					total++;
+				}
+
+				row_block = (uint64)row * grid_dim / nrows;
+				counts[row_block * grid_dim + col_block]++;
+			}
+		}
+
+		for (i = 0; i < grid_dim * grid_dim; i++) {
+			max_count = MAX(max_count, counts[i]);
+			if (counts[i] == 0)
+				num_empty++;
+		}
+
+		logprintf(obj, "%s: %ux%u blocks, %u empty, "
+				"max nonzeros %" PRIu64 " (%.2fx average)\n",
+				pass ? "after" : "before", grid_dim, grid_dim,
+				num_empty, max_count, (double)max_count *
+				grid_dim * grid_dim / MAX(total, 1));
+	}
+
+	logprintf(obj, "%.1f%% of nonzeros are in diagonal blocks\n",
+			100.0 * in_blocks / MAX(total, 1));
+	free(counts);
 }
 
 /*--------------------------------------------------------------------*/
-#define MIN_BLOCKSIZE 4000
+void reorder_matrix(msieve_obj *obj,
+		    uint32 **rowperm_out,
+		    uint32 **colperm_out) {
 
-static void do_partition(msieve_obj *obj,
-			graph_t *graph, heap_t *heap,
-			uint32 row_start, uint32 row_end,
-			uint32 col_start, uint32 col_end) {
-
-	uint32 min_edge_cut, edge_cut;
-	uint32 row_start1, row_start2;
-	uint32 col_start1, col_start2;
-#ifdef VERBOSE
-	printf("optimize [%u,%u] x [%u,%u]\n",
-			row_start, row_end, col_start, col_end);
-#endif
-	edge_cut = heap_init(obj, graph, heap,
-		       		row_start, row_end,
-				col_start, col_end);
-	do {
-		min_edge_cut = edge_cut;
-#ifdef VERBOSE
-		printf("edge cut = %u\n", edge_cut);
-#endif
-		edge_cut = do_partition_core(graph, heap, edge_cut,
-						row_start, row_end,
-						col_start, col_end);
-	} while (min_edge_cut - edge_cut > 1000);
+	uint32 i;
+	uint32 nrows, ncols, dense_rows;
+	uint32 row_pos, col_pos;
+	uint32 num_tasks, num_levels;
+	uint32 grid_dim;
+	la_col_t *cols;
+	reorder_t r;
+	split_task_t *tasks;
+	graph_t *g;
+	double cpu_time = get_cpu_time();
 
-#ifdef VERBOSE
-	printf("edge cut = %u\n", edge_cut);
-#endif
+	logprintf(obj, "permuting matrix for faster multiplies\n");
+
+	read_matrix(obj, &nrows, NULL, NULL, &dense_rows,
+			&ncols, NULL, NULL, &cols, NULL, NULL);
 
-	permute_graph(graph,
-			row_start, row_end,
-			col_start, col_end,
-			&row_start1, &row_start2,
-			&col_start1, &col_start2);
+	r.ncols = ncols;
+	r.rowperm = (uint32 *)xmalloc(nrows * sizeof(uint32));
+	r.colperm = (uint32 *)xmalloc(ncols * sizeof(uint32));
+	r.rowblock = (uint32 *)xmalloc(nrows * sizeof(uint32));
+	r.colblock = (uint32 *)xmalloc(ncols * sizeof(uint32));
 
-	if (col_end - col_start2 > MIN_BLOCKSIZE) {
-		do_partition(obj, graph, heap,
-				row_start2, row_end,
-				col_start2, col_end);
+	tasks = (split_task_t *)xcalloc(1, sizeof(split_task_t));
+	g = &tasks[0].graph;
+	graph_init(obj, g, cols, nrows, dense_rows, ncols);
+
+	/* rows and columns outside the graph go first, in
+	   their original order; that includes the dense rows,
+	   which therefore do not move */
+
+	for (i = 0; i < nrows; i++) {
+		r.rowperm[i] = INVALID_INDEX;
+		r.rowblock[i] = INVALID_INDEX;
 	}
-	if (col_start2 - col_start1 > MIN_BLOCKSIZE) {
-		do_partition(obj, graph, heap,
-				row_start1, row_start2 - 1,
-				col_start1, col_start2 - 1);
+	for (i = 0; i < ncols; i++) {
+		r.colperm[i] = INVALID_INDEX;
+		r.colblock[i] = INVALID_INDEX;
 	}
-	if (col_start1 - col_start > MIN_BLOCKSIZE) {
-		do_partition(obj, graph, heap,
-				row_start, row_start1 - 1,
-				col_start, col_start1 - 1);
+	for (i = 0; i < g->num_vertex; i++) {
+		uint32 v = g->map[i];
+		if (v < ncols)
+			r.colperm[v] = 0;
+		else
+			r.rowperm[v - ncols] = 0;
+	}
+	for (i = row_pos = 0; i < nrows; i++) {
+		if (r.rowperm[i] == INVALID_INDEX)
+			r.rowperm[i] = row_pos++;
+	}
+	for (i = col_pos = 0; i < ncols; i++) {
+		if (r.colperm[i] == INVALID_INDEX)
+			r.colperm[i] = col_pos++;
 	}
-}
 
-/*--------------------------------------------------------------------*/
-void reorder_matrix(msieve_obj *obj, 
-		    uint32 **rowperm, 
-		    uint32 **colperm) {
+	/* split the graph level by level; all the pieces
+	   at one level are split at the same time */
 
-	graph_t graph;
-	heap_t heap;
+	tasks[0].r = &r;
+	tasks[0].row_pos = row_pos;
+	tasks[0].col_pos = col_pos;
+	num_tasks = 1;
+	num_levels = 0;
 
-	logprintf(obj, "permuting matrix for faster multiplies\n");
+	while (num_tasks > 0) {
+		split_task_t *next_tasks;
+		uint32 num_next = 0;
+
+		for (i = 0; i < num_tasks; i++) {
+			split_task_t *t = tasks + i;
+			t->seed1 = obj->seed1 ^ (t->col_pos * 2654435761U);
+			t->seed2 = obj->seed2 + t->row_pos;
+		}
+
+		lanczos_run_tasks(split_core, tasks, sizeof(split_task_t),
+				num_tasks, obj->num_threads);
+		num_levels++;
+
+		next_tasks = (split_task_t *)xcalloc(2 * num_tasks,
+						sizeof(split_task_t));
+		for (i = 0; i < num_tasks; i++) {
+			split_task_t *t = tasks + i;
+			uint32 j;
 
-	graph_init(obj, &graph, &heap);
+			for (j = 0; j < t->num_children; j++) {
+				split_task_t *next = next_tasks + num_next++;
 
-	do_partition(obj, &graph, &heap,
-			graph.num_cols, 
-			graph.num_cols + graph.num_rows - 1,
-			0, 
-			graph.num_cols - 1);
+				next->r = &r;
+				next->graph = t->child[j];
+				next->row_pos = t->child_row_pos[j];
+				next->col_pos = t->child_col_pos[j];
+			}
+		}
+
+		free(tasks);
+		tasks = next_tasks;
+		num_tasks = num_next;
+	}
+	free(tasks);
 
-	graph_free(&graph, rowperm, colperm);
+	logprintf(obj, "nested dissection used %u levels\n", num_levels);
+
+	/* report on a grid with as many stripes as there
+	   are threads or MPI processes along a side */
+
+	grid_dim = MAX(obj->num_threads, 4);
+#ifdef HAVE_MPI
+	grid_dim = MAX(grid_dim, MAX(obj->mpi_nrows, obj->mpi_ncols));
+#endif
+	grid_dim = MIN(grid_dim, REPORT_GRID_MAX);
+	report_layout(obj, cols, nrows, ncols, grid_dim, &r);
+
+	for (i = 0; i < ncols; i++)
+		free(cols[i].data);
+	free(cols);
+	free(r.rowblock);
+	free(r.colblock);
+
+	logprintf(obj, "reordering took %.1f seconds of CPU time\n",
+			get_cpu_time() - cpu_time);
+	*rowperm_out = r.rowperm;
+	*colperm_out = r.colperm;
 }
@@ -36,7 +36,8 @@ $Id$
 
 
 /*------------------------------------------------------------------*/
-static void global_xor_async(v_t *send_buf, v_t *recv_buf, 
+static void global_xor_async(packed_matrix_t *A, 
+			v_t *send_buf, v_t *recv_buf, 
 			uint32 total_size, uint32 num_nodes, 
 			uint32 my_id, MPI_Comm comm) {
 	
@@ -96,7 +97,7 @@ static void global_xor_async(v_t *send_buf, v_t *recv_buf,
 
 		/* combine the new chunk with our own */
 
-		vv_xor(curr_buf + m * chunk, send_buf + m * chunk, size);
+		vv_xor(A, curr_buf + m * chunk, send_buf + m * chunk, size);
 		
 		/* now wait for the send to end */
 
@@ -138,7 +139,8 @@ static void global_xor_async(v_t *send_buf, v_t *recv_buf,
 }
 
 /*------------------------------------------------------------------*/
-void global_xor(void *send_buf_in, void *recv_buf_in, 
+void global_xor(packed_matrix_t *A, 
+		void *send_buf_in, void *recv_buf_in, 
 		uint32 total_size, uint32 num_nodes, 
 		uint32 my_id, MPI_Comm comm) {
 	
@@ -156,7 +158,7 @@ void global_xor(void *send_buf_in, void *recv_buf_in,
 		return;
 	}
 
-	global_xor_async(send_buf, recv_buf, 
+	global_xor_async(A, send_buf, recv_buf, 
 		total_size, num_nodes, my_id, comm);
 }
 
@@ -182,7 +184,8 @@ void global_chunk_info(uint32 total_size, uint32 num_nodes,
 }
 
 /*------------------------------------------------------------------*/
-void global_xor_scatter(void *send_buf_in, void *recv_buf_in, 
+void global_xor_scatter(packed_matrix_t *A, 
+			void *send_buf_in, void *recv_buf_in, 
 			void *scratch_in, uint32 total_size, 
 			uint32 num_nodes, uint32 my_id, 
 			MPI_Comm comm) {
@@ -246,7 +249,7 @@ void global_xor_scatter(void *send_buf_in, void *recv_buf_in,
         
 		/* combine the new chunk with our own */
         
-		vv_xor(send_buf + m * chunk, scratch, size);
+		vv_xor(A, send_buf + m * chunk, scratch, size);
 		
 		/* now wait for the send to end */
         
@@ -276,7 +279,7 @@ void global_xor_scatter(void *send_buf_in, void *recv_buf_in,
     
 	/* combine the new chunk with our own */
     
-   	vv_xor(recv_buf, send_buf + m * chunk, size);
+   	vv_xor(A, recv_buf, send_buf + m * chunk, size);
     
 	/* now wait for the send to end */
     
@@ -0,0 +1,803 @@
+/*--------------------------------------------------------------------
+This source distribution is placed in the public domain by its author,
+Jason Papadopoulos. You may use it for any purpose, free of charge,
+without having to notify anyone. I disclaim any responsibility for any
+errors.
+
+Optionally, please be nice and tell me if you find this source to be
+useful. Again optionally, if you add to the functionality present here
+please consider making those additions public too, so that others may
+benefit from your work.
+
+$Id$
+--------------------------------------------------------------------*/
+
+#include "lanczos.h"
+
+/* Block Wiedemann, an alternative to block Lanczos.
+
+   Block Lanczos needs the result of each iteration before the
+   next can start, so a matrix can only be spread over machines
+   that are connected tightly enough to exchange vectors every
+   iteration. Block Wiedemann instead works with num_seqs
+   independent sequences; like the Lanczos code, it uses the
+   symmetric matrix A = B'B, where B is the matrix after the
+   post-Lanczos rows are removed. With M = num_seqs * VBITS:
+
+   1. For each s, starting from a random block Z_s and Y = A*Z_s,
+      compute the sequence X' * A^i * Y for i < L, where X is a
+      random block M vectors wide that all sequences share. L is
+      about 2N/M, so each sequence needs 1/num_seqs of the matrix
+      multiplies a single sequence would. The sequences have
+      nothing to do with each other, and can be computed at
+      different times, on different machines, or each by its own
+      MPI grid.
+
+   2. Combine the sequences and find a matrix generator for them,
+      i.e. linear recurrences they satisfy (wiedemann_lingen.c).
+      This needs no matrix multiplies.
+
+   3. For each s, use the part of the generator that multiplies
+      sequence s to form a combination of the vectors A^i * Z_s.
+      This needs about N/M more multiplies per sequence, and is
+      also independent for each s.
+
+   4. Add up the results of step 3 and multiply by A until each
+      column becomes zero; the last nonzero value of each column
+      is in the nullspace of A. These go through the same final
+      processing as the output of block Lanczos.
+
+   Each step saves its results to a file, and a run skips any
+   step whose results are already on disk. So a distributed run
+   builds the matrix once, then runs step 1 separately for each
+   sequence, copies the sequence files to one place for step 2,
+   copies the generator back out for step 3, and collects the
+   partial solutions for step 4.
+
+   The random blocks are computed from a hash of the matrix and
+   the position in the vector, so every run that needs one gets
+   the same block no matter how it divides up the matrix */
+
+#define BW_MAGIC 0x4d535742	/* "BWSM" */
+#define BW_VERSION 1
+
+/* the generator step costs grow with the cube of the
+   block size, which limits the number of sequences */
+
+#define BW_MAX_SEQS 8
+
+/* the sequence is made this much longer than the theoretical
+   minimum of 2N/M terms, and generator columns must satisfy
+   their recurrence for this many terms beyond N/M */
+
+#define BW_EXTRA_TERMS 32
+#define BW_MARGIN 8
+
+/* the most multiplies by A that step 4 will try */
+
+#define BW_MAX_POWERS 64
+
+/* the random blocks used; each sequence has its own Z */
+
+enum {
+	BW_STREAM_X = 0,
+	BW_STREAM_Z = BW_MAX_SEQS,
+	BW_STREAM_CHECK = 2 * BW_MAX_SEQS
+};
+
+enum {
+	BW_FILE_SEQ = 0,
+	BW_FILE_GEN,
+	BW_FILE_SOL
+};
+
+enum {
+	BW_PHASE_ALL = 0,
+	BW_PHASE_KRYLOV,
+	BW_PHASE_LINGEN,
+	BW_PHASE_MKSOL
+};
+
+typedef struct {
+	uint32 magic;
+	uint32 version;
+	uint32 type;
+	uint32 vbits;
+	uint32 num_seqs;
+	uint32 seq;		/* for sequences and solutions */
+	uint32 max_n;
+	uint32 n;		/* vector entries, for solutions */
+	uint32 len;		/* terms, or generator coefficients */
+	uint32 gen_cols;	/* usable columns of the generator */
+	uint64 fingerprint;	/* of the matrix */
+	uint64 size;		/* bytes of data after the header */
+	uint64 checksum;	/* of the data */
+} bw_header_t;
+
+typedef struct {
+	msieve_obj *obj;
+	packed_matrix_t *matrix;
+	uint32 n;		/* vector entries on this process */
+	uint32 max_n;
+	uint32 start;		/* global index of the first entry */
+	uint32 num_seqs;
+	uint32 m;		/* num_seqs * VBITS */
+	uint32 seq_len;
+	uint32 min_order;
+	uint64 fingerprint;
+	void *scratch;
+} bw_t;
+
+typedef struct {
+	time_t start_time;
+	uint32 interval;
+	uint32 next;
+	uint32 num_reports;
+} bw_progress_t;
+
+/*-------------------------------------------------------------------*/
+static uint32 bw_is_root(bw_t *bw) {
+
+#ifdef HAVE_MPI
+	return (bw->obj->mpi_la_row_rank + bw->obj->mpi_la_col_rank == 0);
+#else
+	return 1;
+#endif
+}
+
+/*-------------------------------------------------------------------*/
+static void bw_bcast(bw_t *bw, void *buf, size_t num_bytes) {
+
+	/* send data from the root to everyone */
+
+#ifdef HAVE_MPI
+	MPI_TRY(MPI_Bcast(buf, (int)num_bytes, MPI_BYTE, 0,
+			bw->obj->mpi_la_grid))
+#endif
+}
+
+/*-------------------------------------------------------------------*/
+static uint32 bw_all(bw_t *bw, uint32 flag) {
+
+	/* nonzero if flag is nonzero on every process */
+
+#ifdef HAVE_MPI
+	uint32 all;
+
+	MPI_TRY(MPI_Allreduce(&flag, &all, 1, MPI_UNSIGNED, MPI_MIN,
+			bw->obj->mpi_la_grid))
+	return all;
+#else
+	return flag;
+#endif
+}
+
+/*-------------------------------------------------------------------*/
+static void bw_file_name(bw_t *bw, char *buf, uint32 type, uint32 seq) {
+
+	char *base = bw->obj->savefile.name;
+
+	switch (type) {
+	case BW_FILE_SEQ:
+		sprintf(buf, "%s.bw.seq%u", base, seq);
+		break;
+	case BW_FILE_GEN:
+		sprintf(buf, "%s.bw.gen", base);
+		break;
+	case BW_FILE_SOL:
+		/* every MPI process has its own piece */
+#ifdef HAVE_MPI
+		sprintf(buf, "%s.mpi%02u.bw.sol%u", base,
+				bw->obj->mpi_rank, seq);
+#else
+		sprintf(buf, "%s.bw.sol%u", base, seq);
+#endif
+		break;
+	}
+}
+
+/*-------------------------------------------------------------------*/
+static void bw_write(bw_t *bw, uint32 type, uint32 seq,
+			uint32 len, uint32 gen_cols,
+			void *data, uint64 size) {
+
+	/* write to a temporary file and then rename it, so
+	   that an interrupted write never leaves behind a
+	   file that looks finished */
+
+	msieve_obj *obj = bw->obj;
+	char name[LINE_BUF_SIZE];
+	char tmp_name[LINE_BUF_SIZE + 8];
+	bw_header_t h;
+	FILE *fp;
+
+	memset(&h, 0, sizeof(h));
+	h.magic = BW_MAGIC;
+	h.version = BW_VERSION;
+	h.type = type;
+	h.vbits = VBITS;
+	h.num_seqs = bw->num_seqs;
+	h.seq = seq;
+	h.max_n = bw->max_n;
+	h.n = (type == BW_FILE_SOL) ? bw->n : 0;
+	h.len = len;
+	h.gen_cols = gen_cols;
+	h.fingerprint = bw->fingerprint;
+	h.size = size;
+	h.checksum = lanczos_chk_checksum(0, data, (size_t)size);
+
+	bw_file_name(bw, name, type, seq);
+	sprintf(tmp_name, "%s.tmp", name);
+
+	fp = fopen(tmp_name, "wb");
+	if (fp == NULL) {
+		logprintf(obj, "error: cannot open %s\n", tmp_name);
+		exit(-1);
+	}
+	if (fwrite(&h, sizeof(h), (size_t)1, fp) != 1 ||
+	    fwrite(data, (size_t)size, (size_t)1, fp) != 1) {
+		logprintf(obj, "error: cannot write %s\n", tmp_name);
+		exit(-1);
+	}
+	fclose(fp);
+
+	remove(name);
+	if (rename(tmp_name, name) != 0) {
+		logprintf(obj, "error: cannot rename %s\n", tmp_name);
+		exit(-1);
+	}
+}
+
+/*-------------------------------------------------------------------*/
+static void * bw_read(bw_t *bw, uint32 type, uint32 seq,
+			bw_header_t *h) {
+
+	/* returns the data in a file, or NULL if there is no
+	   file or it belongs to a different matrix or setup */
+
+	msieve_obj *obj = bw->obj;
+	char name[LINE_BUF_SIZE];
+	void *data;
+	FILE *fp;
+
+	bw_file_name(bw, name, type, seq);
+	fp = fopen(name, "rb");
+	if (fp == NULL)
+		return NULL;
+
+	if (fread(h, sizeof(bw_header_t), (size_t)1, fp) != 1 ||
+	    h->magic != BW_MAGIC ||
+	    h->version != BW_VERSION ||
+	    h->type != type ||
+	    h->vbits != VBITS ||
+	    h->num_seqs != bw->num_seqs ||
+	    h->seq != seq ||
+	    h->max_n != bw->max_n ||
+	    h->fingerprint != bw->fingerprint ||
+	    (type == BW_FILE_SOL && h->n != bw->n)) {
+		logprintf(obj, "ignoring %s, which is for a different "
+				"matrix or setup\n", name);
+		fclose(fp);
+		return NULL;
+	}
+
+	data = xmalloc((size_t)h->size);
+	if (fread(data, (size_t)h->size, (size_t)1, fp) != 1 ||
+	    lanczos_chk_checksum(0, data, (size_t)h->size) != h->checksum) {
+		logprintf(obj, "ignoring %s, which is damaged\n", name);
+		free(data);
+		fclose(fp);
+		return NULL;
+	}
+
+	fclose(fp);
+	logprintf(obj, "read %s\n", name);
+	return data;
+}
+
+/*-------------------------------------------------------------------*/
+static uint64 bw_hash(uint64 x) {
+
+	x ^= x >> 30;
+	x *= 0xbf58476d1ce4e5b9ULL;
+	x ^= x >> 27;
+	x *= 0x94d049bb133111ebULL;
+	x ^= x >> 31;
+	return x;
+}
+
+/*-------------------------------------------------------------------*/
+static void bw_random_vector(bw_t *bw, uint32 stream, void *v) {
+
+	uint32 i, j;
+	v_t *tmp = (v_t *)xmalloc(bw->n * sizeof(v_t));
+
+	for (i = 0; i < bw->n; i++) {
+		uint64 idx = ((uint64)stream << 40) +
+				(uint64)(bw->start + i) * VWORDS;
+
+		for (j = 0; j < VWORDS; j++) {
+			tmp[i].w[j] = bw_hash(bw->fingerprint ^
+						bw_hash(idx + j));
+		}
+	}
+
+	vv_copyin(v, tmp, bw->n);
+	free(tmp);
+}
+
+/*-------------------------------------------------------------------*/
+static v_t bw_nonzero_cols(bw_t *bw, void *r, void *v) {
+
+	/* returns the columns of v that are not all zero. A
+	   nonzero column of v has a nonzero product with a
+	   random block r, except with probability 2^-VBITS */
+
+	uint32 i;
+	v_t rv[VBITS];
+	v_t res = v_zero;
+
+	vv_mul_BxN_NxB(bw->matrix, r, v, rv, bw->n);
+	for (i = 0; i < VBITS; i++)
+		res = v_or(res, rv[i]);
+	return res;
+}
+
+/*-------------------------------------------------------------------*/
+static void bw_progress_init(bw_t *bw, bw_progress_t *p, uint32 total) {
+
+	msieve_obj *obj = bw->obj;
+
+	memset(p, 0, sizeof(bw_progress_t));
+	p->start_time = time(NULL);
+
+	if (bw_is_root(bw) && bw->max_n > 60000 &&
+	    obj->flags & (MSIEVE_FLAG_USE_LOGFILE |
+	    		  MSIEVE_FLAG_LOG_TO_STDOUT)) {
+		p->interval = MAX(total / 1000, 1);
+		p->next = p->interval;
+	}
+}
+
+/*-------------------------------------------------------------------*/
+static void bw_progress(bw_t *bw, bw_progress_t *p, char *what,
+			uint32 done, uint32 total) {
+
+	time_t curr_time;
+	uint32 eta;
+
+	if (p->interval == 0)
+		return;
+
+	if (done == total) {
+		fprintf(stderr, "\n");
+		return;
+	}
+	if (done < p->next)
+		return;
+
+	curr_time = time(NULL);
+	eta = (double)(curr_time - p->start_time) * (total - done) / done;
+	fprintf(stderr, "%s: %u of %u (%1.1f%%, ETA %dh%2dm)    \r",
+			what, done, total, 100.0 * done / total,
+			eta / 3600, (eta % 3600) / 60);
+	fflush(stderr);
+
+	/* report the ETA to the logfile once */
+
+	if (++p->num_reports == 20) {
+		logprintf(bw->obj, "%s at %1.1f%%, ETA %dh%2dm\n", what,
+				100.0 * done / total,
+				eta / 3600, (eta % 3600) / 60);
+	}
+	p->next = done + p->interval;
+}
+
+/*-------------------------------------------------------------------*/
+static v_t * bw_krylov(bw_t *bw, uint32 seq) {
+
+	/* step 1: compute X' * A^i * A * Z_seq for i < seq_len.
+	   Term i of the result is num_seqs blocks of VBITS
+	   vectors, one block for each VBITS-wide piece of X */
+
+	uint32 i, j;
+	uint32 num_seqs = bw->num_seqs;
+	void *extra = bw->matrix->extra;
+	void *x[BW_MAX_SEQS];
+	void *v;
+	v_t *out;
+	bw_progress_t progress;
+
+	logprintf(bw->obj, "computing sequence %u\n", seq);
+
+	out = (v_t *)xmalloc((size_t)bw->seq_len * num_seqs *
+				VBITS * sizeof(v_t));
+
+	for (i = 0; i < num_seqs; i++) {
+		x[i] = vv_alloc(bw->n, extra);
+		bw_random_vector(bw, BW_STREAM_X + i, x[i]);
+	}
+
+	v = vv_alloc(bw->n, extra);
+	bw_random_vector(bw, BW_STREAM_Z + seq, v);
+	mul_sym_NxN_NxB(bw->matrix, v, v, bw->scratch);
+
+	bw_progress_init(bw, &progress, bw->seq_len);
+
+	for (i = 0; i < bw->seq_len; i++) {
+		for (j = 0; j < num_seqs; j++) {
+			vv_mul_BxN_NxB(bw->matrix, x[j], v, out +
+					((size_t)i * num_seqs + j) * VBITS,
+					bw->n);
+		}
+
+		if (i + 1 < bw->seq_len)
+			mul_sym_NxN_NxB(bw->matrix, v, v, bw->scratch);
+
+		bw_progress(bw, &progress, "krylov", i + 1, bw->seq_len);
+	}
+
+	for (i = 0; i < num_seqs; i++)
+		vv_free(x[i]);
+	vv_free(v);
+	return out;
+}
+
+/*-------------------------------------------------------------------*/
+static void * bw_mksol(bw_t *bw, uint32 seq,
+			v_t *gen, uint32 gen_len) {
+
+	/* step 3: the sum over t of A^(gen_len-1-t) * Z_seq * g_t,
+	   where g_t is the part of generator coefficient t that
+	   multiplies sequence seq; compute it by Horner's rule */
+
+	uint32 i;
+	void *extra = bw->matrix->extra;
+	void *z = vv_alloc(bw->n, extra);
+	void *u = vv_alloc(bw->n, extra);
+	bw_progress_t progress;
+
+	logprintf(bw->obj, "computing partial solution %u\n", seq);
+
+	bw_random_vector(bw, BW_STREAM_Z + seq, z);
+	vv_clear(u, bw->n);
+
+	bw_progress_init(bw, &progress, gen_len);
+
+	for (i = 0; i < gen_len; i++) {
+		if (i > 0)
+			mul_sym_NxN_NxB(bw->matrix, u, u, bw->scratch);
+
+		vv_mul_NxB_BxB_acc(bw->matrix, z, gen + ((size_t)i *
+					bw->num_seqs + seq) * VBITS,
+					u, bw->n);
+
+		bw_progress(bw, &progress, "mksol", i + 1, gen_len);
+	}
+
+	vv_free(z);
+	return u;
+}
+
+/*-------------------------------------------------------------------*/
+static void * bw_finish(bw_t *bw, void *u) {
+
+	/* step 4: A^(k+1) * u is zero for some small k; for each
+	   column, keep the last power of A times u that is not zero */
+
+	uint32 i, j;
+	uint32 num_found;
+	void *extra = bw->matrix->extra;
+	void *w = vv_alloc(bw->n, extra);
+	void *r = vv_alloc(bw->n, extra);
+	void *x = vv_alloc(bw->n, extra);
+	void *tmp;
+	v_t nonzero_u, nonzero_w, done;
+	v_t found = v_zero;
+
+	bw_random_vector(bw, BW_STREAM_CHECK, r);
+	vv_clear(x, bw->n);
+
+	nonzero_u = bw_nonzero_cols(bw, r, u);
+
+	for (i = 0; i < BW_MAX_POWERS && !v_is_all_zeros(nonzero_u); i++) {
+
+		mul_sym_NxN_NxB(bw->matrix, u, w, bw->scratch);
+		nonzero_w = bw_nonzero_cols(bw, r, w);
+
+		done = v_xor(nonzero_u, v_and(nonzero_u, nonzero_w));
+		if (!v_is_all_zeros(done)) {
+			vv_mask(bw->matrix, u, done, bw->n);
+			vv_xor(bw->matrix, x, u, bw->n);
+			found = v_or(found, done);
+		}
+
+		tmp = u; u = w; w = tmp;
+		nonzero_u = nonzero_w;
+	}
+
+	for (i = num_found = 0; i < VWORDS; i++) {
+		for (j = 0; j < 64; j++)
+			num_found += (found.w[i] >> j) & 1;
+	}
+	logprintf(bw->obj, "found %u vectors in the nullspace of B'B\n",
+			num_found);
+
+	vv_free(u);
+	vv_free(w);
+	vv_free(r);
+	if (num_found == 0) {
+		vv_free(x);
+		return NULL;
+	}
+	return x;
+}
+
+/*-------------------------------------------------------------------*/
+static v_t * bw_lingen_input(bw_t *bw, v_t **seqs) {
+
+	/* interleave the sequences into the M x M matrices
+	   the generator code wants: row r of term i holds
+	   row r of each sequence's term i */
+
+	uint32 i, j, k;
+	uint32 num_seqs = bw->num_seqs;
+	uint32 m = bw->m;
+	v_t *out = (v_t *)xmalloc((size_t)bw->seq_len * m *
+					num_seqs * sizeof(v_t));
+
+	for (i = 0; i < bw->seq_len; i++) {
+		for (j = 0; j < m; j++) {
+			for (k = 0; k < num_seqs; k++) {
+				out[((size_t)i * m + j) * num_seqs + k] =
+					seqs[k][(size_t)i * m + j];
+			}
+		}
+	}
+	return out;
+}
+
+/*-------------------------------------------------------------------*/
+void * block_wiedemann(msieve_obj *obj,
+			packed_matrix_t *packed_matrix,
+			uint64 fingerprint) {
+
+	/* returns a block of vectors in the nullspace of B'B,
+	   or NULL if the solver failed or was only asked to
+	   do some of its steps */
+
+	bw_t bw;
+	uint32 i;
+	uint32 phase = BW_PHASE_ALL;
+	int32 only_seq = -1;
+	uint32 gen_len = 0;
+	uint32 gen_cols = 0;
+	uint32 have_gen = 0;
+	v_t *gen = NULL;
+	void *u = NULL;
+	void *x = NULL;
+	bw_header_t h;
+
+	memset(&bw, 0, sizeof(bw));
+	bw.obj = obj;
+	bw.matrix = packed_matrix;
+	bw.max_n = packed_matrix->max_ncols;
+	bw.num_seqs = 1;
+
+	if (obj->nfs_args != NULL) {
+		const char *tmp;
+
+		tmp = strstr(obj->nfs_args, "bw_seqs=");
+		if (tmp != NULL)
+			bw.num_seqs = atoi(tmp + 8);
+
+		tmp = strstr(obj->nfs_args, "bw_seq=");
+		if (tmp != NULL)
+			only_seq = atoi(tmp + 7);
+
+		tmp = strstr(obj->nfs_args, "bw_phase=");
+		if (tmp != NULL) {
+			tmp += 9;
+			if (strncmp(tmp, "krylov", (size_t)6) == 0)
+				phase = BW_PHASE_KRYLOV;
+			else if (strncmp(tmp, "lingen", (size_t)6) == 0)
+				phase = BW_PHASE_LINGEN;
+			else if (strncmp(tmp, "mksol", (size_t)5) == 0)
+				phase = BW_PHASE_MKSOL;
+			else {
+				logprintf(obj, "error: unknown block "
+					"Wiedemann phase\n");
+				exit(-1);
+			}
+		}
+	}
+
+	if (bw.num_seqs < 1 || bw.num_seqs > BW_MAX_SEQS) {
+		logprintf(obj, "error: block Wiedemann needs "
+				"1 to %u sequences\n", BW_MAX_SEQS);
+		exit(-1);
+	}
+	if (only_seq >= (int32)bw.num_seqs) {
+		logprintf(obj, "error: there is no sequence %d\n", only_seq);
+		exit(-1);
+	}
+
+	/* everyone must use the same random blocks */
+
+	bw_bcast(&bw, &fingerprint, sizeof(uint64));
+	bw.fingerprint = fingerprint;
+
+#ifdef HAVE_MPI
+	bw.n = packed_matrix->nsubcols;
+	bw.start = packed_matrix->start_col +
+		packed_matrix->subcol_offsets[obj->mpi_la_row_rank] / VWORDS;
+	bw.scratch = vv_alloc(2 * MAX(packed_matrix->nrows,
+					packed_matrix->ncols),
+				packed_matrix->extra);
+#else
+	bw.n = packed_matrix->ncols;
+	bw.start = 0;
+	bw.scratch = vv_alloc(bw.n, packed_matrix->extra);
+#endif
+
+	bw.m = bw.num_seqs * VBITS;
+	bw.min_order = (bw.max_n + bw.m - 1) / bw.m + BW_MARGIN;
+	bw.seq_len = 2 * ((bw.max_n + bw.m - 1) / bw.m) + BW_EXTRA_TERMS;
+
+	if (packed_matrix->num_threads > 1)
+		logprintf(obj, "commencing block Wiedemann, %u sequence(s) "
+				"of %u terms (%u threads)\n", bw.num_seqs,
+				bw.seq_len, packed_matrix->num_threads);
+	else
+		logprintf(obj, "commencing block Wiedemann, %u sequence(s) "
+				"of %u terms\n", bw.num_seqs, bw.seq_len);
+	logprintf(obj, "memory use: %.1f MB\n", (double)
+			(packed_matrix_sizeof(packed_matrix)) / 1048576);
+
+	/* use the generator from an earlier run if there is one */
+
+	if (phase == BW_PHASE_ALL || phase == BW_PHASE_MKSOL) {
+		if (bw_is_root(&bw)) {
+			gen = (v_t *)bw_read(&bw, BW_FILE_GEN, 0, &h);
+			if (gen != NULL) {
+				have_gen = 1;
+				gen_len = h.len;
+				gen_cols = h.gen_cols;
+			}
+		}
+		bw_bcast(&bw, &have_gen, sizeof(uint32));
+	}
+
+	if (!have_gen && phase == BW_PHASE_MKSOL) {
+		logprintf(obj, "error: no matrix generator found\n");
+		goto finished;
+	}
+
+	if (!have_gen) {
+		v_t *seqs[BW_MAX_SEQS] = {NULL};
+		uint32 have_seq;
+
+		/* step 1 */
+
+		for (i = 0; i < bw.num_seqs; i++) {
+			if (phase == BW_PHASE_KRYLOV && only_seq >= 0 &&
+			    i != (uint32)only_seq)
+				continue;
+
+			have_seq = 0;
+			if (bw_is_root(&bw)) {
+				seqs[i] = (v_t *)bw_read(&bw, BW_FILE_SEQ,
+							i, &h);
+				have_seq = (seqs[i] != NULL &&
+					    h.len == bw.seq_len);
+			}
+			bw_bcast(&bw, &have_seq, sizeof(uint32));
+			if (have_seq)
+				continue;
+
+			if (phase == BW_PHASE_LINGEN) {
+				logprintf(obj, "error: sequence %u is "
+						"missing\n", i);
+				while (i)
+					free(seqs[--i]);
+				goto finished;
+			}
+
+			free(seqs[i]);
+			seqs[i] = bw_krylov(&bw, i);
+			if (bw_is_root(&bw)) {
+				bw_write(&bw, BW_FILE_SEQ, i, bw.seq_len, 0,
+					seqs[i], (uint64)bw.seq_len * bw.m *
+							sizeof(v_t));
+			}
+		}
+
+		if (phase == BW_PHASE_KRYLOV) {
+			for (i = 0; i < bw.num_seqs; i++)
+				free(seqs[i]);
+			goto finished;
+		}
+
+		/* step 2 only runs on the root node */
+
+		if (bw_is_root(&bw)) {
+			v_t *in = bw_lingen_input(&bw, seqs);
+
+			gen = bw_lingen(obj, in, bw.num_seqs, bw.seq_len,
+					bw.min_order, &gen_len, &gen_cols);
+			free(in);
+			if (gen != NULL) {
+				bw_write(&bw, BW_FILE_GEN, 0, gen_len,
+					gen_cols, gen, (uint64)gen_len *
+						bw.m * sizeof(v_t));
+			}
+		}
+		for (i = 0; i < bw.num_seqs; i++)
+			free(seqs[i]);
+
+		bw_bcast(&bw, &gen_cols, sizeof(uint32));
+		if (gen_cols == 0) {
+			logprintf(obj, "error: no usable matrix generator\n");
+			goto finished;
+		}
+		if (phase == BW_PHASE_LINGEN)
+			goto finished;
+	}
+
+	/* give everyone the generator */
+
+	bw_bcast(&bw, &gen_len, sizeof(uint32));
+	if (!bw_is_root(&bw))
+		gen = (v_t *)xmalloc((size_t)gen_len * bw.m * sizeof(v_t));
+	bw_bcast(&bw, gen, (size_t)gen_len * bw.m * sizeof(v_t));
+
+	/* step 3 */
+
+	for (i = 0; i < bw.num_seqs; i++) {
+		void *curr;
+		v_t *saved;
+
+		if (phase == BW_PHASE_MKSOL && only_seq >= 0 &&
+		    i != (uint32)only_seq)
+			continue;
+
+		saved = (v_t *)bw_read(&bw, BW_FILE_SOL, i, &h);
+		if (bw_all(&bw, saved != NULL && h.len == gen_len)) {
+			curr = vv_alloc(bw.n, packed_matrix->extra);
+			vv_copyin(curr, saved, bw.n);
+		}
+		else {
+			v_t *tmp;
+
+			curr = bw_mksol(&bw, i, gen, gen_len);
+
+			tmp = (v_t *)xmalloc(bw.n * sizeof(v_t));
+			vv_copyout(tmp, curr, bw.n);
+			bw_write(&bw, BW_FILE_SOL, i, gen_len, gen_cols,
+					tmp, (uint64)bw.n * sizeof(v_t));
+			free(tmp);
+		}
+		free(saved);
+
+		if (phase == BW_PHASE_MKSOL) {
+			vv_free(curr);
+		}
+		else if (u == NULL) {
+			u = curr;
+		}
+		else {
+			vv_xor(packed_matrix, u, curr, bw.n);
+			vv_free(curr);
+		}
+	}
+
+	/* step 4 */
+
+	if (u != NULL)
+		x = bw_finish(&bw, u);
+
+finished:
+	free(gen);
+	vv_free(bw.scratch);
+	return x;
+}
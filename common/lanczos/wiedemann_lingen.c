@@ -0,0 +1,594 @@
+/*--------------------------------------------------------------------
+This source distribution is placed in the public domain by its author,
+Jason Papadopoulos. You may use it for any purpose, free of charge,
+without having to notify anyone. I disclaim any responsibility for any
+errors.
+
+Optionally, please be nice and tell me if you find this source to be
+useful. Again optionally, if you add to the functionality present here
+please consider making those additions public too, so that others may
+benefit from your work.
+
+$Id$
+--------------------------------------------------------------------*/
+
+#include <thread.h>
+#include "lanczos.h"
+
+/* The matrix generator of a block Wiedemann sequence.
+
+   The input is a sequence a_0, a_1, ... a_{L-1} of m x n
+   matrices (here m = n, a multiple of VBITS). Write S(X) for
+   the sum of a_i * X^i. We want polynomial vectors f(X) with
+   n entries, each with a nominal degree d >= deg(f), such that
+   the coefficients of X^d through X^(L-2) of S(X) * f(X) all
+   vanish. Read backwards, the coefficients of f then give a
+   linear recurrence that holds for L-1-d consecutive terms of
+   the sequence, and when that is more than about N/m terms
+   the same recurrence applies to the Krylov vectors the
+   sequence came from.
+
+   This is the iterative version of the 'M-basis' algorithm of
+   Giorgi, Jeannerod and Villard. We maintain m+n columns of
+   polynomial vectors u = (f, r), where f has n entries and r
+   has m, that form a basis for the solutions to
+
+   	X * S(X) * f(X) + r(X) = 0 mod X^k
+
+   and give each column a nominal degree that bounds the degree
+   of all its entries. Step k looks at the coefficient of X^k of
+   [X*S | I] times the basis, clears it using column operations
+   that only add a column to one of the same or higher nominal
+   degree, and multiplies the columns used as pivots by X. The
+   columns whose degree grows slowest are the ones we want.
+
+   Rather than recomputing each coefficient by convolving the
+   sequence with the basis, the whole residual [X*S | I] * basis
+   (divided by X^k) is kept and updated along with the basis.
+   Each step then needs no products with the sequence, but still
+   touches all of the residual and the basis, so the total work
+   is quadratic in L. The rows of both are independent and are
+   split among threads.
+
+   Only the f part of the basis is stored, since the residual
+   already holds everything the r part would contribute */
+
+/* the basis has m+n columns, a row of which is 'words' 64-bit
+   words. Bit j of word i is column 64*i+j */
+
+typedef struct {
+	uint32 m;		/* also n */
+	uint32 ncols;		/* m + n */
+	uint32 words;		/* in one row of ncols bits */
+
+	uint64 *e;		/* the residual: e_len coefficients,
+				   each m rows */
+	uint32 e_len;
+	uint64 *p;		/* the basis: p_len coefficients, each
+				   n rows; room for p_alloc of them */
+	uint32 p_len;
+	uint32 p_alloc;
+	uint32 *delta;		/* nominal degree of each column */
+
+	/* the column operations of the current step, as
+	   8-bit lookup tables */
+
+	uint64 *pivot_mask;	/* columns used as pivots */
+	uint32 num_tables;
+	uint32 *table_byte;	/* byte of a row each table is for */
+	uint64 *tables;		/* 256 rows per table */
+} lingen_t;
+
+typedef struct {
+	lingen_t *l;
+	uint32 e_row_start;
+	uint32 e_row_end;
+	uint32 p_row_start;
+	uint32 p_row_end;
+	uint64 *tmp;		/* 2 rows */
+} lingen_task_t;
+
+/*-------------------------------------------------------------------*/
+static void transpose_64x64(uint64 *a) {
+
+	/* transpose a 64x64 bit matrix in place, so that bit j
+	   of a[i] swaps places with bit i of a[j] */
+
+	uint32 j, k;
+	uint64 m, t;
+
+	for (j = 32, m = 0x00000000ffffffffULL; j;
+				j >>= 1, m ^= m << j) {
+		for (k = 0; k < 64; k = ((k | j) + 1) & ~j) {
+			t = ((a[k] >> j) ^ a[k | j]) & m;
+			a[k] ^= t << j;
+			a[k | j] ^= t;
+		}
+	}
+}
+
+/*-------------------------------------------------------------------*/
+static void transpose_bits(uint64 *in, uint32 in_rows, uint32 in_words,
+			uint64 *out) {
+
+	/* transpose the in_rows x (64 * in_words) matrix 'in'
+	   into 'out'; in_rows must be a multiple of 64 */
+
+	uint32 i, j, k;
+	uint32 out_words = in_rows / 64;
+	uint64 a[64];
+
+	for (i = 0; i < out_words; i++) {
+		for (j = 0; j < in_words; j++) {
+			for (k = 0; k < 64; k++)
+				a[k] = in[(64 * i + k) * in_words + j];
+
+			transpose_64x64(a);
+
+			for (k = 0; k < 64; k++)
+				out[(64 * j + k) * out_words + i] = a[k];
+		}
+	}
+}
+
+/*-------------------------------------------------------------------*/
+static INLINE void row_mul(lingen_t *l, uint64 *in, uint64 *out) {
+
+	/* out = in times the column operations of the current
+	   step. Columns that were not pivots only ever appear
+	   as themselves, so only the bytes of 'in' containing
+	   a pivot need a table lookup */
+
+	uint32 i, j;
+	uint32 words = l->words;
+
+	memcpy(out, in, words * sizeof(uint64));
+
+	for (i = 0; i < l->num_tables; i++) {
+		uint32 b = l->table_byte[i];
+		uint32 idx = (uint8)((in[b / 8] & l->pivot_mask[b / 8]) >>
+						(8 * (b % 8)));
+		uint64 *t;
+
+		if (idx == 0)
+			continue;
+
+		t = l->tables + (256 * i + idx) * words;
+		for (j = 0; j < words; j++)
+			out[j] ^= t[j];
+	}
+}
+
+/*-------------------------------------------------------------------*/
+static void lingen_update_core(void *data, int thread_num) {
+
+	/* apply the column operations of one step to some rows
+	   of the residual and the basis, then divide the non-pivot
+	   columns of the residual by X and multiply the pivot
+	   columns of the basis by X */
+
+	lingen_task_t *task = (lingen_task_t *)data;
+	lingen_t *l = task->l;
+	uint32 words = l->words;
+	uint64 *pm = l->pivot_mask;
+	uint64 *cur = task->tmp;
+	uint64 *next = task->tmp + words;
+	uint64 *swap;
+	uint32 i, j, t;
+
+	for (i = task->e_row_start; i < task->e_row_end; i++) {
+		uint64 *row = l->e + i * words;
+		size_t stride = (size_t)l->m * words;
+
+		row_mul(l, row, cur);
+		for (t = 0; t < l->e_len; t++, row += stride) {
+
+			if (t + 1 < l->e_len)
+				row_mul(l, row + stride, next);
+			else
+				memset(next, 0, words * sizeof(uint64));
+
+			for (j = 0; j < words; j++)
+				row[j] = (cur[j] & pm[j]) | (next[j] & ~pm[j]);
+
+			swap = cur; cur = next; next = swap;
+		}
+	}
+
+	for (i = task->p_row_start; i < task->p_row_end; i++) {
+		size_t stride = (size_t)l->m * words;
+
+		memset(cur, 0, words * sizeof(uint64));
+		for (t = l->p_len + 1; t; t--) {
+			uint64 *row = l->p + (t - 1) * stride + i * words;
+
+			if (t > 1)
+				row_mul(l, row - stride, next);
+			else
+				memset(next, 0, words * sizeof(uint64));
+
+			for (j = 0; j < words; j++)
+				row[j] = (cur[j] & ~pm[j]) | (next[j] & pm[j]);
+
+			swap = cur; cur = next; next = swap;
+		}
+	}
+}
+
+/*-------------------------------------------------------------------*/
+static uint32 *sort_delta;
+
+static int compare_delta(const void *x, const void *y) {
+
+	uint32 *xx = (uint32 *)x;
+	uint32 *yy = (uint32 *)y;
+
+	if (sort_delta[*xx] != sort_delta[*yy])
+		return (sort_delta[*xx] < sort_delta[*yy]) ? -1 : 1;
+	return (*xx < *yy) ? -1 : (*xx > *yy);
+}
+
+/*-------------------------------------------------------------------*/
+static void lingen_eliminate(lingen_t *l, uint64 *et, uint64 *tt,
+				uint32 *order, int32 *pivot_of_bit) {
+
+	/* Gauss elimination on the columns of the current
+	   coefficient of the residual, transposed into et[].
+	   Columns are visited in order of increasing nominal
+	   degree, so that a column is only ever reduced by
+	   columns whose degree is no larger. tt[] records the
+	   combination of columns that each column ends up as */
+
+	uint32 i, j, k;
+	uint32 m = l->m;
+	uint32 ncols = l->ncols;
+	uint32 words = l->words;
+	uint32 m_words = m / 64;
+
+	for (i = 0; i < ncols; i++)
+		order[i] = i;
+	sort_delta = l->delta;
+	qsort(order, (size_t)ncols, sizeof(uint32), compare_delta);
+
+	memset(tt, 0, (size_t)ncols * words * sizeof(uint64));
+	for (i = 0; i < ncols; i++)
+		tt[i * words + i / 64] = (uint64)1 << (i % 64);
+
+	for (i = 0; i < m; i++)
+		pivot_of_bit[i] = -1;
+	memset(l->pivot_mask, 0, words * sizeof(uint64));
+
+	for (i = 0; i < ncols; i++) {
+		uint32 c = order[i];
+		uint64 *row = et + c * m_words;
+
+		while (1) {
+			uint32 bit;
+			uint32 p;
+
+			for (j = 0; j < m_words; j++) {
+				if (row[j])
+					break;
+			}
+			if (j == m_words)
+				break;
+
+			/* eliminating the lowest set bit with a pivot
+			   row never disturbs the bits below it */
+
+			for (bit = 64 * j; !(row[j] &
+				((uint64)1 << (bit % 64))); bit++)
+				;
+
+			if (pivot_of_bit[bit] < 0) {
+				pivot_of_bit[bit] = c;
+				l->pivot_mask[c / 64] |= (uint64)1 << (c % 64);
+				break;
+			}
+
+			p = pivot_of_bit[bit];
+			for (k = 0; k < m_words; k++)
+				row[k] ^= et[p * m_words + k];
+			for (k = 0; k < words; k++)
+				tt[c * words + k] ^= tt[p * words + k];
+		}
+	}
+}
+
+/*-------------------------------------------------------------------*/
+static void lingen_make_tables(lingen_t *l, uint64 *tt, uint64 *ops) {
+
+	/* turn the column combinations into lookup tables.
+	   Row j of ops[] lists the columns that column j was
+	   added to; only pivot columns were ever added to
+	   anything, so only bytes containing a pivot need
+	   a table */
+
+	uint32 i, j, k;
+	uint32 ncols = l->ncols;
+	uint32 words = l->words;
+
+	transpose_bits(tt, ncols, words, ops);
+	for (i = 0; i < ncols; i++)
+		ops[i * words + i / 64] ^= (uint64)1 << (i % 64);
+
+	l->num_tables = 0;
+	for (i = 0; i < ncols / 8; i++) {
+		uint64 *t;
+
+		if (((l->pivot_mask[i / 8] >> (8 * (i % 8))) & 0xff) == 0)
+			continue;
+
+		t = l->tables + 256 * l->num_tables * words;
+		l->table_byte[l->num_tables++] = i;
+
+		memset(t, 0, words * sizeof(uint64));
+		for (j = 1; j < 256; j++) {
+			uint32 low = j & (0 - j);
+			uint32 bit = 0;
+			uint64 *prev = t + (j ^ low) * words;
+			uint64 *op;
+
+			while (!(low & (1 << bit)))
+				bit++;
+
+			op = ops + (8 * i + bit) * words;
+			for (k = 0; k < words; k++)
+				t[j * words + k] = prev[k] ^ op[k];
+		}
+	}
+}
+
+/*-------------------------------------------------------------------*/
+v_t * bw_lingen(msieve_obj *obj, v_t *seq, uint32 num_seqs,
+		uint32 seq_len, uint32 min_order,
+		uint32 *gen_len_out, uint32 *gen_cols_out) {
+
+	/* seq[] holds seq_len matrices of size M x M, with
+	   M = num_seqs * VBITS; row i of matrix j is the num_seqs
+	   vectors starting at seq[(j * M + i) * num_seqs].
+
+	   Returns up to VBITS columns of the generator, each
+	   shifted so they all have the same degree; coefficient
+	   t of the part of the generator for sequence s is the
+	   VBITS vectors starting at (t * num_seqs + s) * VBITS.
+	   Only columns whose recurrence held for at least
+	   min_order terms are used */
+
+	lingen_t l;
+	uint32 i, j, k;
+	uint32 m = num_seqs * VBITS;
+	uint32 words = 2 * m / 64;
+	uint32 num_steps = seq_len + 1;
+	uint32 num_threads = MAX(obj->num_threads, 1);
+	uint32 gen_cols, gen_len;
+	uint32 chosen[VBITS];
+	uint32 degree[VBITS];
+	uint32 report_interval = 0;
+	uint32 next_report = 0;
+	size_t stride;
+	uint64 *et, *tt, *ops;
+	uint32 *order;
+	int32 *pivot_of_bit;
+	v_t *gen;
+	lingen_task_t *tasks;
+	struct threadpool *pool = NULL;
+	thread_control_t control = {NULL, NULL, NULL};
+	task_control_t task = {NULL, lingen_update_core, NULL, NULL};
+	time_t start_time = time(NULL);
+
+	memset(&l, 0, sizeof(lingen_t));
+	l.m = m;
+	l.ncols = 2 * m;
+	l.words = words;
+	stride = (size_t)m * words;
+
+	logprintf(obj, "computing matrix generator "
+			"(%u x %u blocks, %u terms)\n", m, m, seq_len);
+
+	/* the residual starts off as [X*S | I] */
+
+	l.e_len = num_steps;
+	l.e = (uint64 *)xcalloc(num_steps * stride, sizeof(uint64));
+	for (i = 0; i < m; i++)
+		l.e[i * words + (m + i) / 64] = (uint64)1 << ((m + i) % 64);
+
+	for (i = 1; i < num_steps; i++) {
+		for (j = 0; j < m; j++) {
+			memcpy(l.e + i * stride + j * words,
+				seq + ((size_t)(i - 1) * m + j) * num_seqs,
+				num_seqs * sizeof(v_t));
+		}
+	}
+
+	/* the basis starts off as the identity; a pivot
+	   column can grow by at most one degree per step,
+	   and almost all of them grow at half that rate */
+
+	l.p_len = 1;
+	l.p_alloc = num_steps / 2 + 64;
+	l.p = (uint64 *)xcalloc(l.p_alloc * stride, sizeof(uint64));
+	for (i = 0; i < m; i++)
+		l.p[i * words + i / 64] = (uint64)1 << (i % 64);
+
+	l.delta = (uint32 *)xcalloc(l.ncols, sizeof(uint32));
+	l.pivot_mask = (uint64 *)xmalloc(words * sizeof(uint64));
+	l.table_byte = (uint32 *)xmalloc(l.ncols / 8 * sizeof(uint32));
+	l.tables = (uint64 *)xmalloc(l.ncols / 8 * 256 *
+					words * sizeof(uint64));
+
+	et = (uint64 *)xmalloc(l.ncols * m / 64 * sizeof(uint64));
+	tt = (uint64 *)xmalloc(l.ncols * words * sizeof(uint64));
+	ops = (uint64 *)xmalloc(l.ncols * words * sizeof(uint64));
+	order = (uint32 *)xmalloc(l.ncols * sizeof(uint32));
+	pivot_of_bit = (int32 *)xmalloc(m * sizeof(int32));
+
+	/* split the rows of the residual and the basis
+	   among the threads */
+
+	num_threads = MIN(num_threads, m);
+	tasks = (lingen_task_t *)xmalloc(num_threads *
+					sizeof(lingen_task_t));
+	for (i = 0; i < num_threads; i++) {
+		lingen_task_t *t = tasks + i;
+
+		t->l = &l;
+		t->e_row_start = t->p_row_start = i * m / num_threads;
+		t->e_row_end = t->p_row_end = (i + 1) * m / num_threads;
+		t->tmp = (uint64 *)xmalloc(2 * words * sizeof(uint64));
+	}
+	if (num_threads > 1)
+		pool = threadpool_init(num_threads - 1, num_threads, &control);
+
+	if (num_steps > 20000 &&
+	    obj->flags & (MSIEVE_FLAG_USE_LOGFILE |
+	    		  MSIEVE_FLAG_LOG_TO_STDOUT)) {
+		report_interval = num_steps / 100;
+		next_report = report_interval;
+	}
+
+	for (i = 0; i < num_steps; i++) {
+
+		/* eliminate the lowest coefficient of the residual */
+
+		transpose_bits(l.e, m, words, et);
+		lingen_eliminate(&l, et, tt, order, pivot_of_bit);
+		lingen_make_tables(&l, tt, ops);
+
+		/* the basis grows by one coefficient if there
+		   are any pivots */
+
+		if (l.p_len + 1 >= l.p_alloc) {
+			l.p_alloc *= 2;
+			l.p = (uint64 *)xrealloc(l.p, l.p_alloc * stride *
+							sizeof(uint64));
+		}
+		memset(l.p + l.p_len * stride, 0, stride * sizeof(uint64));
+
+		if (pool != NULL) {
+			for (j = 0; j < num_threads - 1; j++) {
+				task.data = tasks + j;
+				threadpool_add_task(pool, &task, 1);
+			}
+		}
+		lingen_update_core(tasks + num_threads - 1,
+					num_threads - 1);
+		if (pool != NULL)
+			threadpool_drain(pool, 1);
+
+		for (j = 0; j < l.ncols; j++) {
+			if (l.pivot_mask[j / 64] & ((uint64)1 << (j % 64)))
+				l.delta[j]++;
+		}
+
+		l.e_len--;
+		l.p_len++;
+		for (j = 0; j < stride; j++) {
+			if (l.p[(l.p_len - 1) * stride + j])
+				break;
+		}
+		if (j == stride)
+			l.p_len--;
+
+		if (report_interval && i >= next_report) {
+			fprintf(stderr, "matrix generator: %u of %u "
+					"steps (%1.1f%%)   \r", i, num_steps,
+					100.0 * i / num_steps);
+			fflush(stderr);
+			next_report += report_interval;
+		}
+	}
+
+	if (report_interval)
+		fprintf(stderr, "\n");
+
+	/* use the columns whose recurrence held for long
+	   enough, lowest degree first */
+
+	for (i = 0; i < l.ncols; i++)
+		order[i] = i;
+	sort_delta = l.delta;
+	qsort(order, (size_t)l.ncols, sizeof(uint32), compare_delta);
+
+	gen_cols = gen_len = 0;
+	for (i = 0; i < l.ncols && gen_cols < VBITS; i++) {
+		uint32 c = order[i];
+		uint64 mask = (uint64)1 << (c % 64);
+		uint32 deg = 0;
+		uint32 found = 0;
+
+		if (l.delta[c] + min_order >= num_steps)
+			break;
+
+		/* find the actual degree of the column */
+
+		for (j = 0; j < l.p_len; j++) {
+			for (k = 0; k < m; k++) {
+				if (l.p[j * stride + k * words + c / 64] & mask) {
+					deg = j;
+					found = 1;
+					break;
+				}
+			}
+		}
+		if (!found)
+			continue;
+
+		chosen[gen_cols] = c;
+		degree[gen_cols++] = deg;
+		gen_len = MAX(gen_len, deg + 1);
+	}
+
+	logprintf(obj, "matrix generator has %u usable columns, "
+			"degree %u\n", gen_cols, gen_len - 1);
+	logprintf(obj, "matrix generator took %u seconds\n",
+			(uint32)(time(NULL) - start_time));
+
+	/* copy out the chosen columns, shifting each one up
+	   so they all have the same degree */
+
+	gen = NULL;
+	if (gen_cols > 0) {
+		gen = (v_t *)xcalloc((size_t)gen_len * m, sizeof(v_t));
+
+		for (i = 0; i < gen_cols; i++) {
+			uint32 c = chosen[i];
+			uint32 shift = gen_len - 1 - degree[i];
+
+			for (j = 0; j <= degree[i]; j++) {
+				for (k = 0; k < m; k++) {
+					uint64 *row = l.p + j * stride +
+							k * words;
+
+					if (!(row[c / 64] &
+					      ((uint64)1 << (c % 64))))
+						continue;
+
+					gen[(j + shift) * m + k].w[i / 64] |=
+						(uint64)1 << (i % 64);
+				}
+			}
+		}
+	}
+
+	*gen_len_out = gen_len;
+	*gen_cols_out = gen_cols;
+
+	if (pool != NULL)
+		threadpool_free(pool);
+	for (i = 0; i < num_threads; i++)
+		free(tasks[i].tmp);
+	free(tasks);
+	free(et);
+	free(tt);
+	free(ops);
+	free(order);
+	free(pivot_of_bit);
+	free(l.e);
+	free(l.p);
+	free(l.delta);
+	free(l.pivot_mask);
+	free(l.table_byte);
+	free(l.tables);
+	return gen;
+}
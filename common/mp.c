@@ -16,6 +16,7 @@ $Id$
 #include <common.h>
 #include <gmp_xface.h>
 #include <mpz_aprcl32.h>
+#include <thread.h>
 
 /* silly hack: in order to expand macros and then
    turn them into strings, you need two levels of
@@ -1636,6 +1637,28 @@ void mp_modsqrt2(mp_t *a, mp_t *p, mp_t *res,
 }
 
 /*---------------------------------------------------------------*/
+
+/* the APR-CL code keeps its state in global variables, 
+   so only one thread at a time may run it. Code that runs
+   several factorizations at once brackets them with
+   mp_aprcl_lock_init and mp_aprcl_lock_free; a lone
+   factorization never creates the mutex and pays nothing */
+
+static mutex_t aprcl_mutex;
+static uint32 aprcl_mutex_users;
+
+void mp_aprcl_lock_init(void) {
+
+	if (aprcl_mutex_users++ == 0)
+		mutex_init(&aprcl_mutex);
+}
+
+void mp_aprcl_lock_free(void) {
+
+	if (--aprcl_mutex_users == 0)
+		mutex_free(&aprcl_mutex);
+}
+
 int32 mp_is_prime(mp_t *p, uint32 *seed1, uint32 *seed2) {
 
 	const uint32 factors[] = {3,5,7,11,13,17,19,23,29,31,37,41,43,
@@ -1644,7 +1667,7 @@ int32 mp_is_prime(mp_t *p, uint32 *seed1, uint32 *seed2) {
 				  151,157,163,167,173,179,181,191,193,
 				  197,199,211,223,227,229,233,239,241,251};
 
-	uint32 i, j, bits, num_squares, ret;
+	uint32 i, j, bits, num_squares, ret, locked;
 	mp_t base, tmp, oddpart, p_minus_1;
 	mpz_t zp;
 
@@ -1661,7 +1684,12 @@ int32 mp_is_prime(mp_t *p, uint32 *seed1, uint32 *seed2) {
 
 	mpz_init(zp);
 	mp2gmp(p, zp);
+	locked = (aprcl_mutex_users > 0);
+	if (locked)
+		mutex_lock(&aprcl_mutex);
 	ret = mpz_aprcl(zp);
+	if (locked)
+		mutex_unlock(&aprcl_mutex);
 	mpz_clear(zp);
 	if (ret == APRTCLE_PRIME) return MSIEVE_PRIME;
 	if (ret == APRTCLE_PRP) return MSIEVE_PROBABLE_PRIME;
@@ -10,8 +10,16 @@
  *      Author: Tomer Heber (heber.tomer@gmail.com).
  */
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE	/* for the CPU affinity calls */
+#endif
+
 #include <thread.h>
 
+#if defined(__linux__)
+#include <sched.h>
+#endif
+
 #include <pthread.h>
 
 #define THREAD_POOL_DEBUG
@@ -42,6 +50,7 @@ struct threadpool
 {
 	struct threadpool_queue tasks_queue;
 	struct threadpool_queue free_tasks_queue;
+	struct threadpool_queue *thread_queues; /* tasks for one thread */
 
 	task_control_t *tasks;
 
@@ -173,6 +182,25 @@ static int threadpool_queue_getsize(struct threadpool_queue *queue)
 	return queue->num_tasks;
 }
 
+/**
+ * This function shuts down the tasks left in a queue, without
+ * running them.
+ *
+ * @param queue The queue structure.
+ */
+static void threadpool_queue_shutdown(struct threadpool_queue *queue)
+{
+	while (threadpool_queue_getsize(queue)) {
+
+		task_control_t *task = (task_control_t *)
+				threadpool_queue_dequeue(queue);
+
+		if (task != NULL && task->shutdown != NULL) {
+			task->shutdown(task->data, 0);
+		}
+	}
+}
+
 static void threadpool_task_clear(task_control_t *task)
 {
 	memset(task, 0, sizeof(task_control_t));
@@ -185,9 +213,11 @@ static void threadpool_task_clear(task_control_t *task)
  * @param pool The thread pool structure.
  * @return A task or NULL on error (or if thread pool should shut down).
  */
-static task_control_t * threadpool_task_get_task(struct threadpool *pool)
+static task_control_t * threadpool_task_get_task(struct threadpool *pool,
+						int thread_num)
 {
 	task_control_t * task;
+	struct threadpool_queue *my_queue = pool->thread_queues + thread_num;
 
 	if (pool->stop_flag) {
 		/* The pool should shut down return NULL. */
@@ -200,7 +230,8 @@ static task_control_t * threadpool_task_get_task(struct threadpool *pool)
 		return NULL;
 	}
 
-	while (threadpool_queue_is_empty(&(pool->tasks_queue)) && !pool->stop_flag) {
+	while (threadpool_queue_is_empty(&(pool->tasks_queue)) && 
+	       threadpool_queue_is_empty(my_queue) && !pool->stop_flag) {
 		/* Block until a new task arrives. */
 		if (pthread_cond_wait(&(pool->new_tasks_cond),&(pool->mutex))) {
 			perror("pthread_cond_wait: ");
@@ -220,7 +251,13 @@ static task_control_t * threadpool_task_get_task(struct threadpool *pool)
 		return NULL;
 	}
 
-	if ((task = (task_control_t *)threadpool_queue_dequeue(&(pool->tasks_queue))) == NULL) {
+	/* tasks meant for this thread take priority */
+	if (!threadpool_queue_is_empty(my_queue))
+		task = (task_control_t *)threadpool_queue_dequeue(my_queue);
+	else
+		task = (task_control_t *)threadpool_queue_dequeue(&(pool->tasks_queue));
+
+	if (task == NULL) {
 		/* Since task is NULL returning task will return NULL as required. */
 		REPORT_ERROR("Failed to obtain a task from the jobs queue.");
 	}
@@ -263,7 +300,7 @@ static void *worker_thr_routine(void *data)
 	}
 
 	while (1) {
-		task = threadpool_task_get_task(pool);
+		task = threadpool_task_get_task(pool, my_id);
 		if (task == NULL) {
 			if (pool->stop_flag) {
 				/* Worker thr needs to exit (thread pool was shutdown). */
@@ -393,18 +430,15 @@ void threadpool_free(struct threadpool *pool)
 	}
 
 	/* shut down any tasks that are still waiting */
-	while (threadpool_queue_getsize(&(pool->tasks_queue))) {
-
-		task_control_t *task = (task_control_t *)
-				threadpool_queue_dequeue(&(pool->tasks_queue));
-
-		if (task != NULL && task->shutdown != NULL) {
-			task->shutdown(task->data, 0);
-		}
-	}
+	threadpool_queue_shutdown(&(pool->tasks_queue));
+	for (i = 0; i < pool->num_of_threads; i++)
+		threadpool_queue_shutdown(pool->thread_queues + i);
 
 	/* Free all allocated memory. */
 	threadpool_queue_free(&(pool->tasks_queue));
+	for (i = 0; i < pool->num_of_threads; i++)
+		threadpool_queue_free(pool->thread_queues + i);
+	free(pool->thread_queues);
 	threadpool_queue_free(&(pool->free_tasks_queue));
 	free(pool->tasks);
 	free(pool->thr_arr);
@@ -450,6 +484,10 @@ struct threadpool* threadpool_init(int num_of_threads,
 	/* Init the queues. */
 	threadpool_queue_init(&(pool->tasks_queue), queue_size);
 	threadpool_queue_init(&(pool->free_tasks_queue), queue_size);
+	pool->thread_queues = (struct threadpool_queue *)xmalloc(
+				num_of_threads * sizeof(struct threadpool_queue));
+	for (i = 0; i < num_of_threads; i++)
+		threadpool_queue_init(pool->thread_queues + i, queue_size);
 	pool->tasks = (task_control_t *)xmalloc(queue_size *
 					sizeof(task_control_t));
 
@@ -497,15 +535,13 @@ struct threadpool* threadpool_init(int num_of_threads,
 	return pool;
 }
 
-int threadpool_add_task(struct threadpool *pool, task_control_t *new_task, int blocking)
+static int threadpool_add_task_core(struct threadpool *pool, 
+				task_control_t *new_task, 
+				struct threadpool_queue *queue,
+				int blocking)
 {
 	task_control_t *task;
 
-	if (pool == NULL) {
-		REPORT_ERROR("The threadpool received as argument is NULL.");
-		return -1;
-	}
-
 	if (pthread_mutex_lock(&(pool->free_tasks_mutex))) {
 		perror("pthread_mutex_lock: ");
 		return -1;
@@ -557,7 +593,7 @@ int threadpool_add_task(struct threadpool *pool, task_control_t *new_task, int b
 		return -1;
 	}
 
-	if (threadpool_queue_enqueue(&(pool->tasks_queue),task)) {
+	if (threadpool_queue_enqueue(queue,task)) {
 		REPORT_ERROR("Failed to add a new task to the tasks queue.");
 		if (pthread_mutex_unlock(&(pool->mutex))) {
 			perror("pthread_mutex_unlock: ");
@@ -565,7 +601,7 @@ int threadpool_add_task(struct threadpool *pool, task_control_t *new_task, int b
 		return -1;
 	}
 
-	if (threadpool_queue_getsize(&(pool->tasks_queue)) == 1) {
+	if (threadpool_queue_getsize(queue) == 1) {
 		/* Notify all worker threads that there are new jobs. */
 		if (pthread_cond_broadcast(&(pool->new_tasks_cond))) {
 			perror("pthread_cond_broadcast: ");
@@ -585,6 +621,35 @@ int threadpool_add_task(struct threadpool *pool, task_control_t *new_task, int b
 	return 0;
 }
 
+int threadpool_add_task(struct threadpool *pool, task_control_t *new_task, int blocking)
+{
+	if (pool == NULL) {
+		REPORT_ERROR("The threadpool received as argument is NULL.");
+		return -1;
+	}
+
+	return threadpool_add_task_core(pool, new_task, 
+					&(pool->tasks_queue), blocking);
+}
+
+int threadpool_add_task_to(struct threadpool *pool, task_control_t *new_task, 
+			int thread_num, int blocking)
+{
+	if (pool == NULL) {
+		REPORT_ERROR("The threadpool received as argument is NULL.");
+		return -1;
+	}
+
+	if (thread_num < 0 || thread_num >= pool->num_of_threads) {
+		REPORT_ERROR("No thread %d in the threadpool.", thread_num);
+		return -1;
+	}
+
+	return threadpool_add_task_core(pool, new_task, 
+					pool->thread_queues + thread_num, 
+					blocking);
+}
+
 int threadpool_drain(struct threadpool *pool, int blocking)
 {
 	if (pthread_mutex_lock(&(pool->free_tasks_mutex))) {
@@ -623,3 +688,135 @@ int threadpool_drain(struct threadpool *pool, int blocking)
 	return 0;
 }
 
+
+/*------------------------------------------------------------------*/
+#if defined(__linux__)
+static uint32 parse_cpulist(char *buf, uint32 *cpus, uint32 max_cpus)
+{
+	/* parse a Linux CPU list, i.e. "0-3,8,10-11" */
+
+	uint32 num_cpus = 0;
+	char *p = buf;
+
+	while (*p) {
+		uint32 lo, hi;
+		char *next;
+
+		lo = hi = strtoul(p, &next, 10);
+		if (next == p)
+			break;
+		p = next;
+		if (*p == '-') {
+			hi = strtoul(p + 1, &next, 10);
+			p = next;
+		}
+		while (lo <= hi && num_cpus < max_cpus)
+			cpus[num_cpus++] = lo++;
+		if (*p == ',')
+			p++;
+	}
+
+	return num_cpus;
+}
+#endif
+
+uint32 get_cpu_topology(uint32 *cpus, uint32 *nodes, uint32 max_cpus)
+{
+	uint32 num_cpus = 0;
+
+#if defined(__linux__)
+	uint32 i, j;
+	cpu_set_t mask;
+	char name[128];
+	char buf[4096];
+	uint32 node_cpus[1024];
+
+	if (sched_getaffinity(0, sizeof(mask), &mask) != 0)
+		return 0;
+
+	for (i = 0; i < CPU_SETSIZE && num_cpus < max_cpus; i++) {
+		if (CPU_ISSET(i, &mask)) {
+			cpus[num_cpus] = i;
+			nodes[num_cpus++] = 0;
+		}
+	}
+
+	/* kernels without NUMA support have no node directories,
+	   in which case every CPU stays on node 0 */
+
+	for (i = 0; i < 256; i++) {
+		FILE *fp;
+		uint32 num_node_cpus, k;
+
+		sprintf(name, "/sys/devices/system/node/node%u/cpulist", i);
+		fp = fopen(name, "r");
+		if (fp == NULL)
+			continue;
+		if (fgets(buf, sizeof(buf), fp) == NULL)
+			buf[0] = 0;
+		fclose(fp);
+
+		num_node_cpus = parse_cpulist(buf, node_cpus, 1024);
+		for (j = 0; j < num_node_cpus; j++) {
+			for (k = 0; k < num_cpus; k++) {
+				if (cpus[k] == node_cpus[j])
+					nodes[k] = i;
+			}
+		}
+	}
+
+#elif defined(WIN32) || defined(_WIN64)
+	uint32 i;
+	DWORD_PTR proc_mask, sys_mask;
+
+	if (!GetProcessAffinityMask(GetCurrentProcess(), 
+				&proc_mask, &sys_mask))
+		return 0;
+
+	for (i = 0; i < 8 * sizeof(DWORD_PTR) && num_cpus < max_cpus; i++) {
+		UCHAR node;
+
+		if (!(proc_mask & ((DWORD_PTR)1 << i)))
+			continue;
+
+		cpus[num_cpus] = i;
+		if (GetNumaProcessorNode((UCHAR)i, &node) && node != 0xff)
+			nodes[num_cpus++] = node;
+		else
+			nodes[num_cpus++] = 0;
+	}
+#endif
+
+	return num_cpus;
+}
+
+/*------------------------------------------------------------------*/
+int thread_bind_cpus(uint32 *cpus, uint32 num_cpus)
+{
+#if defined(__linux__)
+	uint32 i;
+	cpu_set_t mask;
+
+	CPU_ZERO(&mask);
+	for (i = 0; i < num_cpus; i++) {
+		if (cpus[i] < CPU_SETSIZE)
+			CPU_SET(cpus[i], &mask);
+	}
+	return pthread_setaffinity_np(pthread_self(), sizeof(mask), &mask);
+
+#elif defined(WIN32) || defined(_WIN64)
+	uint32 i;
+	DWORD_PTR mask = 0;
+
+	for (i = 0; i < num_cpus; i++) {
+		if (cpus[i] < 8 * sizeof(DWORD_PTR))
+			mask |= (DWORD_PTR)1 << cpus[i];
+	}
+	if (SetThreadAffinityMask(GetCurrentThread(), mask) == 0)
+		return -1;
+	return 0;
+
+#else
+	return -1;
+#endif
+}
@@ -473,6 +473,49 @@ enum cpu_type get_cpu_type(void) {
 	return cpu;
 }
 
+/*--------------------------------------------------------------------*/
+uint32 get_cpu_simd(void) {
+
+	uint32 simd = 0;
+
+#if defined(HAS_CPUID)
+	uint32 a, b, c, d;
+	uint32 max_code;
+	uint32 xcr0 = 0;
+
+	CPUID(0, max_code, b, c, d);
+	if (max_code < 1)
+		return 0;
+
+	CPUID(1, a, b, c, d);
+	if (d & 0x4000000)
+		simd |= CPU_SIMD_SSE2;
+
+	/* the wider instruction sets are only usable if the
+	   OS saves the upper parts of the vector registers
+	   on a context switch; XGETBV reports which register
+	   state the OS has enabled */
+
+	if ((c & 0x18000000) != 0x18000000 || max_code < 7)
+		return simd;
+
+#if defined(_MSC_VER)
+	xcr0 = (uint32)_xgetbv(0);
+#else
+	ASM_G volatile(".byte 0x0f, 0x01, 0xd0"	/* xgetbv */
+			:"=a"(xcr0) : "c"(0) : "%edx");
+#endif
+
+	CPUID2(7, 0, a, b, c, d);
+	if ((xcr0 & 0x06) == 0x06 && (b & 0x20))
+		simd |= CPU_SIMD_AVX2;
+	if ((xcr0 & 0xe6) == 0xe6 && (b & 0x40010000) == 0x40010000)
+		simd |= CPU_SIMD_AVX512;
+#endif
+
+	return simd;
+}
+
 /*--------------------------------------------------------------------*/
 uint64 get_file_size(char *name) {
 
@@ -534,6 +577,130 @@ uint64 get_ram_size(void) {
 #endif
 }
 
+/*--------------------------------------------------------------------*/
+uint32 map_file(mapped_file_t *m, char *name) {
+
+	memset(m, 0, sizeof(mapped_file_t));
+
+#if defined(WIN32) || defined(_WIN64)
+	{
+		LARGE_INTEGER size;
+
+		m->file = CreateFileA(name, GENERIC_READ, FILE_SHARE_READ,
+					NULL, OPEN_EXISTING, 
+					FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+		if (m->file == INVALID_HANDLE_VALUE)
+			return 1;
+
+		if (GetFileSizeEx(m->file, &size) == 0) {
+			CloseHandle(m->file);
+			return 1;
+		}
+		m->size = size.QuadPart;
+		if (m->size == 0)
+			return 0;
+
+		if ((uint64)(size_t)m->size != m->size) {
+			CloseHandle(m->file);
+			return 1;
+		}
+
+		m->mapping = CreateFileMapping(m->file, NULL, 
+					PAGE_READONLY, 0, 0, NULL);
+		if (m->mapping == NULL) {
+			CloseHandle(m->file);
+			return 1;
+		}
+
+		m->data = (uint8 *)MapViewOfFile(m->mapping, 
+					FILE_MAP_READ, 0, 0, 0);
+		if (m->data == NULL) {
+			CloseHandle(m->mapping);
+			CloseHandle(m->file);
+			return 1;
+		}
+	}
+#else
+	{
+		struct stat tmp;
+		void *data;
+
+		m->fd = open(name, O_RDONLY);
+		if (m->fd < 0)
+			return 1;
+
+		if (fstat(m->fd, &tmp) != 0) {
+			close(m->fd);
+			return 1;
+		}
+		m->size = tmp.st_size;
+		if (m->size == 0)
+			return 0;
+
+		if ((uint64)(size_t)m->size != m->size) {
+			close(m->fd);
+			return 1;
+		}
+
+		data = mmap(NULL, (size_t)m->size, PROT_READ, 
+				MAP_SHARED, m->fd, 0);
+		if (data == MAP_FAILED) {
+			close(m->fd);
+			return 1;
+		}
+		m->data = (uint8 *)data;
+	}
+#endif
+	return 0;
+}
+
+/*--------------------------------------------------------------------*/
+void unmap_file(mapped_file_t *m) {
+
+#if defined(WIN32) || defined(_WIN64)
+	if (m->data != NULL) {
+		UnmapViewOfFile(m->data);
+		CloseHandle(m->mapping);
+	}
+	CloseHandle(m->file);
+#else
+	if (m->data != NULL)
+		munmap(m->data, (size_t)m->size);
+	close(m->fd);
+#endif
+	m->data = NULL;
+	m->size = 0;
+}
+
+/*--------------------------------------------------------------------*/
+void map_file_advise(mapped_file_t *m, uint64 offset, 
+			uint64 size, enum map_advice advice) {
+
+#if !defined(WIN32) && !defined(_WIN64) && defined(MADV_SEQUENTIAL)
+	/* madvise needs a page-aligned start address */
+
+	uint64 page_size = sysconf(_SC_PAGESIZE);
+	uint64 start = offset - offset % page_size;
+	int flags;
+
+	if (m->data == NULL || start >= m->size)
+		return;
+	size = MIN(size + (offset - start), m->size - start);
+
+	switch (advice) {
+	case MAP_ADVICE_SEQUENTIAL:
+		flags = MADV_SEQUENTIAL; break;
+	case MAP_ADVICE_WILLNEED:
+		flags = MADV_WILLNEED; break;
+	case MAP_ADVICE_DONTNEED:
+		flags = MADV_DONTNEED; break;
+	default:
+		flags = MADV_NORMAL; break;
+	}
+	madvise(m->data + start, (size_t)size, flags);
+#endif
+}
+
 /*--------------------------------------------------------------------*/
 libhandle_t load_dynamic_lib(const char *libname)
 {
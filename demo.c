@@ -20,6 +20,7 @@ $Id$
 #endif
 
 msieve_obj *g_curr_factorization = NULL;
+msieve_batch *g_curr_batch = NULL;
 
 /*--------------------------------------------------------------------*/
 void handle_signal(int sig) {
@@ -28,7 +29,9 @@ void handle_signal(int sig) {
 
 	printf("\nreceived signal %d; shutting down\n", sig);
 	
-	if (obj && (obj->flags & MSIEVE_FLAG_SIEVING_IN_PROGRESS))
+	if (g_curr_batch)
+		msieve_batch_stop(g_curr_batch);
+	else if (obj && (obj->flags & MSIEVE_FLAG_SIEVING_IN_PROGRESS))
 		obj->flags |= MSIEVE_FLAG_STOP_SIEVING;
 	else
 		_exit(0);
@@ -97,6 +100,9 @@ void print_usage(char *progname) {
 		 "             <name> (default worktodo.ini) instead of\n"
 		 "             from the command line\n"
 		 "   -m        manual mode: enter numbers via standard input\n"
+		 "   -b        batch mode: factor the numbers from the input\n"
+		 "             file with -t threads, one number per thread,\n"
+		 "             printing the factors of each as it finishes\n"
 	         "   -q        quiet: do not generate any log information,\n"
 		 "             only print any factors found\n"
 	         "   -d <min>  deadline: if still sieving after <min>\n"
@@ -164,18 +170,51 @@ void print_usage(char *progname) {
 		 "   max_weight=X     have filtering start by looking at ideals\n"
 		 "                    of max weight >= X\n"
 		 "   X,Y              same as 'filter_lpbound=X filter_maxrels=Y'\n"
+		 "   relstore=1       keep a binary copy of the relations in\n"
+		 "                    <savefile>.rels and read from it instead\n"
+		 "                    of the savefile (also applies to -nc2\n"
+		 "                    and -nc3)\n"
 		 " linear algebra options:\n"
 		 "   skip_matbuild=1  start the linear algebra but skip building\n"
 		 "                    the matrix (assumes it is built already)\n"
 		 "   la_block=X       use a block size of X (512<=X<=65536)\n"
 		 "   la_superblock=X  use a superblock size of X\n"
+		 "   la_autotune=1    time a few block and superblock sizes\n"
+		 "                    and use the fastest (saved in the\n"
+		 "                    file msieve.tune for later runs)\n"
+		 "   la_reorder=1     permute large matrices so that the\n"
+		 "                    nonzeros fall into diagonal blocks\n"
+		 "   la_simd=0        do not use SIMD kernels for 128- or\n"
+		 "                    256-bit vectors\n"
+		 "   la_delta=1       store the sparse matrix blocks delta\n"
+		 "                    coded, in 3 bytes per nonzero instead\n"
+		 "                    of 4\n"
+		 "   la_numa=X        0 = do not bind LA threads to CPUs,\n"
+		 "                    1 = bind them and keep each one's part\n"
+		 "                    of the matrix on its NUMA node, 2 = also\n"
+		 "                    copy vectors to each node (the default\n"
+		 "                    on machines with more than one node)\n"
+		 "   la_profile=X     log where the solver spends its time\n"
+		 "                    every X iterations (0 = only at the\n"
+		 "                    end) and save it to <savefile>.prof\n"
+		 "   la_solver=bw     use block Wiedemann instead of block\n"
+		 "                    Lanczos (see Readme.nfs)\n"
+		 "   bw_seqs=X        use X independent sequences (1<=X<=8)\n"
+		 "   bw_phase=X       only run phase X of block Wiedemann\n"
+		 "                    (krylov, lingen or mksol)\n"
+		 "   bw_seq=X         only run that phase for sequence X\n"
 		 "   cado_filter=1    assume filtering used the CADO-NFS suite\n"
+		 "   chk_verify=1     with -ncr, only check that the checkpoint\n"
+		 "                    file matches the matrix and is intact\n"
 #ifdef HAVE_MPI
 		 "   mpi_nrows=X      use a grid with X rows\n"
 		 "   mpi_ncols=X      use a grid with X columns\n"
 		 "   X,Y              same as 'mpi_nrows=X mpi_ncols=Y'\n"
 		 "                    (if unspecified, default grid is\n"
 		 "                    1 x [argument to mpirun])\n"
+		 "   mpi_overlap=X    split each matrix multiply into X\n"
+		 "                    pieces, to overlap communication\n"
+		 "                    with computation (default 4, 1 = off)\n"
 #endif
 		 " square root options:\n"
 		 "   dep_first=X start with dependency X, 1<=X<=64\n"
@@ -187,6 +226,65 @@ void print_usage(char *progname) {
 		 MSIEVE_DEFAULT_NFS_FBFILE);
 }
 
+/*--------------------------------------------------------------------*/
+char * find_integer(char *buf) {
+
+	char *int_start, *last;
+
+	/* point to the start of the integer or expression;
+	   if the start point indicates no integer is present,
+	   return NULL */
+
+	last = strchr(buf, '\n');
+	if (last)
+		*last = 0;
+	int_start = buf;
+	while (*int_start && !isdigit(*int_start) &&
+			*int_start != '(' ) {
+		int_start++;
+	}
+	if (*int_start == 0)
+		return NULL;
+	return int_start;
+}
+
+/*--------------------------------------------------------------------*/
+void print_factors(const char *input, msieve_factor *factor) {
+
+	printf("\n");
+	printf("%s\n", input);
+	while (factor != NULL) {
+		char *factor_type;
+
+		if (factor->factor_type == MSIEVE_PRIME)
+			factor_type = "p";
+		else if (factor->factor_type == MSIEVE_COMPOSITE)
+			factor_type = "c";
+		else
+			factor_type = "prp";
+
+		printf("%s%d: %s\n", factor_type, 
+				(int32)strlen(factor->number), 
+				factor->number);
+		factor = factor->next;
+	}
+	printf("\n");
+}
+
+/*--------------------------------------------------------------------*/
+void print_batch_factors(void *user_data, uint32 id, 
+			const char *input, msieve_factor *factors,
+			uint32 flags) {
+
+	/* inputs cut short by an interrupt have nothing
+	   worth printing */
+
+	if (flags & MSIEVE_FLAG_FACTORIZATION_DONE) {
+		print_factors(input, factors);
+		fflush(stdout);
+	}
+}
+
 /*--------------------------------------------------------------------*/
 void factor_integer(char *buf, uint32 flags,
 		    char *savefile_name,
@@ -201,23 +299,13 @@ void factor_integer(char *buf, uint32 flags,
 		    uint32 which_gpu,
 		    const char *nfs_args) {
 	
-	char *int_start, *last;
+	char *int_start;
 	msieve_obj *obj;
-	msieve_factor *factor;
 
-	/* point to the start of the integer or expression;
-	   if the start point indicates no integer is present,
-	   don't try to factor it :) */
+	/* don't try to factor a line with no integer on it :) */
 
-	last = strchr(buf, '\n');
-	if (last)
-		*last = 0;
-	int_start = buf;
-	while (*int_start && !isdigit(*int_start) &&
-			*int_start != '(' ) {
-		int_start++;
-	}
-	if (*int_start == 0)
+	int_start = find_integer(buf);
+	if (int_start == NULL)
 		return;
 
 	g_curr_factorization = msieve_obj_new(int_start, flags,
@@ -244,26 +332,7 @@ void factor_integer(char *buf, uint32 flags,
 
 	if (!(g_curr_factorization->flags & (MSIEVE_FLAG_USE_LOGFILE |
 					MSIEVE_FLAG_LOG_TO_STDOUT))) {
-		factor = g_curr_factorization->factors;
-
-		printf("\n");
-		printf("%s\n", buf);
-		while (factor != NULL) {
-			char *factor_type;
-
-			if (factor->factor_type == MSIEVE_PRIME)
-				factor_type = "p";
-			else if (factor->factor_type == MSIEVE_COMPOSITE)
-				factor_type = "c";
-			else
-				factor_type = "prp";
-
-			printf("%s%d: %s\n", factor_type, 
-					(int32)strlen(factor->number), 
-					factor->number);
-			factor = factor->next;
-		}
-		printf("\n");
+		print_factors(buf, g_curr_factorization->factors);
 	}
 
 	/* save the current value of the random seeds, so that
@@ -318,6 +387,7 @@ int main(int argc, char **argv) {
 	char *nfs_fbfile_name = NULL;
 	uint32 flags;
 	char manual_mode = 0;
+	char batch_mode = 0;
 	int i;
 	int32 deadline = 0;
 	uint32 max_relations = 0;
@@ -392,6 +462,11 @@ int main(int argc, char **argv) {
 				i++;
 				break;
 
+			case 'b':
+				batch_mode = 1;
+				i++;
+				break;
+
 			case 'e':
 				flags |= MSIEVE_FLAG_DEEP_ECM;
 				i++;
@@ -588,6 +663,34 @@ int main(int argc, char **argv) {
 				break;
 		}
 	}
+	else if (batch_mode) {
+		uint32 line = 0;
+		FILE *infile = fopen(infile_name, "r");
+		if (infile == NULL) {
+			printf("cannot open input file '%s'\n", infile_name);
+			return 0;
+		}
+
+		g_curr_batch = msieve_batch_new(flags, savefile_name, 
+					logfile_name, seed1, seed2,
+					cpu, cache_size1, cache_size2,
+					num_threads, print_batch_factors, 
+					NULL);
+		while (1) {
+			char *int_start;
+
+			buf[0] = 0;
+			fgets(buf, (int)sizeof(buf), infile);
+			int_start = find_integer(buf);
+			if (int_start != NULL)
+				msieve_batch_add(g_curr_batch, line, int_start);
+			line++;
+			if (feof(infile))
+				break;
+		}
+		fclose(infile);
+		g_curr_batch = msieve_batch_free(g_curr_batch);
+	}
 	else {
 		FILE *infile = fopen(infile_name, "r");
 		if (infile == NULL) {
@@ -30,47 +30,110 @@ $Id$
    of them.
 
    The implementation here is a compromise: we do duplicate removal
-   in two passes. The first pass maps relations into a hashtable
-   of bits, and we save (on disk) the list of hash bins where two 
-   or more relations collide. The second pass refills the hashtable
-   of bits with just these entries, then reads through the complete
-   dataset again and saves the (a,b) values of any relation that
-   maps to one of the filled-in hash bins. The memory use in the
-   first pass is constant, and the memory use of the second pass
-   is 12 bytes per duplicate relation. Assuming unique relations
-   greatly outnumber duplicates, this solution finds all the duplicates
-   with no false positives, and the memory use is low enough so
-   that singleton filtering is a larger memory bottleneck 
+   in two passes. The first pass maps relations into a Bloom filter,
+   and we save (on disk) a 64-bit hash of every relation that the
+   filter claims to have seen already. The second pass fills a 
+   small hashtable of bits with just these hash values, then reads
+   through the complete dataset again and saves the (a,b) values of 
+   any relation that maps to one of the filled-in hash bins. The 
+   memory use in the first pass is constant, and the memory use of 
+   the second pass is 12 bytes per duplicate relation. Assuming unique
+   relations greatly outnumber duplicates, this solution finds all the
+   duplicates with no false positives, and the memory use is low 
+   enough so that singleton filtering is a larger memory bottleneck 
    
-   One useful optimization for really big problems would turn the
-   first-pass hashtable into a Bloom filter using several hash
-   functions. This would make it much more effective at avoiding
-   false positives as the hashtable gets more congested */
+   Earlier versions used a hashtable of bits with a single hash
+   function in the first pass; for really big problems that table
+   gets congested, and the false collisions it reports all wind 
+   up in the second-pass hashtable. The Bloom filter is 'blocked':
+   all the bits for a relation land in the same 64-byte block, so 
+   that testing and setting them costs a single cache miss. Its size
+   is chosen from the estimated number of relations, subject to the
+   filtering memory limit */
+
+#define BLOOM_BLOCK_WORDS 8	/* 512 bits per block */
+#define BLOOM_NUM_HASHES 7	/* bits set per relation */
+#define BLOOM_BITS_PER_RELATION 16
+#define LOG2_MIN_BLOOM_SIZE 25	/* in bits */
 
 static const uint8 hashmask[] = {0x01, 0x02, 0x04, 0x08,
 				 0x10, 0x20, 0x40, 0x80};
 
+/*--------------------------------------------------------------------*/
+static uint64 mix64(uint64 h) {
+
+	h ^= h >> 30;
+	h *= 0xbf58476d1ce4e5b9ULL;
+	h ^= h >> 27;
+	h *= 0x94d049bb133111ebULL;
+	h ^= h >> 31;
+	return h;
+}
+
+static uint64 relation_hash(int64 a, uint32 b) {
+
+	return mix64((uint64)a + 0x9e3779b97f4a7c15ULL * 
+				((uint64)b + 1));
+}
+
+/*--------------------------------------------------------------------*/
+static uint32 bloom_test_and_set(uint64 *bloom, uint64 num_blocks,
+				uint64 hashval) {
+
+	/* the top half of the hash picks the block, and a
+	   rehash of the whole thing picks the bits within it.
+	   Returns nonzero if all the bits were already set */
+
+	uint32 i;
+	uint32 all_set = 1;
+	uint64 *block = bloom + BLOOM_BLOCK_WORDS *
+			(((hashval >> 32) * num_blocks) >> 32);
+	uint64 bits = mix64(hashval ^ 0x5851f42d4c957f2dULL);
+
+	for (i = 0; i < BLOOM_NUM_HASHES; i++, bits >>= 9) {
+		uint32 word = (uint32)(bits >> 6) & (BLOOM_BLOCK_WORDS - 1);
+		uint64 mask = (uint64)1 << (bits & 63);
+
+		if (!(block[word] & mask)) {
+			all_set = 0;
+			block[word] |= mask;
+		}
+	}
+	return all_set;
+}
+
+/*--------------------------------------------------------------------*/
 static uint32 purge_duplicates_pass2(msieve_obj *obj,
-				uint32 log2_hashtable1_size,
+				uint32 num_collisions,
 				uint32 max_relations) {
 
 	savefile_t *savefile = &obj->savefile;
 	FILE *bad_relation_fp;
 	FILE *collision_fp;
 	FILE *out_fp;
-	uint32 i;
 	char buf[LINE_BUF_SIZE];
 	uint32 num_duplicates;
 	uint32 num_relations;
 	uint32 next_bad_relation;
 	uint32 curr_relation;
+	uint32 log2_hashtable2_size;
 	uint8 *bit_table;
 	hashtable_t duplicates;
-	uint32 key[2];
+	uint32 key[3];
+	uint64 hashval;
 
 	logprintf(obj, "commencing duplicate removal, pass 2\n");
 
-	/* fill in the list of hash collisions */
+	/* fill in the list of hash collisions. The table
+	   only has to be sparse compared to the number of
+	   collisions, not the number of relations */
+
+	log2_hashtable2_size = 16;
+	while (log2_hashtable2_size < 40 &&
+	       ((uint64)1 << log2_hashtable2_size) < 
+	       		(uint64)num_collisions * 32) {
+		log2_hashtable2_size++;
+	}
 
 	sprintf(buf, "%s.hc", savefile->name);
 	collision_fp = fopen(buf, "rb");
@@ -79,13 +142,13 @@ static uint32 purge_duplicates_pass2(msieve_obj *obj,
 		exit(-1);
 	}
 	bit_table = (uint8 *)xcalloc(
-			(size_t)1 << (log2_hashtable1_size - 3), 
+			(size_t)1 << (log2_hashtable2_size - 3), 
 			sizeof(uint8));
 
-	while (fread(&i, (size_t)1, sizeof(uint32), collision_fp) != 0) {
-		if (i < ((uint32)1 << log2_hashtable1_size)) {
-			bit_table[i / 8] |= 1 << (i % 8);
-		}
+	while (fread(&hashval, sizeof(uint64), (size_t)1, 
+				collision_fp) == 1) {
+		hashval >>= 64 - log2_hashtable2_size;
+		bit_table[hashval / 8] |= hashmask[hashval % 8];
 	}
 	fclose(collision_fp);
 
@@ -116,7 +179,6 @@ static uint32 purge_duplicates_pass2(msieve_obj *obj,
 
 	while (!savefile_eof(savefile)) {
 		
-		uint32 hashval;
 		int64 a;
 		uint32 b;
 		char *next_field;
@@ -149,19 +211,20 @@ static uint32 purge_duplicates_pass2(msieve_obj *obj,
 
 		a = strtoll(buf, &next_field, 10);
 		b = strtoul(next_field + 1, NULL, 10);
-		key[0] = (uint32)a;
-		key[1] = ((a >> 32) & 0x1f) | (b << 5);
-
-		hashval = (HASH1(key[0]) ^ HASH2(key[1])) >>
-				(32 - log2_hashtable1_size);
+		hashval = relation_hash(a, b) >> 
+				(64 - log2_hashtable2_size);
 
 		if (bit_table[hashval/8] & hashmask[hashval % 8]) {
 
-			/* relation collides in the first hashtable;
+			/* relation collided in the Bloom filter;
 			   use the second hashtable to determine 
 			   rigorously if the relation was previously seen */
 
 			uint32 is_dup;
+
+			key[0] = (uint32)a;
+			key[1] = (uint32)((uint64)a >> 32);
+			key[2] = b;
 			hashtable_find(&duplicates, key, NULL, &is_dup);
 
 			if (!is_dup) {
@@ -192,7 +255,7 @@ static uint32 purge_duplicates_pass2(msieve_obj *obj,
 	logprintf(obj, "found %u duplicates and %u unique relations\n", 
 				num_duplicates, num_relations);
 	logprintf(obj, "memory use: %.1f MB\n", 
-			(double)((1 << (log2_hashtable1_size-3)) +
+			(double)(((size_t)1 << (log2_hashtable2_size-3)) +
 			hashtable_sizeof(&duplicates)) / 1048576);
 
 	/* clean up and finish */
@@ -243,25 +306,18 @@ static double estimate_rel_size(savefile_t *savefile) {
 #define BIN_SIZE (1 << (LOG2_BIN_SIZE))
 #define TARGET_HITS_PER_PRIME 40.0
 
-uint32 nfs_purge_duplicates(msieve_obj *obj, factor_base_t *fb,
-				uint32 max_relations, 
-				uint32 *num_relations_out) {
-
-	uint32 i;
-	savefile_t *savefile = &obj->savefile;
+typedef struct {
+	msieve_obj *obj;
 	FILE *bad_relation_fp;
 	FILE *collision_fp;
+	uint32 max_relations;
 	uint32 curr_relation;
-	char buf[LINE_BUF_SIZE];
 	uint32 num_relations;
 	uint32 num_collisions;
 	uint32 num_skipped_b;
 	uint32 num_composite;
-	uint8 *hashtable;
-	uint32 blob[2];
-	uint32 log2_hashtable1_size;
-	double rel_size = estimate_rel_size(savefile);
-	mpz_t scratch;
+	uint64 *bloom;
+	uint64 num_bloom_blocks;
 
 	uint8 *free_relation_bits;
 	uint32 *free_relations;
@@ -269,209 +325,210 @@ uint32 nfs_purge_duplicates(msieve_obj *obj, factor_base_t *fb,
 	uint32 num_free_relations_alloc;
 
 	uint32 *prime_bins;
-	double bin_max;
+} dup1_t;
+
+/*--------------------------------------------------------------------*/
+static uint32 select_dup1_relation(void *data, uint32 rel_index) {
+
+	dup1_t *d = (dup1_t *)data;
+
+	d->curr_relation = rel_index;
+	if (d->max_relations && rel_index >= d->max_relations)
+		return READ_RELATION_STOP;
+
+	return READ_RELATION_KEEP;
+}
+
+/*--------------------------------------------------------------------*/
+static void process_dup1_relation(void *data, relation_t *rel,
+				uint32 factor_size, int32 status) {
 
-	uint8 tmp_factors[COMPRESSED_P_MAX_SIZE];
+	dup1_t *d = (dup1_t *)data;
+	uint32 i;
 	uint32 array_size;
-	relation_t tmp_rel;
+	uint64 hashval;
+	uint32 curr_relation = rel->rel_index;
+
+	if (status != 0) {
+
+		/* save the line number of bad relations (hopefully
+		   there are very few of them) */
+
+		fwrite(&curr_relation, (size_t)1, 
+				sizeof(uint32), d->bad_relation_fp);
+		if (status == -99)
+			d->num_skipped_b++;
+		else if (status == -98)
+			d->num_composite++;
+		else
+		    logprintf(d->obj, "error %d reading relation %u\n",
+				status, curr_relation);
+		return;
+	}
+
+	if (curr_relation > 0 && (curr_relation % 10000000 == 0)) {
+		printf("read %uM relations\n", curr_relation / 1000000);
+	} /* there are no more errors -6/-11 to see progress */
+
+	/* relation is good; save its hash if the Bloom filter
+	   claims it was seen before. Duplicates past the second
+	   get saved more than once, but that's harmless */
+
+	d->num_relations++;
+	hashval = relation_hash(rel->a, rel->b);
+
+	if (bloom_test_and_set(d->bloom, d->num_bloom_blocks, hashval)) {
+		fwrite(&hashval, sizeof(uint64), 
+				(size_t)1, d->collision_fp);
+		d->num_collisions++;
+	}
+
+	if (rel->b == 0) {
+		/* remember any free relations that are found */
 
-	tmp_rel.factors = tmp_factors;
+		if (d->num_free_relations == d->num_free_relations_alloc) {
+			d->num_free_relations_alloc *= 2;
+			d->free_relations = (uint32 *)xrealloc(
+					d->free_relations,
+					d->num_free_relations_alloc *
+					sizeof(uint32));
+		}
+		d->free_relations[d->num_free_relations++] = (uint32)(rel->a);
+	}
+	else {
+		uint32 num_r = rel->num_factors_r;
+		uint32 num_a = rel->num_factors_a;
+
+		for (i = array_size = 0; i < num_r + num_a; i++) {
+			uint64 p = decompress_p(rel->factors, &array_size);
+
+			/* add the factors of rel to the 
+			   counts of (32-bit) primes */
+	   
+			if (p >= ((uint64)1 << 32))
+				continue;
+
+			d->prime_bins[p / BIN_SIZE]++;
+
+			/* schedule the adding of a free relation
+			   for each algebraic factor */
+			
+			if (i >= num_r &&
+			    p > MAX_PACKED_PRIME &&
+			    p < FREE_RELATION_LIMIT) {
+				p = p / 2;
+				d->free_relation_bits[p / 8] |= hashmask[p % 8];
+			}
+		}
+	}
+}
+
+/*--------------------------------------------------------------------*/
+uint32 nfs_purge_duplicates(msieve_obj *obj, factor_base_t *fb,
+				uint32 max_relations, uint64 ram_size,
+				uint32 *num_relations_out) {
+
+	uint32 i;
+	savefile_t *savefile = &obj->savefile;
+	char buf[LINE_BUF_SIZE];
+	uint32 curr_relation;
+	uint32 num_relations;
+	uint32 num_collisions;
+	uint64 bloom_size;
+	double num_rels = 0; /* estimated */
+	double rel_size = estimate_rel_size(savefile);
+	uint8 *free_relation_bits;
+	uint32 *free_relations;
+	uint32 num_free_relations;
+	uint32 *prime_bins;
+	double bin_max;
+	dup1_t d;
 
 	logprintf(obj, "commencing duplicate removal, pass 1\n");
 
+	memset(&d, 0, sizeof(dup1_t));
+	d.obj = obj;
+	d.max_relations = max_relations;
+
 	savefile_open(savefile, SAVEFILE_READ);
 	sprintf(buf, "%s.br", savefile->name);
-	bad_relation_fp = fopen(buf, "wb");
-	if (bad_relation_fp == NULL) {
+	d.bad_relation_fp = fopen(buf, "wb");
+	if (d.bad_relation_fp == NULL) {
 		logprintf(obj, "error: dup1 can't open relation file\n");
 		exit(-1);
 	}
 	sprintf(buf, "%s.hc", savefile->name);
-	collision_fp = fopen(buf, "wb");
-	if (collision_fp == NULL) {
+	d.collision_fp = fopen(buf, "wb");
+	if (d.collision_fp == NULL) {
 		logprintf(obj, "error: dup1 can't open collision file\n");
 		exit(-1);
 	}
 
-	/* figure out how large the stage 1 hashtable should be.
-	   We want there to be many more bins in the hashtable than
-	   relations in the savefile, but it takes too long to
-	   actually count the relations. So we estimate the average
-	   relation size and then the number of relations */
-
-	log2_hashtable1_size = 28;
-	if (rel_size > 0.0) {
-		double num_rels; /* estimated */
-#if 0 /* WAS: !defined(WIN32) && !defined(_WIN64) */
-		if (savefile->isCompressed) {
-			char name_gz[256];
-			sprintf(name_gz, "%s.gz", savefile->name);
-			num_rels = get_file_size(name_gz) / 0.55 / rel_size;
-		} else 
-#endif /* get_file_size( ) will now do the same internally */
-			num_rels = get_file_size(savefile->name) / rel_size;
-		log2_hashtable1_size = log(num_rels * 10.0) / M_LN2 + 0.5;
+	/* figure out how large the Bloom filter should be.
+	   We want BLOOM_BITS_PER_RELATION bits for each relation
+	   in the savefile, but it takes too long to actually 
+	   count the relations. So we estimate the average
+	   relation size and then the number of relations. The 
+	   filter is capped at 1/4 of the memory available, since
+	   the filter being congested is much less of a problem 
+	   than running out of memory */
+
+	if (rel_size > 0.0)
+		num_rels = get_file_size(savefile->name) / rel_size;
+
+	bloom_size = (uint64)(num_rels * BLOOM_BITS_PER_RELATION / 8);
+	bloom_size = MIN(bloom_size, ram_size / 4);
+	bloom_size = MAX(bloom_size, (uint64)1 << (LOG2_MIN_BLOOM_SIZE - 3));
+
+	d.num_bloom_blocks = bloom_size / (8 * BLOOM_BLOCK_WORDS);
+	d.num_bloom_blocks = MIN(d.num_bloom_blocks, (uint64)(uint32)(-1));
+	bloom_size = d.num_bloom_blocks * 8 * BLOOM_BLOCK_WORDS;
+	d.bloom = (uint64 *)xcalloc((size_t)bloom_size, (size_t)1);
+
+	if (num_rels > 0) {
+		logprintf(obj, "using %.1f MB Bloom filter "
+				"(%.1f bits per relation)\n",
+				(double)bloom_size / 1048576,
+				8.0 * bloom_size / num_rels);
 	}
-	if (log2_hashtable1_size < 25)
-		log2_hashtable1_size = 25;
-	if (log2_hashtable1_size > 31)
-		log2_hashtable1_size = 31;
-
-	hashtable = (uint8 *)xcalloc((size_t)1 << 
-				(log2_hashtable1_size - 3), sizeof(uint8));
-	prime_bins = (uint32 *)xcalloc((size_t)1 << (32 - LOG2_BIN_SIZE),
+
+	d.prime_bins = (uint32 *)xcalloc((size_t)1 << (32 - LOG2_BIN_SIZE),
 					sizeof(uint32));
 
 	/* set up the structures for tracking free relations */
 
-	free_relation_bits = (uint8 *)xcalloc(
+	d.free_relation_bits = (uint8 *)xcalloc(
 				((size_t)(FREE_RELATION_LIMIT/2) + 7) / 8,
 				(size_t)1);
-	num_free_relations = 0;
-	num_free_relations_alloc = 5000;
-	free_relations = (uint32 *)xmalloc(num_free_relations_alloc *
-						sizeof(uint32));
-
-	curr_relation = (uint32)(-1);
-	num_relations = 0;
-	num_collisions = 0;
-	num_skipped_b = 0;
-	num_composite = 0;
-	mpz_init(scratch);
-	savefile_read_line(buf, sizeof(buf), savefile);
-	while (!savefile_eof(savefile)) {
-
-		int32 status;
-		uint32 hashval;
-
-		if (buf[0] != '-' && !isdigit(buf[0])) {
-
-			/* no relation on this line */
-
-			savefile_read_line(buf, sizeof(buf), savefile);
-			continue;
-		}
-
-		/* read and verify the relation */
-
-		curr_relation++;
-		if (max_relations && curr_relation >= max_relations)
-			break;
-
-		status = nfs_read_relation(buf, fb, &tmp_rel, 
-					&array_size, 1, scratch, 1);
-		if (status != 0) {
-
-			/* save the line number of bad relations (hopefully
-			   there are very few of them) */
-
-			fwrite(&curr_relation, (size_t)1, 
-					sizeof(uint32), bad_relation_fp);
-			if (status == -99)
-				num_skipped_b++;
-			else if (status == -98)
-				num_composite++;
-			else
-			    logprintf(obj, "error %d reading relation %u\n",
-					status, curr_relation);
-			savefile_read_line(buf, sizeof(buf), savefile);
-			continue;
-		}
-
-		if (curr_relation > 0 && (curr_relation % 10000000 == 0)) {
-			printf("read %uM relations\n", curr_relation / 1000000);
-		} /* there are no more errors -6/-11 to see progress */
-
-		/* relation is good; find the value to which it
-		   hashes. Note that only the bottom 35 bits of 'a'
-		   and the bottom 29 bits of 'b' figure into the hash,
-		   so that spurious hash collisions are possible
-		   (though highly unlikely) */
-
-		num_relations++;
-		blob[0] = (uint32)tmp_rel.a;
-		blob[1] = ((tmp_rel.a >> 32) & 0x1f) |
-			  (tmp_rel.b << 5);
-
-		hashval = (HASH1(blob[0]) ^ HASH2(blob[1])) >>
-			   (32 - log2_hashtable1_size);
-
-		/* save the hash bucket if there's a collision. We
-		   don't need to save any more collisions to this bucket,
-		   but future duplicates could cause the same bucket to
-		   be saved more than once. We can cut the number of
-		   redundant bucket reports in half by resetting the
-		   bit to zero */
-
-		if (hashtable[hashval / 8] & hashmask[hashval % 8]) {
-			fwrite(&hashval, (size_t)1, 
-					sizeof(uint32), collision_fp);
-			num_collisions++;
-			hashtable[hashval / 8] &= ~hashmask[hashval % 8];
-		}
-		else {
-			hashtable[hashval / 8] |= hashmask[hashval % 8];
-		}
-
-		if (tmp_rel.b == 0) {
-			/* remember any free relations that are found */
-
-			if (num_free_relations == num_free_relations_alloc) {
-				num_free_relations_alloc *= 2;
-				free_relations = (uint32 *)xrealloc(
-						free_relations,
-						num_free_relations_alloc *
+	d.num_free_relations = 0;
+	d.num_free_relations_alloc = 5000;
+	d.free_relations = (uint32 *)xmalloc(d.num_free_relations_alloc *
 						sizeof(uint32));
-			}
-			free_relations[num_free_relations++] =
-						(uint32)(tmp_rel.a);
-		}
-		else {
-			uint32 num_r = tmp_rel.num_factors_r;
-			uint32 num_a = tmp_rel.num_factors_a;
-
-			for (i = array_size = 0; i < num_r + num_a; i++) {
-				uint64 p = decompress_p(tmp_rel.factors, 
-							&array_size);
-
-				/* add the factors of tmp_rel to the 
-				   counts of (32-bit) primes */
-		   
-				if (p >= ((uint64)1 << 32))
-					continue;
-
-				prime_bins[p / BIN_SIZE]++;
-
-				/* schedule the adding of a free relation
-				   for each algebraic factor */
-				
-				if (i >= num_r &&
-				    p > MAX_PACKED_PRIME &&
-				    p < FREE_RELATION_LIMIT) {
-					p = p / 2;
-					free_relation_bits[p / 8] |= 
-							hashmask[p % 8];
-				}
-			}
-		}
 
-		/* get the next line */
+	d.curr_relation = (uint32)(-1);
+	nfs_read_relations(obj, fb, 1, 1, 
+			select_dup1_relation,
+			process_dup1_relation, &d);
 
-		savefile_read_line(buf, sizeof(buf), savefile);
-	}
+	curr_relation = d.curr_relation;
+	num_relations = d.num_relations;
+	num_collisions = d.num_collisions;
+	free_relation_bits = d.free_relation_bits;
+	free_relations = d.free_relations;
+	num_free_relations = d.num_free_relations;
+	prime_bins = d.prime_bins;
 
-	mpz_clear(scratch);
-	free(hashtable);
+	free(d.bloom);
 	savefile_close(savefile);
-	fclose(bad_relation_fp);
-	fclose(collision_fp);
+	fclose(d.bad_relation_fp);
+	fclose(d.collision_fp);
 
-	if (num_skipped_b > 0)
+	if (d.num_skipped_b > 0)
 		logprintf(obj, "skipped %d relations with b > 2^32\n",
-				num_skipped_b);
-	if (num_composite > 0)
+				d.num_skipped_b);
+	if (d.num_composite > 0)
 		logprintf(obj, "skipped %d relations with composite factors\n",
-				num_composite);
+				d.num_composite);
 	logprintf(obj, "found %u hash collisions in %u relations\n", 
 				num_collisions, num_relations);
 
@@ -511,7 +568,7 @@ uint32 nfs_purge_duplicates(msieve_obj *obj, factor_base_t *fb,
 	}
 	else {
 		num_relations = purge_duplicates_pass2(obj,
-					log2_hashtable1_size,
+					num_collisions,
 					max_relations);
 	}
 
@@ -329,6 +329,7 @@ uint32 nfs_filter_relations(msieve_obj *obj, mpz_t n) {
 
 	memset(&filter, 0, sizeof(filter));
 	memset(&merge, 0, sizeof(merge));
+	filter.ram_size = ram_size;
 	memset(&fb, 0, sizeof(fb));
 	mpz_poly_init(&fb.rfb.poly);
 	mpz_poly_init(&fb.afb.poly);
@@ -342,7 +343,8 @@ uint32 nfs_filter_relations(msieve_obj *obj, mpz_t n) {
 	/* delete duplicate relations */
 
 	filtmin_r = filtmin_a = nfs_purge_duplicates(obj, &fb, 
-					max_relations, &num_relations);
+					max_relations, ram_size,
+					&num_relations);
 	if (filter_bound > 0)
 		filtmin_r = filtmin_a = filter_bound;
 
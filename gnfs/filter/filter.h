@@ -27,11 +27,12 @@ extern "C" {
 /* create '<savefile_name>.d', a binary file containing
    the line numbers of duplicated or corrupted relations.
    Duplicate removal only applies to the first max_relations
-   relations found (or all relations if zero). The return
-   value is the large prime bound to use for the singleton removal */
+   relations found (or all relations if zero), and uses at
+   most about ram_size/4 bytes of memory. The return value is
+   the large prime bound to use for the singleton removal */
 
 uint32 nfs_purge_duplicates(msieve_obj *obj, factor_base_t *fb,
-				uint32 max_relations,
+				uint32 max_relations, uint64 ram_size,
 				uint32 *num_relations_out); 
 
 /* read '<savefile_name>.d' and create '<savefile_name>.lp', a 
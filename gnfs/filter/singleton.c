@@ -14,6 +14,86 @@ $Id$
 
 #include "filter.h"
 
+typedef struct {
+	filter_t *filter;
+	FILE *relation_fp;
+	FILE *final_fp;
+	uint32 have_skip_list;
+	uint32 next_relation;
+	uint32 max_relations;
+	uint32 num_relations;
+	size_t header_words;
+	hashtable_t unique_ideals;
+} lp_file_t;
+
+/*--------------------------------------------------------------------*/
+static uint32 select_lp_relation(void *data, uint32 curr_relation) {
+
+	lp_file_t *lp = (lp_file_t *)data;
+
+	if (lp->max_relations && curr_relation >= lp->max_relations)
+		return READ_RELATION_STOP;
+
+	if (lp->have_skip_list) {
+		if (curr_relation == lp->next_relation) {
+			fread(&lp->next_relation, sizeof(uint32), 
+					(size_t)1, lp->relation_fp);
+			return READ_RELATION_SKIP;
+		}
+	}
+	else {
+		if (curr_relation < lp->next_relation)
+			return READ_RELATION_SKIP;
+
+		fread(&lp->next_relation, sizeof(uint32), 
+				(size_t)1, lp->relation_fp);
+	}
+
+	return READ_RELATION_KEEP;
+}
+
+/*--------------------------------------------------------------------*/
+static void process_lp_relation(void *data, relation_t *rel,
+				uint32 factor_size, int32 status) {
+
+	lp_file_t *lp = (lp_file_t *)data;
+	filter_t *filter = lp->filter;
+	relation_lp_t tmp_ideal;
+	relation_ideal_t packed_ideal;
+	uint32 i;
+
+	if (status != 0)
+		return;
+
+	lp->num_relations++;
+
+	/* get the large ideals */
+
+	find_large_ideals(rel, &tmp_ideal, 
+			filter->filtmin_r,
+			filter->filtmin_a);
+
+	packed_ideal.rel_index = rel->rel_index;
+	packed_ideal.gf2_factors = tmp_ideal.gf2_factors;
+	packed_ideal.ideal_count = tmp_ideal.ideal_count;
+
+	/* map each ideal to a unique integer */
+
+	for (i = 0; i < tmp_ideal.ideal_count; i++) {
+		ideal_t *ideal = tmp_ideal.ideal_list + i;
+
+		hashtable_find(&lp->unique_ideals, ideal,
+				packed_ideal.ideal_list + i,
+				NULL);
+	}
+
+	/* dump the relation to disk */
+
+	fwrite(&packed_ideal, sizeof(uint32),
+		lp->header_words + tmp_ideal.ideal_count, 
+		lp->final_fp);
+}
+
 /*--------------------------------------------------------------------*/
 void nfs_write_lp_file(msieve_obj *obj, factor_base_t *fb,
 			filter_t *filter, uint32 max_relations,
@@ -25,135 +105,54 @@ void nfs_write_lp_file(msieve_obj *obj, factor_base_t *fb,
 	   algorithm-independent form that the rest of the
 	   filtering will use */
 
-	uint32 i;
 	savefile_t *savefile = &obj->savefile;
-	FILE *relation_fp;
-	FILE *final_fp;
 	char buf[LINE_BUF_SIZE];
-	size_t header_words;
-	uint32 next_relation;
-	uint32 curr_relation;
-	uint32 num_relations;
-	hashtable_t unique_ideals;
-	uint8 tmp_factors[COMPRESSED_P_MAX_SIZE];
-	uint32 tmp_factor_size;
-	relation_t tmp_relation;
 	relation_ideal_t packed_ideal;
-	uint32 have_skip_list = (pass == 0);
-	mpz_t scratch;
-
-	tmp_relation.factors = tmp_factors;
+	lp_file_t lp;
 
 	logprintf(obj, "commencing singleton removal, initial pass\n");
 
 	savefile_open(savefile, SAVEFILE_READ);
 	sprintf(buf, "%s.d", savefile->name);
-	relation_fp = fopen(buf, "rb");
-	if (relation_fp == NULL) {
+	lp.relation_fp = fopen(buf, "rb");
+	if (lp.relation_fp == NULL) {
 		logprintf(obj, "error: can't open dup file\n");
 		exit(-1);
 	}
 	sprintf(buf, "%s.lp", savefile->name);
-	final_fp = fopen(buf, "wb");
-	if (final_fp == NULL) {
+	lp.final_fp = fopen(buf, "wb");
+	if (lp.final_fp == NULL) {
 		logprintf(obj, "error: can't open output LP file\n");
 		exit(-1);
 	}
 
-	hashtable_init(&unique_ideals, (uint32)WORDS_IN(ideal_t), 0);
-	header_words = (sizeof(relation_ideal_t) - 
+	hashtable_init(&lp.unique_ideals, (uint32)WORDS_IN(ideal_t), 0);
+	lp.header_words = (sizeof(relation_ideal_t) - 
 			sizeof(packed_ideal.ideal_list)) / sizeof(uint32);
 
 	/* for each relation that survived the duplicate removal */
 
-	curr_relation = (uint32)(-1);
-	next_relation = (uint32)(-1);
-	num_relations = 0;
-	mpz_init(scratch);
-	fread(&next_relation, (size_t)1, 
-			sizeof(uint32), relation_fp);
-	savefile_read_line(buf, sizeof(buf), savefile);
-
-	while (!savefile_eof(savefile)) {
-		
-		int32 status;
-
-		if (buf[0] != '-' && !isdigit(buf[0])) {
-			savefile_read_line(buf, sizeof(buf), savefile);
-			continue;
-		}
-
-		curr_relation++;
-		if (max_relations && curr_relation >= max_relations)
-			break;
-
-		if (have_skip_list) {
-			if (curr_relation == next_relation) {
-				fread(&next_relation, sizeof(uint32), 
-						(size_t)1, relation_fp);
-				savefile_read_line(buf, sizeof(buf), savefile);
-				continue;
-			}
-		}
-		else {
-			if (curr_relation < next_relation) {
-				savefile_read_line(buf, sizeof(buf), savefile);
-				continue;
-			}
-			fread(&next_relation, sizeof(uint32), 
-					(size_t)1, relation_fp);
-		}
-
-		/* read it in */
-
-		status = nfs_read_relation(buf, fb, &tmp_relation, 
-						&tmp_factor_size, 1,
-						scratch, 0);
-
-		if (status == 0) {
-			relation_lp_t tmp_ideal;
-			num_relations++;
-
-			/* get the large ideals */
-
-			find_large_ideals(&tmp_relation, &tmp_ideal, 
-						filter->filtmin_r,
-						filter->filtmin_a);
-
-			packed_ideal.rel_index = curr_relation;
-			packed_ideal.gf2_factors = tmp_ideal.gf2_factors;
-			packed_ideal.ideal_count = tmp_ideal.ideal_count;
+	lp.filter = filter;
+	lp.have_skip_list = (pass == 0);
+	lp.max_relations = max_relations;
+	lp.next_relation = (uint32)(-1);
+	lp.num_relations = 0;
+	fread(&lp.next_relation, (size_t)1, 
+			sizeof(uint32), lp.relation_fp);
 
-			/* map each ideal to a unique integer */
-
-			for (i = 0; i < tmp_ideal.ideal_count; i++) {
-				ideal_t *ideal = tmp_ideal.ideal_list + i;
-
-				hashtable_find(&unique_ideals, ideal,
-						packed_ideal.ideal_list + i,
-						NULL);
-			}
-
-			/* dump the relation to disk */
-
-			fwrite(&packed_ideal, sizeof(uint32),
-				header_words + tmp_ideal.ideal_count, 
-				final_fp);
-		}
-
-		savefile_read_line(buf, sizeof(buf), savefile);
-	}
+	nfs_read_relations(obj, fb, 1, 0, 
+			select_lp_relation, 
+			process_lp_relation, &lp);
 
-	mpz_clear(scratch);
-	filter->num_relations = num_relations;
-	filter->num_ideals = hashtable_get_num(&unique_ideals);
+	filter->num_relations = lp.num_relations;
+	filter->num_ideals = hashtable_get_num(&lp.unique_ideals);
 	filter->relation_array = NULL;
 	logprintf(obj, "memory use: %.1f MB\n",
-			(double)hashtable_sizeof(&unique_ideals) / 1048576);
-	hashtable_free(&unique_ideals);
+			(double)hashtable_sizeof(&lp.unique_ideals) / 1048576);
+	hashtable_free(&lp.unique_ideals);
 	savefile_close(savefile);
-	fclose(relation_fp);
-	fclose(final_fp);
+	fclose(lp.relation_fp);
+	fclose(lp.final_fp);
 
 	sprintf(buf, "%s.lp", savefile->name);
 	filter->lp_file_size = get_file_size(buf);
@@ -13,6 +13,7 @@ $Id$
 --------------------------------------------------------------------*/
 
 #include <common.h>
+#include <thread.h>
 #include "gnfs.h"
 
 /* the number of quadratic characters for each
@@ -177,9 +178,59 @@ static ideal_t *fill_small_ideals(factor_base_t *fb,
 #define QCB_VALS(r) ((r)->rel_index)
 #define QCB_NUM_CHOICES 50000
 
+typedef struct {
+	relation_t *rlist;
+	fb_entry_t *qcb;
+	uint32 qcb_size;
+	uint32 rel_start;
+	uint32 rel_end;
+} qcb_task_t;
+
+static void qcb_task_run(void *data, int thread_num) {
+
+	qcb_task_t *t = (qcb_task_t *)data;
+	fb_entry_t *qcb = t->qcb;
+	uint32 qcb_size = t->qcb_size;
+	uint32 i, j;
+
+	for (i = t->rel_start; i < t->rel_end; i++) {
+		relation_t *rel = t->rlist + i;
+		int64 a = rel->a;
+		uint32 b = rel->b;
+
+		QCB_VALS(rel) = 0;
+		for (j = 0; j < qcb_size; j++) {
+			uint32 p = qcb[j].p;
+			uint32 r = qcb[j].r;
+			int64 res = a % (int64)p;
+			int32 symbol;
+
+			if (res < 0)
+				res += (int64)p;
+
+			symbol = mp_legendre_1(mp_modsub_1((uint32)res,
+					mp_modmul_1(b, r, p), p), p);
+
+			/* symbol must be 1 or -1; if it's 0,
+			   there's something wrong with the choice
+			   of primes in the QCB but this isn't
+			   a fatal error */
+
+			if (symbol == -1)
+				QCB_VALS(rel) |= 1 << (j % 32);
+			else if (symbol == 0)
+				printf("warning: zero character\n");
+		}
+	}
+}
+
 static uint32 fill_qcb(msieve_obj *obj, mpz_poly_t *apoly, 
-			relation_t *rlist, uint32 num_relations) {
+			relation_t *rlist, uint32 num_relations,
+			struct threadpool *threadpool,
+			uint32 num_threads) {
 	uint32 i, j;
+	qcb_task_t *tasks = (qcb_task_t *)xmalloc(num_threads *
+						sizeof(qcb_task_t));
 	prime_sieve_t sieve;
 	fb_entry_t qcb[QCB_SIZE];
 	uint32 min_qcb_ideal = ((uint32)(-1) - QCB_NUM_CHOICES) &
@@ -248,38 +299,35 @@ static uint32 fill_qcb(msieve_obj *obj, mpz_poly_t *apoly,
 	logprintf(obj, "using %u quadratic characters above %u\n",
 				qcb_size, min_qcb_ideal + 1);
 
-	/* cache each relation's quadratic characters for later use */
-
-	for (i = 0; i < num_relations; i++) {
-		relation_t *rel = rlist + i;
-		int64 a = rel->a;
-		uint32 b = rel->b;
-
-		QCB_VALS(rel) = 0;
-		for (j = 0; j < qcb_size; j++) {
-			uint32 p = qcb[j].p;
-			uint32 r = qcb[j].r;
-			int64 res = a % (int64)p;
-			int32 symbol;
+	/* cache each relation's quadratic characters for later
+	   use, with each thread handling a range of relations */
 
-			if (res < 0)
-				res += (int64)p;
+	for (i = 0; i < num_threads; i++) {
+		qcb_task_t *t = tasks + i;
 
-			symbol = mp_legendre_1(mp_modsub_1((uint32)res,
-					mp_modmul_1(b, r, p), p), p);
+		t->rlist = rlist;
+		t->qcb = qcb;
+		t->qcb_size = qcb_size;
+		t->rel_start = (uint32)((uint64)num_relations * i / 
+					num_threads);
+		t->rel_end = (uint32)((uint64)num_relations * (i + 1) / 
+					num_threads);
+	}
 
-			/* symbol must be 1 or -1; if it's 0,
-			   there's something wrong with the choice
-			   of primes in the QCB but this isn't
-			   a fatal error */
+	for (i = 0; i < num_threads - 1; i++) {
+		task_control_t t;
 
-			if (symbol == -1)
-				QCB_VALS(rel) |= 1 << (j % 32);
-			else if (symbol == 0)
-				printf("warning: zero character\n");
-		}
+		t.init = NULL;
+		t.run = qcb_task_run;
+		t.shutdown = NULL;
+		t.data = tasks + i;
+		threadpool_add_task(threadpool, &t, 1);
 	}
+	qcb_task_run(tasks + num_threads - 1, num_threads - 1);
+	if (num_threads > 1)
+		threadpool_drain(threadpool, 1);
 
+	free(tasks);
 	return qcb_size;
 }
 
@@ -374,75 +422,121 @@ static uint32 combine_relations(la_col_t *col, relation_t *rlist,
 /*------------------------------------------------------------------*/
 #define MAX_DENSE_ROW_WORDS 32
 
-static void build_matrix_core(msieve_obj *obj, la_col_t *cycle_list, 
-			uint32 num_cycles, relation_t *rlist, 
-			uint32 num_relations, uint32 num_dense_rows, 
-			ideal_t *small_ideals, uint32 num_small_ideals, 
-			uint32 qcb_size, FILE *matrix_fp) {
+/* the matrix is built in rounds of this many columns
+   per thread. Each thread numbers the large ideals it
+   sees in its own hashtable, and the calling thread then
+   converts those to the global numbering (in the order 
+   the ideals first appear, exactly as a single pass over 
+   the cycles would number them) and writes the columns 
+   out, while the other threads build the next round */
 
-	uint32 i, j, k;
-	hashtable_t unique_ideals;
+#define MATBUILD_ROUND_COLS 16384
+
+typedef struct {
+	la_col_t *cycle_list;
+	relation_t *rlist;
+	ideal_t *small_ideals;
+	uint32 num_small_ideals;
 	uint32 max_small_ideal;
-	uint32 dense_rows[MAX_DENSE_ROW_WORDS];
+	uint32 num_dense_rows;
 	uint32 dense_row_words;
-	size_t mem_use;
-
-	logprintf(obj, "building initial matrix\n");
+	uint32 qcb_size;
+} matbuild_t;
+
+typedef struct {
+	matbuild_t *m;
+	uint32 col_start;
+	uint32 num_cols;
+
+	/* the columns in the format of the matrix file,
+	   with the large ideals numbered by this thread */
+
+	hashtable_t ideals;
+	uint32 *col_data;
+	size_t col_data_size;
+	size_t col_data_alloc;
+} matbuild_batch_t;
+
+static void matbuild_batch_init(matbuild_batch_t *b, matbuild_t *m) {
+
+	memset(b, 0, sizeof(matbuild_batch_t));
+	b->m = m;
+	hashtable_init(&b->ideals, (uint32)WORDS_IN(ideal_t), 0);
+	b->col_data_alloc = 100000;
+	b->col_data = (uint32 *)xmalloc(b->col_data_alloc * 
+					sizeof(uint32));
+}
 
-	dense_row_words = (num_dense_rows + 31) / 32;
-	if (dense_row_words > MAX_DENSE_ROW_WORDS) {
-		printf("error: too many dense rows\n");
-		exit(-1);
-	}
+static void matbuild_batch_free(matbuild_batch_t *b) {
 
-	max_small_ideal = 0;
-	if (num_small_ideals > 0) {
-		max_small_ideal = small_ideals[
-					num_small_ideals - 1].p_lo;
-	}
+	hashtable_free(&b->ideals);
+	free(b->col_data);
+}
 
-	hashtable_init(&unique_ideals, (uint32)WORDS_IN(ideal_t), 0);
+/*------------------------------------------------------------------*/
+static void matbuild_batch_run(void *data, int thread_num) {
 
-	fseek(matrix_fp, 3 * sizeof(uint32), SEEK_SET);
+	matbuild_batch_t *b = (matbuild_batch_t *)data;
+	matbuild_t *m = b->m;
+	uint32 i, j, k;
+	uint32 dense_row_words = m->dense_row_words;
+	uint32 qcb_size = m->qcb_size;
 
-	/* for each cycle */
+	hashtable_reset(&b->ideals);
+	b->col_data_size = 0;
 
-	for (i = 0; i < num_cycles; i++) {
-		la_col_t *c = cycle_list + i;
+	for (i = 0; i < b->num_cols; i++) {
+		la_col_t *c = m->cycle_list + b->col_start + i;
 		ideal_t merged_ideals[MAX_COL_IDEALS];
-		uint32 mapped_ideals[MAX_COL_IDEALS];
+		uint32 *dense_rows;
+		uint32 *mapped_ideals;
 		uint32 num_merged;
 
+		/* make room for the largest possible column */
+
+		if (b->col_data_size + 1 + MAX_COL_IDEALS + 
+				dense_row_words > b->col_data_alloc) {
+			b->col_data_alloc = 2 * b->col_data_alloc +
+					MAX_COL_IDEALS + dense_row_words;
+			b->col_data = (uint32 *)xrealloc(b->col_data,
+						b->col_data_alloc *
+						sizeof(uint32));
+		}
+
 		/* dense rows start off empty */
 
+		dense_rows = b->col_data + b->col_data_size + 
+					1 + MAX_COL_IDEALS;
 		for (j = 0; j < dense_row_words; j++)
 			dense_rows[j] = 0;
 
 		/* merge the relations and quadratic characters
 		   in the cycle */
 
-		num_merged = combine_relations(c, rlist, merged_ideals, 
-						dense_rows, num_dense_rows,
+		num_merged = combine_relations(c, m->rlist, merged_ideals, 
+						dense_rows, m->num_dense_rows,
 						qcb_size);
 
-		/* assign a unique number to each ideal in 
-		   the cycle. This will automatically ignore
-		   empty rows in the matrix */
+		/* assign a number to each ideal in the cycle. 
+		   This will automatically ignore empty rows in 
+		   the matrix */
 
+		mapped_ideals = b->col_data + b->col_data_size + 1;
 		for (j = k = 0; j < num_merged; j++) {
 			ideal_t *ideal = merged_ideals + j;
 			uint64 p = (uint64)ideal->p_hi << 32 | ideal->p_lo;
 
-			if (max_small_ideal > 0 && (p == IDEAL_MINUS_ONE || 
-					p <= max_small_ideal) ) {
+			if (m->max_small_ideal > 0 && 
+			    (p == IDEAL_MINUS_ONE || 
+			     p <= m->max_small_ideal) ) {
 				/* dense ideal; store in compressed format */
 				ideal_t *loc = (ideal_t *)bsearch(ideal, 
-						small_ideals,
-						(size_t)num_small_ideals,
+						m->small_ideals,
+						(size_t)m->num_small_ideals,
 						sizeof(ideal_t),
 						compare_ideals);
 				uint32 idx = qcb_size + 1 +
-						(loc - small_ideals);
+						(loc - m->small_ideals);
 				if (loc == NULL) {
 					printf("error: unexpected dense "
 						"ideal found\n");
@@ -452,18 +546,165 @@ static void build_matrix_core(msieve_obj *obj, la_col_t *cycle_list,
 			}
 			else {
 				uint32 idx;
-				hashtable_find(&unique_ideals, 
-						ideal, &idx, NULL);
-				mapped_ideals[k++] = num_dense_rows + idx;
+				hashtable_find(&b->ideals, ideal, &idx, NULL);
+				mapped_ideals[k++] = idx;
 			}
 		}
 
-		/* save the matrix entries to disk */
+		/* pack the column as it will appear on disk */
+
+		mapped_ideals[-1] = k;
+		memmove(mapped_ideals + k, dense_rows,
+				dense_row_words * sizeof(uint32));
+		b->col_data_size += 1 + k + dense_row_words;
+	}
+}
+
+/*------------------------------------------------------------------*/
+static void matbuild_batch_write(matbuild_batch_t *b, 
+			hashtable_t *unique_ideals,
+			uint32 **map, uint32 *map_alloc,
+			FILE *matrix_fp) {
+
+	/* convert the batch's ideal numbers into the global
+	   ones and write the batch to disk */
+
+	uint32 i, j;
+	uint32 num_ideals = hashtable_get_num(&b->ideals);
+	uint32 dense_row_words = b->m->dense_row_words;
+	uint32 num_dense_rows = b->m->num_dense_rows;
+	uint32 *curr_map;
+	uint32 *col;
+	ideal_t *ideal;
+
+	if (num_ideals > *map_alloc) {
+		*map_alloc = 2 * num_ideals;
+		*map = (uint32 *)xrealloc(*map, *map_alloc * sizeof(uint32));
+	}
+	curr_map = *map;
+
+	ideal = (ideal_t *)hashtable_get_first(&b->ideals);
+	for (i = 0; i < num_ideals; i++) {
+		hashtable_find(unique_ideals, ideal, curr_map + i, NULL);
+		curr_map[i] += num_dense_rows;
+		ideal = (ideal_t *)hashtable_get_next(&b->ideals, ideal);
+	}
+
+	col = b->col_data;
+	for (i = 0; i < b->num_cols; i++) {
+		uint32 k = col[0];
+
+		for (j = 1; j <= k; j++)
+			col[j] = curr_map[col[j]];
+		col += 1 + k + dense_row_words;
+	}
+
+	fwrite(b->col_data, sizeof(uint32), b->col_data_size, matrix_fp);
+}
+
+/*------------------------------------------------------------------*/
+static void build_matrix_core(msieve_obj *obj, la_col_t *cycle_list, 
+			uint32 num_cycles, relation_t *rlist, 
+			uint32 num_relations, uint32 num_dense_rows, 
+			ideal_t *small_ideals, uint32 num_small_ideals, 
+			uint32 qcb_size, FILE *matrix_fp,
+			struct threadpool *threadpool,
+			uint32 num_threads) {
+
+	uint32 i;
+	uint32 col_start;
+	hashtable_t unique_ideals;
+	matbuild_t m;
+	matbuild_batch_t *rounds[2];
+	matbuild_batch_t *build, *write;
+	uint32 num_write = 0;
+	uint32 *map = NULL;
+	uint32 map_alloc = 0;
+	size_t mem_use;
+
+	logprintf(obj, "building initial matrix\n");
+
+	m.cycle_list = cycle_list;
+	m.rlist = rlist;
+	m.small_ideals = small_ideals;
+	m.num_small_ideals = num_small_ideals;
+	m.num_dense_rows = num_dense_rows;
+	m.qcb_size = qcb_size;
+	m.dense_row_words = (num_dense_rows + 31) / 32;
+	if (m.dense_row_words > MAX_DENSE_ROW_WORDS) {
+		printf("error: too many dense rows\n");
+		exit(-1);
+	}
+
+	m.max_small_ideal = 0;
+	if (num_small_ideals > 0) {
+		m.max_small_ideal = small_ideals[
+					num_small_ideals - 1].p_lo;
+	}
+
+	hashtable_init(&unique_ideals, (uint32)WORDS_IN(ideal_t), 0);
+
+	for (i = 0; i < 2; i++) {
+		uint32 j;
+
+		rounds[i] = (matbuild_batch_t *)xmalloc(num_threads *
+						sizeof(matbuild_batch_t));
+		for (j = 0; j < num_threads; j++)
+			matbuild_batch_init(rounds[i] + j, &m);
+	}
+	build = rounds[0];
+	write = rounds[1];
+
+	fseek(matrix_fp, 3 * sizeof(uint32), SEEK_SET);
+
+	/* for each round of cycles */
+
+	col_start = 0;
+	while (1) {
+		matbuild_batch_t *tmp;
+		uint32 num_build = 0;
+
+		for (i = 0; i < num_threads && col_start < num_cycles; i++) {
+			matbuild_batch_t *b = build + i;
+
+			b->col_start = col_start;
+			b->num_cols = MIN(MATBUILD_ROUND_COLS, 
+					num_cycles - col_start);
+			col_start += b->num_cols;
+			num_build++;
+		}
+
+		/* start building the next round; the calling
+		   thread meanwhile writes the previous round and
+		   then builds its own share */
+
+		for (i = 0; i + 1 < num_build; i++) {
+			task_control_t t;
+
+			t.init = NULL;
+			t.run = matbuild_batch_run;
+			t.shutdown = NULL;
+			t.data = build + i;
+			threadpool_add_task(threadpool, &t, 1);
+		}
+
+		for (i = 0; i < num_write; i++) {
+			matbuild_batch_write(write + i, &unique_ideals,
+					&map, &map_alloc, matrix_fp);
+		}
+
+		if (num_build == 0)
+			break;
+
+		matbuild_batch_run(build + num_build - 1, 
+				num_threads - 1);
+		if (num_build > 1)
+			threadpool_drain(threadpool, 1);
 
-		fwrite(&k, sizeof(uint32), (size_t)1, matrix_fp);
-		fwrite(mapped_ideals, sizeof(uint32), (size_t)k, matrix_fp);
-		fwrite(dense_rows, sizeof(uint32), 
-				(size_t)dense_row_words, matrix_fp);
+		tmp = write;
+		write = build;
+		build = tmp;
+		num_write = num_build;
 	}
 
 	/* save the matrix dimensions to disk */
@@ -478,7 +719,8 @@ static void build_matrix_core(msieve_obj *obj, la_col_t *cycle_list,
 
 	mem_use = num_relations * sizeof(relation_t) +
 			num_cycles * sizeof(la_col_t) +
-			hashtable_sizeof(&unique_ideals);
+			hashtable_sizeof(&unique_ideals) +
+			map_alloc * sizeof(uint32);
 
 	for (i = 0; i < num_cycles; i++) {
 		la_col_t *c = cycle_list + i;
@@ -490,8 +732,22 @@ static void build_matrix_core(msieve_obj *obj, la_col_t *cycle_list,
 		mem_use += (r->num_factors_r + r->num_factors_a) *
 				sizeof(uint32);
 	}
+	for (i = 0; i < 2 * num_threads; i++) {
+		matbuild_batch_t *b = rounds[i / num_threads] + 
+					i % num_threads;
+		mem_use += hashtable_sizeof(&b->ideals) +
+				b->col_data_alloc * sizeof(uint32);
+	}
 	logprintf(obj, "memory use: %.1f MB\n", (double)mem_use / 1048576);
 
+	for (i = 0; i < 2; i++) {
+		uint32 j;
+
+		for (j = 0; j < num_threads; j++)
+			matbuild_batch_free(rounds[i] + j);
+		free(rounds[i]);
+	}
+	free(map);
 	hashtable_free(&unique_ideals);
 }
 
@@ -514,6 +770,9 @@ static void build_matrix(msieve_obj *obj, mpz_t n) {
 	FILE *matrix_fp;
 	char buf[256];
 	factor_base_t fb;
+	uint32 num_threads = MAX(obj->num_threads, 1);
+	struct threadpool *threadpool = NULL;
+	thread_control_t control;
 
 	sprintf(buf, "%s.mat", obj->savefile.name);
 	matrix_fp = fopen(buf, "w+b");
@@ -543,9 +802,18 @@ static void build_matrix(msieve_obj *obj, mpz_t n) {
 	nfs_read_cycles(obj, &fb, &num_cycles, &cycle_list, 
 			&num_relations, &rlist, 1, 0);
 
+	/* the calling thread does its share of the work too */
+
+	if (num_threads > 1) {
+		memset(&control, 0, sizeof(control));
+		threadpool = threadpool_init(num_threads - 1, 
+						num_threads, &control);
+	}
+
 	/* assign quadratic characters to each relation */
 
-	qcb_size = fill_qcb(obj, &fb.afb.poly, rlist, num_relations);
+	qcb_size = fill_qcb(obj, &fb.afb.poly, rlist, num_relations,
+				threadpool, num_threads);
 
 	/* we need extra matrix rows to make sure that each
 	   dependency has an even number of relations, and also an
@@ -562,7 +830,10 @@ static void build_matrix(msieve_obj *obj, mpz_t n) {
 	build_matrix_core(obj, cycle_list, num_cycles, rlist, 
 			num_relations, num_dense_rows, 
 			small_ideals, num_small_ideals, 
-			qcb_size, matrix_fp);
+			qcb_size, matrix_fp, threadpool, num_threads);
+
+	if (num_threads > 1)
+		threadpool_free(threadpool);
 
 	nfs_free_relation_list(rlist, num_relations);
 	free_cycle_list(cycle_list, num_cycles);
@@ -591,6 +862,7 @@ void nfs_solve_linear_system(msieve_obj *obj, mpz_t n) {
 	uint64 *dependencies;
 	uint32 skip_matbuild = 0;
 	uint32 cado_filter = 0;
+	uint32 reorder = 0;
 	time_t cpu_time = time(NULL);
 #ifdef HAVE_MPI
 	int32 grid_bools[2] = {0};
@@ -635,6 +907,8 @@ void nfs_solve_linear_system(msieve_obj *obj, mpz_t n) {
 			logprintf(obj, "assuming CADO-NFS filtering\n");
 			cado_filter = 1;
 		}
+		if (strstr(obj->nfs_args, "la_reorder=1"))
+			reorder = 1;
 	}
 
 #ifdef HAVE_MPI
@@ -758,9 +1032,10 @@ void nfs_solve_linear_system(msieve_obj *obj, mpz_t n) {
 			free(cols[i].cycle.list);
 		}
 		free(cols);
-#if 0
+
 		/* optimize the layout of large matrices */
-		if (ncols > MIN_REORDER_SIZE) {
+
+		if (reorder && ncols > MIN_REORDER_SIZE) {
 
 			uint32 *rowperm;
 			uint32 *colperm;
@@ -792,7 +1067,6 @@ void nfs_solve_linear_system(msieve_obj *obj, mpz_t n) {
 			}
 			free(cols);
 		}
-#endif
 
 #ifdef HAVE_MPI
 		}
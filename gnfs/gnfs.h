@@ -361,6 +361,80 @@ int32 nfs_read_relation(char *buf, factor_base_t *fb,
 			uint32 compress, mpz_t scratch,
 			uint32 test_primality);
 
+/* read the savefile (which must already be open) and convert
+   its relations using multiple threads. select() is called in
+   savefile order with the number of each relation found, and
+   decides whether the relation is converted, skipped, or whether
+   reading should stop. process() is then called, also in savefile
+   order, with each converted relation, the number of bytes in its
+   list of factors and the status returned by nfs_read_relation.
+   Both callbacks run in the calling thread, though select() may 
+   get ahead of process() by a few thousand relations. The relation
+   passed to process() is only valid for the duration of the call */
+
+#define READ_RELATION_SKIP 0
+#define READ_RELATION_KEEP 1
+#define READ_RELATION_STOP 2
+
+typedef uint32 (*relation_select_t)(void *data, uint32 rel_index);
+
+typedef void (*relation_process_t)(void *data, relation_t *r,
+				uint32 factor_size, int32 status);
+
+void nfs_read_relations(msieve_obj *obj, factor_base_t *fb,
+			uint32 compress, uint32 test_primality,
+			relation_select_t select,
+			relation_process_t process,
+			void *data);
+
+/* the multithreaded savefile reader underneath nfs_read_relations,
+   with the routine that converts each line of text supplied by
+   the caller. If convert is NULL, lines are converted by 
+   nfs_read_relation with the given compress and test_primality.
+   Otherwise convert() works like nfs_read_relation, except that
+   it decides by itself how to read the relation, and it can 
+   produce up to RELSTORE_MAX_RECORD bytes in r->factors */
+
+typedef int32 (*relation_convert_t)(char *buf, factor_base_t *fb,
+				relation_t *r, uint32 *array_size_out,
+				mpz_t scratch);
+
+void nfs_read_savefile(msieve_obj *obj, factor_base_t *fb,
+			relation_convert_t convert,
+			uint32 compress, uint32 test_primality,
+			relation_select_t select,
+			relation_process_t process,
+			void *data);
+
+/* The relation store is an optional binary copy of the savefile
+   (in '<savefile_name>.rels', with an index in '<savefile_name>.rels.idx'),
+   enabled by 'relstore=1' in the NFS arguments. It holds the (a,b) 
+   coordinates and the factors of every relation, already extracted
+   by nfs_read_relation, so that passes after the first do not
+   need to parse text or perform any trial division. Relations
+   appended to the savefile are added to the store the next time 
+   it is updated. Every savefile relation gets a record, so that
+   relation numbers match those of the savefile */
+
+/* a store record is its length followed by at most
+   RELSTORE_MAX_HEADER bytes of flags, status codes, (a,b)
+   and factor counts, then the factors. The length of the
+   longest record takes 2 bytes in compressed form */
+
+#define RELSTORE_MAX_HEADER (1 + 4 + 10 + 5 + 2)
+#define RELSTORE_MAX_RECORD (2 + RELSTORE_MAX_HEADER + \
+				COMPRESSED_P_MAX_SIZE)
+
+uint32 nfs_relstore_enabled(msieve_obj *obj);
+
+void nfs_relstore_update(msieve_obj *obj, factor_base_t *fb);
+
+void nfs_relstore_read(msieve_obj *obj, 
+			uint32 compress, uint32 test_primality,
+			relation_select_t select,
+			relation_process_t process,
+			void *data);
+
 /* given a relation, find and list all of the rational
    ideals > filtmin_r and all of the algebraic ideals 
    whose prime exceeds filtmin_a. If these bounds are 
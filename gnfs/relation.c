@@ -13,6 +13,7 @@ $Id$
 --------------------------------------------------------------------*/
 
 #include <common.h>
+#include <thread.h>
 #include "gnfs.h"
 
 /*--------------------------------------------------------------------*/
@@ -270,6 +271,415 @@ int32 nfs_read_relation(char *buf, factor_base_t *fb,
 	return 0;
 }
 
+/*--------------------------------------------------------------------*/
+/* Multithreaded reading of the savefile.
+
+   Converting a line of text into a relation is dominated by 
+   the trial division and polynomial evaluation in nfs_read_relation,
+   and for large datasets doing that one line at a time takes hours.
+   The code here splits the work into rounds: each round is a 
+   collection of batches of savefile lines, one batch per thread.
+   While the thread pool converts the batches of one round into 
+   relations, the calling thread hands the results of the previous
+   round to a callback (in savefile order) and reads the lines for
+   the next round from disk. Because rounds are processed strictly 
+   in order, the relation numbers and everything derived from them
+   come out exactly the same as for a single-threaded read */
+
+#define READ_BATCH_LINES 4096
+
+typedef struct {
+	uint32 num_lines;
+	uint32 *line_offset;
+	char *text;
+	uint32 text_size;
+	uint32 text_alloc;
+
+	relation_t *rlist;
+	uint32 *factor_size;
+	int32 *status;
+	uint8 *factors;
+	uint32 factors_alloc;
+
+	struct read_relations_t *reader;
+} read_batch_t;
+
+typedef struct {
+	factor_base_t fb;
+	mpz_t scratch;
+	uint8 tmp_factors[RELSTORE_MAX_RECORD];
+} read_thread_t;
+
+typedef struct read_relations_t {
+	factor_base_t *fb;
+	relation_convert_t convert;
+	uint32 compress;
+	uint32 test_primality;
+
+	uint32 num_threads;
+	read_thread_t *threads;
+	struct threadpool *threadpool;
+
+	uint32 num_batches;     /* per round */
+	read_batch_t *rounds[3];
+} read_relations_t;
+
+/*--------------------------------------------------------------------*/
+static void read_thread_init(void *data, int thread_num) {
+
+	read_relations_t *r = (read_relations_t *)data;
+	read_thread_t *t = r->threads + thread_num;
+	mpz_poly_t *rpoly = &r->fb->rfb.poly;
+	mpz_poly_t *apoly = &r->fb->afb.poly;
+	uint32 i;
+
+	/* nfs_read_relation uses scratch space inside the 
+	   factor base polynomials, so every thread needs 
+	   private copies */
+
+	memset(&t->fb, 0, sizeof(factor_base_t));
+	mpz_poly_init(&t->fb.rfb.poly);
+	mpz_poly_init(&t->fb.afb.poly);
+	mpz_init(t->scratch);
+
+	t->fb.rfb.poly.degree = rpoly->degree;
+	for (i = 0; i <= rpoly->degree; i++)
+		mpz_set(t->fb.rfb.poly.coeff[i], rpoly->coeff[i]);
+
+	t->fb.afb.poly.degree = apoly->degree;
+	for (i = 0; i <= apoly->degree; i++)
+		mpz_set(t->fb.afb.poly.coeff[i], apoly->coeff[i]);
+}
+
+/*--------------------------------------------------------------------*/
+static void read_thread_free(void *data, int thread_num) {
+
+	read_relations_t *r = (read_relations_t *)data;
+	read_thread_t *t = r->threads + thread_num;
+
+	mpz_poly_free(&t->fb.rfb.poly);
+	mpz_poly_free(&t->fb.afb.poly);
+	mpz_clear(t->scratch);
+}
+
+/*--------------------------------------------------------------------*/
+static void read_batch_init(read_batch_t *b, read_relations_t *r) {
+
+	memset(b, 0, sizeof(read_batch_t));
+	b->reader = r;
+	b->line_offset = (uint32 *)xmalloc(READ_BATCH_LINES * 
+						sizeof(uint32));
+	b->rlist = (relation_t *)xmalloc(READ_BATCH_LINES * 
+						sizeof(relation_t));
+	b->factor_size = (uint32 *)xmalloc(READ_BATCH_LINES * 
+						sizeof(uint32));
+	b->status = (int32 *)xmalloc(READ_BATCH_LINES * sizeof(int32));
+
+	b->text_alloc = READ_BATCH_LINES * 100;
+	b->text = (char *)xmalloc(b->text_alloc * sizeof(char));
+	b->factors_alloc = READ_BATCH_LINES * 32;
+	b->factors = (uint8 *)xmalloc(b->factors_alloc * sizeof(uint8));
+}
+
+/*--------------------------------------------------------------------*/
+static void read_batch_free(read_batch_t *b) {
+
+	free(b->line_offset);
+	free(b->rlist);
+	free(b->factor_size);
+	free(b->status);
+	free(b->text);
+	free(b->factors);
+}
+
+/*--------------------------------------------------------------------*/
+static void read_batch_add(read_batch_t *b, char *buf, uint32 rel_index) {
+
+	uint32 len = strlen(buf) + 1;
+
+	if (b->text_size + len > b->text_alloc) {
+		b->text_alloc = 2 * (b->text_size + len);
+		b->text = (char *)xrealloc(b->text, b->text_alloc *
+						sizeof(char));
+	}
+	memcpy(b->text + b->text_size, buf, len);
+
+	b->line_offset[b->num_lines] = b->text_size;
+	b->rlist[b->num_lines].rel_index = rel_index;
+	b->text_size += len;
+	b->num_lines++;
+}
+
+/*--------------------------------------------------------------------*/
+static void read_batch_run(void *data, int thread_num) {
+
+	read_batch_t *b = (read_batch_t *)data;
+	read_relations_t *r = b->reader;
+	read_thread_t *t = r->threads + thread_num;
+	relation_t tmp_relation;
+	uint32 i;
+	uint32 factors_size = 0;
+
+	tmp_relation.factors = t->tmp_factors;
+
+	for (i = 0; i < b->num_lines; i++) {
+
+		relation_t *rel = b->rlist + i;
+		uint32 array_size = 0;
+		int32 status;
+
+		if (r->convert != NULL) {
+			status = r->convert(b->text + b->line_offset[i],
+					&t->fb, &tmp_relation, 
+					&array_size, t->scratch);
+		}
+		else {
+			status = nfs_read_relation(
+					b->text + b->line_offset[i],
+					&t->fb, &tmp_relation, 
+					&array_size, r->compress,
+					t->scratch, r->test_primality);
+		}
+
+		b->status[i] = status;
+		b->factor_size[i] = 0;
+		tmp_relation.rel_index = rel->rel_index;
+		*rel = tmp_relation;
+		if (status != 0)
+			continue;
+
+		/* the factors of all relations in the batch are
+		   packed into one array; pointers to that array 
+		   get filled in after the batch is finished, since
+		   the array can move while it grows */
+
+		if (factors_size + array_size > b->factors_alloc) {
+			b->factors_alloc = 2 * (factors_size + array_size);
+			b->factors = (uint8 *)xrealloc(b->factors,
+						b->factors_alloc * 
+						sizeof(uint8));
+		}
+		memcpy(b->factors + factors_size, t->tmp_factors, 
+				array_size * sizeof(uint8));
+		b->factor_size[i] = array_size;
+		factors_size += array_size;
+	}
+
+	for (i = factors_size = 0; i < b->num_lines; i++) {
+		b->rlist[i].factors = b->factors + factors_size;
+		factors_size += b->factor_size[i];
+	}
+}
+
+/*--------------------------------------------------------------------*/
+static uint32 read_round(savefile_t *savefile, char *buf,
+			read_batch_t *round, uint32 num_batches,
+			uint32 *rel_index, uint32 *done,
+			relation_select_t select, void *data) {
+
+	/* fill up the batches in one round with lines from
+	   the savefile, returning the number of lines read */
+
+	uint32 i;
+	uint32 num_lines = 0;
+
+	for (i = 0; i < num_batches; i++) {
+		round[i].num_lines = 0;
+		round[i].text_size = 0;
+	}
+
+	i = 0;
+	while (!(*done) && i < num_batches) {
+
+		read_batch_t *b = round + i;
+
+		if (savefile_eof(savefile)) {
+			*done = 1;
+			break;
+		}
+
+		if (buf[0] != '-' && !isdigit(buf[0])) {
+
+			/* no relation on this line */
+
+			savefile_read_line(buf, LINE_BUF_SIZE, savefile);
+			continue;
+		}
+
+		switch (select(data, ++(*rel_index))) {
+		case READ_RELATION_STOP:
+			*done = 1;
+			continue;
+
+		case READ_RELATION_KEEP:
+			read_batch_add(b, buf, *rel_index);
+			num_lines++;
+			if (b->num_lines == READ_BATCH_LINES)
+				i++;
+			break;
+		}
+
+		savefile_read_line(buf, LINE_BUF_SIZE, savefile);
+	}
+
+	return num_lines;
+}
+
+/*--------------------------------------------------------------------*/
+static void process_round(read_batch_t *round, uint32 num_batches,
+			relation_process_t process, void *data) {
+
+	uint32 i, j;
+
+	for (i = 0; i < num_batches; i++) {
+		read_batch_t *b = round + i;
+
+		for (j = 0; j < b->num_lines; j++) {
+			process(data, b->rlist + j, 
+				b->factor_size[j], b->status[j]);
+		}
+	}
+}
+
+/*--------------------------------------------------------------------*/
+void nfs_read_savefile(msieve_obj *obj, factor_base_t *fb,
+			relation_convert_t convert,
+			uint32 compress, uint32 test_primality,
+			relation_select_t select,
+			relation_process_t process,
+			void *data) {
+
+	uint32 i, j;
+	savefile_t *savefile = &obj->savefile;
+	char buf[LINE_BUF_SIZE];
+	read_relations_t r;
+	thread_control_t control;
+	uint32 rel_index = (uint32)(-1);
+	uint32 done = 0;
+	uint32 num_threads = MAX(obj->num_threads, 1);
+	read_batch_t *parse, *consume, *fill;
+
+	memset(&r, 0, sizeof(read_relations_t));
+	r.fb = fb;
+	r.convert = convert;
+	r.compress = compress;
+	r.test_primality = test_primality;
+	r.num_threads = num_threads;
+	r.num_batches = num_threads;
+	r.threads = (read_thread_t *)xmalloc(num_threads *
+					sizeof(read_thread_t));
+
+	for (i = 0; i < 3; i++) {
+		r.rounds[i] = (read_batch_t *)xmalloc(r.num_batches *
+						sizeof(read_batch_t));
+		for (j = 0; j < r.num_batches; j++)
+			read_batch_init(r.rounds[i] + j, &r);
+	}
+
+	/* the calling thread is the last one */
+
+	control.init = read_thread_init;
+	control.shutdown = read_thread_free;
+	control.data = &r;
+
+	if (num_threads > 1) {
+		r.threadpool = threadpool_init(num_threads - 1, 
+						num_threads, &control);
+	}
+	read_thread_init(&r, num_threads - 1);
+
+	/* prime the pipeline */
+
+	parse = r.rounds[0];
+	consume = r.rounds[1];
+	fill = r.rounds[2];
+	for (i = 0; i < r.num_batches; i++)
+		consume[i].num_lines = 0;
+
+	savefile_read_line(buf, sizeof(buf), savefile);
+	read_round(savefile, buf, parse, r.num_batches,
+			&rel_index, &done, select, data);
+
+	while (1) {
+		read_batch_t *tmp;
+		uint32 have_lines = 0;
+
+		for (i = 0; i < r.num_batches; i++)
+			have_lines += parse[i].num_lines;
+
+		if (have_lines == 0)
+			break;
+
+		/* start converting the current round; the calling
+		   thread meanwhile processes the previous round,
+		   reads in the next one and then takes its own
+		   share of the conversion */
+
+		for (i = 0; i < num_threads - 1; i++) {
+			task_control_t t;
+
+			t.init = NULL;
+			t.run = read_batch_run;
+			t.shutdown = NULL;
+			t.data = parse + i;
+			threadpool_add_task(r.threadpool, &t, 1);
+		}
+
+		process_round(consume, r.num_batches, process, data);
+
+		read_round(savefile, buf, fill, r.num_batches,
+				&rel_index, &done, select, data);
+
+		read_batch_run(parse + num_threads - 1, num_threads - 1);
+
+		if (num_threads > 1)
+			threadpool_drain(r.threadpool, 1);
+
+		tmp = consume;
+		consume = parse;
+		parse = fill;
+		fill = tmp;
+	}
+
+	process_round(consume, r.num_batches, process, data);
+
+	/* clean up */
+
+	if (num_threads > 1) {
+		threadpool_drain(r.threadpool, 1);
+		threadpool_free(r.threadpool);
+	}
+	read_thread_free(&r, num_threads - 1);
+
+	for (i = 0; i < 3; i++) {
+		for (j = 0; j < r.num_batches; j++)
+			read_batch_free(r.rounds[i] + j);
+		free(r.rounds[i]);
+	}
+	free(r.threads);
+}
+
+/*--------------------------------------------------------------------*/
+void nfs_read_relations(msieve_obj *obj, factor_base_t *fb,
+			uint32 compress, uint32 test_primality,
+			relation_select_t select,
+			relation_process_t process,
+			void *data) {
+
+	/* if a binary copy of the relations is wanted, bring
+	   it up to date with the savefile and read from it */
+
+	if (nfs_relstore_enabled(obj)) {
+		nfs_relstore_update(obj, fb);
+		nfs_relstore_read(obj, compress, test_primality,
+				select, process, data);
+		return;
+	}
+
+	nfs_read_savefile(obj, fb, NULL, compress, test_primality,
+			select, process, data);
+}
+
 /*--------------------------------------------------------------------*/
 uint32 find_large_ideals(relation_t *rel, 
 			relation_lp_t *out, 
@@ -500,6 +910,53 @@ typedef struct {
 	uint32 count;
 } relcount_t;
 
+typedef struct {
+	msieve_obj *obj;
+	uint32 *relidx_list;
+	uint32 num_relidx;
+	uint32 next_select;
+	uint32 num_relations;
+	relation_t *rlist;
+} cycle_rel_t;
+
+static uint32 select_cycle_relation(void *data, uint32 rel_index) {
+
+	cycle_rel_t *c = (cycle_rel_t *)data;
+
+	if (c->next_select == c->num_relidx)
+		return READ_RELATION_STOP;
+
+	if (rel_index < c->relidx_list[c->next_select])
+		return READ_RELATION_SKIP;
+
+	c->next_select++;
+	return READ_RELATION_KEEP;
+}
+
+static void process_cycle_relation(void *data, relation_t *rel,
+				uint32 factor_size, int32 status) {
+
+	cycle_rel_t *c = (cycle_rel_t *)data;
+	relation_t *r;
+
+	if (status) {
+		/* at this point, if the relation couldn't be
+		   read then the filtering stage should have
+		   found that out and skipped it */
+
+		logprintf(c->obj, "error: relation %u corrupt\n", 
+				rel->rel_index);
+		exit(-1);
+	}
+
+	/* save the relation */
+
+	r = c->rlist + c->num_relations++;
+	*r = *rel;
+	r->factors = (uint8 *)xmalloc(factor_size * sizeof(uint8));
+	memcpy(r->factors, rel->factors, factor_size * sizeof(uint8));
+}
+
 static void nfs_get_cycle_relations(msieve_obj *obj, 
 				factor_base_t *fb, uint32 num_cycles, 
 				la_col_t *cycle_list, 
@@ -508,21 +965,13 @@ static void nfs_get_cycle_relations(msieve_obj *obj,
 				uint32 compress,
 				uint32 dependency) {
 	uint32 i, j;
-	char buf[LINE_BUF_SIZE];
-	relation_t *rlist;
 	savefile_t *savefile = &obj->savefile;
 
 	hashtable_t unique_relidx;
 	uint32 num_unique_relidx;
 	uint32 *relidx_list;
 	relcount_t *entry;
-
-	uint8 tmp_factors[COMPRESSED_P_MAX_SIZE];
-	uint32 factor_size;
-	relation_t tmp_relation;
-	mpz_t scratch;
-
-	tmp_relation.factors = tmp_factors;
+	cycle_rel_t c;
 
 	hashtable_init(&unique_relidx, 
 			(uint32)WORDS_IN(relcount_t), 
@@ -578,64 +1027,23 @@ static void nfs_get_cycle_relations(msieve_obj *obj,
 
 	/* read the list of relations */
 
-	rlist = (relation_t *)xmalloc(num_unique_relidx * sizeof(relation_t));
+	c.obj = obj;
+	c.relidx_list = relidx_list;
+	c.num_relidx = num_unique_relidx;
+	c.next_select = 0;
+	c.num_relations = 0;
+	c.rlist = (relation_t *)xmalloc(num_unique_relidx * 
+					sizeof(relation_t));
 
-	i = (uint32)(-1);
-	j = 0;
-	savefile_read_line(buf, sizeof(buf), savefile);
-	mpz_init(scratch);
-	while (!savefile_eof(savefile) && j < num_unique_relidx) {
-		
-		int32 status;
-
-		if (buf[0] != '-' && !isdigit(buf[0])) {
-
-			/* no relation at this line */
-
-			savefile_read_line(buf, sizeof(buf), savefile);
-			continue;
-		}
-		if (++i < relidx_list[j]) {
-
-			/* relation not needed */
-
-			savefile_read_line(buf, sizeof(buf), savefile);
-			continue;
-		}
+	nfs_read_relations(obj, fb, compress, 0,
+			select_cycle_relation,
+			process_cycle_relation, &c);
 
-		status = nfs_read_relation(buf, fb, &tmp_relation, 
-						&factor_size, compress,
-						scratch, 0);
-		if (status) {
-			/* at this point, if the relation couldn't be
-			   read then the filtering stage should have
-			   found that out and skipped it */
-
-			logprintf(obj, "error: relation %u corrupt\n", i);
-			exit(-1);
-		}
-		else {
-			/* save the relation */
-
-			relation_t *r = rlist + j++;
-
-			*r = tmp_relation;
-			r->rel_index = i;
-			r->factors = (uint8 *)xmalloc(factor_size *
-							sizeof(uint8));
-			memcpy(r->factors, tmp_relation.factors,
-					factor_size * sizeof(uint8));
-		}
-
-		savefile_read_line(buf, sizeof(buf), savefile);
-	}
-
-	num_unique_relidx = *num_relations_out = j;
-	logprintf(obj, "read %u relations\n", j);
+	*num_relations_out = c.num_relations;
+	logprintf(obj, "read %u relations\n", c.num_relations);
 	savefile_close(savefile);
 	hashtable_free(&unique_relidx);
-	*rlist_out = rlist;
-	mpz_clear(scratch);
+	*rlist_out = c.rlist;
 }
 
 /*--------------------------------------------------------------------*/
@@ -0,0 +1,568 @@
+/*--------------------------------------------------------------------
+This source distribution is placed in the public domain by its author,
+Jason Papadopoulos. You may use it for any purpose, free of charge,
+without having to notify anyone. I disclaim any responsibility for any
+errors.
+
+Optionally, please be nice and tell me if you find this source to be
+useful. Again optionally, if you add to the functionality present here
+please consider making those additions public too, so that others may
+benefit from your work.
+
+$Id$
+--------------------------------------------------------------------*/
+
+#include <common.h>
+#include "gnfs.h"
+
+/* The relation store replaces the text of the savefile with
+   the output of nfs_read_relation, so that every pass through
+   the relations after the first skips the parsing, the polynomial
+   evaluation and the trial division.
+
+   The store is a header followed by one variable-length record
+   per savefile relation. Each record starts with its length and
+   a byte of flags, optionally followed by the status codes from
+   nfs_read_relation (if the relation was not read successfully
+   in all the ways callers can ask for) and then optionally by
+   the coordinates and compressed factor list of the relation.
+   Integers are stored in the runlength-encoded format produced
+   by compress_p, and factors are stored with their complete
+   multiplicity; if a caller asks for only the factors that occur
+   an odd number of times, the list gets squeezed on the fly.
+
+   A separate index file holds the file offset of every
+   RELSTORE_INDEX_STRIDE-th record, so that reading a sparse
+   collection of relations (i.e. the relations in a few matrix
+   dependencies) only touches the parts of the store that
+   contain them */
+
+#define RELSTORE_MAGIC 0x534c4552
+#define RELSTORE_VERSION 1
+#define RELSTORE_INDEX_STRIDE 1024
+#define RELSTORE_BUF_SIZE 1048576
+
+#define RECORD_FACTORS 0x01	/* (a,b) and factors follow */
+#define RECORD_PACKED 0x02	/* factors only include odd powers */
+#define RECORD_STATUS 0x04	/* status codes follow */
+
+typedef struct {
+	uint32 magic;
+	uint32 version;
+	uint32 poly_hash;	/* checksum of the NFS polynomials */
+	uint32 num_relations;	/* number of records */
+	uint64 savefile_size;	/* savefile size when last updated */
+	uint64 data_size;	/* size of the records */
+} relstore_header_t;
+
+typedef struct {
+	char name[LINE_BUF_SIZE];
+	char idx_name[LINE_BUF_SIZE];
+	FILE *fp;
+	relstore_header_t header;
+
+	uint64 *index;
+	uint32 index_alloc;
+
+	uint8 *buf;
+	uint32 buf_size;
+	uint32 buf_off;
+	uint32 next_relation;
+
+	uint8 factors[COMPRESSED_P_MAX_SIZE];
+} relstore_t;
+
+/*--------------------------------------------------------------------*/
+uint32 nfs_relstore_enabled(msieve_obj *obj) {
+
+	if (obj->nfs_args != NULL &&
+	    strstr(obj->nfs_args, "relstore=1") != NULL)
+		return 1;
+	return 0;
+}
+
+/*--------------------------------------------------------------------*/
+static uint32 poly_hash(factor_base_t *fb) {
+
+	uint32 i, j;
+	uint32 hash = 0;
+	mpz_poly_t *polys[2];
+
+	polys[0] = &fb->rfb.poly;
+	polys[1] = &fb->afb.poly;
+
+	for (i = 0; i < 2; i++) {
+		mpz_poly_t *poly = polys[i];
+
+		hash = HASH1(hash ^ poly->degree);
+		for (j = 0; j <= poly->degree; j++) {
+			hash = HASH2(hash ^ (uint32)mpz_fdiv_ui(
+						poly->coeff[j],
+						4294967291U));
+			hash ^= mpz_sgn(poly->coeff[j]) < 0;
+		}
+	}
+	return hash;
+}
+
+/*--------------------------------------------------------------------*/
+static void relstore_init(msieve_obj *obj, relstore_t *s) {
+
+	memset(s, 0, sizeof(relstore_t));
+	sprintf(s->name, "%s.rels", obj->savefile.name);
+	sprintf(s->idx_name, "%s.rels.idx", obj->savefile.name);
+}
+
+/*--------------------------------------------------------------------*/
+static void relstore_free(relstore_t *s) {
+
+	if (s->fp != NULL)
+		fclose(s->fp);
+	free(s->index);
+	free(s->buf);
+}
+
+/*--------------------------------------------------------------------*/
+static uint32 relstore_open(msieve_obj *obj, relstore_t *s,
+			factor_base_t *fb, char *mode) {
+
+	/* open an existing store and read its index. Returns
+	   zero if the store is missing or belongs to some
+	   other factorization */
+
+	FILE *idx_fp;
+	uint32 num_index;
+
+	s->fp = fopen(s->name, mode);
+	if (s->fp == NULL)
+		return 0;
+
+	if (fread(&s->header, sizeof(relstore_header_t),
+				(size_t)1, s->fp) != 1 ||
+	    s->header.magic != RELSTORE_MAGIC ||
+	    s->header.version != RELSTORE_VERSION ||
+	    (fb != NULL && s->header.poly_hash != poly_hash(fb))) {
+		logprintf(obj, "ignoring incompatible relation store\n");
+		fclose(s->fp);
+		s->fp = NULL;
+		return 0;
+	}
+
+	num_index = (s->header.num_relations + RELSTORE_INDEX_STRIDE - 1) /
+				RELSTORE_INDEX_STRIDE;
+	s->index_alloc = MAX(num_index, 1000);
+	s->index = (uint64 *)xmalloc(s->index_alloc * sizeof(uint64));
+
+	idx_fp = fopen(s->idx_name, "rb");
+	if (idx_fp == NULL ||
+	    fread(s->index, sizeof(uint64), (size_t)num_index,
+		    		idx_fp) != num_index) {
+		logprintf(obj, "error: cannot read relation store index\n");
+		exit(-1);
+	}
+	fclose(idx_fp);
+	return 1;
+}
+
+/*--------------------------------------------------------------------*/
+static void relstore_write_index(msieve_obj *obj, relstore_t *s) {
+
+	FILE *idx_fp;
+	uint32 num_index = (s->header.num_relations +
+				RELSTORE_INDEX_STRIDE - 1) /
+				RELSTORE_INDEX_STRIDE;
+
+	idx_fp = fopen(s->idx_name, "wb");
+	if (idx_fp == NULL) {
+		logprintf(obj, "error: cannot write relation store index\n");
+		exit(-1);
+	}
+	fwrite(s->index, sizeof(uint64), (size_t)num_index, idx_fp);
+	fclose(idx_fp);
+
+	/* the header goes last, so that an interrupted update
+	   leaves a store that is still consistent */
+
+	fflush(s->fp);
+	fseeko(s->fp, (uint64)0, SEEK_SET);
+	fwrite(&s->header, sizeof(relstore_header_t), (size_t)1, s->fp);
+}
+
+/*--------------------------------------------------------------------*/
+static int32 relstore_convert(char *buf, factor_base_t *fb,
+			relation_t *r, uint32 *array_size_out,
+			mpz_t scratch) {
+
+	/* convert one line of the savefile into a store record.
+	   Almost all relations can be read no matter what the
+	   caller wants, but for the rest we save the status
+	   of each of the four ways nfs_read_relation can be called */
+
+	uint8 body[RELSTORE_MAX_HEADER + COMPRESSED_P_MAX_SIZE];
+	uint8 *record = r->factors;
+	relation_t rel;
+	uint32 size = 0;
+	uint32 body_size;
+	uint32 offset;
+	uint8 flags = RECORD_FACTORS;
+	int32 status_full = 0;
+	int32 status_packed = 0;
+	int32 status_tested = 0;
+	int32 status_full_tested;
+	uint64 a;
+
+	/* the factors are read in place, then moved down
+	   to follow the part of the body before them */
+
+	rel.factors = body + RELSTORE_MAX_HEADER;
+
+	status_full_tested = nfs_read_relation(buf, fb, &rel, &size,
+						0, scratch, 1);
+	if (status_full_tested != 0) {
+
+		status_tested = nfs_read_relation(buf, fb, &rel, &size,
+						1, scratch, 1);
+		status_packed = nfs_read_relation(buf, fb, &rel, &size,
+						1, scratch, 0);
+		status_full = nfs_read_relation(buf, fb, &rel, &size,
+						0, scratch, 0);
+		flags = RECORD_STATUS;
+
+		if (status_full == 0) {
+			flags |= RECORD_FACTORS;
+		}
+		else if (status_packed == 0) {
+			nfs_read_relation(buf, fb, &rel, &size,
+						1, scratch, 0);
+			flags |= RECORD_FACTORS | RECORD_PACKED;
+		}
+	}
+
+	/* a relation with more factors than a record can
+	   hold still gets a record, as one that cannot be read */
+
+	if ((flags & RECORD_FACTORS) && size > COMPRESSED_P_MAX_SIZE) {
+		flags = RECORD_STATUS;
+		status_full = status_packed = -97;
+		status_tested = status_full_tested = -97;
+	}
+
+	body[0] = flags;
+	body_size = 1;
+
+	if (flags & RECORD_STATUS) {
+		body[body_size++] = (uint8)(-status_full);
+		body[body_size++] = (uint8)(-status_packed);
+		body[body_size++] = (uint8)(-status_tested);
+		body[body_size++] = (uint8)(-status_full_tested);
+	}
+
+	if (flags & RECORD_FACTORS) {
+		a = ((uint64)rel.a << 1) ^ (uint64)(rel.a >> 63);
+		body_size = compress_p(body, a, body_size);
+		body_size = compress_p(body, (uint64)rel.b, body_size);
+		body[body_size++] = rel.num_factors_r;
+		body[body_size++] = rel.num_factors_a;
+		memmove(body + body_size, rel.factors, (size_t)size);
+		body_size += size;
+	}
+
+	offset = compress_p(record, (uint64)body_size, 0);
+	memcpy(record + offset, body, (size_t)body_size);
+	*array_size_out = offset + body_size;
+	return 0;
+}
+
+/*--------------------------------------------------------------------*/
+typedef struct {
+	relstore_t *store;
+	uint32 num_old;
+	uint32 num_converted;
+} relstore_update_t;
+
+static uint32 select_update(void *data, uint32 rel_index) {
+
+	relstore_update_t *u = (relstore_update_t *)data;
+
+	if (rel_index < u->num_old)
+		return READ_RELATION_SKIP;
+	return READ_RELATION_KEEP;
+}
+
+static void process_update(void *data, relation_t *r,
+			uint32 record_size, int32 status) {
+
+	relstore_update_t *u = (relstore_update_t *)data;
+	relstore_t *s = u->store;
+	relstore_header_t *h = &s->header;
+
+	if (h->num_relations % RELSTORE_INDEX_STRIDE == 0) {
+		uint32 i = h->num_relations / RELSTORE_INDEX_STRIDE;
+
+		if (i == s->index_alloc) {
+			s->index_alloc *= 2;
+			s->index = (uint64 *)xrealloc(s->index,
+						s->index_alloc *
+						sizeof(uint64));
+		}
+		s->index[i] = sizeof(relstore_header_t) + h->data_size;
+	}
+
+	fwrite(r->factors, sizeof(uint8), (size_t)record_size, s->fp);
+	h->data_size += record_size;
+	h->num_relations++;
+	u->num_converted++;
+}
+
+/*--------------------------------------------------------------------*/
+void nfs_relstore_update(msieve_obj *obj, factor_base_t *fb) {
+
+	/* bring the store up to date with the savefile, which
+	   is assumed to be open and positioned at the start.
+	   Since the savefile only ever gets appended to, only
+	   the relations past the end of the store are converted */
+
+	relstore_t s;
+	relstore_update_t u;
+	uint64 savefile_size = get_file_size(obj->savefile.name);
+
+	relstore_init(obj, &s);
+
+	if (relstore_open(obj, &s, fb, "r+b")) {
+		if (s.header.savefile_size == savefile_size) {
+			relstore_free(&s);
+			return;
+		}
+		if (s.header.savefile_size > savefile_size) {
+			logprintf(obj, "savefile has shrunk; "
+					"rebuilding relation store\n");
+			fclose(s.fp);
+			s.fp = NULL;
+		}
+		else {
+			fseeko(s.fp, sizeof(relstore_header_t) +
+					s.header.data_size, SEEK_SET);
+		}
+	}
+
+	if (s.fp == NULL) {
+		s.fp = fopen(s.name, "w+b");
+		if (s.fp == NULL) {
+			logprintf(obj, "error: cannot create relation store\n");
+			exit(-1);
+		}
+
+		memset(&s.header, 0, sizeof(relstore_header_t));
+		s.header.magic = RELSTORE_MAGIC;
+		s.header.version = RELSTORE_VERSION;
+		s.header.poly_hash = poly_hash(fb);
+		fwrite(&s.header, sizeof(relstore_header_t), (size_t)1, s.fp);
+
+		if (s.index == NULL) {
+			s.index_alloc = 1000;
+			s.index = (uint64 *)xmalloc(s.index_alloc *
+							sizeof(uint64));
+		}
+	}
+
+	u.store = &s;
+	u.num_old = s.header.num_relations;
+	u.num_converted = 0;
+
+	nfs_read_savefile(obj, fb, relstore_convert, 0, 0,
+			select_update, process_update, &u);
+
+	s.header.savefile_size = savefile_size;
+	relstore_write_index(obj, &s);
+
+	logprintf(obj, "added %u relations to relation store "
+			"(%u total, %.1f MB)\n",
+			u.num_converted, s.header.num_relations,
+			(double)s.header.data_size / 1048576);
+	relstore_free(&s);
+}
+
+/*--------------------------------------------------------------------*/
+static uint8 * relstore_next_record(relstore_t *s, uint32 *size_out) {
+
+	/* return a pointer to the next record in the buffer,
+	   refilling the buffer if it may not contain the whole
+	   record. relstore_convert never writes a record longer
+	   than RELSTORE_MAX_RECORD bytes */
+
+	uint8 *record;
+	uint32 size;
+	uint32 offset = 0;
+
+	if (s->buf_off + RELSTORE_MAX_RECORD > s->buf_size) {
+		uint32 remaining = s->buf_size - s->buf_off;
+
+		memmove(s->buf, s->buf + s->buf_off, (size_t)remaining);
+		s->buf_size = remaining + fread(s->buf + remaining,
+					sizeof(uint8),
+					(size_t)(RELSTORE_BUF_SIZE - remaining),
+					s->fp);
+		s->buf_off = 0;
+	}
+
+	record = s->buf + s->buf_off;
+	size = (uint32)decompress_p(record, &offset);
+	s->buf_off += offset + size;
+	s->next_relation++;
+	*size_out = size;
+	return record + offset;
+}
+
+/*--------------------------------------------------------------------*/
+static void relstore_seek(relstore_t *s, uint32 rel_index) {
+
+	uint32 block = rel_index / RELSTORE_INDEX_STRIDE;
+
+	fseeko(s->fp, s->index[block], SEEK_SET);
+	s->buf_size = s->buf_off = 0;
+	s->next_relation = block * RELSTORE_INDEX_STRIDE;
+}
+
+/*--------------------------------------------------------------------*/
+static int32 relstore_get(relstore_t *s, uint32 rel_index,
+			relation_t *r, uint32 *factor_size,
+			uint32 compress, uint32 test_primality) {
+
+	/* random access to one relation; the relation is
+	   converted to the form nfs_read_relation would have
+	   produced if called with the same arguments */
+
+	uint8 *record;
+	uint8 flags;
+	uint32 i, j, k;
+	uint32 offset;
+	uint32 size;
+	uint32 num_factors[2];
+	int32 status = 0;
+	uint64 a;
+
+	if (rel_index < s->next_relation ||
+	    rel_index / RELSTORE_INDEX_STRIDE >
+	    		s->next_relation / RELSTORE_INDEX_STRIDE) {
+		relstore_seek(s, rel_index);
+	}
+
+	while (s->next_relation < rel_index)
+		relstore_next_record(s, &size);
+
+	record = relstore_next_record(s, &size);
+	flags = record[0];
+	offset = 1;
+
+	if (flags & RECORD_STATUS) {
+		int32 status_full = -(int32)record[1];
+		int32 status_packed = -(int32)record[2];
+		int32 status_tested = -(int32)record[3];
+		int32 status_full_tested = -(int32)record[4];
+
+		if (test_primality)
+			status = compress ? status_tested : status_full_tested;
+		else
+			status = compress ? status_packed : status_full;
+		offset = 5;
+	}
+
+	if (status != 0 || !(flags & RECORD_FACTORS))
+		return status ? status : -1;
+
+	a = decompress_p(record, &offset);
+	r->a = (int64)(a >> 1) ^ -(int64)(a & 1);
+	r->b = (uint32)decompress_p(record, &offset);
+	r->num_factors_r = record[offset++];
+	r->num_factors_a = record[offset++];
+	r->rel_index = rel_index;
+	r->factors = s->factors;
+	size -= offset;
+
+	if (!compress || r->b == 0 || (flags & RECORD_PACKED)) {
+		memcpy(s->factors, record + offset, (size_t)size);
+		*factor_size = size;
+		return 0;
+	}
+
+	/* keep one instance of every factor that occurs an odd
+	   number of times. nfs_read_relation lists all instances
+	   of a factor next to each other, and always keeps the
+	   factor for -1 */
+
+	num_factors[0] = r->num_factors_r;
+	num_factors[1] = r->num_factors_a;
+	record += offset;
+	offset = 0;
+	size = 0;
+
+	for (i = 0; i < 2; i++) {
+		uint32 num_in = num_factors[i];
+		uint32 num_out = 0;
+
+		for (j = 0; j < num_in; j = k) {
+			uint32 next_offset = offset;
+			uint64 p = decompress_p(record, &offset);
+
+			for (k = j + 1; k < num_in; k++) {
+				next_offset = offset;
+				if (decompress_p(record, &next_offset) != p)
+					break;
+				offset = next_offset;
+			}
+
+			if (p == 0 || (k - j) % 2 == 1) {
+				size = compress_p(s->factors, p, size);
+				num_out++;
+			}
+		}
+		num_factors[i] = num_out;
+	}
+
+	r->num_factors_r = num_factors[0];
+	r->num_factors_a = num_factors[1];
+	*factor_size = size;
+	return 0;
+}
+
+/*--------------------------------------------------------------------*/
+void nfs_relstore_read(msieve_obj *obj,
+			uint32 compress, uint32 test_primality,
+			relation_select_t select,
+			relation_process_t process,
+			void *data) {
+
+	uint32 i;
+	relstore_t s;
+
+	relstore_init(obj, &s);
+	if (!relstore_open(obj, &s, NULL, "rb")) {
+		logprintf(obj, "error: cannot open relation store\n");
+		exit(-1);
+	}
+	s.buf = (uint8 *)xmalloc(RELSTORE_BUF_SIZE * sizeof(uint8));
+
+	if (s.header.num_relations > 0)
+		relstore_seek(&s, 0);
+
+	for (i = 0; i < s.header.num_relations; i++) {
+
+		relation_t r;
+		uint32 factor_size = 0;
+		int32 status;
+		uint32 action = select(data, i);
+
+		if (action == READ_RELATION_STOP)
+			break;
+		if (action == READ_RELATION_SKIP)
+			continue;
+
+		r.rel_index = i;
+		r.factors = s.factors;
+		status = relstore_get(&s, i, &r, &factor_size,
+					compress, test_primality);
+		process(data, &r, factor_size, status);
+	}
+
+	relstore_free(&s);
+}
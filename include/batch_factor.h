@@ -87,6 +87,11 @@ typedef struct {
 
 	savefile_t *savefile;
 	print_relation_t print_relation;
+
+	uint32 num_threads;       /* threads that factor the batch */
+	struct threadpool *threadpool;
+	uint32 scaled_tree;       /* nonzero to use a scaled remainder 
+				     tree (nfs_args 'batch_scaled=1') */
 } relation_batch_t;
 
 /* initialize the relation batch. Batch factoring uses all
@@ -127,22 +127,39 @@ uint32 factor_list_add(msieve_obj *obj,
 #define HASH1(word) ((uint32)(word) * (uint32)(2654435761UL))
 #define HASH2(word) ((uint32)(word) * ((uint32)40499 * 65543))
 
-/* structure used by hashtables. Each entry indexed by the hashtable
-   has blob_words words, plus a 'next' pointer. Only the first 
-   hash_words words are inserted into the table and used for lookups */
+/* structure used by hashtables. Entries of blob_words words
+   each are stored contiguously, in the order they were added.
+   Only the first hash_words words are used for lookups.
+
+   The table itself uses open addressing with linear probing;
+   each slot holds the index of an entry in its low bits and 
+   a fingerprint of the entry's hash in the rest, so that most
+   mismatches are rejected without touching the entry. Slots
+   are 32 bits wide for small tables and 64 bits wide (with
+   HASHTABLE_INDEX_BITS bits of index) for huge ones. When the
+   table gets congested a table of twice the size is allocated,
+   and the contents of the old table migrate a few entries at 
+   a time during later lookups */
+
+#define HASHTABLE_INDEX_BITS 40
 
 typedef struct {
 	uint32 blob_words;
 	uint32 hash_words;
 
-	uint32 *hashtable;
+	void *hashtable;
 	uint32 log2_hashtable_size;
-	uint32 num_used;
-	uint32 congestion_target;
+	uint64 num_used;
+	uint64 congestion_target;
+
+	void *old_hashtable;		/* non-NULL while resizing */
+	uint32 log2_old_hashtable_size;
+	uint64 old_migrate_pos;
+	uint64 old_migrate_end;
 
 	uint32 *match_array;
-	uint32 match_array_size;
-	uint32 match_array_alloc;
+	uint64 match_array_size;
+	uint64 match_array_alloc;
 } hashtable_t;
 
 /* hash_words = 0 means hash_words = blob_words */
@@ -150,28 +167,25 @@ typedef struct {
 void hashtable_init(hashtable_t *h, 
 		    uint32 blob_words, uint32 hash_words);
 
+void hashtable_reset(hashtable_t *h);
 void hashtable_close(hashtable_t *h);
 void hashtable_free(hashtable_t *h);
 size_t hashtable_sizeof(hashtable_t *h);
 
-static INLINE void hashtable_reset(hashtable_t *h) {
-	h->match_array_size = 1;
-	h->num_used = 0;
-
-	memset(h->hashtable, 0, 
-		sizeof(uint32) << h->log2_hashtable_size);
+static INLINE uint32 hashtable_get_num(hashtable_t *h) {
+	return (uint32)(h->match_array_size - 1);
 }
 
-static INLINE uint32 hashtable_get_num(hashtable_t *h) {
+static INLINE uint64 hashtable_get_num64(hashtable_t *h) {
 	return h->match_array_size - 1;
 }
 
 static INLINE void *hashtable_get_first(hashtable_t *h) {
-	return h->match_array + h->blob_words + 1;
+	return h->match_array + h->blob_words;
 }
 
 static INLINE void *hashtable_get_next(hashtable_t *h, void *prev) {
-	return (uint32 *)prev + h->blob_words + 1;
+	return (uint32 *)prev + h->blob_words;
 }
 
 static INLINE uint32 hash_function(uint32 *data, uint32 num_words) {
@@ -201,12 +215,17 @@ static INLINE uint32 hash_function(uint32 *data, uint32 num_words) {
    hashtable. Return a pointer to the entry in the hashtable
    that matches blob[]. blob[] is assigned a counter value
    that starts from zero, and the counter for the entry
-   matching blob[] is output in *ordinal_id (if non-NULL) */
-
+   matching blob[] is output in *ordinal_id (if non-NULL).
+   hashtable_find is fatal if the table grows to more than 
+   2^32 entries; hashtable_find64 is the same, for tables 
+   that may hold more entries than that */
 
 void *hashtable_find(hashtable_t *h, void *blob, 
 		uint32 *ordinal_id, uint32 *present);
 
+void *hashtable_find64(hashtable_t *h, void *blob, 
+		uint64 *ordinal_id, uint32 *present);
+
 /*--------------DECLARATIONS FOR FACTORING METHODS -----------------*/
 
 /* perform trial factoring on an integer.
@@ -253,6 +272,12 @@ uint32 tinyqs(mp_t *n, mp_t *factor1, mp_t *factor2);
 
 uint32 factor_mpqs(msieve_obj *obj, mp_t *n, factor_list_t *factor_list);
 
+/* Fill prime_list with the primes factor_mpqs needs for inputs
+   of up to max_bits bits. Callers that factor many inputs can
+   build this once and point obj->qs_primes at it */
+
+void qs_fill_prime_list(prime_list_t *prime_list, uint32 max_bits);
+
 /* Factor a number using GNFS. Returns
    1 if any factors were found and 0 if not */
 
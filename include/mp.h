@@ -511,6 +511,14 @@ int32 mp_is_prime_1(uint32 p);
 void mp_random_prime(uint32 bits, mp_t *res, uint32 *seed1, uint32 *seed2);
 uint32 mp_next_prime(mp_t *p, mp_t *res, uint32 *seed1, uint32 *seed2);
 
+	/* callers that run mp_is_prime from several threads at
+	   once must call mp_aprcl_lock_init before starting the
+	   threads and mp_aprcl_lock_free after they are done. 
+	   The calls nest, and must not race with each other */
+
+void mp_aprcl_lock_init(void);
+void mp_aprcl_lock_free(void);
+
 
 	/* Modular addition/subtraction: compute a +- b mod p
 	   Note that the asm below has to be quite tricky to
@@ -157,6 +157,11 @@ typedef struct {
 	char *mp_sprintf_buf;    /* scratch space for printing big integers */
 
 	const char *nfs_args;   /* arguments for NFS */
+
+	const uint32 *qs_primes;  /* if not NULL, the first num_qs_primes
+				     primes, which the quadratic sieve
+				     uses instead of building its own list */
+	uint32 num_qs_primes;
 } msieve_obj;
 
 msieve_obj * msieve_obj_new(char *input_integer,
@@ -177,6 +182,67 @@ msieve_obj * msieve_obj_new(char *input_integer,
 msieve_obj * msieve_obj_free(msieve_obj *obj);
 
 void msieve_run(msieve_obj *obj);
+
+/* Batch factoring of many independent, usually small,
+   inputs. A batch owns num_threads worker threads, each of
+   which keeps one msieve_obj for its whole life and factors 
+   one input at a time, so that the per-factorization setup
+   is paid once per thread instead of once per input; tables
+   that do not depend on the input are built once and shared
+   by all the workers.
+
+   Inputs are queued with msieve_batch_add, which blocks if
+   the workers have fallen far enough behind. As each input
+   finishes the callback gets the id it was added with, the
+   input string and the list of factors found, along with
+   the flags of the worker's msieve_obj at that point (a
+   factorization that was interrupted does not have
+   MSIEVE_FLAG_FACTORIZATION_DONE set). Results arrive in 
+   the order the inputs finish, not the order they were added, 
+   but only one callback runs at a time. The factor list
+   belongs to the library and is freed once the callback
+   returns.
+
+   Each worker uses its own savefile, named after savefile_name 
+   with the worker number appended; these are deleted when the 
+   batch is freed. Inputs large enough to need the number field
+   sieve should not be factored this way */
+
+typedef void (*msieve_batch_callback)(void *user_data, 
+				uint32 id, const char *input,
+				msieve_factor *factors,
+				uint32 flags);
+
+typedef struct msieve_batch msieve_batch;
+
+msieve_batch * msieve_batch_new(uint32 flags,
+				char *savefile_name,
+				char *logfile_name,
+				uint32 seed1,
+				uint32 seed2,
+				enum cpu_type cpu,
+				uint32 cache_size1,
+				uint32 cache_size2,
+				uint32 num_threads,
+				msieve_batch_callback callback,
+				void *user_data);
+
+void msieve_batch_add(msieve_batch *batch, uint32 id, 
+			const char *input);
+
+/* wait until every input added so far has been factored */
+
+void msieve_batch_wait(msieve_batch *batch);
+
+/* stop the factorizations in progress as soon as it is 
+   safe, and skip the inputs still queued (the callback is
+   not called for them). Safe to call from a signal handler */
+
+void msieve_batch_stop(msieve_batch *batch);
+
+/* waits for the queued inputs to finish first */
+
+msieve_batch * msieve_batch_free(msieve_batch *batch);
 				
 #define MSIEVE_DEFAULT_LOGFILE "msieve.log"
 #define MSIEVE_DEFAULT_SAVEFILE "msieve.dat"
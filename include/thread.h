@@ -66,6 +66,24 @@ static INLINE void mutex_unlock(mutex_t *m)
 #endif
 }
 
+/* atomic operations ----------------------------------------------*/
+
+/* if *p equals old_val then replace it with new_val,
+   as a single atomic operation. Returns the previous
+   contents of *p, so the swap succeeded if that matches
+   old_val */
+
+static INLINE uint32 atomic_cas32(volatile uint32 *p,
+				uint32 old_val, uint32 new_val)
+{
+#if defined(WIN32) || defined(_WIN64)
+	return (uint32)InterlockedCompareExchange((volatile LONG *)p,
+					(LONG)new_val, (LONG)old_val);
+#else
+	return __sync_val_compare_and_swap(p, old_val, new_val);
+#endif
+}
+
 /* a thread pool --------------------------------------------------*/
 
 typedef void (*init_func)(void *data, int thread_num);
@@ -95,10 +113,34 @@ int threadpool_add_task(struct threadpool *pool,
 
 void threadpool_free(struct threadpool *pool);
 
+/* queue a task that only the pool thread numbered 
+   thread_num will run; useful when the data for the 
+   task is in memory close to that thread */
+
+int threadpool_add_task_to(struct threadpool *pool, 
+			task_control_t *t, 
+			int thread_num,
+			int blocking);
+
 /* returns zero if no pending tasks */
 int threadpool_drain(struct threadpool *pool,
 			int blocking);
 
+/* processor affinity ---------------------------------------------*/
+
+/* fill cpus[] with the logical CPUs this process is 
+   allowed to run on and nodes[] with the NUMA node of
+   each. Returns the number of CPUs, or 0 if this cannot
+   be determined. Without NUMA support every CPU is 
+   reported as being on node 0 */
+
+uint32 get_cpu_topology(uint32 *cpus, uint32 *nodes, uint32 max_cpus);
+
+/* restrict the calling thread to the given list of 
+   logical CPUs. Returns zero on success */
+
+int thread_bind_cpus(uint32 *cpus, uint32 num_cpus);
+
 
 #ifdef __cplusplus
 }
@@ -28,6 +28,7 @@ $Id$
 	#include <errno.h>
 	#include <pthread.h>
 	#include <sys/resource.h>
+	#include <sys/mman.h>
 	#include <float.h>
 	#include <dlfcn.h>
 #endif
@@ -195,6 +196,34 @@ void set_idle_priority(void);
 uint64 get_file_size(char *name);
 uint64 get_ram_size(void);
 
+/* read-only memory mapping of a whole file. map_file returns
+   zero on success; a zero-length file maps to data = NULL. 
+   map_file_advise passes paging hints for part of the mapping
+   to the OS, and is a no-op where that isn't supported */
+
+typedef struct {
+	uint8 *data;
+	uint64 size;
+#if defined(WIN32) || defined(_WIN64)
+	HANDLE file;
+	HANDLE mapping;
+#else
+	int fd;
+#endif
+} mapped_file_t;
+
+enum map_advice {
+	MAP_ADVICE_NORMAL,
+	MAP_ADVICE_SEQUENTIAL,
+	MAP_ADVICE_WILLNEED,
+	MAP_ADVICE_DONTNEED
+};
+
+uint32 map_file(mapped_file_t *m, char *name);
+void unmap_file(mapped_file_t *m);
+void map_file_advise(mapped_file_t *m, uint64 offset, 
+			uint64 size, enum map_advice advice);
+
 libhandle_t load_dynamic_lib(const char *libname);
 void unload_dynamic_lib(libhandle_t h);
 void * get_lib_symbol(libhandle_t h, const char *symbol_name);
@@ -247,6 +276,18 @@ enum cpu_type {
 void get_cache_sizes(uint32 *level1_cache, uint32 *level2_cache);
 enum cpu_type get_cpu_type(void);
 
+/* SIMD instruction sets that both the CPU and the OS
+   support, returned by get_cpu_simd() as a bitfield.
+   Unlike the CPU_* defines below, these are detected 
+   at runtime so a binary built for a generic target 
+   can still choose faster code paths */
+
+#define CPU_SIMD_SSE2	0x01
+#define CPU_SIMD_AVX2	0x02
+#define CPU_SIMD_AVX512	0x04	/* AVX512F plus AVX512BW */
+
+uint32 get_cpu_simd(void);
+
 /* CPU-specific capabilities */
 
 /* assume for all CPUs, even non-x86 CPUs. These guard
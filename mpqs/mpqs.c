@@ -58,7 +58,7 @@ static uint8 choose_multiplier(mp_t *n,
 uint32 factor_mpqs(msieve_obj *obj, mp_t *n, 
 			factor_list_t *factor_list) {
 
-	uint32 bits, fb_size;
+	uint32 bits, fb_size, num_primes;
 	prime_list_t prime_list;
 	fb_t *factor_base;
 	uint32 *modsqrt_array;
@@ -83,15 +83,25 @@ uint32 factor_mpqs(msieve_obj *obj, mp_t *n,
 	logprintf(obj, "commencing quadratic sieve (%u-digit input)\n",
 			strlen(mp_sprintf(n, 10, obj->mp_sprintf_buf)));
 
-	/* Make a prime list, use it to build a factor base */
+	/* Make a prime list, use it to build a factor base. 
+	   If the caller has a long enough list already, 
+	   use a prefix of that */
 
-	fill_prime_list(&prime_list, 2 * params.fb_size + 100, MAX_FB_PRIME);
+	num_primes = 2 * params.fb_size + 100;
+	if (obj->qs_primes != NULL && obj->num_qs_primes >= num_primes) {
+		prime_list.list = (uint32 *)obj->qs_primes;
+		prime_list.num_primes = num_primes;
+	}
+	else {
+		fill_prime_list(&prime_list, num_primes, MAX_FB_PRIME);
+	}
 	build_factor_base(n, &prime_list, &factor_base, 
 				&modsqrt_array, &params.fb_size, 
 				&multiplier);
 	fb_size = params.fb_size;
 	logprintf(obj, "using multiplier of %u\n", multiplier);
-	free(prime_list.list);
+	if (prime_list.list != obj->qs_primes)
+		free(prime_list.list);
 	
 	/* Proceed with the algorithm */
 
@@ -128,6 +138,16 @@ uint32 factor_mpqs(msieve_obj *obj, mp_t *n,
 	return factor_found;
 }
 
+/*--------------------------------------------------------------------*/
+void qs_fill_prime_list(prime_list_t *prime_list, uint32 max_bits) {
+
+	sieve_param_t params;
+
+	get_sieve_params(max_bits, &params);
+	fill_prime_list(prime_list, 2 * MAX(params.fb_size, 100) + 100, 
+				MAX_FB_PRIME);
+}
+
 /*--------------------------------------------------------------------*/
 
 /* Implementation of the modified Knuth-Schroeppel multiplier
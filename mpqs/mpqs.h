@@ -62,6 +62,33 @@ typedef struct {
 	uint32 next_loc2;	/*	the above two roots */
 } packed_fb_t;
 
+/* The factor base primes that trial factoring tests with 
+   a 32-bit reciprocal, stored one field per array so that
+   SIMD code can test many primes at once. The roots are 
+   copied from the factor base for every polynomial */
+
+typedef struct {
+	uint32 *prime;
+	uint32 *recip;
+	uint32 *rcorrect;
+	uint32 *root1;
+	uint32 *root2;
+} tf_primes_t;
+
+/* SIMD versions of the scan of a sieve block for values
+   worth trial factoring, and of the test for which of the
+   factor base primes from start to end-1 divide the sieve
+   value at tf_offset (or have no roots, and need testing
+   the slow way). Both write offsets in ascending order to
+   hits[] and return how many there are */
+
+typedef uint32 (*qs_scan_fcn)(uint8 *sieve_array, uint32 size,
+				uint32 cutoff1, uint16 *hits);
+
+typedef uint32 (*qs_tf_fcn)(tf_primes_t *primes, uint32 start,
+				uint32 end, uint32 tf_offset, 
+				uint32 *hits);
+
 /* Offset 0 in the array of factor base primes is reserved
    for the "prime" -1. This allows the sieve to be over both
    positive and negative values. When actually dividing by
@@ -176,6 +203,11 @@ typedef struct {
 	uint32 tf_med_recip2_cutoff;
 	uint32 tf_large_cutoff;
 
+	qs_scan_fcn scan_simd;    /* SIMD versions of the sieve scan and */
+	qs_tf_fcn tf_simd;        /* trial factoring, or NULL */
+	tf_primes_t tf_primes;
+	uint32 *tf_hits;
+
 	bucket_t *buckets;  /* hash bins for sieve values */
 	uint32 cutoff1;          /* if log2(sieve value) exceeds this number,
 				    a little trial division is performed */
@@ -226,6 +258,14 @@ typedef struct {
 	uint32 components;         /* connected components (see relation.c) */
 	uint32 vertices;           /* vertices in graph (see relation.c) */
 
+	/* bookkeeping information for multithreaded sieving */
+
+	uint32 seed1, seed2;       /* random number state for choosing 'a' */
+	char *out_buf;             /* if not NULL, savefile output is saved
+				      here until the main thread writes it */
+	uint32 out_buf_size;
+	uint32 out_buf_alloc;
+
 } sieve_conf_t;
 
 /* attempt to trial factor one sieve value */
@@ -239,6 +279,14 @@ uint32 check_sieve_val(sieve_conf_t *conf,
 		      uint32 poly_index,
 		      bucket_t *hash_bucket);
 
+/* choose the SIMD routines for conf, if the CPU has any
+   that are usable, and allocate their scratch space. Returns
+   the name of the instruction set, or NULL if none */
+
+const char * qs_simd_init(sieve_conf_t *conf);
+
+void qs_simd_free(sieve_conf_t *conf);
+
 /* the core of the sieving code */
 
 typedef uint32 (*qs_core_sieve_fcn)(sieve_conf_t *conf,
@@ -253,6 +301,15 @@ typedef uint32 (*qs_core_sieve_fcn)(sieve_conf_t *conf,
 DECLARE_SIEVE_FCN(qs_core_sieve_generic_32k);
 DECLARE_SIEVE_FCN(qs_core_sieve_generic_64k);
 
+/* the generic cores, but switching polynomials with AVX2
+   when the CPU has it */
+
+#if (defined(__x86_64__) || defined(_M_X64)) && defined(__GNUC__)
+	#define HAS_AVX2_SIEVE_CORE
+	DECLARE_SIEVE_FCN(qs_core_sieve_avx2_32k);
+	DECLARE_SIEVE_FCN(qs_core_sieve_avx2_64k);
+#endif
+
 #if defined(_MSC_VER) && (_MSC_VER >= 1400)
 	#define HAS_MSVC_SIEVE_CORE
 	DECLARE_SIEVE_FCN(qs_core_sieve_vc8_32k);
@@ -302,6 +359,11 @@ void add_to_cycles(sieve_conf_t *conf,
 			uint32 large_prime1, 
 			uint32 large_prime2);
 
+/* send one line of output to the savefile, or to the
+   output buffer of the sieving thread */
+
+void save_sieve_line(sieve_conf_t *conf, char *buf);
+
 /* encapsulate all of the information conerning a sieve
    relation and dump it to the savefile */
 
@@ -324,6 +386,11 @@ void qs_filter_relations(sieve_conf_t *conf);
 void poly_init(sieve_conf_t *conf, uint32 sieve_size);
 void poly_free(sieve_conf_t *conf);
 
+/* allocate the polynomial scratch data for a sieve_conf_t
+   that is a copy of one already passed to poly_init */
+
+void poly_alloc_scratch(sieve_conf_t *conf);
+
 /* compute a random polynomial 'a' value, and also
    compute all of the 'b' values, all of the precomputed
    quantities for the 'b' values, and all of the initial
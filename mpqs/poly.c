@@ -23,7 +23,6 @@ void poly_init(sieve_conf_t *conf, uint32 sieve_size) {
 	uint32 i, j;
 	uint32 start_bits;
 	uint32 num_factors, rem;
-	uint32 num_derived_poly;
 	mp_t t0, t1;
 	msieve_obj *obj = conf->obj;
 
@@ -208,9 +207,17 @@ void poly_init(sieve_conf_t *conf, uint32 sieve_size) {
 		}
 	}
 
-	/* allocate scratch structures */
+	poly_alloc_scratch(conf);
+	logprintf(obj, "polynomial 'A' values have %u factors\n", num_factors);
+}
+
+/*--------------------------------------------------------------------*/
+void poly_alloc_scratch(sieve_conf_t *conf) {
+
+	uint32 i;
+	uint32 num_factors = conf->num_poly_factors;
+	uint32 num_derived_poly = 1 << (num_factors - 1);
 
-	num_derived_poly = 1 << (num_factors - 1);
 	conf->next_poly_action = (uint8 *)xmalloc(num_derived_poly * 
 						sizeof(uint8));
 	conf->curr_b = (signed_mp_t *)xmalloc(num_derived_poly * 
@@ -227,7 +234,6 @@ void poly_init(sieve_conf_t *conf, uint32 sieve_size) {
 				num_factors * sizeof(uint32) *
 				(conf->fb_size - conf->sieve_large_fb_start));
 	}
-	logprintf(obj, "polynomial 'A' values have %u factors\n", num_factors);
 }
 
 /*--------------------------------------------------------------------*/
@@ -331,7 +337,6 @@ void build_base_poly(sieve_conf_t *conf) {
 	/* Build the next MPQS polynomial and prepare the
 	   factor base for using it */
 
-	msieve_obj *obj = conf->obj;
 	char buf[256];
 	uint32 i, j, k;
 	mp_t *a = &conf->curr_a;
@@ -366,7 +371,7 @@ void build_base_poly(sieve_conf_t *conf) {
 		uint32 range = factor_bounds[bits+1] - factor_bounds[bits];
 
 		poly_factors[i] = factor_bounds[bits] + 
-				get_rand(&obj->seed1, &obj->seed2) % range;
+				get_rand(&conf->seed1, &conf->seed2) % range;
 
 		for (j = 0; j < i; j++) {
 			if (poly_factors[j] == poly_factors[i])
@@ -528,7 +533,7 @@ void build_base_poly(sieve_conf_t *conf) {
 	for (j = 0; j < conf->num_poly_factors; j++)
 		i += sprintf(buf + i, " %x", conf->poly_factors[j]);
 	i += sprintf(buf + i, "\n");
-	savefile_write_line(&obj->savefile, buf);
+	save_sieve_line(conf, buf);
 }
 
 /*--------------------------------------------------------------------*/
@@ -95,6 +95,26 @@ static uint32 purge_duplicate_relations(msieve_obj *obj,
 	return j;
 }
 
+/*--------------------------------------------------------------------*/
+void save_sieve_line(sieve_conf_t *conf, char *buf) {
+
+	uint32 size;
+
+	if (conf->out_buf == NULL) {
+		savefile_write_line(&conf->obj->savefile, buf);
+		return;
+	}
+
+	size = strlen(buf);
+	if (conf->out_buf_size + size + 1 > conf->out_buf_alloc) {
+		conf->out_buf_alloc = 2 * (conf->out_buf_size + size + 1);
+		conf->out_buf = (char *)xrealloc(conf->out_buf,
+						conf->out_buf_alloc);
+	}
+	memcpy(conf->out_buf + conf->out_buf_size, buf, size + 1);
+	conf->out_buf_size += size;
+}
+
 /*--------------------------------------------------------------------*/
 void save_relation(sieve_conf_t *conf, uint32 sieve_offset,
 		uint32 *fb_offsets, uint32 num_factors, 
@@ -134,7 +154,14 @@ void save_relation(sieve_conf_t *conf, uint32 sieve_offset,
 	else
 		i += sprintf(buf + i, "L %x %x\n", large_prime2, large_prime1);
 
-	savefile_write_line(&conf->obj->savefile, buf);
+	save_sieve_line(conf, buf);
+
+	/* a sieving thread leaves the bookkeeping below to
+	   the main thread, which does it when the relation
+	   is actually written out */
+
+	if (conf->out_buf != NULL)
+		return;
 
 	/* for partial relations, also update the bookeeping for
 	   tracking the number of fundamental cycles */
@@ -13,15 +13,40 @@ $Id$
 --------------------------------------------------------------------*/
 
 #include <common.h>
+#include <thread.h>
 #include "mpqs.h"
 
+/* With more than one thread, each thread sieves with its
+   own 'a' value, using its own copy of the sieve_conf_t
+   and of all the scratch data that goes with it (the
+   factor base roots change with every polynomial). The
+   savefile output of each thread is buffered, and after
+   each round of 'a' values the main thread writes it out
+   and updates the relation counts and the cycle-counting
+   graph. Inputs smaller than this many factor base primes
+   sieve too quickly for the threads to be worthwhile */
+
+#define MIN_FB_SIZE_THREADS 2000
+
+typedef struct {
+	sieve_conf_t *conf;
+	qs_core_sieve_fcn core_sieve_fcn;
+	uint32 relations_found;
+} sieve_thread_t;
+
+typedef struct {
+	uint32 num_threads;
+	sieve_thread_t *threads; /* the last one uses the main conf */
+	struct threadpool *threadpool;
+} sieve_threads_t;
+
 static void collect_relations(sieve_conf_t *conf,
 			      uint32 target_relations,
-			      qs_core_sieve_fcn core_sieve_fcn);
+			      sieve_threads_t *t);
 
 static uint32 do_sieving_internal(sieve_conf_t *conf,
 				  uint32 max_relations,
-				  qs_core_sieve_fcn core_sieve_fcn);
+				  sieve_threads_t *t);
 
 #ifdef SIEVE_TIMING
 #define PRINT_TIME(var) printf(#var ": %lf (%4.1f%%)\n",		\
@@ -45,6 +70,139 @@ uint64 tf_large_time;
 #define PRINT_TIME(var) /* nothing */
 #endif
 
+/*--------------------------------------------------------------------*/
+static void alloc_buckets(sieve_conf_t *conf) {
+
+	uint32 i;
+	uint32 num_buckets = conf->poly_block * conf->num_sieve_blocks;
+
+	conf->buckets = (bucket_t *)xcalloc((size_t)num_buckets, 
+						sizeof(bucket_t));
+	if (conf->fb_size > conf->sieve_large_fb_start) {
+		for (i = 0; i < num_buckets; i++) {
+			conf->buckets[i].num_alloc = 1000;
+			conf->buckets[i].list = (bucket_entry_t *)
+					xmalloc(1000 * sizeof(bucket_entry_t));
+		}
+	}
+}
+
+/*--------------------------------------------------------------------*/
+static void free_buckets(sieve_conf_t *conf) {
+
+	uint32 i;
+
+	for (i = 0; i < conf->poly_block * conf->num_sieve_blocks; i++)
+		free(conf->buckets[i].list);
+	free(conf->buckets);
+}
+
+/*--------------------------------------------------------------------*/
+static sieve_conf_t * sieve_conf_copy(sieve_conf_t *conf) {
+
+	/* make a copy of conf that a sieving thread can
+	   use without interfering with anyone else */
+
+	sieve_conf_t *c = (sieve_conf_t *)xmalloc(sizeof(sieve_conf_t));
+
+	memcpy(c, conf, sizeof(sieve_conf_t));
+
+	c->factor_base = (fb_t *)xmalloc(conf->fb_size * sizeof(fb_t));
+	memcpy(c->factor_base, conf->factor_base, 
+			conf->fb_size * sizeof(fb_t));
+	c->packed_fb = (packed_fb_t *)xmalloc(conf->sieve_large_fb_start *
+						sizeof(packed_fb_t));
+	qs_simd_init(c);
+	c->sieve_array = (uint8 *)aligned_malloc(
+					(size_t)conf->sieve_block_size, 64);
+	alloc_buckets(c);
+	poly_alloc_scratch(c);
+
+	/* the copy does not track relations or cycles */
+
+	c->relation_list = NULL;
+	c->cycle_list = NULL;
+	c->cycle_table = NULL;
+	c->cycle_hashtable = NULL;
+
+	c->seed1 = get_rand(&conf->seed1, &conf->seed2);
+	c->seed2 = get_rand(&conf->seed1, &conf->seed2);
+
+	c->out_buf_size = 0;
+	c->out_buf_alloc = 10000;
+	c->out_buf = (char *)xmalloc(c->out_buf_alloc);
+	return c;
+}
+
+/*--------------------------------------------------------------------*/
+static void sieve_conf_free(sieve_conf_t *c) {
+
+	poly_free(c);
+	free_buckets(c);
+	aligned_free(c->sieve_array);
+	free(c->packed_fb);
+	qs_simd_free(c);
+	free(c->factor_base);
+	free(c->out_buf);
+	free(c);
+}
+
+/*--------------------------------------------------------------------*/
+typedef struct {
+	uint32 block_size;	/* sieve block size in bytes */
+	uint32 simd;		/* CPU_SIMD_* flags the core needs */
+	qs_core_sieve_fcn fcn;
+	const char *name;
+} sieve_core_t;
+
+/* the available sieve cores, best first for each block size */
+
+static const sieve_core_t sieve_cores[] = {
+#if defined(HAS_MSVC_SIEVE_CORE)
+	{ 32768, 0, qs_core_sieve_vc8_32k, "VC8 32kb" },
+	{ 65536, 0, qs_core_sieve_vc8_64k, "VC8 64kb" },
+#else
+#if defined(HAS_AVX2_SIEVE_CORE)
+	{ 32768, CPU_SIMD_AVX2, qs_core_sieve_avx2_32k, "AVX2 32kb" },
+	{ 65536, CPU_SIMD_AVX2, qs_core_sieve_avx2_64k, "AVX2 64kb" },
+#endif
+	{ 32768, 0, qs_core_sieve_generic_32k, "generic 32kb" },
+	{ 65536, 0, qs_core_sieve_generic_64k, "generic 64kb" },
+#endif
+};
+
+static const sieve_core_t * choose_sieve_core(msieve_obj *obj) {
+
+	uint32 i;
+	uint32 block_size;
+	uint32 simd = get_cpu_simd();
+
+	/* decide on the size of one sieve block. If the L1
+	   cache size is 32kB then this is also the sieve block
+	   size, otherwise it is 64kB. The latter rule is needed
+	   because Pentium 4 CPUs have very small L1 sizes, and
+	   are designed to work out of L2 cache most of the
+	   time anyway. CPUs with a 48kB L1 also do better with
+	   64kB blocks: their L2 is fast enough to back up the
+	   sieve block, and more of the factor base then gets
+	   sieved directly instead of going through hashtables */
+
+	if (obj->cache_size1 == 32768)
+		block_size = 32768;
+	else
+		block_size = 65536;
+
+	for (i = 0; i < sizeof(sieve_cores) / sizeof(sieve_core_t); i++) {
+		const sieve_core_t *core = sieve_cores + i;
+
+		if (core->block_size == block_size &&
+		    (core->simd & simd) == core->simd)
+			return core;
+	}
+
+	return NULL; /* not reached */
+}
+
 /*--------------------------------------------------------------------*/
 void do_sieving(msieve_obj *obj, mp_t *n, 
 		mp_t **poly_a_list, poly_t **poly_list,
@@ -54,6 +212,8 @@ void do_sieving(msieve_obj *obj, mp_t *n,
 		la_col_t **cycle_list, uint32 *num_cycles) {
 
 	sieve_conf_t conf;
+	sieve_threads_t threads;
+	thread_control_t control;
 	uint32 bound;
 	uint32 i;
 	uint32 bits;
@@ -64,6 +224,7 @@ void do_sieving(msieve_obj *obj, mp_t *n,
 	uint32 max_relations, relations_found;
 	uint32 sieve_block_size;
 	uint32 recip_cutoff;
+	const sieve_core_t *core;
 	qs_core_sieve_fcn core_sieve_fcn;
 
 	/* fill in initial sieve parameters */
@@ -75,44 +236,19 @@ void do_sieving(msieve_obj *obj, mp_t *n,
 	conf.factor_base = factor_base;
 	conf.modsqrt_array = modsqrt_array;
 	conf.fb_size = params->fb_size;
+	conf.seed1 = obj->seed1;
+	conf.seed2 = obj->seed2;
 	bits = mp_bits(conf.n);
 
-	/* decide on the size of one sieve block. If the L1
-	   cache size is 32kB then this is also the sieve block
-	   size, otherwise it is 64kB. The latter rule is needed
-	   because Pentium 4 CPUs have very small L1 sizes, and
-	   are designed to work out of L2 cache most of the
-	   time anyway */
+	/* decide on the size of one sieve block and the core
+	   sieving routine to use */
 
-	if (obj->cache_size1 == 32768)
-		conf.sieve_block_size = sieve_block_size = 32768;
-	else 
-		conf.sieve_block_size = sieve_block_size = 65536;
+	core = choose_sieve_core(obj);
+	core_sieve_fcn = core->fcn;
+	conf.sieve_block_size = sieve_block_size = core->block_size;
 	conf.sieve_array = (uint8 *)aligned_malloc(
 					(size_t)sieve_block_size, 64);
-
-	/* decide on the core sieving routine to use */
-
-	core_sieve_fcn = NULL;
-#if defined(HAS_MSVC_SIEVE_CORE)
-	if (sieve_block_size == 32768) {
-		logprintf(obj, "using VC8 32kb sieve core\n");
-		core_sieve_fcn = qs_core_sieve_vc8_32k;
-	}
-	else {
-		logprintf(obj, "using VC8 64kb sieve core\n");
-		core_sieve_fcn = qs_core_sieve_vc8_64k;
-	}
-#else
-	if (sieve_block_size == 32768) {
-		logprintf(obj, "using generic 32kb sieve core\n");
-		core_sieve_fcn = qs_core_sieve_generic_32k;
-	}
-	else {
-		logprintf(obj, "using generic 64kb sieve core\n");
-		core_sieve_fcn = qs_core_sieve_generic_64k;
-	}
-#endif
+	logprintf(obj, "using %s sieve core\n", core->name);
 
 	/* round the size of the sieve interval (positive plus
 	   negative parts combined) up to an integral number 
@@ -272,6 +408,15 @@ void do_sieving(msieve_obj *obj, mp_t *n,
 	conf.sieve_large_fb_start = i;
 	conf.packed_fb = (packed_fb_t *)xmalloc(i * sizeof(packed_fb_t));
 
+	/* use vector instructions for scanning and trial
+	   factoring if the CPU has them */
+
+	{
+		const char *simd_name = qs_simd_init(&conf);
+		if (simd_name != NULL)
+			logprintf(obj, "using %s sieve scanning\n", simd_name);
+	}
+
 	/* The sieve code is optimized for sieving intervals that are
 	   extremely small. To reduce the overhead of using a large
 	   factor base, cache blocking is used for the sieve interval
@@ -386,20 +531,11 @@ void do_sieving(msieve_obj *obj, mp_t *n,
 	   size down; that's okay, very small sieve intervals are
 	   actually more likely to contain smooth relations */
 
-	conf.buckets = (bucket_t *)xcalloc((size_t)(conf.poly_block *
-							num_sieve_blocks), 
-							sizeof(bucket_t));
-	if (fb_size > conf.sieve_large_fb_start) {
-		for (i = 0; i < conf.poly_block * num_sieve_blocks; i++) {
-			conf.buckets[i].num_alloc = 1000;
-			conf.buckets[i].list = (bucket_entry_t *)
-					xmalloc(1000 * sizeof(bucket_entry_t));
-		}
-	}
+	conf.num_sieve_blocks = num_sieve_blocks;
+	alloc_buckets(&conf);
 
 	/* fill in miscellaneous parameters */
 
-	conf.num_sieve_blocks = num_sieve_blocks;
 	conf.large_prime_max = bound;
 
 	/* initialize the polynomial generation code. Note that
@@ -423,6 +559,35 @@ void do_sieving(msieve_obj *obj, mp_t *n,
 							sizeof(cycle_t));
 	}
 
+	/* set up the sieving threads; the main thread
+	   is the last one */
+
+	threads.num_threads = 1;
+	if (fb_size >= MIN_FB_SIZE_THREADS)
+		threads.num_threads = MAX(obj->num_threads, 1);
+
+	threads.threads = (sieve_thread_t *)xmalloc(threads.num_threads *
+						sizeof(sieve_thread_t));
+	for (i = 0; i < threads.num_threads - 1; i++)
+		threads.threads[i].conf = sieve_conf_copy(&conf);
+	threads.threads[i].conf = &conf;
+	for (i = 0; i < threads.num_threads; i++)
+		threads.threads[i].core_sieve_fcn = core_sieve_fcn;
+
+	threads.threadpool = NULL;
+	if (threads.num_threads > 1) {
+		logprintf(obj, "sieving with %u threads\n", 
+				threads.num_threads);
+
+		conf.out_buf_alloc = 10000;
+		conf.out_buf = (char *)xmalloc(conf.out_buf_alloc);
+
+		memset(&control, 0, sizeof(control));
+		threads.threadpool = threadpool_init(
+					threads.num_threads - 1, 
+					threads.num_threads, &control);
+	}
+
 	/* stop when this many relations are found */
 
 	max_relations = obj->max_relations;
@@ -436,7 +601,7 @@ void do_sieving(msieve_obj *obj, mp_t *n,
 
 	TIME1(total_time)
 	relations_found = do_sieving_internal(&conf, max_relations,
-						core_sieve_fcn);
+						&threads);
 	TIME2(total_time)
 
 	PRINT_TIME(total_time);
@@ -461,11 +626,19 @@ void do_sieving(msieve_obj *obj, mp_t *n,
 	savefile_close(&obj->savefile);
 	obj->flags &= ~MSIEVE_FLAG_SIEVING_IN_PROGRESS;
 
-	for (i = 0; i < conf.poly_block * num_sieve_blocks; i++) {
-		free(conf.buckets[i].list);
-	}
-	free(conf.buckets);
+	if (threads.num_threads > 1)
+		threadpool_free(threads.threadpool);
+	for (i = 0; i < threads.num_threads - 1; i++)
+		sieve_conf_free(threads.threads[i].conf);
+	free(threads.threads);
+	free(conf.out_buf);
+	conf.out_buf = NULL;
+	obj->seed1 = conf.seed1;
+	obj->seed2 = conf.seed2;
+
+	free_buckets(&conf);
 	free(conf.packed_fb);
+	qs_simd_free(&conf);
 	aligned_free(conf.sieve_array);
 
 	/* if enough relations are available, do the postprocessing
@@ -497,7 +670,7 @@ void do_sieving(msieve_obj *obj, mp_t *n,
 /*--------------------------------------------------------------------*/
 static uint32 do_sieving_internal(sieve_conf_t *conf, 
 				uint32 max_relations,
-				qs_core_sieve_fcn core_sieve_fcn) {
+				sieve_threads_t *t) {
 
 	uint32 num_relations = 0;
 	uint32 update;
@@ -609,7 +782,7 @@ static uint32 do_sieving_internal(sieve_conf_t *conf,
 	while (!(obj->flags & MSIEVE_FLAG_STOP_SIEVING) && 
 		num_relations < max_relations) {
 
-		collect_relations(conf, update, core_sieve_fcn);
+		collect_relations(conf, update, t);
 
 		num_relations = conf->num_relations + 
 				conf->num_cycles +
@@ -643,58 +816,186 @@ static uint32 do_sieving_internal(sieve_conf_t *conf,
 	return num_relations;
 }
 
+/*--------------------------------------------------------------------*/
+static uint32 sieve_poly_a(sieve_conf_t *conf, 
+			qs_core_sieve_fcn core_sieve_fcn) {
+
+	/* choose the next polynomial 'a' value and sieve with
+	   all of the polynomials that use it */
+
+	uint32 i;
+	uint32 relations_found = 0;
+	uint32 num_poly = 1 << (conf->num_poly_factors - 1);
+	uint32 poly_block = MIN(num_poly, conf->poly_block);
+
+	/* build the next batch of polynomials. For
+	   big factorizations there may be thousands
+	   of them */
+
+	TIME1(base_poly_time)
+	build_base_poly(conf);
+	TIME2(base_poly_time)
+
+	/* Do the sieving for all polynomials, handling
+	   batches of polynomials at a time. */
+
+	i = 0;
+	while (i < num_poly) {
+		uint32 curr_num_poly = MIN(poly_block, num_poly - i);
+
+		relations_found += core_sieve_fcn(conf, i, curr_num_poly);
+		i += curr_num_poly;
+
+		/* see if anybody wants sieving to stop. If num_poly
+    		   is small we bail out after sieving for the entire 
+		   current batch of polynomials has finished. If
+		   num_poly is large we wait until a significant
+		   number of polynomials have been sieved. Basically
+		   you're entitled to a big pile of polynomials
+		   whenever the loop runs, and you should get your
+		   money's worth without having to wait a really
+		   long time to finish up */
+
+		if ((conf->obj->flags & MSIEVE_FLAG_STOP_SIEVING) &&
+		    num_poly > 1024 && i > 2000) {
+			break;
+		}
+	}
+
+	return relations_found;
+}
+
+/*--------------------------------------------------------------------*/
+static void sieve_thread_run(void *data, int thread_num) {
+
+	sieve_thread_t *t = (sieve_thread_t *)data;
+
+	t->relations_found = sieve_poly_a(t->conf, t->core_sieve_fcn);
+}
+
+/*--------------------------------------------------------------------*/
+static void write_thread_output(sieve_conf_t *conf, 
+				sieve_conf_t *thread_conf) {
+
+	/* write out the buffered output of one sieving
+	   thread, and do the bookkeeping that save_relation()
+	   skipped for each relation */
+
+	char *line = thread_conf->out_buf;
+	char *end = line + thread_conf->out_buf_size;
+
+	while (line < end) {
+		char *next = strchr(line, '\n') + 1;
+		char *tmp = strchr(line, 'L');
+		char c = *next;
+
+		*next = 0;
+		savefile_write_line(&conf->obj->savefile, line);
+		*next = c;
+
+		if (line[0] == 'R' && tmp != NULL && tmp < next) {
+			uint32 prime1, prime2;
+
+			read_large_primes(tmp, &prime1, &prime2);
+			if (prime1 == prime2) {
+				conf->num_relations++;
+			}
+			else {
+				add_to_cycles(conf, prime1, prime2);
+				conf->num_cycles++;
+			}
+		}
+		line = next;
+	}
+
+	thread_conf->out_buf_size = 0;
+	thread_conf->out_buf[0] = 0;
+}
+
 /*--------------------------------------------------------------------*/
 static void collect_relations(sieve_conf_t *conf, 
 			      uint32 target_relations,
-			      qs_core_sieve_fcn core_sieve_fcn) {
+			      sieve_threads_t *t) {
 	
 	uint32 i;
 	uint32 relations_found = 0;
-	uint32 num_poly = 1 << (conf->num_poly_factors - 1);
-	uint32 poly_block = MIN(num_poly, conf->poly_block);
+	uint32 num_threads = t->num_threads;
 
 	/* top-level sieving loop: keep building polynomials
 	   and sieving with them until at least target_relations
-	   relations have been found */
+	   relations have been found. Each thread handles one
+	   'a' value per round */
 
 	while (relations_found < target_relations) {
 		
-		/* build the next batch of polynomials. For
-		   big factorizations there may be thousands
-		   of them */
-
-		TIME1(base_poly_time)
-		build_base_poly(conf);
-		TIME2(base_poly_time)
-
-		/* Do the sieving for all polynomials, handling
-		   batches of polynomials at a time. */
-
-		i = 0;
-		while (i < num_poly) {
-			uint32 curr_num_poly = MIN(poly_block, num_poly - i);
-
-			relations_found += core_sieve_fcn(conf, i, 
-							curr_num_poly);
-			i += curr_num_poly;
-
-			/* see if anybody wants sieving to stop. If num_poly
-	    		   is small we bail out after sieving for the entire 
-			   current batch of polynomials has finished. If
-			   num_poly is large we wait until a significant
-			   number of polynomials have been sieved. Basically
-			   you're entitled to a big pile of polynomials
-			   whenever the loop runs, and you should get your
-			   money's worth without having to wait a really
-			   long time to finish up */
-
-			if ((conf->obj->flags & MSIEVE_FLAG_STOP_SIEVING) &&
-			    ((num_poly <= 1024 && i == num_poly) ||
-			     (num_poly > 1024 && i > 2000))) {
-				return;
+		for (i = 0; i < num_threads - 1; i++) {
+			task_control_t task;
+
+			task.init = NULL;
+			task.run = sieve_thread_run;
+			task.shutdown = NULL;
+			task.data = t->threads + i;
+			threadpool_add_task(t->threadpool, &task, 1);
+		}
+		sieve_thread_run(t->threads + i, i);
+
+		if (num_threads > 1) {
+			threadpool_drain(t->threadpool, 1);
+
+			for (i = 0; i < num_threads; i++) {
+				write_thread_output(conf, 
+						t->threads[i].conf);
 			}
 		}
+
+		for (i = 0; i < num_threads; i++)
+			relations_found += t->threads[i].relations_found;
+
+		/* nobody gets to start on a new 'a' value
+		   once sieving is supposed to stop */
+
+		if (conf->obj->flags & MSIEVE_FLAG_STOP_SIEVING)
+			return;
+	}
+}
+
+/*--------------------------------------------------------------------*/
+static uint32 check_sieve_val_simd(sieve_conf_t *conf, mp_t *res,
+				uint32 start, uint32 end, uint32 tf_offset,
+				uint32 *bits, uint32 *fb_offsets,
+				uint32 num_factors) {
+
+	/* trial factor res by factor base primes start to
+	   end-1, using the vector code to find the primes
+	   that divide. Primes whose roots are not known are
+	   reported too, and get a multiple precision mod.
+	   If bits is not NULL it accumulates the logarithms
+	   of the factors found */
+
+	uint32 i, j;
+	uint32 *hits = conf->tf_hits;
+	uint32 num_hits = conf->tf_simd(&conf->tf_primes, start, end,
+					tf_offset, hits);
+
+	for (i = 0; i < num_hits; i++) {
+		uint32 fb_offset = hits[i];
+		fb_t *fbptr = conf->factor_base + fb_offset;
+		uint32 prime = fbptr->prime;
+
+		if (fbptr->root1 == INVALID_ROOT &&
+		    mp_mod_1(res, prime) != 0)
+			continue;
+
+		do {
+			if (bits != NULL)
+				*bits += fbptr->logprime;
+			fb_offsets[num_factors++] = fb_offset;
+			mp_divrem_1(res, prime, res);
+			j = mp_mod_1(res, prime);
+		} while (j == 0);
 	}
+
+	return num_factors;
 }
 
 /*--------------------------------------------------------------------*/
@@ -828,7 +1129,15 @@ uint32 check_sieve_val(sieve_conf_t *conf, int32 sieve_offset,
 	   Begin with factor base primes whose reciprocal assumes
 	   a numerator up to 2^32 */
 
-	for (i = MIN_FB_OFFSET + 1; i < tf_small_recip1_cutoff; i++) {
+	i = MIN_FB_OFFSET + 1;
+	if (conf->tf_simd != NULL) {
+		num_factors = check_sieve_val_simd(conf, &res, i,
+					tf_small_recip1_cutoff, tf_offset,
+					&bits, fb_offsets, num_factors);
+		i = tf_small_recip1_cutoff;
+	}
+
+	for (; i < tf_small_recip1_cutoff; i++) {
 		fb_t *fbptr = factor_base + i;
 		uint32 prime = fbptr->prime;
 		uint32 root1 = fbptr->root1;
@@ -912,6 +1221,13 @@ uint32 check_sieve_val(sieve_conf_t *conf, int32 sieve_offset,
 	   reciprocal assumes numerators up to 2^32 */
 
 	TIME1(tf_small_time)
+	if (conf->tf_simd != NULL) {
+		num_factors = check_sieve_val_simd(conf, &res, i,
+					tf_med_recip1_cutoff, tf_offset,
+					NULL, fb_offsets, num_factors);
+		i = tf_med_recip1_cutoff;
+	}
+
 	for (; i < tf_med_recip1_cutoff; i++) {
 		fb_t *fbptr = factor_base + i;
 		uint32 prime = fbptr->prime;
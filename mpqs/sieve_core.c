@@ -154,6 +154,140 @@ static void fill_sieve_block(sieve_conf_t *conf,
 	TIME2(sieve_large_time)
 }
 
+/*--------------------------------------------------------------------*/
+#if defined(SIEVE_CORE_AVX2) && defined(HAS_AVX2_SIEVE_CORE)
+
+/* Polynomial switching with AVX2. A factor base entry is 16
+   bytes, so one 256-bit register holds two of them, with the
+   prime in 32-bit lanes 0 and 4 and the roots in lanes 1-2
+   and 5-6. The new roots are computed in place and blended
+   back, which avoids any gathers or scatters.
+
+   Adding m mod p is the same as subtracting p-m, and
+   a-m mod p is the smaller of a-m and a-m+p when both are
+   computed mod 2^32 */
+
+#include <immintrin.h>
+
+#define USE_AVX2_ROOTS
+#define AVX2_TARGET __attribute__((target("avx2")))
+
+#define FB_PRIME_MASK 0x3ffffff	/* the 'prime' bitfield of fb_t */
+#define FB_ROOT_LANES 0x66
+
+AVX2_TARGET
+static void update_roots_large_avx2(fb_t *fb, uint32 num_fb,
+				uint32 *poly_b, uint32 stride,
+				uint32 add) {
+
+	/* update the roots of num_fb consecutive primes that
+	   are sieved with the hashtable. poly_b points to the
+	   correction for the first prime, and successive 
+	   corrections are stride apart */
+
+	uint32 k;
+	__m256i prime_mask = _mm256_set1_epi32(FB_PRIME_MASK);
+
+	for (k = 0; k + 2 <= num_fb; k += 2, poly_b += 2 * stride) {
+
+		__m256i v = _mm256_loadu_si256((__m256i *)(fb + k));
+		__m256i p = _mm256_shuffle_epi32(
+				_mm256_and_si256(v, prime_mask), 0x00);
+		__m256i m = _mm256_set_m128i(_mm_set1_epi32(poly_b[stride]),
+					     _mm_set1_epi32(poly_b[0]));
+		__m256i r;
+
+		if (add)
+			m = _mm256_sub_epi32(p, m);
+
+		r = _mm256_sub_epi32(v, m);
+		r = _mm256_min_epu32(r, _mm256_add_epi32(r, p));
+		_mm256_storeu_si256((__m256i *)(fb + k),
+				_mm256_blend_epi32(v, r, FB_ROOT_LANES));
+	}
+
+	if (k < num_fb) {
+		fb_t *fbptr = fb + k;
+		uint32 prime = fbptr->prime;
+		uint32 m = poly_b[0];
+
+		if (add) {
+			fbptr->root1 = mp_modadd_1(fbptr->root1, m, prime);
+			fbptr->root2 = mp_modadd_1(fbptr->root2, m, prime);
+		}
+		else {
+			fbptr->root1 = mp_modsub_1(fbptr->root1, m, prime);
+			fbptr->root2 = mp_modsub_1(fbptr->root2, m, prime);
+		}
+	}
+}
+
+AVX2_TARGET
+static void update_roots_small_avx2(fb_t *factor_base, 
+				uint32 start, uint32 end,
+				uint32 *poly_b, uint32 add) {
+
+	/* update the roots of the sieved primes from start
+	   to end-1. These primes need root1 <= root2, and 
+	   primes with invalid roots are left alone. The 
+	   corrections are indexed by factor base offset */
+
+	uint32 j;
+	__m256i prime_mask = _mm256_set1_epi32(FB_PRIME_MASK);
+	__m256i invalid = _mm256_set1_epi32((int32)INVALID_ROOT);
+
+	for (j = start; j + 2 <= end; j += 2) {
+
+		__m256i v = _mm256_loadu_si256((__m256i *)(factor_base + j));
+		__m256i p = _mm256_shuffle_epi32(
+				_mm256_and_si256(v, prime_mask), 0x00);
+		__m256i m = _mm256_set_m128i(_mm_set1_epi32(poly_b[j + 1]),
+					     _mm_set1_epi32(poly_b[j]));
+		__m256i skip = _mm256_cmpeq_epi32(
+				_mm256_shuffle_epi32(v, 0x55), invalid);
+		__m256i r, swap;
+
+		if (add)
+			m = _mm256_sub_epi32(p, m);
+
+		r = _mm256_sub_epi32(v, m);
+		r = _mm256_min_epu32(r, _mm256_add_epi32(r, p));
+
+		/* lanes 1 and 2 get the smaller and larger root */
+
+		swap = _mm256_shuffle_epi32(r, 0xd8);
+		r = _mm256_blend_epi32(_mm256_min_epu32(r, swap),
+				       _mm256_max_epu32(r, swap), 0x44);
+		r = _mm256_blend_epi32(v, r, FB_ROOT_LANES);
+		_mm256_storeu_si256((__m256i *)(factor_base + j),
+				_mm256_blendv_epi8(r, v, skip));
+	}
+
+	if (j < end) {
+		fb_t *fbptr = factor_base + j;
+		uint32 prime = fbptr->prime;
+		uint32 root1 = fbptr->root1;
+		uint32 root2 = fbptr->root2;
+		uint32 m = poly_b[j];
+
+		if (root1 == INVALID_ROOT)
+			return;
+
+		if (add) {
+			root1 = mp_modadd_1(root1, m, prime);
+			root2 = mp_modadd_1(root2, m, prime);
+		}
+		else {
+			root1 = mp_modsub_1(root1, m, prime);
+			root2 = mp_modsub_1(root2, m, prime);
+		}
+		fbptr->root1 = MIN(root1, root2);
+		fbptr->root2 = MAX(root1, root2);
+	}
+}
+
+#endif
+
 /*--------------------------------------------------------------------*/
 #define PACKED_SIEVE_MASK ((uint64)0x80808080 << 32 | 0x80808080)
 
@@ -165,6 +299,8 @@ static void fill_sieve_block(sieve_conf_t *conf,
 	#endif
 #endif
 
+#define SIMD_SCAN_CHUNK 4096
+
 static uint32 scan_sieve_block(sieve_conf_t *conf,
 				mp_t *a, signed_mp_t *b, signed_mp_t *c,
 				int32 block_start,
@@ -177,6 +313,36 @@ static uint32 scan_sieve_block(sieve_conf_t *conf,
 	uint64 *packed_sieve = (uint64 *)conf->sieve_array;
 	uint32 relations_found = 0;
 
+	/* use the vector scan if the CPU has one; it finds
+	   the same sieve values as the loop below, a few
+	   thousand at a time */
+
+	if (conf->scan_simd != NULL) {
+		uint16 hits[SIMD_SCAN_CHUNK];
+
+		TIME1(tf_plus_scan_time)
+		for (i = 0; i < SIEVE_BLOCK_SIZE; i += SIMD_SCAN_CHUNK) {
+			uint32 num_hits = conf->scan_simd(sieve_array + i,
+						SIMD_SCAN_CHUNK, cutoff1, hits);
+
+			for (j = 0; j < num_hits; j++) {
+				uint32 k = i + hits[j];
+				uint32 bits = sieve_array[k];
+
+				TIME1(tf_total_time)
+				relations_found += 
+					check_sieve_val(conf, 
+						block_start + (int32)k, 
+						cutoff1 + 257 - bits,
+						a, b, c, poly_index,
+						hashtable);
+				TIME2(tf_total_time)
+			}
+		}
+		TIME2(tf_plus_scan_time)
+		return relations_found;
+	}
+
 	TIME1(tf_plus_scan_time)
 	for (i = 0; i < SIEVE_BLOCK_SIZE / 8; i += 8) {
 
@@ -338,7 +504,10 @@ uint32 ROUTINE_NAME(sieve_conf_t *conf,
 
 	   In short: black magic, awful mess, really fast. */
 
-	uint32 i, j, k, m, n;
+	uint32 i, j, k, n;
+#if !defined(USE_AVX2_ROOTS)
+	uint32 m;
+#endif
 	uint32 relations_found = 0;
 	uint32 num_sieve_blocks = conf->num_sieve_blocks;
 	uint32 sieve_size;
@@ -435,6 +604,11 @@ uint32 ROUTINE_NAME(sieve_conf_t *conf,
 			   of the total poly initialization time! */
 
 			TIME1(next_poly_large_time)
+#if defined(USE_AVX2_ROOTS)
+			update_roots_large_avx2(fb_start, fb_block,
+						poly_b_start + n, num_factors,
+						next_action & 0x80);
+#else
 			if (next_action & 0x80) {
 				for (k = 0; k < fb_block; 
 					k++, poly_b_start += num_factors) {
@@ -467,6 +641,7 @@ uint32 ROUTINE_NAME(sieve_conf_t *conf,
 					fbptr->root2 = root2;
 				}
 			}
+#endif
 			TIME2(next_poly_large_time)
 
 			/* polynomial j is finished; point to the
@@ -517,6 +692,20 @@ uint32 ROUTINE_NAME(sieve_conf_t *conf,
 			pfbptr->next_loc2 = fbptr->root2;
 		}
 
+		/* the vector trial factoring code needs the
+		   roots too, packed next to each other */
+
+		if (conf->tf_simd != NULL) {
+			tf_primes_t *tf_primes = &conf->tf_primes;
+
+			for (j = MIN_FB_OFFSET + 1; 
+					j < conf->tf_med_recip1_cutoff; j++) {
+				fb_t *fbptr = factor_base + j;
+				tf_primes->root1[j] = fbptr->root1;
+				tf_primes->root2[j] = fbptr->root2;
+			}
+		}
+
 		/* Form 'c', equal to (b * b - n) / a (exact
 		   division). Having this quantity available
 		   makes trial factoring a little faster.
@@ -585,6 +774,10 @@ uint32 ROUTINE_NAME(sieve_conf_t *conf,
 		k = conf->sieve_large_fb_start;
 
 		TIME1(next_poly_small_time)
+#if defined(USE_AVX2_ROOTS)
+		update_roots_small_avx2(factor_base, MIN_FB_OFFSET + 1, k,
+					poly_b_array, next_action & 0x80);
+#else
 		if (next_action & 0x80) {
 			for (j = MIN_FB_OFFSET + 1; j < k; j++) {
 	
@@ -633,6 +826,7 @@ uint32 ROUTINE_NAME(sieve_conf_t *conf,
 				}
 			}
 		}
+#endif
 		TIME2(next_poly_small_time)
 		buckets += num_sieve_blocks;
 	}
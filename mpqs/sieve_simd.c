@@ -0,0 +1,286 @@
+/*--------------------------------------------------------------------
+This source distribution is placed in the public domain by its author,
+Jason Papadopoulos. You may use it for any purpose, free of charge,
+without having to notify anyone. I disclaim any responsibility for any
+errors.
+
+Optionally, please be nice and tell me if you find this source to be
+useful. Again optionally, if you add to the functionality present here
+please consider making those additions public too, so that others may
+benefit from your work.
+
+$Id$
+--------------------------------------------------------------------*/
+
+#include <common.h>
+#include "mpqs.h"
+
+/* For inputs of 90+ digits a large part of the sieving time
+   goes to finding the sieve values worth trial factoring and
+   then to trial dividing them by the small factor base primes.
+   This file has AVX2 and AVX512 versions of both jobs, chosen
+   at runtime so that a binary built for a generic x86_64
+   target still uses them.
+
+   The scan looks at 64 sieve values at a time, and like the
+   generic code only looks closer at a group of 64 if one of
+   them has its top bit set. The trial division computes
+   (tf_offset mod p) with the same reciprocal arithmetic as
+   check_sieve_val, for 8 or 16 primes at once, and reports
+   the primes where it matches one of the roots; these are
+   exactly the primes the generic code would have found */
+
+#if (defined(__x86_64__) || defined(_M_X64)) && \
+	(defined(__GNUC__) || defined(_MSC_VER))
+	#define HAS_QS_SIMD
+#endif
+
+#ifdef HAS_QS_SIMD
+
+#include <immintrin.h>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+static INLINE uint32 lowest_bit(uint64 x) {
+	unsigned long r;
+	_BitScanForward64(&r, x);
+	return r;
+}
+#define TARGET_AVX2
+#define TARGET_AVX512
+#else
+#define lowest_bit(x) __builtin_ctzll(x)
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#define TARGET_AVX512 __attribute__((target("avx2,avx512f,avx512bw")))
+#endif
+
+/* the arrays in a tf_primes_t are padded so that the vector
+   loops can read a full vector past the last prime */
+
+#define TF_PAD 16
+
+/*------------------------- AVX2 -----------------------------------*/
+
+TARGET_AVX2
+static uint32 scan_avx2(uint8 *sieve_array, uint32 size,
+			uint32 cutoff1, uint16 *hits) {
+
+	uint32 i;
+	uint32 num_hits = 0;
+	__m256i limit;
+
+	/* a byte exceeds cutoff1 if it is at least cutoff1+1,
+	   and no byte can exceed 255 */
+
+	if (cutoff1 >= 255)
+		return 0;
+	limit = _mm256_set1_epi8((char)(cutoff1 + 1));
+
+	for (i = 0; i < size; i += 64) {
+		__m256i v0 = _mm256_load_si256((__m256i *)(sieve_array + i));
+		__m256i v1 = _mm256_load_si256((__m256i *)(sieve_array + i
+									+ 32));
+		uint64 mask;
+
+		if (_mm256_movemask_epi8(_mm256_or_si256(v0, v1)) == 0)
+			continue;
+
+		v0 = _mm256_cmpeq_epi8(_mm256_max_epu8(v0, limit), v0);
+		v1 = _mm256_cmpeq_epi8(_mm256_max_epu8(v1, limit), v1);
+		mask = (uint32)_mm256_movemask_epi8(v0) |
+			(uint64)(uint32)_mm256_movemask_epi8(v1) << 32;
+
+		while (mask) {
+			hits[num_hits++] = (uint16)(i + lowest_bit(mask));
+			mask &= mask - 1;
+		}
+	}
+
+	return num_hits;
+}
+
+TARGET_AVX2
+static uint32 tf_avx2(tf_primes_t *primes, uint32 start,
+			uint32 end, uint32 tf_offset, uint32 *hits) {
+
+	uint32 i;
+	uint32 num_hits = 0;
+	__m256i offset = _mm256_set1_epi32((int32)tf_offset);
+	__m256i invalid = _mm256_set1_epi32((int32)INVALID_ROOT);
+
+	for (i = start; i < end; i += 8) {
+		__m256i p = _mm256_loadu_si256((__m256i *)(primes->prime + i));
+		__m256i r = _mm256_loadu_si256((__m256i *)(primes->recip + i));
+		__m256i rc = _mm256_loadu_si256((__m256i *)
+						(primes->rcorrect + i));
+		__m256i r1 = _mm256_loadu_si256((__m256i *)(primes->root1 + i));
+		__m256i r2 = _mm256_loadu_si256((__m256i *)(primes->root2 + i));
+		__m256i x = _mm256_add_epi32(offset, rc);
+		__m256i q_even, q_odd, q, hit;
+		uint32 mask;
+
+		/* q = ((tf_offset + rcorrect) * recip) >> 32, which
+		   needs separate multiplies for the even and odd
+		   32-bit lanes */
+
+		q_even = _mm256_srli_epi64(_mm256_mul_epu32(x, r), 32);
+		q_odd = _mm256_mul_epu32(_mm256_srli_epi64(x, 32),
+					_mm256_srli_epi64(r, 32));
+		q = _mm256_blend_epi32(q_even, q_odd, 0xaa);
+		q = _mm256_sub_epi32(offset, _mm256_mullo_epi32(q, p));
+
+		hit = _mm256_or_si256(_mm256_cmpeq_epi32(q, r1),
+				      _mm256_cmpeq_epi32(q, r2));
+		hit = _mm256_or_si256(hit, _mm256_cmpeq_epi32(r1, invalid));
+		mask = _mm256_movemask_ps(_mm256_castsi256_ps(hit));
+		if (end - i < 8)
+			mask &= (1 << (end - i)) - 1;
+
+		while (mask) {
+			hits[num_hits++] = i + lowest_bit(mask);
+			mask &= mask - 1;
+		}
+	}
+
+	return num_hits;
+}
+
+/*------------------------- AVX512 ---------------------------------*/
+
+TARGET_AVX512
+static uint32 scan_avx512(uint8 *sieve_array, uint32 size,
+			uint32 cutoff1, uint16 *hits) {
+
+	uint32 i;
+	uint32 num_hits = 0;
+	__m512i limit;
+
+	if (cutoff1 >= 255)
+		return 0;
+	limit = _mm512_set1_epi8((char)cutoff1);
+
+	for (i = 0; i < size; i += 64) {
+		__m512i v = _mm512_load_si512((__m512i *)(sieve_array + i));
+		uint64 mask;
+
+		if (_mm512_movepi8_mask(v) == 0)
+			continue;
+
+		mask = _mm512_cmpgt_epu8_mask(v, limit);
+		while (mask) {
+			hits[num_hits++] = (uint16)(i + lowest_bit(mask));
+			mask &= mask - 1;
+		}
+	}
+
+	return num_hits;
+}
+
+TARGET_AVX512
+static uint32 tf_avx512(tf_primes_t *primes, uint32 start,
+			uint32 end, uint32 tf_offset, uint32 *hits) {
+
+	uint32 i;
+	uint32 num_hits = 0;
+	__m512i offset = _mm512_set1_epi32((int32)tf_offset);
+	__m512i invalid = _mm512_set1_epi32((int32)INVALID_ROOT);
+
+	for (i = start; i < end; i += 16) {
+		__m512i p = _mm512_loadu_si512(primes->prime + i);
+		__m512i r = _mm512_loadu_si512(primes->recip + i);
+		__m512i rc = _mm512_loadu_si512(primes->rcorrect + i);
+		__m512i r1 = _mm512_loadu_si512(primes->root1 + i);
+		__m512i r2 = _mm512_loadu_si512(primes->root2 + i);
+		__m512i x = _mm512_add_epi32(offset, rc);
+		__m512i q_even, q_odd, q;
+		uint32 mask;
+
+		q_even = _mm512_srli_epi64(_mm512_mul_epu32(x, r), 32);
+		q_odd = _mm512_mul_epu32(_mm512_srli_epi64(x, 32),
+					_mm512_srli_epi64(r, 32));
+		q = _mm512_mask_blend_epi32(0xaaaa, q_even, q_odd);
+		q = _mm512_sub_epi32(offset, _mm512_mullo_epi32(q, p));
+
+		mask = _mm512_cmpeq_epi32_mask(q, r1) |
+		       _mm512_cmpeq_epi32_mask(q, r2) |
+		       _mm512_cmpeq_epi32_mask(r1, invalid);
+		if (end - i < 16)
+			mask &= (1 << (end - i)) - 1;
+
+		while (mask) {
+			hits[num_hits++] = i + lowest_bit(mask);
+			mask &= mask - 1;
+		}
+	}
+
+	return num_hits;
+}
+
+#endif /* HAS_QS_SIMD */
+
+/*--------------------------------------------------------------------*/
+const char * qs_simd_init(sieve_conf_t *conf) {
+
+	uint32 i, n;
+	tf_primes_t *p = &conf->tf_primes;
+	const char *name = NULL;
+
+	conf->scan_simd = NULL;
+	conf->tf_simd = NULL;
+	memset(p, 0, sizeof(tf_primes_t));
+	conf->tf_hits = NULL;
+
+#ifdef HAS_QS_SIMD
+	{
+		uint32 simd = get_cpu_simd();
+
+		if (simd & CPU_SIMD_AVX512) {
+			conf->scan_simd = scan_avx512;
+			conf->tf_simd = tf_avx512;
+			name = "AVX512";
+		}
+		else if (simd & CPU_SIMD_AVX2) {
+			conf->scan_simd = scan_avx2;
+			conf->tf_simd = tf_avx2;
+			name = "AVX2";
+		}
+	}
+#endif
+
+	if (name == NULL)
+		return NULL;
+
+	/* the primes and reciprocals do not change; the
+	   roots are filled in by the sieve core */
+
+	n = conf->tf_med_recip1_cutoff + TF_PAD;
+	p->prime = (uint32 *)xcalloc((size_t)n, sizeof(uint32));
+	p->recip = (uint32 *)xcalloc((size_t)n, sizeof(uint32));
+	p->rcorrect = (uint32 *)xcalloc((size_t)n, sizeof(uint32));
+	p->root1 = (uint32 *)xcalloc((size_t)n, sizeof(uint32));
+	p->root2 = (uint32 *)xcalloc((size_t)n, sizeof(uint32));
+	conf->tf_hits = (uint32 *)xmalloc(n * sizeof(uint32));
+
+	for (i = MIN_FB_OFFSET + 1; i < conf->tf_med_recip1_cutoff; i++) {
+		fb_t *fbptr = conf->factor_base + i;
+
+		p->prime[i] = fbptr->prime;
+		p->recip[i] = fbptr->recip;
+		p->rcorrect[i] = fbptr->rcorrect;
+	}
+
+	return name;
+}
+
+/*--------------------------------------------------------------------*/
+void qs_simd_free(sieve_conf_t *conf) {
+
+	tf_primes_t *p = &conf->tf_primes;
+
+	free(p->prime);
+	free(p->recip);
+	free(p->rcorrect);
+	free(p->root1);
+	free(p->root2);
+	free(conf->tf_hits);
+}